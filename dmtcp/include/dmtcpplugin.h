@@ -50,6 +50,13 @@
 #define EVENTFD_VAL_TYPE int
 
 #define DELETED_FILE_SUFFIX " (deleted)"
+
+// Seconds to wait for a socket peer outside the computation to return the
+// drain cookie before it is taken to be a process not under DMTCP (default:
+// wait forever).  Peers in the computation are always waited for, if the
+// variable is set for all of it.  The data of such a socket is left unread,
+// for the application.
+#define ENV_VAR_DRAIN_TIMEOUT "DMTCP_DRAIN_TIMEOUT"
 #define LIB_PRIVATE __attribute__ ((visibility ("hidden")))
 
 typedef enum eDmtcpEvent {
@@ -111,12 +118,32 @@ EXTERNC int dmtcp_unique_pids_equal(DmtcpUniqueProcessId a,
 EXTERNC int dmtcp_plugin_disable_ckpt(void);
 EXTERNC void dmtcp_plugin_enable_ckpt(void);
 EXTERNC void dmtcp_process_event(DmtcpEvent_t event, DmtcpEventData_t *data);
+/* The DMTCP_EVENT_REGISTER_NAME_SERVICE_DATA and DMTCP_EVENT_SEND_QUERIES
+ * phases always run, unless DMTCP_NAME_SERVICE_ON_DEMAND=1.  Then they run
+ * only if some process of the computation calls this during the current
+ * checkpoint or restart, before those events; e.g. from DMTCP_EVENT_PRE_CKPT
+ * or DMTCP_EVENT_POST_RESTART.  A plugin that uses those events should call
+ * it, so that it works in either mode. */
+EXTERNC void dmtcp_request_name_service(void);
 EXTERNC int dmtcp_send_key_val_pair_to_coordinator(const void *key,
                                                    size_t key_len,
                                                    const void *val,
                                                    size_t val_len);
 EXTERNC int dmtcp_send_query_to_coordinator(const void *key, size_t key_len,
                                             void *val, size_t *val_len);
+/* Bulk forms of the two calls above, for plugins with many keys.  Records are
+ * packed into as few messages as possible and the queries are pipelined.  On
+ * input val_lens[i] is the size of the buffer vals[i]; on output it is the
+ * size of the value copied there, or 0 if keys[i] was not registered. */
+EXTERNC int dmtcp_send_key_val_pairs_to_coordinator(size_t count,
+                                                    const void * const *keys,
+                                                    const size_t *key_lens,
+                                                    const void * const *vals,
+                                                    const size_t *val_lens);
+EXTERNC int dmtcp_send_queries_to_coordinator(size_t count,
+                                              const void * const *keys,
+                                              const size_t *key_lens,
+                                              void **vals, size_t *val_lens);
 EXTERNC int dmtcp_get_coordinator_sockname(struct sockaddr_storage *addr);
 
 EXTERNC const char* dmtcp_get_tmpdir();
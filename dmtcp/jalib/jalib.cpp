@@ -29,6 +29,8 @@
 #include <fcntl.h>
 #include <stdarg.h>
 #include <dlfcn.h>
+#include <signal.h>
+#include <sys/syscall.h>
 
 #include <fstream>
 #include "jalib.h"
@@ -141,6 +143,33 @@ namespace jalib {
                                         timeout);
   }
 
+  int epoll_create1(int flags) {
+    return jalib::syscall(SYS_epoll_create1, (long) flags);
+  }
+
+  int epoll_ctl(int epfd, int op, int fd, struct epoll_event *event) {
+    return jalib::syscall(SYS_epoll_ctl, (long) epfd, (long) op, (long) fd,
+                          event);
+  }
+
+  // SYS_epoll_wait does not exist on every architecture; epoll_pwait with
+  // a NULL sigmask is equivalent.
+  int epoll_wait(int epfd, struct epoll_event *events, int maxevents,
+                 int timeout) {
+    return jalib::syscall(SYS_epoll_pwait, (long) epfd, events,
+                          (long) maxevents, (long) timeout, (void*) NULL,
+                          (long) (_NSIG / 8));
+  }
+
+  ssize_t sendmsg(int sockfd, const struct msghdr *msg, int flags) {
+    return jalib::syscall(SYS_sendmsg, (long) sockfd, msg, (long) flags);
+  }
+
+  ssize_t recv(int sockfd, void *buf, size_t len, int flags) {
+    return jalib::syscall(SYS_recvfrom, (long) sockfd, buf, (long) len,
+                          (long) flags, (void*) NULL, (void*) NULL);
+  }
+
   int socket(int domain, int type, int protocol) {
     REAL_FUNC_PASSTHROUGH(int, socket) (domain, type, protocol);
   }
@@ -31,6 +31,9 @@
 #include <fstream>
 #include "dmtcpplugin.h"
 
+struct epoll_event;
+struct msghdr;
+
 namespace jalib {
   typedef struct JalibFuncPtrs {
     const char* (*dmtcp_get_tmpdir)();
@@ -94,6 +97,14 @@ namespace jalib {
   ssize_t write(int fd, const void *buf, size_t count);
   int select(int nfds, fd_set *readfds, fd_set *writefds,
              fd_set *exceptfds, struct timeval *timeout);
+  // epoll, sendmsg and recv are reached through jalib::syscall() so that the
+  // plugins' wrappers are bypassed, as they are for select() above.
+  int epoll_create1(int flags);
+  int epoll_ctl(int epfd, int op, int fd, struct epoll_event *event);
+  int epoll_wait(int epfd, struct epoll_event *events, int maxevents,
+                 int timeout);
+  ssize_t sendmsg(int sockfd, const struct msghdr *msg, int flags);
+  ssize_t recv(int sockfd, void *buf, size_t len, int flags);
 
   int socket(int domain, int type, int protocol);
   int connect(int sockfd, const struct sockaddr *serv_addr, socklen_t addrlen);
@@ -32,6 +32,8 @@
 #include <string.h>
 #include <unistd.h>
 #include <errno.h>
+#include <sys/epoll.h>
+#include <sys/uio.h>
 #include <algorithm>
 #include <set>
 #include <typeinfo>
@@ -376,13 +378,28 @@ bool jalib::JSocket::isValid() const
  */
 bool jalib::JChunkReader::readOnce()
 {
-  if ( !ready() )
+  if ( _read < _length )
   {
     ssize_t cnt = _sock.read ( _buffer + _read, _length - _read );
     if ( cnt <= 0 && errno != EAGAIN && errno != EINTR )
       _hadError = true;
     if ( cnt > 0 )
       _read += cnt;
+    if ( _read == _length && !_hadError )
+    {
+      _payloadLength = payloadLength();
+      if ( _payloadLength > 0 )
+        _payload = (char*) jalib::JAllocDispatcher::malloc(_payloadLength);
+    }
+  }
+  else if ( _payloadRead < _payloadLength )
+  {
+    ssize_t cnt = _sock.read ( _payload + _payloadRead,
+                               _payloadLength - _payloadRead );
+    if ( cnt <= 0 && errno != EAGAIN && errno != EINTR )
+      _hadError = true;
+    if ( cnt > 0 )
+      _payloadRead += cnt;
   }
   return ready();
 }
@@ -421,6 +438,19 @@ bool jalib::JChunkWriter::hadError()
   return _hadError || !_sock.isValid();
 }
 
+jalib::JSharedChunk::JSharedChunk ( const char* buf, int len )
+    : _buffer ( ( char* ) jalib::JAllocDispatcher::malloc ( len ) )
+    , _length ( len )
+    , _refs ( 1 )
+{
+  memcpy ( _buffer, buf, len );
+}
+
+jalib::JSharedChunk::~JSharedChunk()
+{
+  jalib::JAllocDispatcher::free ( _buffer );
+}
+
 
 
 /*!
@@ -430,6 +460,11 @@ void jalib::JChunkReader::reset()
 {
   memset ( _buffer,0,_length );
   _read = 0;
+  if ( _payload != NULL )
+    jalib::JAllocDispatcher::free(_payload);
+  _payload = NULL;
+  _payloadLength = 0;
+  _payloadRead = 0;
 }
 
 
@@ -450,6 +485,9 @@ jalib::JChunkReader::JChunkReader ( JSocket sock, int chunkSize )
     , _length ( chunkSize )
     , _read ( 0 )
     , _hadError ( false )
+    , _payload ( NULL )
+    , _payloadLength ( 0 )
+    , _payloadRead ( 0 )
 {
   memset ( _buffer,0,_length );
 }
@@ -464,8 +502,16 @@ jalib::JChunkReader::JChunkReader ( const JChunkReader& that )
     , _length ( that._length )
     , _read ( that._read )
     , _hadError ( that._hadError )
+    , _payload ( NULL )
+    , _payloadLength ( that._payloadLength )
+    , _payloadRead ( that._payloadRead )
 {
   memcpy ( _buffer,that._buffer,_length );
+  if ( that._payload != NULL )
+  {
+    _payload = (char*) jalib::JAllocDispatcher::malloc(_payloadLength);
+    memcpy ( _payload,that._payload,_payloadLength );
+  }
 }
 
 
@@ -476,6 +522,9 @@ jalib::JChunkReader::~JChunkReader()
 {
   jalib::JAllocDispatcher::free(_buffer);
   _buffer = 0;
+  if ( _payload != NULL )
+    jalib::JAllocDispatcher::free(_payload);
+  _payload = 0;
 }
 
 
@@ -487,6 +536,9 @@ jalib::JChunkReader& jalib::JChunkReader::operator= ( const JChunkReader& that )
   if ( this == &that ) return *this;;
   jalib::JAllocDispatcher::free(_buffer);
   _buffer = 0;
+  if ( _payload != NULL )
+    jalib::JAllocDispatcher::free(_payload);
+  _payload = 0;
   new ( this ) JChunkReader ( that );
   return *this;
 }
@@ -507,20 +559,89 @@ void jalib::JSocket::changeFd ( int newFd )
 }
 
 
+// Upper bound on the events returned by a single epoll_wait() call.
+static const int EPOLL_MAX_EVENTS = 256;
+//shared chunks gathered into a single sendmsg()
+static const int SHARED_WRITE_IOV_MAX = 64;
+
 void jalib::JMultiSocketProgram::addDataSocket ( JReaderInterface* sock )
 {
   _dataSockets.push_back ( sock );
+  int fd = sock->socket().sockfd();
+  if ( _epollFd >= 0 && fd >= 0 )
+  {
+    interest ( fd ).reader = sock;
+    updateInterest ( fd );
+  }
 }
 
 void jalib::JMultiSocketProgram::addListenSocket ( const JSocket& sock )
 {
   _listenSockets.push_back ( sock );
+  if ( _epollFd >= 0 && sock.isValid() )
+  {
+    interest ( sock.sockfd() ).listening = true;
+    updateInterest ( sock.sockfd() );
+  }
 }
 
-
 void jalib::JMultiSocketProgram::addWrite ( JWriterInterface* write )
 {
   _writes.push_back ( write );
+  int fd = write->socket().sockfd();
+  if ( _epollFd >= 0 && fd >= 0 )
+  {
+    interest ( fd ).writes.push_back ( PendingWrite ( write ) );
+    updateInterest ( fd );
+  }
+}
+
+/*!
+    \fn jalib::JMultiSocketProgram::addSharedWrite(const JSocket& sock, JSharedChunk* chunk)
+
+    Queue chunk on sock without copying it.  The write is attempted before
+    the next epoll_wait(); EPOLLOUT is only requested if the socket does not
+    take all of it.
+ */
+void jalib::JMultiSocketProgram::addSharedWrite ( const JSocket& sock,
+                                                  JSharedChunk* chunk )
+{
+  int fd = sock.sockfd();
+  if ( _epollFd < 0 || fd < 0 )
+  {
+    addWrite ( new JChunkWriter ( sock, chunk->buffer(), chunk->length() ) );
+    return;
+  }
+  FdInterest& fi = interest ( fd );
+  chunk->ref();
+  fi.writes.push_back ( PendingWrite ( chunk ) );
+  if ( !fi.flushQueued && ( fi.events & EPOLLOUT ) == 0 )
+  {
+    fi.flushQueued = true;
+    _sharedWriteFds.push_back ( fd );
+  }
+}
+
+/*!
+    \fn jalib::JMultiSocketProgram::flushWrites()
+
+    Make one attempt at every pending write, for callers about to exit.
+ */
+void jalib::JMultiSocketProgram::flushWrites()
+{
+  if ( _epollFd < 0 )
+  {
+    for ( size_t i=0; i<_writes.size(); ++i )
+    {
+      if ( _writes[i]->socket().sockfd() >= 0 )
+        _writes[i]->writeOnce();
+    }
+    return;
+  }
+  for ( size_t fd=0; fd<_interest.size(); ++fd )
+  {
+    dispatchWrites ( fd );
+  }
 }
 
 void jalib::JMultiSocketProgram::setTimeoutInterval ( double dblTimeout )
@@ -535,20 +656,392 @@ void jalib::JMultiSocketProgram::setTimeoutInterval ( double dblTimeout )
   timeradd ( &timeoutInterval,&stoptime,&stoptime );
 }
 
-void jalib::JMultiSocketProgram::monitorSockets ( double dblTimeout )
+jalib::JMultiSocketProgram::FdInterest&
+jalib::JMultiSocketProgram::interest ( int fd )
 {
-  /*
-  int tSec = ( int ) dblTimeout;
-  int tMs = ( int ) ( 1000000.0 * ( dblTimeout - tSec ) );
-  const struct timeval timeoutInterval = {tSec,tMs};
-  bool timeoutEnabled = dblTimeout > 0 && timerisset ( &timeoutInterval );
+  if ( ( size_t ) fd >= _interest.size() )
+  {
+    _interest.resize ( std::max ( ( size_t ) fd + 1, 2 * _interest.size() ) );
+  }
+  return _interest[fd];
+}
 
-  struct timeval stoptime={0,0};
-  struct timeval timeoutBuf=timeoutInterval;
-  struct timeval * timeout = timeoutEnabled ? &timeoutBuf : NULL;
-  JASSERT ( gettimeofday ( &stoptime,NULL ) == 0 );
-  timeradd ( &timeoutInterval,&stoptime,&stoptime );
-  */
+/*!
+    \fn jalib::JMultiSocketProgram::updateInterest(int fd)
+
+    Bring the epoll registration of fd in line with its reader, listen socket
+    and pending writes.  EPOLLOUT is only requested while a write is pending.
+ */
+void jalib::JMultiSocketProgram::updateInterest ( int fd )
+{
+  FdInterest& fi = interest ( fd );
+  unsigned int events = 0;
+  if ( fi.reader != NULL || fi.listening )
+  {
+    events |= EPOLLIN;
+  }
+  for ( size_t i=0; i<fi.writes.size(); ++i )
+  {
+    JWriterInterface* write = fi.writes[i].write;
+    //shared chunks leave the queue as soon as they are written
+    if ( write == NULL || ( !write->isDone() && !write->hadError() ) )
+    {
+      events |= EPOLLOUT;
+      break;
+    }
+  }
+  if ( events == fi.events ) return;
+
+  if ( fi.events == 0 ) _registeredFds++;
+  if ( events == 0 ) _registeredFds--;
+
+  if ( fi.alwaysReady )
+  {
+    if ( events == 0 )
+    {
+      fi.alwaysReady = false;
+      _alwaysReadyFds.erase ( std::find ( _alwaysReadyFds.begin(),
+                                          _alwaysReadyFds.end(), fd ) );
+    }
+    fi.events = events;
+    return;
+  }
+
+  struct epoll_event ev;
+  memset ( &ev, 0, sizeof ( ev ) );
+  ev.events = events;
+  ev.data.fd = fd;
+  if ( events == 0 )
+  {
+    //fails harmlessly if fd was already closed
+    jalib::epoll_ctl ( _epollFd, EPOLL_CTL_DEL, fd, &ev );
+  }
+  else
+  {
+    int op = fi.events == 0 ? EPOLL_CTL_ADD : EPOLL_CTL_MOD;
+    int ret = jalib::epoll_ctl ( _epollFd, op, fd, &ev );
+    if ( ret == -1 && op == EPOLL_CTL_MOD && errno == ENOENT )
+    {
+      //fd was closed and reused behind our back
+      ret = jalib::epoll_ctl ( _epollFd, EPOLL_CTL_ADD, fd, &ev );
+    }
+    if ( ret == -1 )
+    {
+      //Regular files (e.g. stdin redirected from a file) cannot be polled.
+      //Like select(), report them ready on every iteration; a bad fd is
+      //handled the same way so that readOnce()/writeOnce() flag the error.
+      JTRACE ( "fd cannot be polled, treating it as always ready" )
+        ( fd ) ( JASSERT_ERRNO );
+      fi.alwaysReady = true;
+      _alwaysReadyFds.push_back ( fd );
+    }
+  }
+  fi.events = events;
+}
+
+void jalib::JMultiSocketProgram::sweepDataSockets ( IntSet& closedFds )
+{
+  size_t i;
+  //forget readers whose socket was replaced or poisoned by a subclass
+  for ( i=0; i<_interest.size(); ++i )
+  {
+    JReaderInterface* sock = _interest[i].reader;
+    if ( sock != NULL && sock->socket().sockfd() != ( int ) i )
+    {
+      _interest[i].reader = NULL;
+      updateInterest ( i );
+    }
+  }
+
+  //cleanup dead sockets
+  for ( i=0; i<_dataSockets.size(); ++i )
+  {
+    if ( _dataSockets[i]->hadError() )
+    {
+      JReaderInterface* dsock = _dataSockets[i];
+      int fd = dsock->socket().sockfd();
+      closedFds.insert(fd);
+      //socket is dead... remove it
+      //JTRACE ( "disconnect" ) ( i ) ( fd );
+      if ( fd >= 0 && ( size_t ) fd < _interest.size()
+           && _interest[fd].reader == dsock )
+      {
+        _interest[fd].reader = NULL;
+        dropWrites ( fd );
+        updateInterest ( fd );
+      }
+
+      _dataSockets[i] = 0;
+      //swap with last
+      _dataSockets[i] = _dataSockets[_dataSockets.size()-1];
+      _dataSockets.pop_back();
+      i--;
+      onDisconnect(dsock);
+      dsock->socket().close();
+      delete dsock;
+    }
+  }
+}
+
+void jalib::JMultiSocketProgram::sweepListenSockets()
+{
+  size_t i;
+  IntSet listenFds;
+  for ( i=0; i<_listenSockets.size(); ++i )
+  {
+    if ( _listenSockets[i].isValid() )
+    {
+      listenFds.insert ( _listenSockets[i].sockfd() );
+    }
+    else
+    {
+      _listenSockets[i].close();
+      //socket is dead... remove it
+      JTRACE ( "listen socket failure" ) ( i );
+      //swap with last
+      _listenSockets[i] = _listenSockets[_listenSockets.size()-1];
+      _listenSockets.pop_back();
+      i--;
+    }
+  }
+
+  //also drops listen sockets that a subclass removed from _listenSockets
+  for ( i=0; i<_interest.size(); ++i )
+  {
+    bool listening = listenFds.find ( i ) != listenFds.end();
+    if ( _interest[i].listening != listening )
+    {
+      _interest[i].listening = listening;
+      updateInterest ( i );
+    }
+  }
+  for ( IntSet::iterator it = listenFds.begin(); it != listenFds.end(); ++it )
+  {
+    if ( !interest ( *it ).listening )
+    {
+      interest ( *it ).listening = true;
+      updateInterest ( *it );
+    }
+  }
+}
+
+void jalib::JMultiSocketProgram::sweepWrites ( const IntSet& closedFds )
+{
+  //cleanup finished/dead writes
+  for ( size_t i=0; i<_writes.size(); ++i )
+  {
+    JWriterInterface* write = _writes[i];
+    int fd = write->socket().sockfd();
+    if (  write->hadError()
+       || write->isDone()
+       || closedFds.find(fd)!=closedFds.end() )
+    {
+      if ( fd >= 0 && ( size_t ) fd < _interest.size() )
+      {
+        jalib::vector<PendingWrite>& queue = _interest[fd].writes;
+        for ( size_t j=0; j<queue.size(); ++j )
+        {
+          if ( queue[j].write == write )
+          {
+            queue.erase ( queue.begin() + j );
+            break;
+          }
+        }
+        updateInterest ( fd );
+      }
+      //socket is or write done... pop it
+      delete _writes[i];
+      _writes[i] = 0;
+      //swap with last
+      _writes[i] = _writes[_writes.size()-1];
+      _writes.pop_back();
+      i--;
+    }
+  }
+}
+
+void jalib::JMultiSocketProgram::dropWrites ( int fd )
+{
+  jalib::vector<PendingWrite>& queue = _interest[fd].writes;
+  for ( size_t i=0; i<queue.size(); ++i )
+  {
+    if ( queue[i].chunk != NULL )
+      queue[i].chunk->unref();
+  }
+  queue.clear();
+}
+
+void jalib::JMultiSocketProgram::dispatchWrites ( int fd )
+{
+  if ( ( size_t ) fd >= _interest.size() ) return;
+  jalib::vector<PendingWrite>& queue = _interest[fd].writes;
+  //writes to one fd go out in the order they were queued
+  size_t i = 0;
+  bool sharedWrites = false;
+  while ( i<queue.size() )
+  {
+    JWriterInterface* write = queue[i].write;
+    if ( write == NULL )
+    {
+      sharedWrites = true;
+      //written chunks are removed, so i then indexes the next write
+      if ( !writeSharedChunks ( fd, i ) )
+        break;
+      continue;
+    }
+    if ( !write->isDone() && !write->hadError() )
+    {
+//      JTRACE("writing data")(fd);
+      write->writeOnce();
+      if ( !write->isDone() && !write->hadError() )
+        break;
+    }
+    _needWriteSweep = true;
+    ++i;
+  }
+  //shared chunks are not swept, so drop EPOLLOUT here once they are out
+  if ( sharedWrites )
+    updateInterest ( fd );
+}
+
+/*!
+    \fn jalib::JMultiSocketProgram::writeSharedChunks(int fd, size_t first)
+
+    Send the run of shared chunks that starts at queue position first with a
+    single non-blocking sendmsg() and drop those that were fully written.
+    Returns false if the socket would block.
+ */
+bool jalib::JMultiSocketProgram::writeSharedChunks ( int fd, size_t first )
+{
+  jalib::vector<PendingWrite>& queue = _interest[fd].writes;
+  struct iovec iov[SHARED_WRITE_IOV_MAX];
+  size_t last = first;
+  int iovcnt = 0;
+  while ( last<queue.size() && queue[last].write == NULL
+          && iovcnt < SHARED_WRITE_IOV_MAX )
+  {
+    iov[iovcnt].iov_base = ( char* ) queue[last].chunk->buffer()
+                           + queue[last].sent;
+    iov[iovcnt].iov_len = queue[last].chunk->length() - queue[last].sent;
+    ++iovcnt;
+    ++last;
+  }
+
+  struct msghdr msg;
+  memset ( &msg, 0, sizeof ( msg ) );
+  msg.msg_iov = iov;
+  msg.msg_iovlen = iovcnt;
+  ssize_t cnt = jalib::sendmsg ( fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL );
+  size_t written;
+  if ( cnt < 0 )
+  {
+    if ( errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR )
+      return false;
+    //the reader of this socket sees the failure too and gets swept;
+    //until then, discard what was queued on it
+    JTRACE ( "shared write failed" ) ( fd ) ( JASSERT_ERRNO );
+    written = ( size_t ) -1;
+  }
+  else
+  {
+    written = cnt;
+  }
+
+  size_t done = first;
+  while ( done<last )
+  {
+    size_t remaining = queue[done].chunk->length() - queue[done].sent;
+    if ( written < remaining )
+    {
+      queue[done].sent += written;
+      break;
+    }
+    written -= remaining;
+    queue[done].chunk->unref();
+    ++done;
+  }
+  queue.erase ( queue.begin() + first, queue.begin() + done );
+  return done == last;
+}
+
+/*!
+    \fn jalib::JMultiSocketProgram::flushSharedWrites()
+
+    Try the shared writes queued since the last epoll_wait() straight away,
+    so a broadcast to sockets with room in their send buffers costs one
+    sendmsg() each and no epoll_ctl() calls.
+ */
+void jalib::JMultiSocketProgram::flushSharedWrites()
+{
+  for ( size_t i=0; i<_sharedWriteFds.size(); ++i )
+  {
+    int fd = _sharedWriteFds[i];
+    FdInterest& fi = _interest[fd];
+    fi.flushQueued = false;
+    if ( !fi.writes.empty() && fi.writes[0].write == NULL )
+      dispatchWrites ( fd );
+    updateInterest ( fd );
+  }
+  _sharedWriteFds.clear();
+}
+
+void jalib::JMultiSocketProgram::dispatchRead ( int fd )
+{
+  if ( ( size_t ) fd >= _interest.size() ) return;
+  JReaderInterface* sock = _interest[fd].reader;
+  if ( sock == NULL ) return;
+//  JTRACE("receiving data")(fd);
+  if ( sock->socket().sockfd() == fd && sock->readOnce() )
+  {
+    onData ( sock );
+    sock->reset();
+  }
+  if ( sock->hadError() || sock->socket().sockfd() != fd )
+  {
+    //onData() may also have dropped listen sockets
+    _needDataSweep = true;
+    _needListenSweep = true;
+  }
+}
+
+void jalib::JMultiSocketProgram::dispatchAccept ( int fd )
+{
+  if ( ( size_t ) fd >= _interest.size() || !_interest[fd].listening ) return;
+  size_t i;
+  for ( i=0; i<_listenSockets.size(); ++i )
+  {
+    if ( _listenSockets[i].sockfd() == fd ) break;
+  }
+  if ( i == _listenSockets.size() ) return;
+
+  struct sockaddr_storage addr;
+  socklen_t addrlen = sizeof ( addr );
+  JSocket sk = _listenSockets[i].accept ( &addr,&addrlen );
+  JTRACE ( "accepting new connection" ) ( i ) ( sk.sockfd() )
+    ( _listenSockets[i].sockfd() ) ( JASSERT_ERRNO );
+  if ( sk.isValid() )
+  {
+    onConnect ( sk, ( sockaddr* ) &addr,addrlen );
+  }
+  else if ( errno != EAGAIN && errno != EINTR )
+  {
+    _interest[fd].listening = false;
+    updateInterest ( fd );
+    _listenSockets[i].close();
+    _needListenSweep = true;
+  }
+}
+
+/*!
+    \fn jalib::JMultiSocketProgram::monitorSockets(double dblTimeout)
+
+    The sockets are registered with an epoll instance that lives for the
+    duration of this call, so each iteration only touches the descriptors
+    that have events.  The per-socket cleanup that select() required on every
+    iteration is only done after a socket failed or a timeout interval.
+ */
+void jalib::JMultiSocketProgram::monitorSockets ( double dblTimeout )
+{
   struct timeval tmptime={0,0};
   struct timeval timeoutBuf;
   struct timeval * timeout;
@@ -558,17 +1051,41 @@ void jalib::JMultiSocketProgram::monitorSockets ( double dblTimeout )
   timeoutBuf = timeoutInterval;
   timeout = timeoutEnabled ? &timeoutBuf : NULL;
 
-  IntSet closedFds;
-  fd_set rfds;
-  fd_set wfds;
-  int maxFd;
+  _epollFd = jalib::epoll_create1 ( EPOLL_CLOEXEC );
+  JASSERT ( _epollFd != -1 ) ( JASSERT_ERRNO ).Text ( "epoll_create1 failed" );
+  _registeredFds = 0;
+  _interest.clear();
+  _alwaysReadyFds.clear();
+  _sharedWriteFds.clear();
+
   size_t i;
+  for ( i=0; i<_dataSockets.size(); ++i )
+  {
+    int fd = _dataSockets[i]->socket().sockfd();
+    if ( fd >= 0 )
+    {
+      interest ( fd ).reader = _dataSockets[i];
+      updateInterest ( fd );
+    }
+  }
+  for ( i=0; i<_writes.size(); ++i )
+  {
+    int fd = _writes[i]->socket().sockfd();
+    if ( fd >= 0 )
+    {
+      interest ( fd ).writes.push_back ( PendingWrite ( _writes[i] ) );
+      updateInterest ( fd );
+    }
+  }
+  _needDataSweep = true;
+  _needListenSweep = true;
+  _needWriteSweep = true;
+
+  IntSet closedFds;
+  jalib::vector<struct epoll_event> events;
   for ( ;; )
   {
     closedFds.clear();
-    maxFd = -1;
-    FD_ZERO ( &rfds );
-    FD_ZERO ( &wfds );
 
     if( timeout == NULL && timeoutEnabled){
       timeoutBuf=timeoutInterval;
@@ -577,78 +1094,28 @@ void jalib::JMultiSocketProgram::monitorSockets ( double dblTimeout )
       timeout = NULL;
     }
 
-    //collect listen fds in rfds, cleanup dead sockets
-    for ( i=0; i<_listenSockets.size(); ++i )
+    if ( _needListenSweep )
     {
-      if ( _listenSockets[i].isValid() )
-      {
-        FD_SET ( _listenSockets[i].sockfd(), &rfds );
-        maxFd = std::max ( maxFd,_listenSockets[i].sockfd() );
-      }
-      else
-      {
-        _listenSockets[i].close();
-        //socket is dead... remove it
-        JTRACE ( "listen socket failure" ) ( i );
-        //swap with last
-        _listenSockets[i] = _listenSockets[_listenSockets.size()-1];
-        _listenSockets.pop_back();
-        i--;
-      }
+      _needListenSweep = false;
+      sweepListenSockets();
     }
-
-    //collect data fds in rfds, cleanup dead sockets
-    for ( i=0; i<_dataSockets.size(); ++i )
+    if ( _needDataSweep )
     {
-      if ( !_dataSockets[i]->hadError() )
-      {
-        FD_SET ( _dataSockets[i]->socket().sockfd(), &rfds );
-        maxFd = std::max ( maxFd,_dataSockets[i]->socket().sockfd() );
-      }
-      else
-      {
-        JReaderInterface* dsock = _dataSockets[i];
-        closedFds.insert(dsock->socket().sockfd());
-        //socket is dead... remove it
-        //JTRACE ( "disconnect" ) ( i ) ( _dataSockets[i]->socket().sockfd() );
-
-        _dataSockets[i] = 0;
-        //swap with last
-        _dataSockets[i] = _dataSockets[_dataSockets.size()-1];
-        _dataSockets.pop_back();
-        i--;
-        onDisconnect(dsock);
-        dsock->socket().close();
-        delete dsock;
-      }
+      _needDataSweep = false;
+      sweepDataSockets ( closedFds );
+      if ( !closedFds.empty() ) _needWriteSweep = true;
     }
-
-    //collect all writes in wfds, cleanup finished/dead
-    for ( i=0; i<_writes.size(); ++i )
+    if ( _needWriteSweep )
     {
-      if (  !_writes[i]->hadError()
-         && !_writes[i]->isDone()
-         && closedFds.find(_writes[i]->socket().sockfd())==closedFds.end() )
-      {
-        FD_SET ( _writes[i]->socket().sockfd(), &wfds );
-        maxFd = std::max ( maxFd,_writes[i]->socket().sockfd() );
-      }
-      else
-      {
-        //socket is or write done... pop it
-        delete _writes[i];
-        _writes[i] = 0;
-        //swap with last
-        _writes[i] = _writes[_writes.size()-1];
-        _writes.pop_back();
-        i--;
-      }
+      _needWriteSweep = false;
+      sweepWrites ( closedFds );
     }
+    flushSharedWrites();
 
-    if ( maxFd == -1 )
+    if ( _registeredFds == 0 )
     {
       //JTRACE ( "no sockets left" );
-      return;
+      break;
     }
 
     //NOTE:  The top level routine of dmtcp_coordinator calls monitorSockets(),
@@ -659,65 +1126,52 @@ void jalib::JMultiSocketProgram::monitorSockets ( double dblTimeout )
     //  completion, they then return to monitorSockets() to wait for more
     //  work to do.  dmtcp_coordinator.cpp also describes some of this logic.
     //this will block till we have some work to do
-    int retval = jalib::select ( maxFd+1, &rfds, &wfds, NULL, timeout );
+    int timeoutMs = -1;
+    if ( !_alwaysReadyFds.empty() )
+      timeoutMs = 0;
+    else if ( timeout != NULL )
+      timeoutMs = timeout->tv_sec * 1000 + ( timeout->tv_usec + 999 ) / 1000;
 
-    if ( retval == -1 )
+    events.resize ( EPOLL_MAX_EVENTS + _alwaysReadyFds.size() );
+    int retval = jalib::epoll_wait ( _epollFd, &events[0], EPOLL_MAX_EVENTS,
+                                     timeoutMs );
+
+    if ( retval == -1 && errno != EINTR )
     {
       JWARNING ( retval != -1 )
-        ( maxFd ) ( retval ) ( JASSERT_ERRNO ).Text ( "select failed" );
-      return;
+        ( _registeredFds ) ( retval ) ( JASSERT_ERRNO )
+        .Text ( "epoll_wait failed" );
+      break;
     }
-    else if ( retval > 0 )
-    {
-      //write all data
-      for ( i=0; i<_writes.size(); ++i )
-      {
-        int fd = _writes[i]->socket().sockfd();
-        if ( fd >= 0 && FD_ISSET ( fd, &wfds ) )
-        {
-//                    JTRACE("writing data")(_writes[i]->socket().sockfd());
-          _writes[i]->writeOnce();
-        }
-      }
 
+    int nevents = std::max ( retval, 0 );
+    for ( i=0; i<_alwaysReadyFds.size(); ++i )
+    {
+      events[nevents].events = _interest[_alwaysReadyFds[i]].events;
+      events[nevents].data.fd = _alwaysReadyFds[i];
+      nevents++;
+    }
 
-      //read all new data
-      for ( i=0; i<_dataSockets.size(); ++i )
-      {
-        int fd = _dataSockets[i]->socket().sockfd();
-        if ( fd >= 0 && FD_ISSET ( fd, &rfds ) )
-        {
-//                   JTRACE("receiving data")(i)(_dataSockets[i].socket().sockfd());
-          if ( _dataSockets[i]->readOnce() )
-          {
-            onData ( _dataSockets[i] );
-            _dataSockets[i]->reset();
-          }
-        }
-      }
+    int n;
+    //write all data
+    for ( n=0; n<nevents; ++n )
+    {
+      if ( events[n].events & ( EPOLLOUT | EPOLLERR | EPOLLHUP ) )
+        dispatchWrites ( events[n].data.fd );
+    }
 
+    //read all new data
+    for ( n=0; n<nevents; ++n )
+    {
+      if ( events[n].events & ( EPOLLIN | EPOLLERR | EPOLLHUP ) )
+        dispatchRead ( events[n].data.fd );
+    }
 
-      //accept all new connections
-      for ( i=0; i<_listenSockets.size(); ++i )
-      {
-        int fd = _listenSockets[i].sockfd();
-        if ( fd >= 0 && FD_ISSET ( fd, &rfds ) )
-        {
-          struct sockaddr_storage addr;
-          socklen_t addrlen = sizeof ( addr );
-          JSocket sk = _listenSockets[i].accept ( &addr,&addrlen );
-          JTRACE ( "accepting new connection" ) ( i ) ( sk.sockfd() )
-            ( _listenSockets[i].sockfd() ) ( JASSERT_ERRNO );
-          if ( sk.isValid() )
-          {
-            onConnect ( sk, ( sockaddr* ) &addr,addrlen );
-          }
-          else if ( errno != EAGAIN && errno != EINTR )
-          {
-            _listenSockets[i].close();
-          }
-        }
-      }
+    //accept all new connections
+    for ( n=0; n<nevents; ++n )
+    {
+      if ( events[n].events & ( EPOLLIN | EPOLLERR | EPOLLHUP ) )
+        dispatchAccept ( events[n].data.fd );
     }
 
     if ( timeoutEnabled )
@@ -734,9 +1188,21 @@ void jalib::JMultiSocketProgram::monitorSockets ( double dblTimeout )
         timeradd ( &timeoutInterval,&stoptime,&stoptime );
 //                 JTRACE("timeout interval")(timeoutSec);
         onTimeoutInterval();
+        //subclasses may poison data sockets or drop listen sockets here
+        _needDataSweep = true;
+        _needListenSweep = true;
       }
     }
   }
+
+  jalib::close ( _epollFd );
+  _epollFd = -1;
+  for ( i=0; i<_interest.size(); ++i )
+  {
+    dropWrites ( i );
+  }
+  _interest.clear();
+  _alwaysReadyFds.clear();
 }
 
 
@@ -186,15 +186,29 @@ namespace jalib
       bool readOnce();
       void readAll();
       void reset();
-      bool ready() const { return _length == _read; }
+      bool ready() const {
+        return _length == _read && _payloadLength == _payloadRead;
+      }
       const char* buffer() const{ return _buffer; }
       bool hadError() const { return _hadError || !_sock.isValid(); }
       int bytesRead() const {return _read;}
+      // The variable-length data that followed the chunk, if any.
+      const char* payload() const { return _payload; }
+      size_t payloadBytes() const { return _payloadLength; }
     protected:
+      // Called once the chunk is complete; returns how many more bytes belong
+      // to the same message.  readOnce() reads them into payload() before
+      // reporting ready(), one read() per call, so a slow peer never blocks
+      // the caller.
+      virtual size_t payloadLength() const { return 0; }
+
       char* _buffer;
       int _length;
       int _read;
       bool _hadError;
+      char* _payload;
+      size_t _payloadLength;
+      size_t _payloadRead;
   };
 
   class JWriterInterface
@@ -240,6 +254,32 @@ namespace jalib
       bool _hadError;
   };
 
+  // An immutable buffer queued on many sockets at once with
+  // JMultiSocketProgram::addSharedWrite().  Every pending write holds a
+  // reference; the creator holds the first one until it has queued them all.
+  class JSharedChunk
+  {
+    public:
+#ifdef JALIB_ALLOCATOR
+      static void* operator new(size_t nbytes, void* p) { return p; }
+      static void* operator new(size_t nbytes) { JALLOC_HELPER_NEW(nbytes); }
+      static void  operator delete(void* p) { JALLOC_HELPER_DELETE(p); }
+#endif
+      JSharedChunk ( const char* buf, int len );
+      void ref() { _refs++; }
+      void unref() { if ( --_refs == 0 ) delete this; }
+      const char* buffer() const { return _buffer; }
+      int length() const { return _length; }
+    private:
+      ~JSharedChunk();
+      JSharedChunk ( const JSharedChunk& that );
+      JSharedChunk& operator= ( const JSharedChunk& that );
+
+      char* _buffer;
+      int _length;
+      int _refs;
+  };
+
 
   class JMultiSocketProgram
   {
@@ -249,6 +289,7 @@ namespace jalib
       static void* operator new(size_t nbytes) { JALLOC_HELPER_NEW(nbytes); }
       static void  operator delete(void* p) { JALLOC_HELPER_DELETE(p); }
 #endif
+      JMultiSocketProgram() : _epollFd ( -1 ) {}
       virtual ~JMultiSocketProgram() {}
       void addDataSocket ( JReaderInterface* sock );
       void addListenSocket ( const JSocket& sock );
@@ -259,14 +300,66 @@ namespace jalib
       void setTimeoutInterval ( double dblTimeout );
       virtual void onTimeoutInterval() {};
       void addWrite ( JWriterInterface* write );
+      void addSharedWrite ( const JSocket& sock, JSharedChunk* chunk );
+      void flushWrites();
     protected:
       jalib::vector<JReaderInterface*> _dataSockets;
       jalib::vector<JSocket> _listenSockets;
       jalib::vector<JWriterInterface*> _writes;
     private:
+      // One queued write: either a writer owned through _writes, or a
+      // reference to a shared chunk together with this socket's cursor in it.
+      struct PendingWrite
+      {
+        PendingWrite ( JWriterInterface* w ) : write ( w ), chunk ( NULL )
+                                             , sent ( 0 ) {}
+        PendingWrite ( JSharedChunk* c ) : write ( NULL ), chunk ( c )
+                                         , sent ( 0 ) {}
+        JWriterInterface* write;
+        JSharedChunk* chunk;
+        int sent;
+      };
+
+      // Interest registered with the epoll instance for one descriptor.  A
+      // descriptor may carry a reader or a listen socket together with the
+      // queue of writes pending on it.
+      struct FdInterest
+      {
+        FdInterest() : reader ( NULL ), listening ( false ), events ( 0 )
+                     , alwaysReady ( false ), flushQueued ( false ) {}
+        JReaderInterface* reader;
+        bool listening;
+        jalib::vector<PendingWrite> writes;
+        unsigned int events;
+        bool alwaysReady;
+        bool flushQueued;
+      };
+
+      FdInterest& interest ( int fd );
+      void updateInterest ( int fd );
+      void sweepDataSockets ( IntSet& closedFds );
+      void sweepListenSockets();
+      void sweepWrites ( const IntSet& closedFds );
+      void dropWrites ( int fd );
+      void dispatchWrites ( int fd );
+      bool writeSharedChunks ( int fd, size_t first );
+      void flushSharedWrites();
+      void dispatchRead ( int fd );
+      void dispatchAccept ( int fd );
+
       bool timeoutEnabled;
       struct timeval timeoutInterval;
       struct timeval stoptime;
+
+      // Only valid while monitorSockets() is running.
+      int _epollFd;
+      int _registeredFds;
+      bool _needDataSweep;
+      bool _needListenSweep;
+      bool _needWriteSweep;
+      jalib::vector<FdInterest> _interest;
+      IntVector _alwaysReadyFds;
+      IntVector _sharedWriteFds;
   };
 
 } //namespace jalib
@@ -108,6 +108,14 @@
   #define ENV_DELTACOMPRESSION
 #endif
 #define ENV_VAR_FORKED_CKPT "MTCP_FORKED_CHECKPOINT"
+#define ENV_VAR_WRITER_THREADS "DMTCP_WRITER_THREADS"
+#define ENV_VAR_INCREMENTAL "DMTCP_INCREMENTAL"
+#define ENV_VAR_CHUNK_STORE "DMTCP_CHUNK_STORE"
+// ENV_VAR_DRAIN_TIMEOUT is in dmtcpplugin.h; the socket plugin reads it.
+#define ENV_VAR_NAME_SERVICE_ON_DEMAND "DMTCP_NAME_SERVICE_ON_DEMAND"
+#define ENV_VAR_LAZY_RESTORE "DMTCP_LAZY_RESTORE"
+#define ENV_VAR_RESTORE_THREADS "DMTCP_RESTORE_THREADS"
+#define ENV_VAR_FAST_RESTART "DMTCP_FAST_RESTART"
 #define ENV_VAR_SIGCKPT "DMTCP_SIGCKPT"
 #define ENV_VAR_SCREENDIR "SCREENDIR"
 
@@ -132,6 +140,11 @@
     ENV_VAR_UTILITY_DIR,\
     ENV_VAR_STDERR_PATH,\
     ENV_VAR_COMPRESSION,\
+    ENV_VAR_WRITER_THREADS,\
+    ENV_VAR_INCREMENTAL,\
+    ENV_VAR_CHUNK_STORE,\
+    ENV_VAR_DRAIN_TIMEOUT,\
+    ENV_VAR_NAME_SERVICE_ON_DEMAND,\
     ENV_VAR_SIGCKPT,\
     ENV_VAR_ROOT_PROCESS,\
     ENV_VAR_PREFIX_ID,\
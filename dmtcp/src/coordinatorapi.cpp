@@ -174,14 +174,15 @@ void dmtcp::CoordinatorAPI::recvMsgFromCoordinator(dmtcp::DmtcpMessage *msg,
 void dmtcp::CoordinatorAPI::connectAndSendUserCommand(char c,
                                                       int *coordErrorCode,
                                                       int *numPeers,
-                                                      int *running)
+                                                      int *running,
+                                                      dmtcp::string *replyText)
 {
   if (tryConnectToCoordinator() == false) {
     *coordErrorCode = ERROR_COORDINATOR_NOT_FOUND;
     return;
   }
 
-  sendUserCommand(c, coordErrorCode, numPeers, running);
+  sendUserCommand(c, coordErrorCode, numPeers, running, replyText);
   _coordinatorSocket.close();
 }
 
@@ -375,7 +376,8 @@ void dmtcp::CoordinatorAPI::recvCoordinatorHandshake()
 
 //tell the coordinator to run given user command
 void dmtcp::CoordinatorAPI::sendUserCommand(char c, int* coordErrorCode /*= NULL*/,
-                                            int *numPeers, int *isRunning)
+                                            int *numPeers, int *isRunning,
+                                            dmtcp::string *replyText)
 {
   DmtcpMessage msg, reply;
 
@@ -412,6 +414,14 @@ void dmtcp::CoordinatorAPI::sendUserCommand(char c, int* coordErrorCode /*= NULL
   if (isRunning != NULL) {
     *isRunning = reply.isRunning;
   }
+  // Some commands ('p') answer with text.
+  if (reply.extraBytes > 0) {
+    dmtcp::string text(reply.extraBytes, '\0');
+    _coordinatorSocket.readAll(&text[0], reply.extraBytes);
+    if (replyText != NULL) {
+      *replyText = text;
+    }
+  }
 }
 
 pid_t dmtcp::CoordinatorAPI::getVirtualPidFromCoordinator()
@@ -580,7 +590,7 @@ void dmtcp::CoordinatorAPI::startNewCoordinator(dmtcp::CoordinatorAPI::Coordinat
   }
 }
 
-void dmtcp::CoordinatorAPI::sendCkptFilename()
+void dmtcp::CoordinatorAPI::sendCkptFilename(bool imagePending)
 {
   if (noCoordinator()) return;
   // Tell coordinator to record our filename in the restart script
@@ -589,12 +599,31 @@ void dmtcp::CoordinatorAPI::sendCkptFilename()
   JTRACE("recording filenames") (ckptFilename) (hostname);
   dmtcp::DmtcpMessage msg;
   msg.type = DMT_CKPT_FILENAME;
+  msg.imagePending = imagePending;
   msg.extraBytes = ckptFilename.length() +1 + hostname.length() +1;
   _coordinatorSocket << msg;
   _coordinatorSocket.writeAll (ckptFilename.c_str(), ckptFilename.length() +1);
   _coordinatorSocket.writeAll (hostname.c_str(),     hostname.length() +1);
 }
 
+// Called in the forked child that wrote the checkpoint image.  It must not
+// touch the worker's own connection, which the worker is still using.
+void dmtcp::CoordinatorAPI::sendCkptDurable(bool durable)
+{
+  if (noCoordinator()) return;
+  jalib::JSocket sock = createNewConnectionToCoordinator(false);
+  if (!sock.isValid()) {
+    JWARNING(false) .Text("Failed to tell the coordinator that the"
+                          " checkpoint image was written");
+    return;
+  }
+  JTRACE("checkpoint image written") (UniquePid::getCkptFilename()) (durable);
+  dmtcp::DmtcpMessage msg(DMT_CKPT_DURABLE);
+  msg.imageFailed = durable ? 0 : 1;
+  sock << msg;
+  sock.close();
+}
+
 // At restart, the HOST/PORT used by dmtcp_coordinator could be different then
 // those at checkpoint time. This could cause the child processes created after
 // restart to fail to connect to the coordinator.
@@ -701,6 +730,120 @@ int dmtcp::CoordinatorAPI::sendQueryToCoordinator(const void *key, size_t key_le
   return 1;
 }
 
+// Largest payload of one bulk name service message.  At most
+// NS_QUERY_PIPELINE_DEPTH query messages are outstanding so that the replies
+// in flight stay small enough for the socket buffers; otherwise the
+// coordinator could block writing replies while we block writing queries.
+static const size_t NS_BULK_MAX_BYTES = 32 * 1024;
+static const int NS_QUERY_PIPELINE_DEPTH = 2;
+
+// Packs records [first, *end) into a newly allocated buffer of *len bytes.
+// vals is NULL for queries.  A record larger than NS_BULK_MAX_BYTES is sent
+// on its own.
+static char *packNameServiceRecords(size_t first, size_t count,
+                                    const void * const *keys,
+                                    const size_t *key_lens,
+                                    const void * const *vals,
+                                    const size_t *val_lens,
+                                    size_t *end, size_t *len)
+{
+  size_t i = first;
+  size_t bytes = 0;
+  do {
+    bytes += sizeof(dmtcp::NameServiceRecord) + key_lens[i] +
+             (vals == NULL ? 0 : val_lens[i]);
+    i++;
+  } while (i < count &&
+           bytes + sizeof(dmtcp::NameServiceRecord) + key_lens[i] +
+           (vals == NULL ? 0 : val_lens[i]) <= NS_BULK_MAX_BYTES);
+
+  char *buf = (char*) JALLOC_HELPER_MALLOC(bytes);
+  char *out = buf;
+  for (size_t j = first; j < i; j++) {
+    dmtcp::NameServiceRecord rec;
+    rec.keyLen = key_lens[j];
+    rec.valLen = vals == NULL ? 0 : val_lens[j];
+    memcpy(out, &rec, sizeof(rec));
+    memcpy(out + sizeof(rec), keys[j], rec.keyLen);
+    if (rec.valLen > 0) {
+      memcpy(out + sizeof(rec) + rec.keyLen, vals[j], rec.valLen);
+    }
+    out += sizeof(rec) + rec.keyLen + rec.valLen;
+  }
+  *end = i;
+  *len = bytes;
+  return buf;
+}
+
+int dmtcp::CoordinatorAPI::sendKeyValPairsToCoordinator(size_t count,
+                                                        const void * const *keys,
+                                                        const size_t *key_lens,
+                                                        const void * const *vals,
+                                                        const size_t *val_lens)
+{
+  size_t i = 0;
+  while (i < count) {
+    size_t len;
+    char *extraData = packNameServiceRecords(i, count, keys, key_lens,
+                                             vals, val_lens, &i, &len);
+    DmtcpMessage msg (DMT_REGISTER_NAME_SERVICE_DATA_BULK);
+    msg.extraBytes = len;
+    sendMsgToCoordinator(msg, extraData, msg.extraBytes);
+    JALLOC_HELPER_FREE(extraData);
+  }
+  return 1;
+}
+
+int dmtcp::CoordinatorAPI::sendQueriesToCoordinator(size_t count,
+                                                    const void * const *keys,
+                                                    const size_t *key_lens,
+                                                    void **vals,
+                                                    size_t *val_lens)
+{
+  size_t sent = 0;
+  size_t received = 0;
+  int inFlight = 0;
+  while (received < count) {
+    while (sent < count && inFlight < NS_QUERY_PIPELINE_DEPTH) {
+      size_t len;
+      char *extraData = packNameServiceRecords(sent, count, keys, key_lens,
+                                               NULL, NULL, &sent, &len);
+      DmtcpMessage msg (DMT_NAME_SERVICE_QUERY_BULK);
+      msg.extraBytes = len;
+      sendMsgToCoordinator(msg, extraData, msg.extraBytes);
+      JALLOC_HELPER_FREE(extraData);
+      inFlight++;
+    }
+
+    DmtcpMessage msg;
+    void *extraData;
+    recvMsgFromCoordinator(&msg, &extraData);
+    JASSERT(msg.type == DMT_NAME_SERVICE_QUERY_BULK_RESPONSE) (msg.type);
+    inFlight--;
+
+    // Replies come back in the order of the queries.
+    const char *in = (const char*) extraData;
+    const char *inEnd = in + msg.extraBytes;
+    while (in < inEnd) {
+      NameServiceRecord rec;
+      memcpy(&rec, in, sizeof(rec));
+      in += sizeof(rec);
+      JASSERT(received < sent && in + rec.keyLen + rec.valLen <= inEnd)
+        (received) (sent) (rec.keyLen) (rec.valLen);
+      JASSERT(rec.keyLen == key_lens[received] &&
+              memcmp(in, keys[received], rec.keyLen) == 0) (received);
+      JASSERT(rec.valLen <= val_lens[received])
+        (rec.valLen) (val_lens[received]) (received);
+      memcpy(vals[received], in + rec.keyLen, rec.valLen);
+      val_lens[received] = rec.valLen;
+      in += rec.keyLen + rec.valLen;
+      received++;
+    }
+    JALLOC_HELPER_FREE(extraData);
+  }
+  return 1;
+}
+
 int dmtcp::CoordinatorAPI::getCoordSockname(struct sockaddr_storage *addr)
 {
   socklen_t addrlen = sizeof(*addr);
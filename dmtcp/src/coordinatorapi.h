@@ -77,7 +77,8 @@ namespace dmtcp
       void connectAndSendUserCommand(char c,
                                      int *coordErrorCode = NULL,
                                      int *numPeers = NULL,
-                                     int *isRunning = NULL);
+                                     int *isRunning = NULL,
+                                     dmtcp::string *replyText = NULL);
 
       void useAlternateCoordinatorFd();
 
@@ -88,7 +89,8 @@ namespace dmtcp
       void sendUserCommand(char c,
                            int *coordErrorCode = NULL,
                            int *numPeers = NULL,
-                           int *isRunning = NULL);
+                           int *isRunning = NULL,
+                           dmtcp::string *replyText = NULL);
 
       pid_t virtualPid() const { return _virtualPid; }
       pid_t getVirtualPidFromCoordinator();
@@ -107,7 +109,8 @@ namespace dmtcp
                                       DMT_HELLO_COORDINATOR,
                                     bool preForkHandshake = false);
       void recvCoordinatorHandshake();
-      void sendCkptFilename();
+      void sendCkptFilename(bool imagePending = false);
+      void sendCkptDurable(bool durable);
       void updateHostAndPortEnv();
 
       static void setupVirtualCoordinator();
@@ -120,6 +123,15 @@ namespace dmtcp
                                       const void *val, size_t val_len);
       int sendQueryToCoordinator(const void *key, size_t key_len,
                                  void *val, size_t *val_len);
+      int sendKeyValPairsToCoordinator(size_t count,
+                                       const void * const *keys,
+                                       const size_t *key_lens,
+                                       const void * const *vals,
+                                       const size_t *val_lens);
+      int sendQueriesToCoordinator(size_t count,
+                                   const void * const *keys,
+                                   const size_t *key_lens,
+                                   void **vals, size_t *val_lens);
 
       int getCoordSockname(struct sockaddr_storage *addr);
 
@@ -48,8 +48,32 @@ static const char* theUsage =
   "  --port, -p, (environment variable DMTCP_PORT):\n"
   "      Port where dmtcp_coordinator is run (default: 7779)\n"
   "  --gzip, --no-gzip, (environment variable DMTCP_GZIP=[01]):\n"
-  "      Enable/disable compression of checkpoint images (default: 1)\n"
-  "      WARNING:  gzip adds seconds.  Without gzip, ckpt is often < 1 s\n"
+  "      Enable/disable compression of checkpoint images (default: 0)\n"
+  "        Memory is compressed in-process, in blocks of 1 MB\n"
+  "  --writer-threads <arg>, (environment variable DMTCP_WRITER_THREADS):\n"
+  "      Number of threads compressing, or writing large memory areas of an\n"
+  "        uncompressed checkpoint image, in parallel (default: 1)\n"
+  "  --incremental <arg>, (environment variable DMTCP_INCREMENTAL):\n"
+  "      Number of incremental checkpoint images, holding only the pages\n"
+  "        written since the previous image, between full ones (default: 0)\n"
+  "  --chunk-store, --no-chunk-store,\n"
+  "      (environment variable DMTCP_CHUNK_STORE=[01]):\n"
+  "      Enable/disable storing memory in chunks shared by all checkpoint\n"
+  "        images in the checkpoint directory (default: 0)\n"
+  "  --forked-checkpointing, (environment variable MTCP_FORKED_CHECKPOINT):\n"
+  "      Resume as soon as a child process holds a copy of the memory; the\n"
+  "        child writes the image and the coordinator then updates the\n"
+  "        restart script (EXPERIMENTAL)\n"
+  "  --drain-timeout <arg>, (environment variable DMTCP_DRAIN_TIMEOUT):\n"
+  "      Seconds to wait at checkpoint for the peer of a socket, if it is\n"
+  "        not part of the computation, to answer the drain; after that\n"
+  "        it is treated as a process not under DMTCP and its data is left\n"
+  "        in the socket (default: no limit)\n"
+  "  --name-service-on-demand,\n"
+  "      (environment variable DMTCP_NAME_SERVICE_ON_DEMAND=1):\n"
+  "      Run the name service phases of a checkpoint or restart only if a\n"
+  "        plugin asks for them with dmtcp_request_name_service(); use only\n"
+  "        if all plugins in use do so (default: always run them)\n"
 #ifdef HBICT_DELTACOMP
   "  --hbict, --no-hbict, (environment variable DMTCP_HBICT=[01]):\n"
   "      Enable/disable compression of checkpoint images (default: 1)\n"
@@ -162,6 +186,27 @@ static void processArgs(int *orig_argc, char ***orig_argv)
     } else if (s == "--no-gzip") {
       setenv(ENV_VAR_COMPRESSION, "0", 1);
       shift;
+    } else if (argc>1 && s == "--writer-threads") {
+      setenv(ENV_VAR_WRITER_THREADS, argv[1], 1);
+      shift; shift;
+    } else if (argc>1 && s == "--incremental") {
+      setenv(ENV_VAR_INCREMENTAL, argv[1], 1);
+      shift; shift;
+    } else if (s == "--chunk-store") {
+      setenv(ENV_VAR_CHUNK_STORE, "1", 1);
+      shift;
+    } else if (s == "--no-chunk-store") {
+      setenv(ENV_VAR_CHUNK_STORE, "0", 1);
+      shift;
+    } else if (argc>1 && s == "--drain-timeout") {
+      setenv(ENV_VAR_DRAIN_TIMEOUT, argv[1], 1);
+      shift; shift;
+    } else if (s == "--name-service-on-demand") {
+      setenv(ENV_VAR_NAME_SERVICE_ON_DEMAND, "1", 1);
+      shift;
+    } else if (s == "--forked-checkpointing") {
+      setenv(ENV_VAR_FORKED_CKPT, "1", 1);
+      shift;
     }
 #ifdef HBICT_DELTACOMP
     else if (s == "--hbict") {
@@ -273,9 +318,8 @@ int main ( int argc, char** argv )
   dmtcp::Util::initializeLogFile();
 
 #ifdef FORKED_CHECKPOINTING
-  /* When this is robust, add --forked-checkpointing option on command-line,
-   * with #ifdef FORKED_CHECKPOINTING around the option, change default of
-   * configure.ac, dmtcp/configure.ac, to enable, and change them
+  /* When this is robust, change default of configure.ac,
+   * dmtcp/configure.ac, to enable, and change them
    * from enable-forked... to disable-...
    */
   setenv(ENV_VAR_FORKED_CKPT, "1", 1);
@@ -51,6 +51,8 @@ static const char* theUsage =
   "COMMANDS FOR COORDINATOR:\n"
   "    s, -s, --status : Print status message\n"
   "    c, -c, --checkpoint : Checkpoint all nodes\n"
+  "    t, -t, --timings : Print phase timings of the last and current\n"
+  "                       checkpoint or restart (JSON)\n"
   "    bc, -bc, --bcheckpoint : Checkpoint all nodes, blocking until done\n"
   "    i, -i, --interval <val> : Update ckpt interval to <val> seconds"
 						   		" (0=never)\n"
@@ -108,7 +110,7 @@ int main ( int argc, char** argv )
         fprintf(stderr, theUsage, "");
         return 1;
       } else if (*cmd == 's' || *cmd == 'i' || *cmd == 'c' || *cmd == 'b'
-		 || *cmd == 'f' || *cmd == 'k' || *cmd == 'q') {
+		 || *cmd == 'f' || *cmd == 'k' || *cmd == 'q' || *cmd == 't') {
         request = s;
         if (*cmd == 'i') {
 	  if (isdigit(cmd[1])) { // if -i5, for example
@@ -142,6 +144,7 @@ int main ( int argc, char** argv )
   int coordErrorCode = CoordinatorAPI::NOERROR;
   int numPeers;
   int isRunning;
+  dmtcp::string timings;
   CoordinatorAPI coordinatorAPI;
   char *cmd = (char *)request.c_str();
   switch (*cmd) {
@@ -159,6 +162,11 @@ int main ( int argc, char** argv )
     // actual command
     coordinatorAPI.connectAndSendUserCommand(*(cmd+1), &coordErrorCode);
     break;
+  case 't':
+    // The coordinator's own 't' lists the nodes; 'p' gets the timings.
+    coordinatorAPI.connectAndSendUserCommand('p', &coordErrorCode,
+                                             NULL, NULL, &timings);
+    break;
   case 's':
     coordinatorAPI.connectAndSendUserCommand(*cmd, &coordErrorCode,
                                              &numPeers, &isRunning);
@@ -205,6 +213,10 @@ int main ( int argc, char** argv )
     printf("RUNNING=%s\n", (isRunning?"yes":"no"));
   }
 
+  if (*cmd == 't') {
+    printf("%s", timings.c_str());
+  }
+
   return 0;
 }
 
@@ -41,6 +41,9 @@
  *                -> DONE_QUERYING -> REFILLED -> RUNNING		    *
  * Restart:    RESTARTING -> CHECKPOINTED -> NAME_SERVICE_DATA_REGISTERED   *
  *                -> DONE_QUERYING -> REFILLED -> RUNNING	            *
+ * If no worker needs the name service (possible only with                  *
+ *   DMTCP_NAME_SERVICE_ON_DEMAND=1), CHECKPOINTED goes straight to         *
+ *   REFILLED.                                                              *
  * If debugging, set gdb breakpoint on:					    *
  *   dmtcp::DmtcpCoordinator::onConnect					    *
  *   dmtcp::DmtcpCoordinator::onData					    *
@@ -54,6 +57,7 @@
 #include "dmtcpmessagetypes.h"
 #include "coordinatorapi.h"
 #include "lookup_service.h"
+#include "phase_timings.h"
 #include "syscallwrappers.h"
 #include "util.h"
 #include "../jalib/jconvert.h"
@@ -80,6 +84,7 @@ static const char* theHelpMessage =
   "  l : List connected nodes\n"
   "  s : Print status message\n"
   "  c : Checkpoint all nodes\n"
+  "  p : Print phase timings of the last and current checkpoint or restart\n"
   "  i : Print current checkpoint interval\n"
   "      (To change checkpoint interval, use dmtcp_command)\n"
   "  f : Force a restart even if there are missing nodes (debugging only)\n"
@@ -109,6 +114,10 @@ static const char* theUsage =
   "  --interval, -i, (environment variable DMTCP_CHECKPOINT_INTERVAL):\n"
   "      Time in seconds between automatic checkpoints\n"
   "      (default: 0, disabled)\n"
+  "  --relay <host>[:<port>]\n"
+  "      Serve the workers of this node on behalf of the coordinator at\n"
+  "      <host>:<port> (default port: 7779).  Workers and dmtcp_command\n"
+  "      connect to the relay; checkpoints are started upstream.\n"
   "  --help:\n"
   "      Print this message and exit.\n"
   "  --version:\n"
@@ -381,11 +390,15 @@ static int numPeers = -1;
 static time_t curTimeStamp = -1;
 
 static dmtcp::LookupService lookupService;
+static dmtcp::PhaseTimings phaseTimings;
 static dmtcp::string localHostName;
 static dmtcp::string localPrefix;
 static dmtcp::string remotePrefix;
 
 #define INITIAL_VIRTUAL_PID 40000
+// Seconds after which we stop waiting for a forked checkpoint writer that
+// has not reported; it may have crashed.
+#define PENDING_IMAGE_TIMEOUT 1800
 #define MAX_VIRTUAL_PID   4000000
 static pid_t _nextVirtualPid = INITIAL_VIRTUAL_PID;
 
@@ -393,18 +406,38 @@ namespace
 {
   static int theNextClientNumber = 1;
 
-  class NamedChunkReader : public jalib::JChunkReader
+  // Reads a DmtcpMessage and then its extraBytes as the payload, so that
+  // onData() sees whole messages and never waits on a slow peer.
+  class MessageReader : public jalib::JChunkReader
+  {
+    public:
+      MessageReader ( const jalib::JSocket& sock )
+          : jalib::JChunkReader ( sock, sizeof ( dmtcp::DmtcpMessage ) ) {}
+    protected:
+      virtual size_t payloadLength() const {
+        const dmtcp::DmtcpMessage& msg = *(const dmtcp::DmtcpMessage*) _buffer;
+        msg.assertValid();
+        return msg.extraBytes;
+      }
+  };
+
+  class NamedChunkReader : public MessageReader
   {
     public:
       NamedChunkReader ( const jalib::JSocket& sock
                          ,const struct sockaddr * remote
                          ,socklen_t len
                          ,dmtcp::DmtcpMessage &hello_remote)
-          : jalib::JChunkReader ( sock, sizeof ( dmtcp::DmtcpMessage ) )
+          : MessageReader ( sock )
           , _clientNumber ( theNextClientNumber++ )
+          , _virtualPid ( -1 )
+          , _isRelay ( false )
+          , _relayedWorkers ( 0 )
+          , _nameServiceWorkers ( 0 )
       {
         _identity = hello_remote.from;
         _state = hello_remote.state;
+        _maxState = hello_remote.state;
       }
       const dmtcp::UniquePid& identity() const { return _identity;}
       void identity(dmtcp::UniquePid upid) { _identity = upid;}
@@ -418,20 +451,48 @@ namespace
       dmtcp::string prefixDir(void) const { return _prefixDir; }
       pid_t virtualPid(void) const { return _virtualPid; }
       void virtualPid(pid_t pid) { _virtualPid = pid; }
+      int nameServiceWorkers() const { return _nameServiceWorkers; }
+      void nameServiceWorkers(int n) { _nameServiceWorkers = n; }
 
       void readProcessInfo(dmtcp::DmtcpMessage& msg) {
         if (msg.extraBytes > 0) {
           char* extraData = new char[msg.extraBytes];
           _sock.readAll(extraData, msg.extraBytes);
-          _hostname = extraData;
-          _progname = extraData + _hostname.length() + 1;
-          if (msg.extraBytes > _hostname.length() + _progname.length() + 2) {
-            _prefixDir = extraData + _hostname.length() + _progname.length() + 2;
-          }
+          setProcessInfo(msg, extraData);
           delete [] extraData;
         }
       }
 
+      void setProcessInfo(dmtcp::DmtcpMessage& msg, const char *extraData) {
+        _hostname = extraData;
+        _progname = extraData + _hostname.length() + 1;
+        if (msg.extraBytes > _hostname.length() + _progname.length() + 2) {
+          _prefixDir = extraData + _hostname.length() + _progname.length() + 2;
+        }
+      }
+
+      // For a relay, state() is the lowest and maxState() the highest state
+      // of the workers behind it.
+      bool isRelay() const { return _isRelay; }
+      void isRelay(bool value) { _isRelay = value; }
+      int relayedWorkers() const { return _relayedWorkers; }
+      dmtcp::WorkerState maxState() const { return _maxState; }
+      void relayStatus(dmtcp::WorkerState minState,
+                       dmtcp::WorkerState maxState, int workers) {
+        _state = minState;
+        _maxState = maxState;
+        _relayedWorkers = workers;
+      }
+      void addRelayedWorker(dmtcp::WorkerState state) {
+        if (_relayedWorkers == 0 || state.value() < _state.value()) {
+          _state = state;
+        }
+        if (_relayedWorkers == 0 || state.value() > _maxState.value()) {
+          _maxState = state;
+        }
+        _relayedWorkers++;
+      }
+
     private:
       dmtcp::UniquePid _identity;
       int _clientNumber;
@@ -440,9 +501,38 @@ namespace
       dmtcp::string _progname;
       dmtcp::string _prefixDir;
       pid_t         _virtualPid;
+      bool          _isRelay;
+      int           _relayedWorkers;
+      dmtcp::WorkerState _maxState;
+      int           _nameServiceWorkers;
   };
 }
 
+dmtcp::DmtcpCoordinator::DmtcpCoordinator()
+  : _numWorkers ( 0 )
+  , _nameServiceWorkers ( 0 )
+  , _restartScriptPending ( false )
+  , _upstream ( NULL )
+  , _reportedNameServiceWorkers ( 0 )
+{
+  memset ( _workersInState, 0, sizeof ( _workersInState ) );
+  _reportedStatus.minimumState = WorkerState::UNKNOWN;
+  _reportedStatus.maximumState = WorkerState::UNKNOWN;
+  _reportedStatus.minimumStateUnanimous = true;
+  _reportedStatus.numPeers = 0;
+}
+
+void dmtcp::DmtcpCoordinator::countWorkerState ( dmtcp::WorkerState state,
+                                                 int delta )
+{
+  JASSERT ( state.value() >= 0 && state.value() < WorkerState::_MAX )
+    ( state );
+  _workersInState[state.value()] += delta;
+  _numWorkers += delta;
+  JASSERT ( _workersInState[state.value()] >= 0 && _numWorkers >= 0 )
+    ( state ) ( _workersInState[state.value()] ) ( _numWorkers );
+}
+
 pid_t dmtcp::DmtcpCoordinator::getNewVirtualPid()
 {
   pid_t pid = -1;
@@ -467,6 +557,13 @@ void dmtcp::DmtcpCoordinator::handleUserCommand(char cmd, DmtcpMessage* reply /*
 {
   if (reply != NULL) reply->coordErrorCode = CoordinatorAPI::NOERROR;
 
+  if ( isRelay() && strchr ( "cCfFkKiI", cmd ) != NULL ) {
+    // Checkpoints and kills are driven by the upstream coordinator.
+    JNOTE ( "relay: send this command to the upstream coordinator" ) ( cmd );
+    if (reply != NULL) reply->coordErrorCode = CoordinatorAPI::ERROR_INVALID_COMMAND;
+    return;
+  }
+
   switch ( cmd ){
   case 'b': case 'B':  // prefix blocking command, prior to checkpoint command
     JTRACE ( "blocking checkpoint beginning..." );
@@ -502,9 +599,18 @@ void dmtcp::DmtcpCoordinator::handleUserCommand(char cmd, DmtcpMessage* reply /*
             ;i!= _dataSockets.end()
             ;++i )
     {
-      if ( ( *i )->socket().sockfd() != STDIN_FD )
+      if ( ( *i )->socket().sockfd() != STDIN_FD && *i != _upstream )
       {
         const NamedChunkReader& cli = *((NamedChunkReader*)(*i));
+        if ( cli.isRelay() ) {
+          JASSERT_STDERR << cli.clientNumber()
+                         << ", RELAY@" << cli.hostname()
+                         << ", " << cli.identity()
+                         << ", " << cli.relayedWorkers() << " workers"
+                         << ", " << cli.state().toString()
+                         << '\n';
+          continue;
+        }
         JASSERT_STDERR << cli.clientNumber()
                        << ", " << cli.progname() << "["  << cli.identity().pid() << "]@"  << cli.hostname()
                        << ", " << cli.identity()
@@ -523,20 +629,12 @@ void dmtcp::DmtcpCoordinator::handleUserCommand(char cmd, DmtcpMessage* reply /*
     broadcastMessage ( DMT_KILL_PEER );
     /* Call to broadcastMessage only puts the messages into the write queue.
      * We actually want the messages to be written out to the respective sockets
-     * so that we can then close the sockets and exit gracefully.  The following
-     * loop is taken from the implementation of monitorSocket() implementation
-     * in jsocket.cpp.
+     * so that we can then close the sockets and exit gracefully.
      *
      * Once the messages have been written out, the coordinator closes all the
      * connections and calls exit().
      */
-    for ( size_t i=0; i<_writes.size(); ++i )
-    {
-      int fd = _writes[i]->socket().sockfd();
-      if ( fd >= 0 ) {
-        _writes[i]->writeOnce();
-      }
-    }
+    flushWrites();
     JASSERT_STDERR << "DMTCP coordinator exiting... (per request)\n";
     for ( dmtcp::vector<jalib::JReaderInterface*>::iterator i = _dataSockets.begin()
         ; i!= _dataSockets.end()
@@ -563,6 +661,12 @@ void dmtcp::DmtcpCoordinator::handleUserCommand(char cmd, DmtcpMessage* reply /*
   case 'h': case 'H': case '?':
     JASSERT_STDERR << theHelpMessage;
     break;
+  case 'p': case 'P':
+    // dmtcp_command gets the report in processDmtUserCmd.
+    if (reply == NULL) {
+      JASSERT_STDERR << phaseTimings.report();
+    }
+    break;
   case 's': case 'S':
     {
       CoordinatorStatus s = getStatus();
@@ -594,8 +698,26 @@ void dmtcp::DmtcpCoordinator::handleUserCommand(char cmd, DmtcpMessage* reply /*
   return;
 }
 
+static void replyToBlockingCommand()
+{
+  dmtcp::DmtcpMessage blockUntilDoneReply(dmtcp::DMT_USER_CMD_RESULT);
+  JNOTE ( "replying to dmtcp_command:  we're done" );
+  // These were set in dmtcp::DmtcpCoordinator::onConnect in this file
+  jalib::JSocket remote ( blockUntilDoneRemote );
+  remote << blockUntilDoneReply;
+  remote.close();
+  blockUntilDone = false;
+  blockUntilDoneRemote = -1;
+}
+
 void dmtcp::DmtcpCoordinator::updateMinimumState(dmtcp::WorkerState oldState)
 {
+  if ( isRelay() ) {
+    // The upstream coordinator decides on barriers for the whole computation.
+    sendRelayStatus();
+    return;
+  }
+
   WorkerState newState = minimumState();
 
   if ( oldState == WorkerState::RUNNING
@@ -605,28 +727,42 @@ void dmtcp::DmtcpCoordinator::updateMinimumState(dmtcp::WorkerState oldState)
     broadcastMessage(DMT_DO_FD_LEADER_ELECTION,
                      UniquePid::ComputationId(),
                      getStatus().numPeers );
+    phaseTimings.beginPhase ( PhaseTimings::LEADER_ELECTION );
   }
   if ( oldState == WorkerState::SUSPENDED
        && newState == WorkerState::FD_LEADER_ELECTION )
   {
     JNOTE ( "draining all nodes" );
     broadcastMessage ( DMT_DO_DRAIN );
+    phaseTimings.beginPhase ( PhaseTimings::DRAIN );
   }
   if ( oldState == WorkerState::FD_LEADER_ELECTION
        && newState == WorkerState::DRAINED )
   {
     JNOTE ( "checkpointing all nodes" );
     broadcastMessage ( DMT_DO_CHECKPOINT );
+    phaseTimings.beginPhase ( PhaseTimings::CHECKPOINT );
   }
 
 #ifdef COORD_NAMESERVICE
+  /* Every worker reported with its CHECKPOINTED DMT_OK whether it needs the
+   * name service phases; by default all do.  If none does, go straight to
+   * the refill and save the two barriers of those phases.
+   */
   if ( oldState == WorkerState::DRAINED
        && newState == WorkerState::CHECKPOINTED )
   {
-    writeRestartScript();
-    JNOTE ( "building name service database" );
+    writeRestartScriptWhenDurable();
     lookupService.reset();
-    broadcastMessage ( DMT_DO_REGISTER_NAME_SERVICE_DATA );
+    if ( _nameServiceWorkers > 0 ) {
+      JNOTE ( "building name service database" ) ( _nameServiceWorkers );
+      broadcastMessage ( DMT_DO_REGISTER_NAME_SERVICE_DATA );
+      phaseTimings.beginPhase ( PhaseTimings::NAME_SERVICE );
+    } else {
+      JNOTE ( "refilling all nodes" );
+      broadcastMessage ( DMT_DO_REFILL );
+      phaseTimings.beginPhase ( PhaseTimings::REFILL );
+    }
   }
   if ( oldState == WorkerState::RESTARTING
        && newState == WorkerState::CHECKPOINTED )
@@ -634,8 +770,16 @@ void dmtcp::DmtcpCoordinator::updateMinimumState(dmtcp::WorkerState oldState)
     JTIMER_STOP ( restart );
 
     lookupService.reset();
-    JNOTE ( "building name service database (after restart)" );
-    broadcastMessage ( DMT_DO_REGISTER_NAME_SERVICE_DATA );
+    if ( _nameServiceWorkers > 0 ) {
+      JNOTE ( "building name service database (after restart)" )
+        ( _nameServiceWorkers );
+      broadcastMessage ( DMT_DO_REGISTER_NAME_SERVICE_DATA );
+      phaseTimings.beginPhase ( PhaseTimings::NAME_SERVICE );
+    } else {
+      JNOTE ( "refilling all nodes (after restart)" );
+      broadcastMessage ( DMT_DO_REFILL );
+      phaseTimings.beginPhase ( PhaseTimings::REFILL );
+    }
   }
   if ( oldState == WorkerState::CHECKPOINTED
        && newState == WorkerState::NAME_SERVICE_DATA_REGISTERED ){
@@ -646,8 +790,10 @@ void dmtcp::DmtcpCoordinator::updateMinimumState(dmtcp::WorkerState oldState)
        && newState == WorkerState::DONE_QUERYING ){
     JNOTE ( "refilling all nodes" );
     broadcastMessage ( DMT_DO_REFILL );
+    phaseTimings.beginPhase ( PhaseTimings::REFILL );
   }
-  if ( oldState == WorkerState::DONE_QUERYING
+  if ( ( oldState == WorkerState::DONE_QUERYING
+         || oldState == WorkerState::CHECKPOINTED )
        && newState == WorkerState::REFILLED )
 #else
     if ( oldState == WorkerState::DRAINED
@@ -655,7 +801,8 @@ void dmtcp::DmtcpCoordinator::updateMinimumState(dmtcp::WorkerState oldState)
     {
       JNOTE ( "refilling all nodes" );
       broadcastMessage ( DMT_DO_REFILL );
-      writeRestartScript();
+      phaseTimings.beginPhase ( PhaseTimings::REFILL );
+      writeRestartScriptWhenDurable();
     }
   if ( oldState == WorkerState::RESTARTING
        && newState == WorkerState::CHECKPOINTED )
@@ -664,6 +811,7 @@ void dmtcp::DmtcpCoordinator::updateMinimumState(dmtcp::WorkerState oldState)
 
     JNOTE ( "refilling all nodes (after checkpoint)" );
     broadcastMessage ( DMT_DO_REFILL );
+    phaseTimings.beginPhase ( PhaseTimings::REFILL );
   }
   if ( oldState == WorkerState::CHECKPOINTED
        && newState == WorkerState::REFILLED )
@@ -671,6 +819,7 @@ void dmtcp::DmtcpCoordinator::updateMinimumState(dmtcp::WorkerState oldState)
   {
     JNOTE ( "restarting all nodes" );
     broadcastMessage ( DMT_DO_RESUME );
+    phaseTimings.beginPhase ( PhaseTimings::RESUME );
 
     JTIMER_STOP ( checkpoint );
     isRestarting = false;
@@ -678,16 +827,18 @@ void dmtcp::DmtcpCoordinator::updateMinimumState(dmtcp::WorkerState oldState)
     setTimeoutInterval( theCheckpointInterval );
 
     if (blockUntilDone) {
-      DmtcpMessage blockUntilDoneReply(DMT_USER_CMD_RESULT);
-      JNOTE ( "replying to dmtcp_command:  we're done" );
-      // These were set in dmtcp::DmtcpCoordinator::onConnect in this file
-      jalib::JSocket remote ( blockUntilDoneRemote );
-      remote << blockUntilDoneReply;
-      remote.close();
-      blockUntilDone = false;
-      blockUntilDoneRemote = -1;
+      replyToBlockingCommand();
     }
   }
+
+  // RUNNING sorts below REFILLED, so only a unanimous RUNNING means that the
+  // last worker has resumed.
+  if ( oldState == WorkerState::REFILLED
+       && newState == WorkerState::RUNNING && getStatus().minimumStateUnanimous )
+  {
+    const char *dir = getenv ( ENV_VAR_CHECKPOINT_DIR );
+    phaseTimings.finish ( dir == NULL ? "." : dir );
+  }
 }
 
 void dmtcp::DmtcpCoordinator::onData ( jalib::JReaderInterface* sock )
@@ -702,12 +853,13 @@ void dmtcp::DmtcpCoordinator::onData ( jalib::JReaderInterface* sock )
     NamedChunkReader * client= ( NamedChunkReader* ) sock;
     DmtcpMessage& msg = * ( DmtcpMessage* ) sock->buffer();
     msg.assertValid();
-    char * extraData = 0;
+    // MessageReader has already read the extraBytes; they are freed when the
+    // reader is reset after we return.
+    const char * extraData = ( ( MessageReader* ) sock )->payload();
 
-    if ( msg.extraBytes > 0 )
-    {
-      extraData = new char[msg.extraBytes];
-      sock->socket().readAll ( extraData, msg.extraBytes );
+    if ( sock == _upstream ) {
+      onUpstreamData ( msg, extraData );
+      return;
     }
 
     switch ( msg.type )
@@ -716,6 +868,13 @@ void dmtcp::DmtcpCoordinator::onData ( jalib::JReaderInterface* sock )
       {
         WorkerState oldState = client->state();
         client->setState ( msg.state );
+        countWorkerState ( oldState, -1 );
+        countWorkerState ( msg.state, +1 );
+        _nameServiceWorkers += msg.nameServiceWorkers -
+                               client->nameServiceWorkers();
+        client->nameServiceWorkers ( msg.nameServiceWorkers );
+        phaseTimings.workerReported ( msg.state, client->identity(),
+                                      client->hostname() );
         CoordinatorStatus s = getStatus();
         WorkerState newState = s.minimumState;
         /* It is possible for minimumState to be RUNNING while one or more
@@ -740,6 +899,10 @@ void dmtcp::DmtcpCoordinator::onData ( jalib::JReaderInterface* sock )
       {
         JASSERT ( extraData!=0 )
           .Text ( "extra data expected with DMT_CKPT_FILENAME message" );
+        if ( isRelay() ) {
+          forwardUpstream ( msg, extraData );
+          break;
+        }
         dmtcp::string ckptFilename;
         dmtcp::string hostname;
         ckptFilename = extraData;
@@ -747,12 +910,29 @@ void dmtcp::DmtcpCoordinator::onData ( jalib::JReaderInterface* sock )
 
         JTRACE ( "recording restart info" ) ( ckptFilename ) ( hostname );
         _restartFilenames[hostname].push_back ( ckptFilename );
+        if ( msg.imagePending &&
+             _earlyDurableImages.erase ( msg.from ) == 0 ) {
+          PendingImage& p = _pendingImages[msg.from];
+          p.reporter = sock;
+          p.since = time ( NULL );
+        }
       }
       break;
+      case DMT_CKPT_DURABLE:  // relayed from a forked checkpoint writer
+        if ( isRelay() ) {
+          forwardUpstream ( msg, extraData );
+          break;
+        }
+        imageDurable ( msg );
+        break;
       case DMT_USER_CMD:  // dmtcpaware API being used
         {
           JTRACE("got user command from client")
             (msg.coordCmd)(client->identity());
+          if ( isRelay() ) {
+            forwardUpstream ( msg, extraData, jalib::JSocket ( -1 ), sock );
+            break;
+          }
 	  // Checkpointing commands should always block, to prevent
 	  //   dmtcpaware checkpoint call from returning prior to checkpoint.
 	  if (msg.coordCmd == 'c')
@@ -764,6 +944,14 @@ void dmtcp::DmtcpCoordinator::onData ( jalib::JReaderInterface* sock )
             // For dmtcpaware API, we don't change theDefaultCheckpointInterval
           }
           handleUserCommand( msg.coordCmd, &reply );
+          if ( msg.coordCmd == 'p' || msg.coordCmd == 'P' ) {
+            // Also what a relay forwards for dmtcp_command
+            dmtcp::string report = phaseTimings.report();
+            reply.extraBytes = report.length();
+            sock->socket() << reply;
+            sock->socket().writeAll ( report.c_str(), reply.extraBytes );
+            break;
+          }
           sock->socket() << reply;
           //alternately, we could do the write without blocking:
           //addWrite(new jalib::JChunkWriter(sock->socket(), (char*)&msg,
@@ -776,6 +964,10 @@ void dmtcp::DmtcpCoordinator::onData ( jalib::JReaderInterface* sock )
       case DMT_REGISTER_NAME_SERVICE_DATA:
       {
         JTRACE ("received REGISTER_NAME_SERVICE_DATA msg") (client->identity());
+        if ( isRelay() ) {
+          forwardUpstream ( msg, extraData );
+          break;
+        }
         lookupService.registerData(client->identity(), msg,
                                    (const char*) extraData);
       }
@@ -783,10 +975,38 @@ void dmtcp::DmtcpCoordinator::onData ( jalib::JReaderInterface* sock )
       case DMT_NAME_SERVICE_QUERY:
       {
         JTRACE ("received NAME_SERVICE_QUERY msg") (client->identity());
+        if ( isRelay() ) {
+          forwardUpstream ( msg, extraData, jalib::JSocket ( -1 ), sock );
+          break;
+        }
         lookupService.respondToQuery(client->identity(), sock->socket(), msg,
                                      (const char*) extraData);
       }
       break;
+      case DMT_REGISTER_NAME_SERVICE_DATA_BULK:
+      {
+        JTRACE ("received REGISTER_NAME_SERVICE_DATA_BULK msg")
+          (client->identity()) (msg.extraBytes);
+        if ( isRelay() ) {
+          forwardUpstream ( msg, extraData );
+          break;
+        }
+        lookupService.registerDataBulk(client->identity(), msg,
+                                       (const char*) extraData);
+      }
+      break;
+      case DMT_NAME_SERVICE_QUERY_BULK:
+      {
+        JTRACE ("received NAME_SERVICE_QUERY_BULK msg")
+          (client->identity()) (msg.extraBytes);
+        if ( isRelay() ) {
+          forwardUpstream ( msg, extraData, jalib::JSocket ( -1 ), sock );
+          break;
+        }
+        lookupService.respondToQueryBulk(client->identity(), sock->socket(),
+                                         msg, (const char*) extraData);
+      }
+      break;
 #endif
       case DMT_UPDATE_PROCESS_INFO_AFTER_FORK:
       {
@@ -799,12 +1019,22 @@ void dmtcp::DmtcpCoordinator::onData ( jalib::JReaderInterface* sock )
           client->identity(msg.from);
       }
           break;
+      case DMT_HELLO_COORDINATOR:
+      case DMT_RESTART_PROCESS:
+      case DMT_GET_VIRTUAL_PID:
+        JASSERT ( client->isRelay() ) ( msg.from ) ( msg.type )
+          .Text ( "handshake from an already connected worker" );
+        processRelayedHello ( sock, msg, extraData );
+        break;
+      case DMT_RELAY_STATUS:
+        JASSERT ( client->isRelay() ) ( msg.from )
+          .Text ( "relay status from a worker" );
+        processRelayStatus ( sock, msg );
+        break;
       default:
         JASSERT ( false ) ( msg.from ) ( msg.type )
 		.Text ( "unexpected message from worker" );
     }
-
-    delete[] extraData;
   }
 }
 
@@ -812,30 +1042,159 @@ void dmtcp::DmtcpCoordinator::onDisconnect ( jalib::JReaderInterface* sock )
 {
   if ( sock->socket().sockfd() == STDIN_FD ) {
     JTRACE ( "stdin closed" );
+  } else if ( sock == _upstream ) {
+    // Without the upstream coordinator the local workers can no longer take
+    // part in the computation; they see their coordinator go away, just as
+    // they would without a relay.
+    JNOTE ( "lost connection to the upstream coordinator, exiting" );
+    exit ( 0 );
   } else {
     NamedChunkReader& client = * ( ( NamedChunkReader* ) sock );
+    if ( client.isRelay() ) {
+      JNOTE ( "relay disconnected" )
+        ( client.identity() ) ( client.hostname() ) ( client.relayedWorkers() );
+      countRelayedWorkers ( sock, -1 );
+      _nameServiceWorkers -= client.nameServiceWorkers();
+      dmtcp::map< pid_t, jalib::JChunkReader* >::iterator i;
+      for ( i = _virtualPidToChunkReaderMap.begin();
+            i != _virtualPidToChunkReaderMap.end(); ) {
+        if ( i->second == sock ) {
+          _virtualPidToChunkReaderMap.erase ( i++ );
+        } else {
+          ++i;
+        }
+      }
+      dropPendingImages ( sock );
+      if ( client.relayedWorkers() > 0 ) {
+        workersLeft ( client.state() );
+      }
+      return;
+    }
+
     JNOTE ( "client disconnected" ) ( client.identity() );
+    countWorkerState ( client.state(), -1 );
+    _nameServiceWorkers -= client.nameServiceWorkers();
     _virtualPidToChunkReaderMap.erase(client.virtualPid());
 
-    CoordinatorStatus s = getStatus();
-    if (s.numPeers < 1) {
-      if (exitOnLast) {
-        JNOTE ("last client exited, shutting down..");
-        handleUserCommand('q');
-      }
-      // If a kill in is progress, the coordinator refuses any new connections,
-      // thus we need to reset it to false once all the processes in the
-      // computations have disconnected.
-      killInProgress = false;
-      if (theCheckpointInterval != theDefaultCheckpointInterval) {
-        theCheckpointInterval = theDefaultCheckpointInterval;
-        JNOTE ( "CheckpointInterval reset on end of current computation" )
+    if ( isRelay() ) {
+      dropRelayRequests ( sock );
+      sendRelayStatus ( client.virtualPid() );
+      return;
+    }
+    dropPendingImages ( sock );
+    workersLeft ( client.state() );
+  }
+}
+
+void dmtcp::DmtcpCoordinator::workersLeft ( dmtcp::WorkerState oldState )
+{
+  CoordinatorStatus s = getStatus();
+  if (s.numPeers < 1) {
+    if (exitOnLast) {
+      JNOTE ("last client exited, shutting down..");
+      handleUserCommand('q');
+    }
+    // If a kill in is progress, the coordinator refuses any new connections,
+    // thus we need to reset it to false once all the processes in the
+    // computations have disconnected.
+    killInProgress = false;
+    _pendingImages.clear();
+    _earlyDurableImages.clear();
+    _restartScriptPending = false;
+    if (theCheckpointInterval != theDefaultCheckpointInterval) {
+      theCheckpointInterval = theDefaultCheckpointInterval;
+      JNOTE ( "CheckpointInterval reset on end of current computation" )
 	  ( theCheckpointInterval );
-      }
+    }
+  } else {
+    updateMinimumState(oldState);
+  }
+}
+
+/* With forked checkpointing (MTCP_FORKED_CHECKPOINT), a worker reports
+ * CHECKPOINTED as soon as a child process holds a copy of its memory, so the
+ * computation resumes while the images are written.  Each writer tells us
+ * with DMT_CKPT_DURABLE when its image is on disk; until the last one has,
+ * the restart script keeps naming the previous images.
+ */
+void dmtcp::DmtcpCoordinator::writeRestartScriptWhenDurable()
+{
+  if ( !_pendingImages.empty() ) {
+    JNOTE ( "checkpoint images are being written in the background" )
+      ( _pendingImages.size() );
+    _restartScriptPending = true;
+    return;
+  }
+  writeRestartScript();
+}
+
+void dmtcp::DmtcpCoordinator::writeRestartScriptIfDurable()
+{
+  if ( _pendingImages.empty() && _restartScriptPending ) {
+    JNOTE ( "all checkpoint images written" );
+    _restartScriptPending = false;
+    writeRestartScript();
+  }
+}
+
+void dmtcp::DmtcpCoordinator::imageDurable ( const DmtcpMessage& msg )
+{
+  if ( msg.compGroup.generation() !=
+         UniquePid::ComputationId().generation() ) {
+    JTRACE ( "ignoring image of an earlier checkpoint" ) ( msg.from )
+      ( msg.compGroup );
+    return;
+  }
+  // The writer reports failures too, so that we stop waiting for it.
+  JWARNING ( !msg.imageFailed ) ( msg.from )
+    .Text ( "the forked writer could not make the checkpoint image durable;"
+            " the image may be incomplete" );
+  // This can arrive before the worker's own DMT_CKPT_FILENAME.
+  if ( _pendingImages.erase ( msg.from ) == 0 ) {
+    _earlyDurableImages.insert ( msg.from );
+  }
+  JTRACE ( "checkpoint image written" ) ( msg.from ) ( msg.imageFailed )
+    ( _pendingImages.size() );
+  writeRestartScriptIfDurable();
+}
+
+/* The workers that reported over sock are gone.  Their writers may still
+ * finish, but nothing ties a late report to them any more, so stop waiting.
+ */
+void dmtcp::DmtcpCoordinator::dropPendingImages ( jalib::JReaderInterface *sock )
+{
+  dmtcp::map< UniquePid, PendingImage >::iterator i;
+  for ( i = _pendingImages.begin(); i != _pendingImages.end(); ) {
+    if ( i->second.reporter == sock ) {
+      JWARNING ( false ) ( i->first )
+        .Text ( "worker left before its checkpoint image was written;"
+                " the image may be incomplete" );
+      _pendingImages.erase ( i++ );
     } else {
-      updateMinimumState(client.state());
+      ++i;
     }
   }
+  writeRestartScriptIfDurable();
+}
+
+/* A writer that crashed never reports.  Give up on it after
+ * PENDING_IMAGE_TIMEOUT, so that it cannot hold off checkpoints for good.
+ */
+void dmtcp::DmtcpCoordinator::dropStalePendingImages()
+{
+  time_t now = time ( NULL );
+  dmtcp::map< UniquePid, PendingImage >::iterator i;
+  for ( i = _pendingImages.begin(); i != _pendingImages.end(); ) {
+    if ( now - i->second.since >= PENDING_IMAGE_TIMEOUT ) {
+      JWARNING ( false ) ( i->first ) ( PENDING_IMAGE_TIMEOUT )
+        .Text ( "no report from the forked checkpoint writer in time;"
+                " the image may be incomplete" );
+      _pendingImages.erase ( i++ );
+    } else {
+      ++i;
+    }
+  }
+  writeRestartScriptIfDurable();
 }
 
 void dmtcp::DmtcpCoordinator::initializeComputation()
@@ -860,11 +1219,9 @@ void dmtcp::DmtcpCoordinator::onConnect ( const jalib::JSocket& sock,
                                           socklen_t remoteLen )
 {
   jalib::JSocket remote ( sock );
-  // If no client is connected to Coordinator, then there can be only zero data
-  // sockets OR there can be one data socket and that should be STDIN.
-  if ( _dataSockets.size() == 0 ||
-       ( _dataSockets.size() == 1
-	 && _dataSockets[0]->socket().sockfd() == STDIN_FD ) ) {
+  // If no worker is connected to the Coordinator (directly or through a
+  // relay), this is the start of a new computation.
+  if ( !isRelay() && _numWorkers == 0 ) {
     initializeComputation();
   }
 
@@ -877,6 +1234,11 @@ void dmtcp::DmtcpCoordinator::onConnect ( const jalib::JSocket& sock,
     return;
   }
 
+  if (isRelay()) {
+    relayConnection(hello_remote, remote);
+    return;
+  }
+
   if (hello_remote.type == DMT_GET_VIRTUAL_PID) {
     dmtcp::DmtcpMessage reply(DMT_GET_VIRTUAL_PID_RESULT);
     reply.virtualPid = getNewVirtualPid();
@@ -890,6 +1252,25 @@ void dmtcp::DmtcpCoordinator::onConnect ( const jalib::JSocket& sock,
     return;
   }
 
+  if (hello_remote.type == DMT_CKPT_DURABLE) {
+    imageDurable(hello_remote);
+    remote.close();
+    return;
+  }
+
+  if (hello_remote.type == DMT_RELAY_HELLO) {
+    NamedChunkReader *relay = new NamedChunkReader(sock, remoteAddr, remoteLen,
+                                                   hello_remote);
+    relay->readProcessInfo(hello_remote);
+    relay->isRelay(true);
+    relay->relayStatus(WorkerState::UNKNOWN, WorkerState::UNKNOWN, 0);
+    dmtcp::DmtcpMessage hello_local(DMT_HELLO_WORKER);
+    remote << hello_local;
+    JNOTE ( "relay connected" ) ( hello_remote.from ) ( relay->hostname() );
+    addDataSocket ( relay );
+    return;
+  }
+
   if (killInProgress) {
     JNOTE("Connection request received in the middle of killing computation. "
           "Sending it the kill message.");
@@ -903,34 +1284,69 @@ void dmtcp::DmtcpCoordinator::onConnect ( const jalib::JSocket& sock,
   NamedChunkReader *ds = new NamedChunkReader(sock, remoteAddr, remoteLen,
                                               hello_remote);
 
+  if( hello_remote.extraBytes > 0 ){
+    ds->readProcessInfo(hello_remote);
+  }
+
+  dmtcp::DmtcpMessage hello_local;
+  bool accepted = admitWorker ( hello_remote, hello_local, ds );
+  remote << hello_local;
+  if ( !accepted ) {
+    remote.close();
+    delete ds;
+    return;
+  }
+
+  if ( hello_remote.type == DMT_HELLO_COORDINATOR &&
+       hello_remote.state != WorkerState::RESTARTING &&
+       workersRunningAndSuspendMsgSent ) {
+    // Now send DMT_DO_SUSPEND message so that this process can also
+    // participate in the current checkpoint
+    DmtcpMessage suspendMsg (dmtcp::DMT_DO_SUSPEND);
+    remote << suspendMsg;
+  }
+
+  if ( hello_remote.type == DMT_HELLO_COORDINATOR ) {
+    _virtualPidToChunkReaderMap[ds->virtualPid()] = ds;
+  }
+
+  //add this client as a chunk reader
+  // in this case a 'chunk' is sizeof(DmtcpMessage)
+  addDataSocket ( ds );
+  countWorkerState ( ds->state(), +1 );
+
+  JTRACE( "END" )
+  ( _dataSockets.size() ) ( _dataSockets[0]->socket().sockfd() == STDIN_FD );
+}
+
+bool dmtcp::DmtcpCoordinator::admitWorker ( DmtcpMessage& hello_remote,
+                                            DmtcpMessage& hello_local,
+                                            jalib::JChunkReader *jcr )
+{
+  NamedChunkReader *ds = (NamedChunkReader*) jcr;
+
   if (hello_remote.virtualPid == -1) {
     ds->virtualPid(getNewVirtualPid());
   } else {
     ds->virtualPid(hello_remote.virtualPid);
   }
 
-  if( hello_remote.extraBytes > 0 ){
-    ds->readProcessInfo(hello_remote);
-  }
-
   if ( hello_remote.type == DMT_RESTART_PROCESS ) {
-    if ( validateDmtRestartProcess ( hello_remote, remote ) == false )
-      return;
+    if ( validateDmtRestartProcess ( hello_remote, hello_local ) == false )
+      return false;
     isRestarting = true;
   } else if ( hello_remote.type == DMT_HELLO_COORDINATOR &&
               hello_remote.state == WorkerState::RESTARTING) {
-    if ( validateRestartingWorkerProcess ( hello_remote, remote ) == false )
-      return;
+    if ( validateRestartingWorkerProcess ( hello_remote, hello_local ) == false )
+      return false;
     //JASSERT(hello_remote.virtualPid != -1);
     ds->virtualPid(hello_remote.virtualPid);
-    _virtualPidToChunkReaderMap[ds->virtualPid()] = ds;
     isRestarting = true;
   } else if ( hello_remote.type == DMT_HELLO_COORDINATOR &&
               (hello_remote.state == WorkerState::RUNNING ||
                hello_remote.state == WorkerState::UNKNOWN)) {
-    if ( validateNewWorkerProcess ( hello_remote, remote, ds ) == false )
-      return;
-    _virtualPidToChunkReaderMap[ds->virtualPid()] = ds;
+    if ( validateNewWorkerProcess ( hello_remote, hello_local, ds ) == false )
+      return false;
   } else {
     JASSERT ( false )
       .Text ( "Connect request from Unknown Remote Process Type" );
@@ -945,13 +1361,7 @@ void dmtcp::DmtcpCoordinator::onConnect ( const jalib::JSocket& sock,
     JNOTE ( "CheckpointInterval updated (for this computation only)" )
 	  ( oldInterval ) ( theCheckpointInterval );
   }
-
-  //add this client as a chunk reader
-  // in this case a 'chunk' is sizeof(DmtcpMessage)
-  addDataSocket ( ds );
-
-  JTRACE( "END" )
-  ( _dataSockets.size() ) ( _dataSockets[0]->socket().sockfd() == STDIN_FD );
+  return true;
 }
 
 void dmtcp::DmtcpCoordinator::processDmtUserCmd( DmtcpMessage& hello_remote,
@@ -974,6 +1384,13 @@ void dmtcp::DmtcpCoordinator::processDmtUserCmd( DmtcpMessage& hello_remote,
     handleUserCommand( hello_remote.coordCmd, &reply );
     remote << reply;
     remote.close();
+  } else if ( hello_remote.coordCmd == 'p' || hello_remote.coordCmd == 'P' ) {
+    dmtcp::string report = phaseTimings.report();
+    reply.coordErrorCode = CoordinatorAPI::NOERROR;
+    reply.extraBytes = report.length();
+    remote << reply;
+    remote.writeAll( report.c_str(), reply.extraBytes );
+    remote.close();
   } else {
     handleUserCommand( hello_remote.coordCmd, &reply );
     remote << reply;
@@ -983,7 +1400,7 @@ void dmtcp::DmtcpCoordinator::processDmtUserCmd( DmtcpMessage& hello_remote,
 }
 
 bool dmtcp::DmtcpCoordinator::validateDmtRestartProcess
-	 ( DmtcpMessage& hello_remote, jalib::JSocket& remote )
+	 ( DmtcpMessage& hello_remote, DmtcpMessage& hello_local )
 {
   struct timeval tv;
   // This is dmtcp_restart process, connecting to get timestamp
@@ -991,7 +1408,7 @@ bool dmtcp::DmtcpCoordinator::validateDmtRestartProcess
 
   JASSERT ( hello_remote.numPeers > 0 );
 
-  dmtcp::DmtcpMessage hello_local ( dmtcp::DMT_RESTART_PROCESS_REPLY );
+  hello_local.type = dmtcp::DMT_RESTART_PROCESS_REPLY;
 
   if( UniquePid::ComputationId() == dmtcp::UniquePid(0,0,0) ){
     JASSERT ( minimumState() == WorkerState::UNKNOWN )
@@ -1005,14 +1422,13 @@ bool dmtcp::DmtcpCoordinator::validateDmtRestartProcess
     JNOTE ( "FIRST dmtcp_restart connection.  Set numPeers. Generate timestamp" )
       ( numPeers ) ( curTimeStamp ) ( UniquePid::ComputationId() );
     JTIMER_START(restart);
+    phaseTimings.beginRestart ( UniquePid::ComputationId() );
   } else if ( UniquePid::ComputationId() != hello_remote.compGroup ) {
     // Coordinator already serving some other computation group - reject this process.
     JNOTE ("Reject incoming dmtcp_restart connection"
            " since it is not from current computation")
       ( UniquePid::ComputationId() ) ( hello_remote.compGroup );
     hello_local.type = dmtcp::DMT_REJECT;
-    remote << hello_local;
-    remote.close();
     return false;
   } else if ( numPeers != hello_remote.numPeers ) {
     // Sanity check
@@ -1020,8 +1436,6 @@ bool dmtcp::DmtcpCoordinator::validateDmtRestartProcess
       ( numPeers ) ( hello_remote.numPeers );
 
     hello_local.type = dmtcp::DMT_REJECT;
-    remote << hello_local;
-    remote.close();
     return false;
   } else {
     // This is a second or higher dmtcp_restart process connecting to the coordinator.
@@ -1032,16 +1446,14 @@ bool dmtcp::DmtcpCoordinator::validateDmtRestartProcess
   // Sent generated timestamp in local massage for dmtcp_restart process.
   hello_local.coordTimeStamp = curTimeStamp;
 
-  remote << hello_local;
-
   return true;
 }
 
 bool dmtcp::DmtcpCoordinator::validateRestartingWorkerProcess
-	 ( DmtcpMessage& hello_remote, jalib::JSocket& remote )
+	 ( DmtcpMessage& hello_remote, DmtcpMessage& hello_local )
 {
   struct timeval tv;
-  dmtcp::DmtcpMessage hello_local ( dmtcp::DMT_HELLO_WORKER );
+  hello_local.type = dmtcp::DMT_HELLO_WORKER;
 
   JASSERT(hello_remote.state == WorkerState::RESTARTING) (hello_remote.state);
 
@@ -1057,22 +1469,19 @@ bool dmtcp::DmtcpCoordinator::validateRestartingWorkerProcess
     JNOTE ( "FIRST dmtcp_restart connection.  Set numPeers. Generate timestamp" )
       ( numPeers ) ( curTimeStamp ) ( UniquePid::ComputationId() );
     JTIMER_START(restart);
+    phaseTimings.beginRestart ( UniquePid::ComputationId() );
   } else if (minimumState() != WorkerState::RESTARTING &&
              minimumState() != WorkerState::CHECKPOINTED) {
     JNOTE ("Computation not in RESTARTING or CHECKPOINTED state."
            "  Reject incoming restarting computation process.")
       (UniquePid::ComputationId()) (hello_remote.compGroup) (minimumState());
     hello_local.type = dmtcp::DMT_REJECT;
-    remote << hello_local;
-    remote.close();
     return false;
   } else if ( hello_remote.compGroup != UniquePid::ComputationId()) {
     JNOTE ("Reject incoming restarting computation process"
            " since it is not from current computation")
       ( UniquePid::ComputationId() ) ( hello_remote.compGroup );
     hello_local.type = dmtcp::DMT_REJECT;
-    remote << hello_local;
-    remote.close();
     return false;
   }
   // dmtcp_restart already connected and compGroup created.
@@ -1083,7 +1492,6 @@ bool dmtcp::DmtcpCoordinator::validateRestartingWorkerProcess
     ( UniquePid::ComputationId() ) ( hello_remote.compGroup ) ( minimumState() );
 
   hello_local.coordTimeStamp = curTimeStamp;
-  remote << hello_local;
 
   // NOTE: Sending the same message twice. We want to make sure that the
   // worker process receives/processes the first messages as soon as it
@@ -1105,10 +1513,11 @@ bool dmtcp::DmtcpCoordinator::validateRestartingWorkerProcess
 }
 
 bool dmtcp::DmtcpCoordinator::validateNewWorkerProcess
-  (DmtcpMessage& hello_remote, jalib::JSocket& remote, jalib::JChunkReader *jcr)
+  (DmtcpMessage& hello_remote, DmtcpMessage& hello_local,
+   jalib::JChunkReader *jcr)
 {
   NamedChunkReader *ds = (NamedChunkReader*) jcr;
-  dmtcp::DmtcpMessage hello_local(dmtcp::DMT_HELLO_WORKER);
+  hello_local.type = dmtcp::DMT_HELLO_WORKER;
   hello_local.virtualPid = ds->virtualPid();
   CoordinatorStatus s = getStatus();
 
@@ -1124,14 +1533,8 @@ bool dmtcp::DmtcpCoordinator::validateNewWorkerProcess
     JASSERT(s.numPeers > 0) (s.numPeers);
     JASSERT(s.minimumState != WorkerState::SUSPENDED) (s.minimumState);
 
-    // Handshake
+    // Handshake; the caller follows it up with DMT_DO_SUSPEND.
     hello_local.compGroup = UniquePid::ComputationId();
-    remote << hello_local;
-
-    // Now send DMT_DO_SUSPEND message so that this process can also
-    // participate in the current checkpoint
-    DmtcpMessage suspendMsg (dmtcp::DMT_DO_SUSPEND);
-    remote << suspendMsg;
 
   } else if (s.numPeers > 0 && s.minimumState != WorkerState::RUNNING &&
              s.minimumState != WorkerState::UNKNOWN) {
@@ -1141,8 +1544,6 @@ bool dmtcp::DmtcpCoordinator::validateNewWorkerProcess
       (UniquePid::ComputationId()) (hello_remote.from)
       (s.numPeers) (s.minimumState);
     hello_local.type = dmtcp::DMT_REJECT;
-    remote << hello_local;
-    remote.close();
     return false;
 
   } else if (hello_remote.compGroup != UniquePid()) {
@@ -1152,8 +1553,6 @@ bool dmtcp::DmtcpCoordinator::validateNewWorkerProcess
       (hello_remote.compGroup);
 
     hello_local.type = dmtcp::DMT_REJECT;
-    remote << hello_local;
-    remote.close();
     return false;
 
   } else {
@@ -1190,19 +1589,341 @@ bool dmtcp::DmtcpCoordinator::validateNewWorkerProcess
                 "remote nodes. Rejecting connection!")
             (remotePrefix) (localPrefix) (ds->prefixDir());
           hello_local.type = dmtcp::DMT_REJECT;
-          remote << hello_local;
-          remote.close();
           return false;
         }
       }
     }
     hello_local.compGroup = UniquePid::ComputationId();
     hello_local.coordTimeStamp = curTimeStamp;
-    remote << hello_local;
   }
   return true;
 }
 
+void dmtcp::DmtcpCoordinator::countRelayedWorkers ( jalib::JReaderInterface *sock,
+                                                    int sign )
+{
+  NamedChunkReader *relay = ( NamedChunkReader* ) sock;
+  // A relay only reports the range of its workers' states.  Counting one of
+  // them at the highest state and the rest at the lowest keeps everything
+  // getStatus() derives exact: minimum, maximum, unanimity and total.
+  if ( relay->relayedWorkers() > 0 ) {
+    countWorkerState ( relay->state(), sign * ( relay->relayedWorkers() - 1 ) );
+    countWorkerState ( relay->maxState(), sign );
+  }
+}
+
+void dmtcp::DmtcpCoordinator::processRelayedHello ( jalib::JReaderInterface *sock,
+                                                    DmtcpMessage& hello_remote,
+                                                    const char *extraData )
+{
+  NamedChunkReader *relay = ( NamedChunkReader* ) sock;
+  dmtcp::DmtcpMessage hello_local;
+
+  if ( _numWorkers == 0 ) {
+    initializeComputation();
+  }
+
+  // The relay expects exactly one reply per forwarded handshake, so unlike
+  // onConnect() the kill case is answered with a plain DMT_REJECT.
+  if ( hello_remote.type == DMT_GET_VIRTUAL_PID ) {
+    hello_local.type = DMT_GET_VIRTUAL_PID_RESULT;
+    hello_local.virtualPid = getNewVirtualPid();
+    relay->socket() << hello_local;
+    return;
+  }
+  if ( killInProgress ) {
+    JNOTE ( "Relayed connection request received in the middle of killing "
+            "computation.  Rejecting it." ) ( hello_remote.from );
+    hello_local.type = DMT_REJECT;
+    relay->socket() << hello_local;
+    return;
+  }
+
+  NamedChunkReader ds ( relay->socket(), NULL, 0, hello_remote );
+  if ( hello_remote.extraBytes > 0 ) {
+    ds.setProcessInfo ( hello_remote, extraData );
+  }
+  bool accepted = admitWorker ( hello_remote, hello_local, &ds );
+  relay->socket() << hello_local;
+  if ( !accepted ) {
+    return;
+  }
+
+  if ( hello_remote.type == DMT_HELLO_COORDINATOR ) {
+    _virtualPidToChunkReaderMap[ds.virtualPid()] = relay;
+  }
+  // Count the worker now, as for a direct connection; the relay's next
+  // status report will include it as well.
+  countRelayedWorkers ( relay, -1 );
+  relay->addRelayedWorker ( ds.state() );
+  countRelayedWorkers ( relay, +1 );
+}
+
+void dmtcp::DmtcpCoordinator::processRelayStatus ( jalib::JReaderInterface *sock,
+                                                   const DmtcpMessage& msg )
+{
+  NamedChunkReader *relay = ( NamedChunkReader* ) sock;
+  WorkerState oldState = relay->state();
+  int oldWorkers = relay->relayedWorkers();
+
+  JTRACE ( "got DMT_RELAY_STATUS message" )
+    ( msg.from ) ( msg.state ) ( msg.maxState ) ( msg.numPeers )
+    ( msg.virtualPid );
+
+  countRelayedWorkers ( relay, -1 );
+  relay->relayStatus ( msg.state, msg.maxState, msg.numPeers );
+  countRelayedWorkers ( relay, +1 );
+  _nameServiceWorkers += msg.nameServiceWorkers - relay->nameServiceWorkers();
+  relay->nameServiceWorkers ( msg.nameServiceWorkers );
+  if ( msg.state != oldState ) {
+    phaseTimings.workerReported ( msg.state, relay->identity(),
+                                  relay->hostname() );
+  }
+
+  if ( msg.virtualPid != -1 ) {
+    _virtualPidToChunkReaderMap.erase ( msg.virtualPid );
+  }
+
+  if ( msg.numPeers < oldWorkers ) {
+    workersLeft ( oldState );
+  } else {
+    updateMinimumState ( oldState );
+  }
+}
+
+void dmtcp::DmtcpCoordinator::connectUpstream ( const char *host, int port )
+{
+  jalib::JSocket upstream = jalib::JClientSocket ( host, port );
+  JASSERT ( upstream.isValid() ) ( host ) ( port ) ( JASSERT_ERRNO )
+    .Text ( "Failed to connect to the upstream coordinator" );
+
+  dmtcp::string hostname = jalib::Filesystem::GetCurrentHostname();
+  dmtcp::string progname = BINARY_NAME;
+  DmtcpMessage hello_local ( DMT_RELAY_HELLO );
+  hello_local.extraBytes = hostname.length() + 1 + progname.length() + 1;
+  upstream << hello_local;
+  upstream.writeAll ( hostname.c_str(), hostname.length() + 1 );
+  upstream.writeAll ( progname.c_str(), progname.length() + 1 );
+
+  DmtcpMessage hello_remote;
+  hello_remote.poison();
+  upstream >> hello_remote;
+  hello_remote.assertValid();
+  JASSERT ( hello_remote.type == DMT_HELLO_WORKER ) ( hello_remote.type )
+    .Text ( "Upstream coordinator refused the relay connection" );
+
+  JNOTE ( "relaying to upstream coordinator" ) ( host ) ( port );
+  _upstream = new MessageReader ( upstream );
+  addDataSocket ( _upstream );
+}
+
+void dmtcp::DmtcpCoordinator::relayConnection ( DmtcpMessage& hello_remote,
+                                                jalib::JSocket& remote )
+{
+  char *extraData = NULL;
+  if ( hello_remote.extraBytes > 0 ) {
+    extraData = new char[hello_remote.extraBytes];
+    remote.readAll ( extraData, hello_remote.extraBytes );
+  }
+
+  switch ( hello_remote.type ) {
+    case DMT_USER_CMD:
+      relayUserCommand ( hello_remote, remote );
+      break;
+    case DMT_GET_VIRTUAL_PID:
+      forwardUpstream ( hello_remote, extraData, remote );
+      break;
+    case DMT_CKPT_DURABLE:
+      // No reply; the writer exits once it has told us.
+      forwardUpstream ( hello_remote, extraData );
+      remote.close();
+      break;
+    case DMT_HELLO_COORDINATOR:
+    case DMT_RESTART_PROCESS:
+    {
+      NamedChunkReader *ds = new NamedChunkReader ( remote, NULL, 0,
+                                                    hello_remote );
+      if ( hello_remote.extraBytes > 0 ) {
+        ds->setProcessInfo ( hello_remote, extraData );
+      }
+      if ( hello_remote.type == DMT_HELLO_COORDINATOR ) {
+        ds->virtualPid ( hello_remote.virtualPid );
+      }
+      // Count the worker while its handshake is in flight, so that no status
+      // sent upstream can drop a worker the upstream coordinator admitted.
+      countWorkerState ( ds->state(), +1 );
+      forwardUpstream ( hello_remote, extraData, remote, ds );
+      sendRelayStatus();
+      break;
+    }
+    default:
+      JNOTE ( "relay: refusing connection" ) ( hello_remote.type )
+        ( hello_remote.from );
+      remote.close();
+  }
+  delete[] extraData;
+}
+
+void dmtcp::DmtcpCoordinator::relayUserCommand ( DmtcpMessage& hello_remote,
+                                                 jalib::JSocket& remote )
+{
+  JTRACE ( "relaying user command from dmtcp_command" ) ( hello_remote.coordCmd );
+  if ( hello_remote.coordCmd == 'b' || hello_remote.coordCmd == 'B' ) {
+    // 'b' arrives on its own connection ahead of the 'c' it applies to; keep
+    // it here and wait for DMT_DO_RESUME before answering that 'c'.
+    DmtcpMessage reply ( DMT_USER_CMD_RESULT );
+    reply.coordErrorCode = CoordinatorAPI::NOERROR;
+    blockUntilDone = true;
+    remote << reply;
+    remote.close();
+    return;
+  }
+  bool blocking = blockUntilDone && blockUntilDoneRemote == -1 &&
+                  hello_remote.coordCmd == 'c';
+  forwardUpstream ( hello_remote, NULL, remote );
+  _relayRequests.back().blocking = blocking;
+  if ( hello_remote.coordCmd == 'q' || hello_remote.coordCmd == 'Q' ) {
+    // No reply comes for 'q'; the upstream coordinator just goes away.
+    _relayRequests.pop_back();
+  }
+}
+
+void dmtcp::DmtcpCoordinator::forwardUpstream ( const DmtcpMessage& msg,
+                                                const char *extraData,
+                                                jalib::JSocket client,
+                                                jalib::JReaderInterface *worker )
+{
+  // Writes to the upstream coordinator go through the write queue so that a
+  // relay never blocks on it while the upstream coordinator is writing to us.
+  addWrite ( new jalib::JChunkWriter ( _upstream->socket(), ( char* ) &msg,
+                                       sizeof ( DmtcpMessage ) ) );
+  if ( msg.extraBytes > 0 ) {
+    addWrite ( new jalib::JChunkWriter ( _upstream->socket(), extraData,
+                                         msg.extraBytes ) );
+  }
+
+  if ( client.isValid() || worker != NULL ) {
+    RelayRequest req;
+    req.type = msg.type;
+    req.client = client;
+    req.worker = worker;
+    _relayRequests.push_back ( req );
+  }
+}
+
+void dmtcp::DmtcpCoordinator::onUpstreamData ( const DmtcpMessage& msg,
+                                               const char *extraData )
+{
+  switch ( msg.type ) {
+    case DMT_HELLO_WORKER:
+    case DMT_REJECT:
+    case DMT_RESTART_PROCESS_REPLY:
+    case DMT_GET_VIRTUAL_PID_RESULT:
+    case DMT_USER_CMD_RESULT:
+    case DMT_NAME_SERVICE_QUERY_RESPONSE:
+    case DMT_NAME_SERVICE_QUERY_BULK_RESPONSE:
+      break;
+    default:
+      // A barrier or kill message for every worker in the computation.
+      JTRACE ( "relaying message to local workers" ) ( msg.type );
+      broadcastMessage ( msg );
+      if ( msg.type == DMT_DO_RESUME && blockUntilDone &&
+           blockUntilDoneRemote != -1 ) {
+        replyToBlockingCommand();
+      }
+      return;
+  }
+
+  JASSERT ( !_relayRequests.empty() ) ( msg.type )
+    .Text ( "reply from upstream coordinator without a pending request" );
+  RelayRequest req = _relayRequests.front();
+  _relayRequests.pop_front();
+
+  switch ( req.type ) {
+    case DMT_HELLO_COORDINATOR:
+    case DMT_RESTART_PROCESS:
+    {
+      NamedChunkReader *ds = ( NamedChunkReader* ) req.worker;
+      req.client << msg;
+      if ( msg.type == DMT_REJECT ) {
+        req.client.close();
+        countWorkerState ( ds->state(), -1 );
+        delete ds;
+        sendRelayStatus();
+        break;
+      }
+      if ( msg.type == DMT_HELLO_WORKER && msg.virtualPid != -1 ) {
+        ds->virtualPid ( msg.virtualPid );
+      }
+      if ( req.type == DMT_HELLO_COORDINATOR &&
+           ds->state() != WorkerState::RESTARTING &&
+           workersRunningAndSuspendMsgSent ) {
+        // Let this process participate in the checkpoint already under way.
+        DmtcpMessage suspendMsg ( dmtcp::DMT_DO_SUSPEND );
+        req.client << suspendMsg;
+      }
+      JNOTE ( "worker connected" ) ( ds->identity() );
+      addDataSocket ( ds );
+      break;
+    }
+    case DMT_GET_VIRTUAL_PID:
+      req.client << msg;
+      req.client.close();
+      break;
+    default:
+      if ( req.worker != NULL ) {
+        // A connected worker's query or dmtcpaware command
+        req.worker->socket() << msg;
+        if ( msg.extraBytes > 0 ) {
+          req.worker->socket().writeAll ( extraData, msg.extraBytes );
+        }
+      } else if ( req.blocking && msg.coordErrorCode == CoordinatorAPI::NOERROR ) {
+        // Reply is done when DMT_DO_RESUME passes through.
+        blockUntilDoneRemote = req.client.sockfd();
+      } else if ( req.client.isValid() ) {
+        req.client << msg;
+        if ( msg.extraBytes > 0 ) {
+          req.client.writeAll ( extraData, msg.extraBytes );
+        }
+        req.client.close();
+      }
+  }
+}
+
+void dmtcp::DmtcpCoordinator::sendRelayStatus ( pid_t exitedVirtualPid )
+{
+  CoordinatorStatus s = getStatus();
+  if ( exitedVirtualPid == -1 &&
+       s.numPeers == _reportedStatus.numPeers &&
+       s.minimumState == _reportedStatus.minimumState &&
+       s.maximumState == _reportedStatus.maximumState &&
+       _nameServiceWorkers == _reportedNameServiceWorkers ) {
+    return;
+  }
+
+  DmtcpMessage msg ( DMT_RELAY_STATUS );
+  msg.state = s.minimumState;
+  msg.maxState = s.maximumState;
+  msg.numPeers = s.numPeers;
+  msg.virtualPid = exitedVirtualPid;
+  msg.nameServiceWorkers = _nameServiceWorkers;
+  forwardUpstream ( msg, NULL );
+  _reportedStatus = s;
+  _reportedNameServiceWorkers = _nameServiceWorkers;
+}
+
+void dmtcp::DmtcpCoordinator::dropRelayRequests ( jalib::JReaderInterface *worker )
+{
+  // The replies still arrive and must be consumed in order; just make sure
+  // they aren't written to a worker that is gone.
+  dmtcp::list<RelayRequest>::iterator i;
+  for ( i = _relayRequests.begin(); i != _relayRequests.end(); ++i ) {
+    if ( i->worker == worker ) {
+      i->worker = NULL;
+    }
+  }
+}
+
 void dmtcp::DmtcpCoordinator::onTimeoutInterval()
 {
   if ( theCheckpointInterval > 0 )
@@ -1212,17 +1933,27 @@ void dmtcp::DmtcpCoordinator::onTimeoutInterval()
 
 bool dmtcp::DmtcpCoordinator::startCheckpoint()
 {
+  dropStalePendingImages();
+  if ( !_pendingImages.empty() ) {
+    // The writers of the next images would use the same temporary files.
+    JWARNING ( false ) ( _pendingImages.size() )
+      .Text ( "refusing to checkpoint, the last images are still being"
+              " written" );
+    return false;
+  }
   CoordinatorStatus s = getStatus();
   if ( s.minimumState == WorkerState::RUNNING && s.minimumStateUnanimous
        && !workersRunningAndSuspendMsgSent )
   {
     JTIMER_START ( checkpoint );
     _restartFilenames.clear();
+    _earlyDurableImages.clear();
     JNOTE ( "starting checkpoint, suspending all nodes" )( s.numPeers );
     UniquePid::ComputationId().incrementGeneration();
     JNOTE("Incremented Generation") (UniquePid::ComputationId().generation());
     // Pass number of connected peers to all clients
     broadcastMessage(DMT_DO_SUSPEND);
+    phaseTimings.beginCheckpoint ( UniquePid::ComputationId() );
 
     // Suspend Message has been sent but the workers are still in running
     // state.  If the coordinator receives another checkpoint request from user
@@ -1256,20 +1987,26 @@ void dmtcp::DmtcpCoordinator::broadcastMessage ( const DmtcpMessage& msg )
 {
   if (msg.type == DMT_KILL_PEER) {
     killInProgress = true;
+  } else if (msg.type == DMT_DO_SUSPEND && isRelay()) {
+    // Relayed from upstream; startCheckpoint() sets this on the coordinator
+    // that started the checkpoint.
+    workersRunningAndSuspendMsgSent = true;
   } else if (msg.type == DMT_DO_FD_LEADER_ELECTION) {
     // All the workers are in SUSPENDED state, now it is safe to reset
     // this flag.
     workersRunningAndSuspendMsgSent = false;
   }
 
+  // One copy of the message is shared by all the sockets it is queued on.
+  jalib::JSharedChunk *chunk = new jalib::JSharedChunk ( ( char* ) &msg,
+                                                         sizeof ( DmtcpMessage ) );
   for ( dmtcp::vector<jalib::JReaderInterface*>::iterator i
 	= _dataSockets.begin() ; i!= _dataSockets.end() ; i++ )
   {
-    if ( ( *i )->socket().sockfd() != STDIN_FD )
-      addWrite ( new jalib::JChunkWriter ( ( *i )->socket(),
-					   ( char* ) &msg,
-					   sizeof ( DmtcpMessage ) ) );
+    if ( ( *i )->socket().sockfd() != STDIN_FD && *i != _upstream )
+      addSharedWrite ( ( *i )->socket(), chunk );
   }
+  chunk->unref();
 }
 
 dmtcp::DmtcpCoordinator::CoordinatorStatus dmtcp::DmtcpCoordinator::getStatus() const
@@ -1279,21 +2016,18 @@ dmtcp::DmtcpCoordinator::CoordinatorStatus dmtcp::DmtcpCoordinator::getStatus()
   const static int INITIAL_MAX = WorkerState::UNKNOWN;
   int min = INITIAL_MIN;
   int max = INITIAL_MAX;
-  int count = 0;
-  bool unanimous = true;
-  for ( const_iterator i = _dataSockets.begin()
-      ; i != _dataSockets.end()
-      ; ++i )
+  int count = _numWorkers;
+  int distinctStates = 0;
+  for ( int state = 0; state < WorkerState::_MAX; ++state )
   {
-    if ( ( *i )->socket().sockfd() != STDIN_FD )
+    if ( _workersInState[state] > 0 )
     {
-      int cliState = ((NamedChunkReader*)*i)->state().value();
-      count++;
-      unanimous = unanimous && (min==cliState || min==INITIAL_MIN);
-      if ( cliState < min ) min = cliState;
-      if ( cliState > max ) max = cliState;
+      distinctStates++;
+      if ( state < min ) min = state;
+      if ( state > max ) max = state;
     }
   }
+  bool unanimous = distinctStates <= 1;
 
   status.minimumState = ( min==INITIAL_MIN ? WorkerState::UNKNOWN
 			  : (WorkerState::eWorkerState)min );
@@ -1470,6 +2204,8 @@ int main ( int argc, char** argv )
   if ( portStr != NULL ) thePort = jalib::StringToInt ( portStr );
 
   bool background = false;
+  dmtcp::string relayHost;
+  int relayPort = DEFAULT_PORT;
 
   shift;
   while(argc > 0){
@@ -1501,6 +2237,14 @@ int main ( int argc, char** argv )
     }else if(argc>1 && (s == "-t" || s == "--tmpdir")){
       setenv(ENV_VAR_TMPDIR, argv[1], 1);
       shift; shift;
+    }else if(argc>1 && s == "--relay"){
+      relayHost = argv[1];
+      size_t colon = relayHost.find(':');
+      if (colon != dmtcp::string::npos) {
+        relayPort = jalib::StringToInt(relayHost.c_str() + colon + 1);
+        relayHost.erase(colon);
+      }
+      shift; shift;
     }else if(argc == 1){ //last arg can be port
       char *endptr;
       long x = strtol(argv[0], &endptr, 10);
@@ -1563,6 +2307,10 @@ int main ( int argc, char** argv )
     theDefaultCheckpointInterval = jalib::StringToInt ( interval );
     theCheckpointInterval = theDefaultCheckpointInterval;
   }
+  if ( !relayHost.empty() ) {
+    // The upstream coordinator owns the checkpoint interval.
+    theDefaultCheckpointInterval = theCheckpointInterval = 0;
+  }
 
 #if 0
   JASSERT_STDERR <<
@@ -1584,6 +2332,8 @@ int main ( int argc, char** argv )
   else
     fprintf(stderr, "%d", theCheckpointInterval);
   fprintf(stderr, "\n    Exit on last client: %d\n", exitOnLast);
+  if ( !relayHost.empty() )
+    fprintf(stderr, "    Relaying to: %s:%d\n", relayHost.c_str(), relayPort);
 #endif
 
   if(background){
@@ -1624,6 +2374,8 @@ int main ( int argc, char** argv )
    * DMT_KILL_PEER message to all the connected peers before exiting.
    */
   setupSIGINTHandler();
+  if ( !relayHost.empty() )
+    prog.connectUpstream ( relayHost.c_str(), relayPort );
   prog.addListenSocket ( *sock );
   if(!background && !batchMode)
     prog.addDataSocket ( new jalib::JChunkReader ( STDIN_FD , 1 ) );
@@ -38,6 +38,8 @@ namespace dmtcp
         int numPeers;
       } CoordinatorStatus;
 
+      DmtcpCoordinator();
+
       virtual void onData(jalib::JReaderInterface* sock);
       virtual void onConnect(const jalib::JSocket& sock,
                              const struct sockaddr* remoteAddr,
@@ -55,13 +57,26 @@ namespace dmtcp
 
       void processDmtUserCmd(DmtcpMessage& hello_remote,
                              jalib::JSocket& remote);
+      bool admitWorker(DmtcpMessage& hello_remote,
+                       DmtcpMessage& hello_local,
+                       jalib::JChunkReader *jcr);
       bool validateDmtRestartProcess(DmtcpMessage& hello_remote,
-                                     jalib::JSocket& remote);
+                                     DmtcpMessage& hello_local);
       bool validateNewWorkerProcess(DmtcpMessage& hello_remote,
-                                    jalib::JSocket& remote,
+                                    DmtcpMessage& hello_local,
                                     jalib::JChunkReader *jcr);
       bool validateRestartingWorkerProcess(DmtcpMessage& hello_remote,
-                                           jalib::JSocket& remote);
+                                           DmtcpMessage& hello_local);
+      void workersLeft(dmtcp::WorkerState oldState);
+      void imageDurable(const DmtcpMessage& msg);
+      void dropPendingImages(jalib::JReaderInterface *sock);
+      void dropStalePendingImages();
+      void writeRestartScriptIfDurable();
+
+      // Relay mode (--relay): this coordinator serves the workers of one
+      // node and stands in for all of them at the upstream coordinator.
+      void connectUpstream(const char *host, int port);
+      bool isRelay() const { return _upstream != NULL; }
 
       CoordinatorStatus getStatus() const;
       dmtcp::WorkerState minimumState() const {
@@ -72,7 +87,40 @@ namespace dmtcp
 
     protected:
       void writeRestartScript();
+      void writeRestartScriptWhenDurable();
     private:
+      void countWorkerState(dmtcp::WorkerState state, int delta);
+
+      // Upstream side of a relay connection
+      void countRelayedWorkers(jalib::JReaderInterface *relay, int sign);
+      void processRelayedHello(jalib::JReaderInterface *relay,
+                               DmtcpMessage& hello_remote,
+                               const char *extraData);
+      void processRelayStatus(jalib::JReaderInterface *relay,
+                              const DmtcpMessage& msg);
+
+      // Relay side
+      void relayConnection(DmtcpMessage& hello_remote, jalib::JSocket& remote);
+      void relayUserCommand(DmtcpMessage& hello_remote, jalib::JSocket& remote);
+      void forwardUpstream(const DmtcpMessage& msg, const char *extraData,
+                           jalib::JSocket client = jalib::JSocket(-1),
+                           jalib::JReaderInterface *worker = NULL);
+      void onUpstreamData(const DmtcpMessage& msg, const char *extraData);
+      void sendRelayStatus(pid_t exitedVirtualPid = -1);
+      void dropRelayRequests(jalib::JReaderInterface *worker);
+
+      // A request forwarded upstream whose reply is still outstanding.  The
+      // upstream coordinator answers requests in order, so replies are
+      // matched to these first-in first-out.
+      struct RelayRequest {
+        DmtcpMessageType type;
+        jalib::JSocket client;            // dmtcp_command or connecting process
+        jalib::JReaderInterface *worker;  // connected worker, or pending hello
+        bool blocking;                    // a 'c' after a 'b' prefix
+        RelayRequest() : type(DMT_NULL), client(-1), worker(NULL),
+                         blocking(false) {}
+      };
+
       typedef dmtcp::vector<jalib::JReaderInterface*>::iterator iterator;
       typedef
         dmtcp::vector<jalib::JReaderInterface*>::const_iterator const_iterator;
@@ -80,6 +128,30 @@ namespace dmtcp
       //map from hostname to checkpoint files
       map< dmtcp::string, dmtcp::vector<dmtcp::string> > _restartFilenames;
       dmtcp::map< pid_t, jalib::JChunkReader* > _virtualPidToChunkReaderMap;
+
+      // Number of connected workers in each WorkerState.  Kept up to date on
+      // connect, disconnect and DMT_OK so that getStatus() is O(1) rather
+      // than a scan over all clients.
+      int _workersInState[dmtcp::WorkerState::_MAX];
+      int _numWorkers;
+      // Workers that asked for the name service phases in their last DMT_OK.
+      int _nameServiceWorkers;
+      // Forked checkpoints whose images are still being written, by worker,
+      // with the connection (the worker's, or its relay's) that reported
+      // them and when.  A writer may report before its worker does; such
+      // workers are in _earlyDurableImages until then.
+      struct PendingImage {
+        jalib::JReaderInterface *reporter;
+        time_t since;
+      };
+      dmtcp::map< UniquePid, PendingImage > _pendingImages;
+      dmtcp::set< UniquePid > _earlyDurableImages;
+      bool _restartScriptPending;
+
+      jalib::JChunkReader *_upstream;
+      dmtcp::list<RelayRequest> _relayRequests;
+      CoordinatorStatus _reportedStatus;
+      int _reportedNameServiceWorkers;
   };
 
 }
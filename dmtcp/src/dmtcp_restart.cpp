@@ -63,6 +63,16 @@ static const char* theUsage =
   "      --batch implies -i 3600, unless otherwise specified.\n"
   "  --no-check:\n"
   "      Skip check for valid coordinator and never start one automatically\n"
+  "  --lazy, (environment variable DMTCP_LAZY_RESTORE=[01]):\n"
+  "      Resume the processes before their memory is read back, and read it\n"
+  "        on demand and in the background (needs kernel userfaultfd)\n"
+  "  --fast-restart, (environment variable DMTCP_FAST_RESTART=[01]):\n"
+  "      Map the read-only memory of uncompressed checkpoint images from the\n"
+  "        image file, copy-on-write, instead of reading it; processes\n"
+  "        restarted from one image share those pages\n"
+  "  --restore-threads <arg>, (environment variable DMTCP_RESTORE_THREADS):\n"
+  "      Number of threads reading the large memory areas of uncompressed or\n"
+  "        in-process compressed checkpoint images in parallel (default: 1)\n"
   "  --quiet, -q, (or set environment variable DMTCP_QUIET = 0, 1, or 2):\n"
   "      Skip banner and NOTE messages; if given twice, also skip WARNINGs\n"
   "  --help:\n"
@@ -110,6 +120,15 @@ int main(int argc, char** argv)
     } else if (s == "--no-check") {
       autoStartCoordinator = false;
       shift;
+    } else if (s == "--lazy") {
+      setenv(ENV_VAR_LAZY_RESTORE, "1", 1);
+      shift;
+    } else if (s == "--fast-restart") {
+      setenv(ENV_VAR_FAST_RESTART, "1", 1);
+      shift;
+    } else if (argc>1 && s == "--restore-threads") {
+      setenv(ENV_VAR_RESTORE_THREADS, argv[1], 1);
+      shift; shift;
     } else if (s == "-j" || s == "--join") {
       allowedModes = dmtcp::CoordinatorAPI::COORD_JOIN;
       shift;
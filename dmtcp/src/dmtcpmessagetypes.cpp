@@ -51,6 +51,7 @@ dmtcp::DmtcpMessage::DmtcpMessage ( DmtcpMessageType t /*= DMT_NULL*/ )
     ,from ( UniquePid::ThisProcess() )
     ,coordinator ( theDefaultCoordinator )
     ,state ( WorkerState::currentState() )
+    ,maxState ( WorkerState::UNKNOWN )
     ,compGroup ( UniquePid::ComputationId() )
     ,virtualPid ( -1 )
     ,keyLen ( 0 )
@@ -61,6 +62,9 @@ dmtcp::DmtcpMessage::DmtcpMessage ( DmtcpMessageType t /*= DMT_NULL*/ )
     ,numPeers(0)
     ,isRunning(0)
     ,coordErrorCode(0)
+    ,nameServiceWorkers(0)
+    ,imagePending(0)
+    ,imageFailed(0)
     ,extraBytes ( 0 )
 {
 //     struct sockaddr_storage _addr;
@@ -178,11 +182,17 @@ dmtcp::ostream& dmtcp::operator << ( dmtcp::ostream& o, const dmtcp::DmtcpMessag
       OSHIFTPRINTF ( DMT_REGISTER_NAME_SERVICE_DATA )
       OSHIFTPRINTF ( DMT_NAME_SERVICE_QUERY )
       OSHIFTPRINTF ( DMT_NAME_SERVICE_QUERY_RESPONSE )
+      OSHIFTPRINTF ( DMT_REGISTER_NAME_SERVICE_DATA_BULK )
+      OSHIFTPRINTF ( DMT_NAME_SERVICE_QUERY_BULK )
+      OSHIFTPRINTF ( DMT_NAME_SERVICE_QUERY_BULK_RESPONSE )
 //#endif
 
       OSHIFTPRINTF ( DMT_OK )
       OSHIFTPRINTF ( DMT_CKPT_FILENAME )
+      OSHIFTPRINTF ( DMT_CKPT_DURABLE )
       OSHIFTPRINTF ( DMT_FORCE_RESTART )
+      OSHIFTPRINTF ( DMT_RELAY_HELLO )
+      OSHIFTPRINTF ( DMT_RELAY_STATUS )
       OSHIFTPRINTF ( DMT_KILL_PEER )
       OSHIFTPRINTF ( DMT_REJECT )
 
@@ -65,13 +65,21 @@ namespace dmtcp
     DMT_REGISTER_NAME_SERVICE_DATA,
     DMT_NAME_SERVICE_QUERY,
     DMT_NAME_SERVICE_QUERY_RESPONSE,
+    DMT_REGISTER_NAME_SERVICE_DATA_BULK, // arrays of NameServiceRecords
+    DMT_NAME_SERVICE_QUERY_BULK,
+    DMT_NAME_SERVICE_QUERY_BULK_RESPONSE,
 //#endif
 
     DMT_OK,                  // slave telling coordinator it is done (response
                              //   to DMT_DO_*)  this means slave reached barrier
     DMT_CKPT_FILENAME,       // a slave sending it's checkpoint filename to coordinator
+    DMT_CKPT_DURABLE,        // on connect established forked ckpt writer ->
+                             //   coordinator: the image is on disk
     DMT_FORCE_RESTART,       // force a restart even if not all sockets are reconnected
 
+    DMT_RELAY_HELLO,         // on connect established relay -> coordinator
+    DMT_RELAY_STATUS,        // relay reporting its workers' states upstream
+
     DMT_KILL_PEER,           // send kill message to peer
     DMT_REJECT               // coordinator discards incoming connection
                              //because it is not from current computation group
@@ -133,6 +141,16 @@ namespace dmtcp
     }
   };
 
+  // The extra bytes of the *_BULK name service messages are a sequence of
+  // records, each a NameServiceRecord followed by keyLen bytes of key and
+  // valLen bytes of value.  Queries carry no values; a response has a zero
+  // valLen for a key that was not registered.
+  struct NameServiceRecord
+  {
+    size_t keyLen;
+    size_t valLen;
+  };
+
 #define DMTCPMESSAGE_NUM_PARAMS 2
 #define DMTCPMESSAGE_SAME_CKPT_INTERVAL (-1) /* default value */
 
@@ -145,6 +163,7 @@ namespace dmtcp
 
     DmtcpUniqueProcessId   coordinator;
     WorkerState state;
+    WorkerState maxState;   // DMT_RELAY_STATUS: highest state behind a relay
     UniquePid   compGroup;
     pid_t       virtualPid;
 
@@ -160,6 +179,18 @@ namespace dmtcp
     int isRunning;
     int coordErrorCode;
 
+    // DMT_OK: 1 if this worker needs the name service phases in the
+    // current checkpoint/restart.  DMT_RELAY_STATUS: how many workers behind
+    // the relay do.
+    int nameServiceWorkers;
+
+    // DMT_CKPT_FILENAME: 1 if a forked child is still writing the image; a
+    // DMT_CKPT_DURABLE follows once it is on disk.
+    int imagePending;
+    // DMT_CKPT_DURABLE: 1 if the writer failed, or could not tell whether
+    // the image is on disk.
+    int imageFailed;
+
     //extraBytes are used for passing checkpoint filename to coordinator it
     //must be zero in all messages except for in DMT_CKPT_FILENAME
     size_t extraBytes;
@@ -184,6 +184,13 @@ EXTERNC int dmtcp_send_key_val_pair_to_coordinator(const void *key,
 //   size of that buffer (the memory allocated by user).
 // On output, we copy data to val, and set *val_len to the actual buffer size
 //   (to the size of the data that we copied to the user buffer).
+// Sets a flag that goes to the coordinator with the CHECKPOINTED DMT_OK and
+// is then cleared; see dmtcpplugin.h.
+EXTERNC void dmtcp_request_name_service()
+{
+  DmtcpWorker::requestNameService();
+}
+
 EXTERNC int dmtcp_send_query_to_coordinator(const void *key, size_t key_len,
                                             void *val, size_t *val_len)
 {
@@ -191,6 +198,27 @@ EXTERNC int dmtcp_send_query_to_coordinator(const void *key, size_t key_len,
                                                            val, val_len);
 }
 
+EXTERNC int dmtcp_send_key_val_pairs_to_coordinator(size_t count,
+                                                    const void * const *keys,
+                                                    const size_t *key_lens,
+                                                    const void * const *vals,
+                                                    const size_t *val_lens)
+{
+  return CoordinatorAPI::instance().sendKeyValPairsToCoordinator(count,
+                                                                 keys, key_lens,
+                                                                 vals, val_lens);
+}
+
+EXTERNC int dmtcp_send_queries_to_coordinator(size_t count,
+                                              const void * const *keys,
+                                              const size_t *key_lens,
+                                              void **vals, size_t *val_lens)
+{
+  return CoordinatorAPI::instance().sendQueriesToCoordinator(count,
+                                                             keys, key_lens,
+                                                             vals, val_lens);
+}
+
 EXTERNC int dmtcp_get_coordinator_sockname(struct sockaddr_storage *addr)
 {
   return CoordinatorAPI::instance().getCoordSockname(addr);
@@ -41,6 +41,8 @@ LIB_PRIVATE void pthread_atfork_parent();
 LIB_PRIVATE void pthread_atfork_child();
 
 bool dmtcp::DmtcpWorker::_exitInProgress = false;
+bool dmtcp::DmtcpWorker::_nameServiceRequested = false;
+bool dmtcp::DmtcpWorker::_nameServiceOnDemand = false;
 
 static void processDmtcpCommands(dmtcp::string programName,
                                  dmtcp::vector<dmtcp::string>& args);
@@ -393,6 +395,9 @@ dmtcp::DmtcpWorker::DmtcpWorker (bool enableCheckpointing)
 
   processRlimit();
 
+  const char *onDemand = getenv(ENV_VAR_NAME_SERVICE_ON_DEMAND);
+  _nameServiceOnDemand = onDemand != NULL && strcmp(onDemand, "1") == 0;
+
   //This is called for side effect only.  Force this function to call
   // getenv("MTCP_SIGCKPT") now and cache it to avoid getenv calls later.
   determineMtcpSignal();
@@ -480,8 +485,9 @@ dmtcp::DmtcpWorker::~DmtcpWorker()
   cleanupWorker();
 }
 
-void dmtcp::DmtcpWorker::waitForCoordinatorMsg(dmtcp::string msgStr,
-                                               DmtcpMessageType type)
+dmtcp::DmtcpMessageType
+dmtcp::DmtcpWorker::waitForCoordinatorMsg(dmtcp::string msgStr,
+                                          DmtcpMessageType type)
 {
   if (dmtcp_no_coordinator()) {
     if (type == DMT_DO_SUSPEND) {
@@ -490,7 +496,7 @@ void dmtcp::DmtcpWorker::waitForCoordinatorMsg(dmtcp::string msgStr,
       ProcessInfo::instance().numPeers(1);
       ProcessInfo::instance().compGroup(UniquePid::ComputationId());
     }
-    return;
+    return type;
   }
 
   if (type == DMT_DO_SUSPEND) {
@@ -514,6 +520,13 @@ void dmtcp::DmtcpWorker::waitForCoordinatorMsg(dmtcp::string msgStr,
   } else {
     msg.type = DMT_OK;
     msg.state = WorkerState::currentState();
+    if (msg.state == WorkerState::CHECKPOINTED) {
+      // Plugins that predate dmtcp_request_name_service() still expect the
+      // phases, so they are skipped only if the user said so.
+      msg.nameServiceWorkers =
+        (_nameServiceRequested || !_nameServiceOnDemand) ? 1 : 0;
+      _nameServiceRequested = false;
+    }
     CoordinatorAPI::instance().sendMsgToCoordinator(msg);
   }
 
@@ -547,6 +560,11 @@ void dmtcp::DmtcpWorker::waitForCoordinatorMsg(dmtcp::string msgStr,
            || type == DMT_DO_SEND_QUERIES)
           && msg.type == DMT_FORCE_RESTART);
 
+  // The coordinator skips the name service phases if no process asked for
+  // them.
+  if (type == DMT_DO_REGISTER_NAME_SERVICE_DATA && msg.type == DMT_DO_REFILL) {
+    return msg.type;
+  }
   JASSERT(msg.type == type) (msg.type) (type);
 
   // Coordinator sends some computation information along with the SUSPEND
@@ -559,6 +577,7 @@ void dmtcp::DmtcpWorker::waitForCoordinatorMsg(dmtcp::string msgStr,
     JASSERT(UniquePid::ComputationId() == msg.compGroup);
     ProcessInfo::instance().compGroup(msg.compGroup);
   }
+  return msg.type;
 }
 
 void dmtcp::DmtcpWorker::informCoordinatorOfRUNNINGState()
@@ -666,20 +685,26 @@ void dmtcp::DmtcpWorker::waitForStage3Refill(bool isRestart)
   dmtcp::SharedData::refill();
 
 #ifdef COORD_NAMESERVICE
-  waitForCoordinatorMsg("REGISTER_NAME_SERVICE_DATA",
-                          DMT_DO_REGISTER_NAME_SERVICE_DATA);
-  edata.nameserviceInfo.isRestart = isRestart;
-  processEvent(DMTCP_EVENT_REGISTER_NAME_SERVICE_DATA, &edata);
-  JTRACE("Key Value Pairs registered with the coordinator");
-  WorkerState::setCurrentState(WorkerState::NAME_SERVICE_DATA_REGISTERED);
-
-  waitForCoordinatorMsg("SEND_QUERIES", DMT_DO_SEND_QUERIES);
-  processEvent(DMTCP_EVENT_SEND_QUERIES, &edata);
-  JTRACE("Queries sent to the coordinator");
-  WorkerState::setCurrentState(WorkerState::DONE_QUERYING);
-#endif
-
+  if (waitForCoordinatorMsg("REGISTER_NAME_SERVICE_DATA",
+                            DMT_DO_REGISTER_NAME_SERVICE_DATA)
+        == DMT_DO_REGISTER_NAME_SERVICE_DATA) {
+    edata.nameserviceInfo.isRestart = isRestart;
+    processEvent(DMTCP_EVENT_REGISTER_NAME_SERVICE_DATA, &edata);
+    JTRACE("Key Value Pairs registered with the coordinator");
+    WorkerState::setCurrentState(WorkerState::NAME_SERVICE_DATA_REGISTERED);
+
+    waitForCoordinatorMsg("SEND_QUERIES", DMT_DO_SEND_QUERIES);
+    processEvent(DMTCP_EVENT_SEND_QUERIES, &edata);
+    JTRACE("Queries sent to the coordinator");
+    WorkerState::setCurrentState(WorkerState::DONE_QUERYING);
+
+    waitForCoordinatorMsg ("REFILL", DMT_DO_REFILL);
+  } else {
+    JTRACE("No name service data in this computation, skipped to refill");
+  }
+#else
   waitForCoordinatorMsg ("REFILL", DMT_DO_REFILL);
+#endif
 
   SyslogCheckpointer::restoreService();
 
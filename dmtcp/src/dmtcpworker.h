@@ -42,8 +42,8 @@ namespace dmtcp
 #endif
       static DmtcpWorker& instance();
 
-      void waitForCoordinatorMsg(dmtcp::string signalStr,
-                                 DmtcpMessageType type);
+      DmtcpMessageType waitForCoordinatorMsg(dmtcp::string signalStr,
+                                             DmtcpMessageType type);
       void informCoordinatorOfRUNNINGState();
       void waitForStage1Suspend();
       void waitForStage2Checkpoint();
@@ -62,6 +62,7 @@ namespace dmtcp
 
       static void setExitInProgress() { _exitInProgress = true; };
       static bool exitInProgress() { return _exitInProgress; };
+      static void requestNameService() { _nameServiceRequested = true; };
       void interruptCkpthread();
 
       void writeCheckpointPrefix(int fd);
@@ -73,6 +74,8 @@ namespace dmtcp
     private:
       static DmtcpWorker theInstance;
       static bool _exitInProgress;
+      static bool _nameServiceRequested;
+      static bool _nameServiceOnDemand;
   };
 }
 
@@ -30,6 +30,7 @@
 #include "coordinatorapi.h"
 #include "shareddata.h"
 #include "threadsync.h"
+#include "mtcpinterface.h"
 #include  "../jalib/jconvert.h"
 #include  "../jalib/jassert.h"
 #include  "../jalib/jfilesystem.h"
@@ -139,6 +140,9 @@ extern "C" pid_t fork()
   coordinatorAPI.createNewConnectionBeforeFork(child_name);
   dmtcp::Util::setVirtualPidEnvVar(coordinatorAPI.virtualPid(), getpid());
 
+  /* The child would see zeros where memory is still being restored lazily */
+  dmtcp::waitForLazyRestore();
+
   //Enable the pthread_atfork child call
   pthread_atfork_enabled = true;
   pid_t childPid = _real_fork();
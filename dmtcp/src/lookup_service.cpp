@@ -4,42 +4,136 @@
 
 using namespace dmtcp;
 
+// Arena blocks are carved into entries; an entry larger than a block gets a
+// block of its own.
+static const size_t LOOKUP_ARENA_BLOCK_SIZE = 256 * 1024;
+static const size_t LOOKUP_INITIAL_CAPACITY = 1024;
+
+// FNV-1a.  Keys are mostly ConnectionIdentifiers, which differ in only a few
+// bytes, so every byte must affect the result.
+static size_t hashKey(const void *key, size_t keyLen)
+{
+  const unsigned char *p = (const unsigned char*) key;
+  uint64_t h = 14695981039346656037ULL;
+  for (size_t i = 0; i < keyLen; i++) {
+    h ^= p[i];
+    h *= 1099511628211ULL;
+  }
+  return (size_t) (h ^ (h >> 32));
+}
+
 void dmtcp::LookupService::reset()
 {
-  keyValueMapIterator it;
-  for (it = _keyValueMap.begin(); it != _keyValueMap.end(); it++) {
-    KeyValue *k = (KeyValue*)&(it->first);
-    KeyValue *v = it->second;
-    k->destroy();
-    v->destroy();
-    delete v;
+  while (_arena != NULL) {
+    ArenaBlock *next = _arena->next;
+    JALLOC_HELPER_FREE(_arena);
+    _arena = next;
+  }
+  if (_table != NULL) {
+    JALLOC_HELPER_FREE(_table);
+    _table = NULL;
+  }
+  _capacity = 0;
+  _count = 0;
+}
+
+void *dmtcp::LookupService::arenaAlloc(size_t len)
+{
+  len = (len + sizeof(size_t) - 1) & ~(sizeof(size_t) - 1);
+  if (_arena == NULL || _arena->used + len > _arena->size) {
+    size_t size = sizeof(ArenaBlock) + len;
+    if (size < LOOKUP_ARENA_BLOCK_SIZE) {
+      size = LOOKUP_ARENA_BLOCK_SIZE;
+    }
+    ArenaBlock *block = (ArenaBlock*) JALLOC_HELPER_MALLOC(size);
+    block->next = _arena;
+    block->used = sizeof(ArenaBlock);
+    block->size = size;
+    _arena = block;
+  }
+  void *p = (char*) _arena + _arena->used;
+  _arena->used += len;
+  return p;
+}
+
+dmtcp::LookupService::Entry **
+dmtcp::LookupService::findSlot(const void *key, size_t keyLen, size_t hash)
+{
+  size_t mask = _capacity - 1;
+  for (size_t i = hash & mask; ; i = (i + 1) & mask) {
+    Entry *e = _table[i];
+    if (e == NULL ||
+        (e->hash == hash && e->keyLen == keyLen &&
+         memcmp(e->key(), key, keyLen) == 0)) {
+      return &_table[i];
+    }
+  }
+}
+
+void dmtcp::LookupService::grow()
+{
+  Entry **oldTable = _table;
+  size_t oldCapacity = _capacity;
+
+  _capacity = oldCapacity == 0 ? LOOKUP_INITIAL_CAPACITY : oldCapacity * 2;
+  _table = (Entry**) JALLOC_HELPER_MALLOC(_capacity * sizeof(Entry*));
+  memset(_table, 0, _capacity * sizeof(Entry*));
+
+  size_t mask = _capacity - 1;
+  for (size_t i = 0; i < oldCapacity; i++) {
+    Entry *e = oldTable[i];
+    if (e != NULL) {
+      size_t j = e->hash & mask;
+      while (_table[j] != NULL) {
+        j = (j + 1) & mask;
+      }
+      _table[j] = e;
+    }
+  }
+  if (oldTable != NULL) {
+    JALLOC_HELPER_FREE(oldTable);
   }
-  _keyValueMap.clear();
 }
 
 void dmtcp::LookupService::addKeyValue(const void *key, size_t keyLen,
                                        const void *val, size_t valLen)
 {
-  KeyValue k(key, keyLen);
-  KeyValue *v = new KeyValue(val, valLen);
-  if (_keyValueMap.find(k) != _keyValueMap.end()) {
+  // Keep the load factor at or below 3/4.
+  if ((_count + 1) * 4 > _capacity * 3) {
+    grow();
+  }
+  size_t hash = hashKey(key, keyLen);
+  Entry **slot = findSlot(key, keyLen, hash);
+  if (*slot != NULL) {
+    // The old entry stays in the arena until reset().
     JTRACE("Duplicate key");
+  } else {
+    _count++;
   }
-  _keyValueMap[k] = v;
+
+  Entry *e = (Entry*) arenaAlloc(sizeof(Entry) + keyLen + valLen);
+  e->hash = hash;
+  e->keyLen = keyLen;
+  e->valLen = valLen;
+  memcpy(e->key(), key, keyLen);
+  memcpy(e->val(), val, valLen);
+  *slot = e;
 }
 
 const void* dmtcp::LookupService::query(const void *key, size_t keyLen,
                                         void **val, size_t *valLen)
 {
-  KeyValue k(key, keyLen);
-  if (_keyValueMap.find(k) == _keyValueMap.end()) {
+  Entry *e = NULL;
+  if (_table != NULL) {
+    e = *findSlot(key, keyLen, hashKey(key, keyLen));
+  }
+  if (e == NULL) {
     JTRACE("Lookup Failed, Key not found.");
     return NULL;
   }
 
-  KeyValue *v = _keyValueMap[k];
-  *val = v->data();
-  *valLen = v->len();
+  *val = e->val();
+  *valLen = e->valLen;
 
   return *val;
 }
@@ -86,3 +180,74 @@ void dmtcp::LookupService::respondToQuery(const dmtcp::UniquePid& upid,
 
   delete [] extraData;
 }
+
+void dmtcp::LookupService::registerDataBulk(const dmtcp::UniquePid& upid,
+                                            const DmtcpMessage& msg,
+                                            const char *data)
+{
+  size_t offset = 0;
+  while (offset < msg.extraBytes) {
+    NameServiceRecord rec;
+    JASSERT(offset + sizeof(rec) <= msg.extraBytes) (offset) (upid);
+    memcpy(&rec, data + offset, sizeof(rec));
+    offset += sizeof(rec);
+    JASSERT(rec.keyLen > 0 && rec.valLen > 0 &&
+            offset + rec.keyLen + rec.valLen <= msg.extraBytes)
+      (rec.keyLen) (rec.valLen) (offset) (msg.extraBytes) (upid);
+    addKeyValue(data + offset, rec.keyLen,
+                data + offset + rec.keyLen, rec.valLen);
+    offset += rec.keyLen + rec.valLen;
+  }
+}
+
+void dmtcp::LookupService::respondToQueryBulk(const dmtcp::UniquePid& upid,
+                                              jalib::JSocket& remote,
+                                              const DmtcpMessage& msg,
+                                              const char *data)
+{
+  // First pass: look up every key and size the response.
+  dmtcp::vector<void*> vals;
+  dmtcp::vector<size_t> valLens;
+  size_t replyBytes = 0;
+  size_t offset = 0;
+  while (offset < msg.extraBytes) {
+    NameServiceRecord rec;
+    JASSERT(offset + sizeof(rec) <= msg.extraBytes) (offset) (upid);
+    memcpy(&rec, data + offset, sizeof(rec));
+    offset += sizeof(rec);
+    JASSERT(rec.keyLen > 0 && offset + rec.keyLen <= msg.extraBytes)
+      (rec.keyLen) (offset) (msg.extraBytes) (upid);
+    void *val = NULL;
+    size_t valLen = 0;
+    query(data + offset, rec.keyLen, &val, &valLen);
+    vals.push_back(val);
+    valLens.push_back(val == NULL ? 0 : valLen);
+    replyBytes += sizeof(rec) + rec.keyLen + valLens.back();
+    offset += rec.keyLen;
+  }
+
+  char *extraData = new char[replyBytes];
+  char *out = extraData;
+  offset = 0;
+  for (size_t n = 0; n < vals.size(); n++) {
+    NameServiceRecord rec;
+    memcpy(&rec, data + offset, sizeof(rec));
+    offset += sizeof(rec);
+    rec.valLen = valLens[n];
+    memcpy(out, &rec, sizeof(rec));
+    memcpy(out + sizeof(rec), data + offset, rec.keyLen);
+    if (rec.valLen > 0) {
+      memcpy(out + sizeof(rec) + rec.keyLen, vals[n], rec.valLen);
+    }
+    out += sizeof(rec) + rec.keyLen + rec.valLen;
+    offset += rec.keyLen;
+  }
+
+  DmtcpMessage reply (DMT_NAME_SERVICE_QUERY_BULK_RESPONSE);
+  reply.extraBytes = replyBytes;
+
+  remote << reply;
+  remote.writeAll(extraData, reply.extraBytes);
+
+  delete [] extraData;
+}
@@ -22,60 +22,32 @@
 #ifndef LOOKUP_SERVICE_H
 #define LOOKUP_SERVICE_H
 
-#include <map>
+#include <stdint.h>
 #include <string.h>
 #include "dmtcpmessagetypes.h"
 #include "../jalib/jsocket.h"
 
 namespace dmtcp
 {
-  class KeyValue {
-    public:
-      KeyValue(const void *data, const size_t len) {
-        _data = JALLOC_HELPER_MALLOC(len);
-        _len = len;
-        memcpy(_data, data, len);
-      }
-      ~KeyValue() {}
-
-      void destroy() {
-        JASSERT(_data != NULL);
-        JALLOC_HELPER_FREE(_data);
-      }
-
-      void *data() {return _data;}
-      size_t len() {return _len;}
-
-      bool operator< ( const KeyValue& that ) const {
-        if (_len == that._len) {
-          return memcmp(_data, that._data, _len) < 0;
-        }
-        return _len < that._len;
-      }
-      bool operator== ( const KeyValue& that ) const {
-        return _len == that._len && memcmp(_data, that._data, _len) == 0;
-      }
-      bool operator!= ( const KeyValue& that ) const {
-        return ! operator== ( that );
-      }
-
-    private:
-      void *_data;
-      size_t _len;
-  };
-
+  // Name service of the coordinator.  Entries live in an open-addressing hash
+  // table (linear probing, power-of-two capacity).  Keys and values are
+  // copied into a bump-allocated arena next to their header, so adding an
+  // entry normally does no allocation of its own, and reset() frees all of
+  // them one arena block at a time.
   class LookupService {
     public:
-      LookupService(){}
+      LookupService() : _table(NULL), _capacity(0), _count(0), _arena(NULL) {}
       ~LookupService() { reset(); }
       void reset();
 
-      typedef map<KeyValue, KeyValue*>::iterator keyValueMapIterator;
-
       void registerData(const UniquePid& upid, const DmtcpMessage& msg,
                         const char *data);
       void respondToQuery(const UniquePid& upid, jalib::JSocket& remote,
                           const DmtcpMessage& msg, const char *data);
+      void registerDataBulk(const UniquePid& upid, const DmtcpMessage& msg,
+                            const char *data);
+      void respondToQueryBulk(const UniquePid& upid, jalib::JSocket& remote,
+                              const DmtcpMessage& msg, const char *data);
 
       void addKeyValue(const void *key, size_t keyLen,
                        const void *val, size_t valLen);
@@ -83,7 +55,28 @@ namespace dmtcp
                         void **val, size_t *valLen);
 
     private:
-      map<KeyValue, KeyValue*> _keyValueMap;
+      // Header of an entry; the key bytes and then the value bytes follow it.
+      struct Entry {
+        size_t hash;
+        size_t keyLen;
+        size_t valLen;
+        char *key() { return (char*) (this + 1); }
+        char *val() { return key() + keyLen; }
+      };
+      struct ArenaBlock {
+        ArenaBlock *next;
+        size_t used;
+        size_t size;
+      };
+
+      void *arenaAlloc(size_t len);
+      Entry **findSlot(const void *key, size_t keyLen, size_t hash);
+      void grow();
+
+      Entry **_table;
+      size_t _capacity;
+      size_t _count;
+      ArenaBlock *_arena;
   };
 }
 #endif
@@ -67,6 +67,7 @@ static void callbackWriteCkptPrefix(int fd);
 void callbackHoldsAnyLocks(int *retval);
 void callbackPreSuspendUserThread();
 void callbackPreResumeUserThread(int isRestart);
+void callbackCkptDurable(int durable);
 
 extern "C" int dmtcp_is_ptracing() __attribute__ ((weak));
 
@@ -112,7 +113,8 @@ void dmtcp::initializeMtcpEngine()
 
   mtcp_set_dmtcp_callbacks(&callbackHoldsAnyLocks,
                            &callbackPreSuspendUserThread,
-                           &callbackPreResumeUserThread);
+                           &callbackPreResumeUserThread,
+                           &callbackCkptDurable);
 
   JTRACE ("Calling mtcp_init");
   mtcp_init(UniquePid::getCkptFilename(), 0xBadF00d, 1);
@@ -135,6 +137,11 @@ void dmtcp::shutdownMtcpEngineOnFork()
   mtcp_reset_on_fork();
 }
 
+void dmtcp::waitForLazyRestore()
+{
+  mtcp_wait_for_lazy_restore();
+}
+
 void dmtcp::killCkpthread()
 {
   mtcp_kill_ckpthread();
@@ -222,7 +229,8 @@ static void callbackPostCheckpoint(int isRestart,
    *      The current solution is to send a dummy message to coordinator here
    *      before sending a proper request.
    */
-  dmtcp::CoordinatorAPI::instance().sendCkptFilename();
+  dmtcp::CoordinatorAPI::instance().sendCkptFilename(
+    !isRestart && mtcp_ckpt_image_pending());
 
   dmtcp::DmtcpWorker::instance().waitForStage3Refill(isRestart);
 
@@ -294,6 +302,14 @@ void callbackPreResumeUserThread(int isRestart)
   syscall(DMTCP_FAKE_SYSCALL);
 }
 
+void callbackCkptDurable(int durable)
+{
+  // With forked checkpointing the worker reported CHECKPOINTED as soon as its
+  // memory was forked; the coordinator writes the restart script once every
+  // writer has reported.
+  dmtcp::CoordinatorAPI::instance().sendCkptDurable(durable);
+}
+
 void prctlGetProcessName()
 {
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,11)
@@ -30,6 +30,7 @@ namespace dmtcp
   void killCkpthread();
 
   void shutdownMtcpEngineOnFork();
+  void waitForLazyRestore();
 
   //these next two are defined in dmtcpawareapi.cpp
   void userHookTrampoline_preCkpt();
@@ -0,0 +1,246 @@
+#include <stdio.h>
+#include <string.h>
+#include <iomanip>
+#include "phase_timings.h"
+#include "../jalib/jassert.h"
+
+using namespace dmtcp;
+
+static const char *thePhaseNames[PhaseTimings::NUM_PHASES] = {
+  "suspend",
+  "leader_election",
+  "drain",
+  "checkpoint",
+  "restart",
+  "name_service",
+  "refill",
+  "resume"
+};
+
+static void now(struct timespec *t)
+{
+  JASSERT(clock_gettime(CLOCK_MONOTONIC, t) == 0) (JASSERT_ERRNO);
+}
+
+static double msSince(const struct timespec& start)
+{
+  struct timespec t;
+  now(&t);
+  return (t.tv_sec - start.tv_sec) * 1000.0 +
+         (t.tv_nsec - start.tv_nsec) / 1000000.0;
+}
+
+// The phase finished by a worker reporting this state, or -1.
+static int phaseOfState(WorkerState state, bool isRestart)
+{
+  switch (state.value()) {
+    case WorkerState::SUSPENDED:          return PhaseTimings::SUSPEND;
+    case WorkerState::FD_LEADER_ELECTION: return PhaseTimings::LEADER_ELECTION;
+    case WorkerState::DRAINED:            return PhaseTimings::DRAIN;
+    case WorkerState::CHECKPOINTED:
+      return isRestart ? PhaseTimings::RESTART : PhaseTimings::CHECKPOINT;
+#ifdef COORD_NAMESERVICE
+    case WorkerState::DONE_QUERYING:      return PhaseTimings::NAME_SERVICE;
+#endif
+    case WorkerState::REFILLED:           return PhaseTimings::REFILL;
+    case WorkerState::RUNNING:            return PhaseTimings::RESUME;
+    default:                              return -1;
+  }
+}
+
+static void writeJsonString(dmtcp::ostream& o, const dmtcp::string& s)
+{
+  o << '"';
+  for (size_t i = 0; i < s.length(); i++) {
+    unsigned char c = s[i];
+    if (c < 0x20) {
+      char buf[8];
+      snprintf(buf, sizeof(buf), "\\u%04x", c);
+      o << buf;
+      continue;
+    }
+    if (c == '"' || c == '\\') {
+      o << '\\';
+    }
+    o << s[i];
+  }
+  o << '"';
+}
+
+dmtcp::PhaseTimings::PhaseTimings()
+  : _phase(NUM_PHASES)
+{
+  _current.valid = false;
+  _last.valid = false;
+}
+
+void dmtcp::PhaseTimings::begin(const UniquePid& compGroup, bool isRestart,
+                                Phase first)
+{
+  _current.valid = true;
+  _current.isRestart = isRestart;
+  _current.compGroup = compGroup;
+  _current.ms = 0;
+  now(&_current.start);
+  for (int i = 0; i < NUM_PHASES; i++) {
+    PhaseRecord& p = _current.phases[i];
+    p.used = false;
+    p.ms = 0;
+    p.workers = 0;
+    memset(p.buckets, 0, sizeof(p.buckets));
+  }
+  beginPhase(first);
+}
+
+void dmtcp::PhaseTimings::beginCheckpoint(const UniquePid& compGroup)
+{
+  begin(compGroup, false, SUSPEND);
+}
+
+void dmtcp::PhaseTimings::beginRestart(const UniquePid& compGroup)
+{
+  begin(compGroup, true, RESTART);
+}
+
+void dmtcp::PhaseTimings::beginPhase(Phase phase)
+{
+  if (!_current.valid) {
+    return;
+  }
+  _phase = phase;
+  _current.phases[phase].used = true;
+  now(&_current.phases[phase].start);
+}
+
+void dmtcp::PhaseTimings::workerReported(WorkerState state,
+                                         const UniquePid& worker,
+                                         const dmtcp::string& hostname)
+{
+  if (!_current.valid || phaseOfState(state, _current.isRestart) != _phase) {
+    return;
+  }
+  PhaseRecord& p = _current.phases[_phase];
+  double ms = msSince(p.start);
+
+  int bucket = 0;
+  while (bucket < NUM_BUCKETS - 1 && ms >= (double) (1 << bucket)) {
+    bucket++;
+  }
+  p.buckets[bucket]++;
+
+  // Reports arrive in order of latency, so the last ones are the slowest.
+  Straggler& s = p.stragglers[p.workers % NUM_STRAGGLERS];
+  s.worker = worker;
+  s.hostname = hostname;
+  s.ms = ms;
+  p.ms = ms;
+  p.workers++;
+}
+
+void dmtcp::PhaseTimings::finish(const char *dir)
+{
+  if (!_current.valid) {
+    return;
+  }
+  _current.ms = msSince(_current.start);
+  _phase = NUM_PHASES;
+
+  dmtcp::ostringstream name;
+  name << dir << "/dmtcp_timings_" << _current.compGroup << "_"
+       << std::setw(5) << std::setfill('0') << _current.compGroup.generation()
+       << ".json";
+  dmtcp::ostringstream json;
+  writeGeneration(json, _current, false);
+  json << '\n';
+
+  FILE *fp = fopen(name.str().c_str(), "w");
+  JWARNING(fp != NULL) (name.str()) (JASSERT_ERRNO)
+    .Text("failed to write checkpoint timings");
+  if (fp != NULL) {
+    fputs(json.str().c_str(), fp);
+    fclose(fp);
+  }
+  JNOTE("phase timings written") (_current.isRestart) (_current.ms)
+    (name.str());
+
+  _last = _current;
+  _current.valid = false;
+}
+
+void dmtcp::PhaseTimings::writeGeneration(dmtcp::ostream& o,
+                                          const Generation& g,
+                                          bool inProgress) const
+{
+  o << std::fixed << std::setprecision(3);
+  o << "{\"computation\": \"" << g.compGroup << "\""
+    << ", \"generation\": " << g.compGroup.generation()
+    << ", \"type\": \"" << (g.isRestart ? "restart" : "checkpoint") << "\"";
+  if (inProgress) {
+    o << ", \"elapsed_ms\": " << msSince(g.start)
+      << ", \"phase\": \"" << thePhaseNames[_phase] << "\"";
+  } else {
+    o << ", \"total_ms\": " << g.ms;
+  }
+  o << ", \"phases\": [";
+
+  bool first = true;
+  for (int i = 0; i < NUM_PHASES; i++) {
+    const PhaseRecord& p = g.phases[i];
+    if (!p.used) {
+      continue;
+    }
+    o << (first ? "" : ",") << "\n  {\"name\": \"" << thePhaseNames[i] << "\""
+      << ", \"ms\": " << p.ms
+      << ", \"workers\": " << p.workers;
+
+    o << ", \"histogram\": [";
+    bool firstBucket = true;
+    for (int b = 0; b < NUM_BUCKETS; b++) {
+      if (p.buckets[b] == 0) {
+        continue;
+      }
+      o << (firstBucket ? "" : ", ") << "{\"lt_ms\": ";
+      if (b == NUM_BUCKETS - 1) {
+        o << "null";
+      } else {
+        o << (1 << b);
+      }
+      o << ", \"count\": " << p.buckets[b] << "}";
+      firstBucket = false;
+    }
+
+    // Slowest first.
+    o << "], \"stragglers\": [";
+    int n = p.workers < NUM_STRAGGLERS ? p.workers : NUM_STRAGGLERS;
+    for (int k = 1; k <= n; k++) {
+      const Straggler& s =
+        p.stragglers[(p.workers - k) % NUM_STRAGGLERS];
+      o << (k == 1 ? "" : ", ") << "{\"worker\": \"" << s.worker << "\""
+        << ", \"host\": ";
+      writeJsonString(o, s.hostname);
+      o << ", \"ms\": " << s.ms << "}";
+    }
+    o << "]}";
+    first = false;
+  }
+  o << "]}";
+}
+
+dmtcp::string dmtcp::PhaseTimings::report() const
+{
+  dmtcp::ostringstream o;
+  o << "{\"last\": ";
+  if (_last.valid) {
+    writeGeneration(o, _last, false);
+  } else {
+    o << "null";
+  }
+  o << ",\n\"in_progress\": ";
+  if (_current.valid) {
+    writeGeneration(o, _current, true);
+  } else {
+    o << "null";
+  }
+  o << "}\n";
+  return o.str();
+}
@@ -0,0 +1,100 @@
+/****************************************************************************
+ *   Copyright (C) 2006-2010 by Jason Ansel, Kapil Arya, and Gene Cooperman *
+ *   jansel@csail.mit.edu, kapil@ccs.neu.edu, gene@ccs.neu.edu              *
+ *                                                                          *
+ *   This file is part of the dmtcp/src module of DMTCP (DMTCP:dmtcp/src).  *
+ *                                                                          *
+ *  DMTCP:dmtcp/src is free software: you can redistribute it and/or        *
+ *  modify it under the terms of the GNU Lesser General Public License as   *
+ *  published by the Free Software Foundation, either version 3 of the      *
+ *  License, or (at your option) any later version.                         *
+ *                                                                          *
+ *  DMTCP:dmtcp/src is distributed in the hope that it will be useful,      *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of          *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the           *
+ *  GNU Lesser General Public License for more details.                     *
+ *                                                                          *
+ *  You should have received a copy of the GNU Lesser General Public        *
+ *  License along with DMTCP:dmtcp/src.  If not, see                        *
+ *  <http://www.gnu.org/licenses/>.                                         *
+ ****************************************************************************/
+
+#ifndef PHASE_TIMINGS_H
+#define PHASE_TIMINGS_H
+
+#include <time.h>
+#include "dmtcpalloc.h"
+#include "dmtcpmessagetypes.h"
+#include "uniquepid.h"
+
+namespace dmtcp
+{
+  // Timing of the phases of one checkpoint or restart, as the coordinator
+  // sees them.  A phase begins when the coordinator broadcasts the message
+  // that starts it and ends when the last worker reports the state that
+  // finishes it.  For each phase we keep a histogram of the workers'
+  // latencies and the last few workers to report (the stragglers).  A relay
+  // counts as one worker, reporting when the slowest worker behind it does.
+  class PhaseTimings {
+    public:
+      enum Phase {
+        SUSPEND,
+        LEADER_ELECTION,
+        DRAIN,
+        CHECKPOINT,     // writing the checkpoint images
+        RESTART,        // first dmtcp_restart until all images are restored
+        NAME_SERVICE,
+        REFILL,
+        RESUME,
+        NUM_PHASES
+      };
+      // Latency buckets [0,1ms), [1,2ms), [2,4ms), ...; the last is open.
+      enum { NUM_BUCKETS = 20, NUM_STRAGGLERS = 5 };
+
+      PhaseTimings();
+
+      void beginCheckpoint(const UniquePid& compGroup);
+      void beginRestart(const UniquePid& compGroup);
+      void beginPhase(Phase phase);
+      void workerReported(WorkerState state, const UniquePid& worker,
+                          const dmtcp::string& hostname);
+      // All workers are running again.  Writes the report of this generation
+      // to a JSON file in dir.
+      void finish(const char *dir);
+
+      // JSON with the last finished generation and the one in progress.
+      dmtcp::string report() const;
+
+    private:
+      struct Straggler {
+        UniquePid worker;
+        dmtcp::string hostname;
+        double ms;
+      };
+      struct PhaseRecord {
+        bool used;
+        struct timespec start;
+        double ms;              // latency of the last worker to report
+        int workers;
+        int buckets[NUM_BUCKETS];
+        Straggler stragglers[NUM_STRAGGLERS];   // ring of the last reports
+      };
+      struct Generation {
+        bool valid;
+        bool isRestart;
+        UniquePid compGroup;
+        struct timespec start;
+        double ms;
+        PhaseRecord phases[NUM_PHASES];
+      };
+
+      void begin(const UniquePid& compGroup, bool isRestart, Phase first);
+      void writeGeneration(dmtcp::ostream& o, const Generation& g,
+                           bool inProgress) const;
+
+      Generation _current;
+      Generation _last;
+      int _phase;               // phase in progress, or NUM_PHASES
+  };
+}
+#endif
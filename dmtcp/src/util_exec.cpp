@@ -397,13 +397,28 @@ void dmtcp::Util::runMtcpRestore(const char* path)
   char protected_stderr_fd_str[16];
   sprintf(protected_stderr_fd_str, "%d", PROTECTED_STDERR_FD);
 
-  char* newArgs[] = {
+  char* newArgs[9] = {
     (char*) mtcprestart.c_str(),
     (char*) "--stderr-fd",
     protected_stderr_fd_str,
-    (char*) path,
     NULL
   };
+  int n = 3;
+  const char *lazy = getenv(ENV_VAR_LAZY_RESTORE);
+  if (lazy != NULL && strcmp(lazy, "0") != 0) {
+    newArgs[n++] = (char*) "--lazy";
+  }
+  const char *fast = getenv(ENV_VAR_FAST_RESTART);
+  if (fast != NULL && strcmp(fast, "0") != 0) {
+    newArgs[n++] = (char*) "--fast-restart";
+  }
+  const char *threads = getenv(ENV_VAR_RESTORE_THREADS);
+  if (threads != NULL && atoi(threads) > 1) {
+    newArgs[n++] = (char*) "--restore-threads";
+    newArgs[n++] = (char*) threads;
+  }
+  newArgs[n++] = (char*) path;
+  newArgs[n] = NULL;
   JTRACE ("launching mtcp_restart") (path);
   _real_execv(newArgs[0], newArgs);
   JASSERT(false) (newArgs[0]) (newArgs[1]) (JASSERT_ERRNO)
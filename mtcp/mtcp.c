@@ -369,6 +369,7 @@ static void (*callback_pre_ckpt)() = NULL;
 static void (*callback_post_ckpt)(int is_restarting, char* argv_start) = NULL;
 int  (*mtcp_callback_ckpt_fd)(int fd) = NULL;
 void (*mtcp_callback_write_ckpt_header)(int fd) = NULL;
+void (*mtcp_callback_ckpt_durable)(int durable) = NULL;
 
 static void (*callback_holds_any_locks)(int *retval) = NULL;
 static void (*callback_pre_suspend_user_thread)() = NULL;
@@ -527,9 +528,12 @@ void mtcp_init (char const *checkpointfilename,
     mtcp_abort ();
   }
 
-  if (((PROT_READ|PROT_WRITE|PROT_EXEC)&MTCP_PROT_ZERO_PAGE) != 0) {
-    MTCP_PRINTF("ERROR: PROT_READ|PROT_WRITE|PROT_EXEC and MTCP_PROT_ZERO_PAGE "
-                "shouldn't overlap\n");
+  if (((PROT_READ|PROT_WRITE|PROT_EXEC) &
+       (MTCP_PROT_ZERO_PAGE|MTCP_PROT_COMPRESSED|MTCP_PROT_PARENT_PAGE|
+        MTCP_PROT_CHUNKS)) != 0) {
+    MTCP_PRINTF("ERROR: PROT_READ|PROT_WRITE|PROT_EXEC and MTCP_PROT_ZERO_PAGE/"
+                "MTCP_PROT_COMPRESSED/MTCP_PROT_PARENT_PAGE/MTCP_PROT_CHUNKS"
+                " shouldn't overlap\n");
     mtcp_abort();
   }
 
@@ -726,13 +730,20 @@ void mtcp_set_callbacks(void (*sleep_between_ckpt)(int sec),
   mtcp_callback_write_ckpt_header = write_ckpt_header;
 }
 
+/* ckpt_durable:  With forked checkpointing, called in the child process that
+ *                 writes the image once it is done; durable is 1 if the
+ *                 image is complete on disk, and 0 if that failed or is not
+ *                 known.
+ */
 void mtcp_set_dmtcp_callbacks(void (*holds_any_locks)(int *retval),
                               void (*pre_suspend_user_thread)(),
-                              void (*pre_resume_user_thread)(int is_restart))
+                              void (*pre_resume_user_thread)(int is_restart),
+                              void (*ckpt_durable)(int durable))
 {
   callback_holds_any_locks = holds_any_locks;
   callback_pre_suspend_user_thread = pre_suspend_user_thread;
   callback_pre_resume_user_thread = pre_resume_user_thread;
+  mtcp_callback_ckpt_durable = ckpt_durable;
 }
 
 /*************************************************************************
@@ -1758,6 +1769,9 @@ static void *checkpointhread (void *dummy)
         DPRINTF("after callback_sleep_between_ckpt(%d)\n",intervalsecs);
     }
 
+    /* After a lazy restart, memory must be complete before it is saved. */
+    mtcp_wait_for_lazy_restore();
+
     mtcp_sys_gettimeofday (&started, NULL);
     checkpointsize = 0;
 
@@ -2715,8 +2729,8 @@ static int is_thread_locked (void)
 
 #define STRINGS_LEN 10000
 static char UNUSED_IN_64_BIT STRINGS[STRINGS_LEN];
-static int should_mmap_ckpt_image = 0;
-void mtcp_restore_start (int fd, int verify, int mmap_ckpt_image,
+static int restore_flags = 0;
+void mtcp_restore_start (int fd, int verify, int flags,
                          pid_t gzip_child_pid,
                          char *ckpt_newname, char *cmd_file,
                          char *argv[], char *envp[] )
@@ -2725,7 +2739,11 @@ void mtcp_restore_start (int fd, int verify, int mmap_ckpt_image,
   int i;
   char *strings = STRINGS;
 #endif
-  should_mmap_ckpt_image = mmap_ckpt_image;
+  restore_flags = flags;
+  if (verify) {
+    /* Verifying the image means reading all of it now. */
+    restore_flags &= ~MTCP_RESTORE_LAZY;
+  }
 
   DEBUG_RESTARTING = 1;
   /* If we just replace extendedStack by (tempstack+STACKSIZE) in "asm"
@@ -2809,7 +2827,7 @@ void mtcp_restore_start (int fd, int verify, int mmap_ckpt_image,
    */
 
   /* This should never return */
-  mtcp_restoreverything(should_mmap_ckpt_image, (void*)mtcp_finishrestore);
+  mtcp_restoreverything(restore_flags, (void*)mtcp_finishrestore);
   mtcp_abort();
 }
 
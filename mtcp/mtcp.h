@@ -44,6 +44,7 @@ void mtcp_init(char const *checkpointfilename,
                int interval,
                int clonenabledefault);
 void mtcp_reset_on_fork();
+void mtcp_wait_for_lazy_restore();
 int mtcp_ok (void);
 int mtcp_no (void);
 
@@ -56,7 +57,10 @@ void mtcp_set_callbacks(void (*sleep_between_ckpt)(int sec),
 
 void mtcp_set_dmtcp_callbacks(void (*holds_any_locks)(int *retval),
                               void (*pre_suspend_user_thread)(),
-                              void (*pre_resume_user_thread)(int is_restart));
+                              void (*pre_resume_user_thread)(int is_restart),
+                              void (*ckpt_durable)(int durable));
+/* 1 if the last checkpoint image is still being written by a forked child */
+int mtcp_ckpt_image_pending(void);
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,403 @@
+/*****************************************************************************
+ *   Copyright (C) 2006-2013 by Michael Rieker, Jason Ansel, Kapil Arya, and *
+ *                                                            Gene Cooperman *
+ *   mrieker@nii.net, jansel@csail.mit.edu, kapil@ccs.neu.edu, and           *
+ *                                                          gene@ccs.neu.edu *
+ *                                                                           *
+ *   This file is part of the MTCP module of DMTCP (DMTCP:mtcp).             *
+ *                                                                           *
+ *  DMTCP:mtcp is free software: you can redistribute it and/or              *
+ *  modify it under the terms of the GNU Lesser General Public License as    *
+ *  published by the Free Software Foundation, either version 3 of the       *
+ *  License, or (at your option) any later version.                          *
+ *                                                                           *
+ *  DMTCP:dmtcp/src is distributed in the hope that it will be useful,       *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of           *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the            *
+ *  GNU Lesser General Public License for more details.                      *
+ *                                                                           *
+ *  You should have received a copy of the GNU Lesser General Public         *
+ *  License along with DMTCP:dmtcp/src.  If not, see                         *
+ *  <http://www.gnu.org/licenses/>.                                          *
+ *****************************************************************************/
+
+/*****************************************************************************
+ *
+ *  Content-addressed chunk store (MTCP_CHUNK_STORE=1).
+ *
+ *  The contents of an area with MTCP_PROT_CHUNKS are cut into chunks of
+ *  MTCP_CHUNK_SIZE bytes from the start of the area, and the image holds
+ *  one MtcpChunkRef per chunk instead of its bytes.  The chunk itself is
+ *  the file mtcp_chunks/xx/yyyy... in the directory of the image, named by
+ *  the 128-bit mtcp_chunk_hash() of its contents in hex.  All processes
+ *  that checkpoint into the same directory share the store, so identical
+ *  library data and heaps are stored once per node and not once per
+ *  process, and chunks that did not change are not written again by the
+ *  next checkpoint.  Storing a chunk that is there already updates its
+ *  modification time instead; the checkpoint writer removes the chunks that
+ *  no image of the current generation used (see collect_chunk_garbage() in
+ *  mtcp_writeckpt.c).
+ *
+ *  A chunk file is a MtcpCompressBlockHdr followed by the stored bytes, in
+ *  the LZ4 block format if the image is compressed and the chunk shrinks.
+ *  It is written under a temporary name, synced, and renamed into place, so
+ *  that a file under its final name is complete.  Processes that store the
+ *  same chunk at once write the same bytes, and the last rename wins.  The
+ *  writer syncs the directory too (mtcp_sync_chunk_dir()) before it writes
+ *  a reference to the chunk.
+ *
+ *  mtcp_chunk_hash() is XXH64 with two seeds, computed in one pass.  It is
+ *  not cryptographic:  the store trusts the processes writing into it.
+ *
+ *  The writer side runs on the helper threads and the reader side inside
+ *  mtcp_restoreverything():  no libc.
+ *
+ *****************************************************************************/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <sys/mman.h>
+
+#include "mtcp_internal.h"
+#include "mtcp_util.h"
+
+#define PRIME64_1 0x9E3779B185EBCA87ULL
+#define PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define PRIME64_3 0x165667B19E3779F9ULL
+#define PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define PRIME64_5 0x27D4EB2F165667C5ULL
+#define SEED_0 0
+#define SEED_1 PRIME64_3
+
+#define REFS_PER_READ 64
+
+typedef struct { uint32_t v; } __attribute__ ((packed)) unaligned_u32;
+typedef struct { uint64_t v; } __attribute__ ((packed)) unaligned_u64;
+
+static inline uint32_t read32(const unsigned char *p)
+{
+  return ((const unaligned_u32 *) p)->v;
+}
+
+static inline uint64_t read64(const unsigned char *p)
+{
+  return ((const unaligned_u64 *) p)->v;
+}
+
+static inline uint64_t rotl64(uint64_t x, int r)
+{
+  return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t round64(uint64_t acc, uint64_t input)
+{
+  return rotl64(acc + input * PRIME64_2, 31) * PRIME64_1;
+}
+
+static inline uint64_t merge64(uint64_t h, uint64_t v)
+{
+  return (h ^ round64(0, v)) * PRIME64_1 + PRIME64_4;
+}
+
+static void init_lanes(uint64_t v[4], uint64_t seed)
+{
+  v[0] = seed + PRIME64_1 + PRIME64_2;
+  v[1] = seed + PRIME64_2;
+  v[2] = seed;
+  v[3] = seed - PRIME64_1;
+}
+
+/* Finish XXH64 of size bytes:  v are the lanes after the 32-byte stripes,
+ * and p the rem bytes left over.
+ */
+static uint64_t finish64(const uint64_t v[4], uint64_t seed, size_t size,
+                         const unsigned char *p, size_t rem)
+{
+  uint64_t h;
+
+  if (size >= 32) {
+    h = rotl64(v[0], 1) + rotl64(v[1], 7) + rotl64(v[2], 12) +
+        rotl64(v[3], 18);
+    h = merge64(merge64(merge64(merge64(h, v[0]), v[1]), v[2]), v[3]);
+  } else {
+    h = seed + PRIME64_5;
+  }
+  h += size;
+
+  for (; rem >= 8; p += 8, rem -= 8) {
+    h = rotl64(h ^ round64(0, read64(p)), 27) * PRIME64_1 + PRIME64_4;
+  }
+  if (rem >= 4) {
+    h = rotl64(h ^ (read32(p) * PRIME64_1), 23) * PRIME64_2 + PRIME64_3;
+    p += 4;
+    rem -= 4;
+  }
+  for (; rem > 0; p++, rem--) {
+    h = rotl64(h ^ (*p * PRIME64_5), 11) * PRIME64_1;
+  }
+
+  h = (h ^ (h >> 33)) * PRIME64_2;
+  h = (h ^ (h >> 29)) * PRIME64_3;
+  return h ^ (h >> 32);
+}
+
+__attribute__ ((visibility ("hidden")))
+void mtcp_chunk_hash(const void *buf, size_t size, uint64_t hash[2])
+{
+  const unsigned char *p = (const unsigned char *) buf;
+  size_t rem = size;
+  uint64_t v[4], w[4];
+
+  init_lanes(v, SEED_0);
+  init_lanes(w, SEED_1);
+  for (; rem >= 32; p += 32, rem -= 32) {
+    uint64_t a = read64(p), b = read64(p + 8);
+    uint64_t c = read64(p + 16), d = read64(p + 24);
+    v[0] = round64(v[0], a);
+    w[0] = round64(w[0], a);
+    v[1] = round64(v[1], b);
+    w[1] = round64(w[1], b);
+    v[2] = round64(v[2], c);
+    w[2] = round64(w[2], c);
+    v[3] = round64(v[3], d);
+    w[3] = round64(w[3], d);
+  }
+  hash[0] = finish64(v, SEED_0, size, p, rem);
+  hash[1] = finish64(w, SEED_1, size, p, rem);
+}
+
+/* name gets MTCP_CHUNK_NAME_SIZE bytes:  the hash in hex, with a '/' after
+ * the first byte.
+ */
+__attribute__ ((visibility ("hidden")))
+void mtcp_chunk_name(char *name, const uint64_t hash[2])
+{
+  static const char hex[] = "0123456789abcdef";
+  int i, n = 0;
+
+  for (i = 0; i < 32; i++) {
+    name[n++] = hex[(hash[i / 16] >> (60 - 4 * (i % 16))) & 0xf];
+    if (i == 1) {
+      name[n++] = '/';
+    }
+  }
+  name[n] = '\0';
+}
+
+/* path gets PATH_MAX bytes:  the file of the chunk in store (which ends in
+ * '/'), then suffix.  Returns -1 if that is too long.
+ */
+static int chunk_path(char *path, const char *store, const MtcpChunkRef *ref,
+                      const char *suffix)
+{
+  size_t len = mtcp_strlen(store);
+
+  if (len + MTCP_CHUNK_NAME_SIZE + mtcp_strlen(suffix) > PATH_MAX) {
+    return -1;
+  }
+  mtcp_strncpy(path, store, PATH_MAX);
+  mtcp_chunk_name(path + len, ref->hash);
+  mtcp_strncat(path, suffix, mtcp_strlen(suffix) + 1);
+  return 0;
+}
+
+static long write_all_raw(int fd, const void *buf, size_t size)
+{
+  const char *p = (const char *) buf;
+
+  while (size > 0) {
+    long rc = mtcp_sys_write_raw(fd, p, size);
+    if (rc == -EINTR) {
+      continue;
+    }
+    if (rc <= 0) {
+      return rc == 0 ? -EIO : rc;
+    }
+    p += rc;
+    size -= rc;
+  }
+  return 0;
+}
+
+/* Put the size bytes at buf into store, unless a chunk with the same
+ * contents is there already, and fill in ref.  tmp_suffix makes the name
+ * of the temporary file unique to the caller.  If compress_buf (of
+ * MTCP_CHUNK_SIZE bytes) and scratch are given, a new chunk is compressed.
+ * Returns 1 if the chunk was written, 0 if it was there, or else -errno.
+ * Runs on the helper threads:  raw syscalls only.
+ */
+__attribute__ ((visibility ("hidden")))
+int mtcp_store_chunk(const char *store, const char *tmp_suffix,
+                     const void *buf, size_t size, MtcpChunkRef *ref,
+                     void *compress_buf, void *scratch)
+{
+  char path[PATH_MAX];
+  char tmp[PATH_MAX];
+  MtcpCompressBlockHdr hdr;
+  const void *stored = buf;
+  long fd, rc;
+
+  mtcp_chunk_hash(buf, size, ref->hash);
+  ref->raw_size = size;
+  ref->padding = 0;
+  if (chunk_path(path, store, ref, "") == -1 ||
+      chunk_path(tmp, store, ref, tmp_suffix) == -1) {
+    return -ENAMETOOLONG;
+  }
+  /* There already:  mark it as used by this generation. */
+  if (mtcp_sys_utimensat_raw(AT_FDCWD, path, NULL, 0) == 0) {
+    return 0;
+  }
+
+  hdr.raw_size = size;
+  hdr.stored_size = size;
+  if (compress_buf != NULL) {
+    size_t n = mtcp_compress_block(buf, size, compress_buf, size - 1, scratch);
+    if (n > 0) {
+      hdr.stored_size = n;
+      stored = compress_buf;
+    }
+  }
+
+  fd = mtcp_sys_open_raw(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+  if (fd < 0) {
+    return fd;
+  }
+  rc = write_all_raw(fd, &hdr, sizeof(hdr));
+  if (rc == 0) {
+    rc = write_all_raw(fd, stored, hdr.stored_size);
+  }
+  if (rc == 0) {
+    rc = mtcp_sys_fsync_raw(fd);
+  }
+  mtcp_sys_close_raw(fd);
+  if (rc == 0) {
+    rc = mtcp_sys_rename_raw(tmp, path);
+  }
+  if (rc < 0) {
+    mtcp_sys_unlink_raw(tmp);
+    return rc;
+  }
+  return 1;
+}
+
+/* Sync the subdirectory of store that holds the chunks whose hash starts
+ * with the byte first_byte, after mtcp_store_chunk() wrote some.  Returns 0
+ * or -errno.  Runs on the helper threads.
+ */
+__attribute__ ((visibility ("hidden")))
+int mtcp_sync_chunk_dir(const char *store, int first_byte)
+{
+  static const char hex[] = "0123456789abcdef";
+  char path[PATH_MAX];
+  size_t len = mtcp_strlen(store);
+  long fd, rc;
+
+  if (len + 3 > sizeof(path)) {
+    return -ENAMETOOLONG;
+  }
+  mtcp_strncpy(path, store, sizeof(path));
+  path[len] = hex[(first_byte >> 4) & 0xf];
+  path[len + 1] = hex[first_byte & 0xf];
+  path[len + 2] = '\0';
+  fd = mtcp_sys_open_raw(path, O_RDONLY | O_DIRECTORY, 0);
+  if (fd < 0) {
+    return fd;
+  }
+  rc = mtcp_sys_fsync_raw(fd);
+  mtcp_sys_close_raw(fd);
+  return rc;
+}
+
+/* Read the chunk of ref from store into dst.  scratch (MTCP_CHUNK_SIZE
+ * bytes) holds a compressed chunk.
+ */
+__attribute__ ((visibility ("hidden")))
+void mtcp_read_chunk(const char *store, const MtcpChunkRef *ref,
+                     void *dst, void *scratch)
+{
+  static char path[PATH_MAX];
+  MtcpCompressBlockHdr hdr;
+  int fd;
+
+  if (chunk_path(path, store, ref, "") == -1) {
+    MTCP_PRINTF("chunk store name too long: %s\n", store);
+    mtcp_abort();
+  }
+  fd = mtcp_sys_open2(path, O_RDONLY);
+  if (fd < 0) {
+    MTCP_PRINTF("error %d opening chunk %s\n", mtcp_sys_errno, path);
+    mtcp_abort();
+  }
+  mtcp_readfile(fd, &hdr, sizeof(hdr));
+  if (hdr.raw_size != ref->raw_size || hdr.stored_size == 0 ||
+      hdr.stored_size > hdr.raw_size) {
+    MTCP_PRINTF("corrupt chunk %s (%u/%u bytes)\n",
+                path, hdr.stored_size, hdr.raw_size);
+    mtcp_abort();
+  }
+  if (hdr.stored_size == hdr.raw_size) {
+    mtcp_readfile(fd, dst, hdr.raw_size);
+  } else {
+    mtcp_readfile(fd, scratch, hdr.stored_size);
+    if (mtcp_decompress_block(scratch, hdr.stored_size,
+                              dst, hdr.raw_size) == -1) {
+      MTCP_PRINTF("corrupt compressed chunk %s\n", path);
+      mtcp_abort();
+    }
+  }
+  mtcp_sys_close(fd);
+}
+
+/* Bytes of MtcpChunkRef in the image for size bytes of contents */
+__attribute__ ((visibility ("hidden")))
+size_t mtcp_chunk_refs_size(size_t size)
+{
+  return (size + MTCP_CHUNK_SIZE - 1) / MTCP_CHUNK_SIZE * sizeof(MtcpChunkRef);
+}
+
+/* Read size bytes of contents into buf:  the chunk references from fd, and
+ * the chunks from the store next to the image open on fd.
+ */
+__attribute__ ((visibility ("hidden")))
+void mtcp_readfile_chunks(int fd, void *buf, size_t size)
+{
+  static char store[PATH_MAX];
+  static MtcpChunkRef refs[REFS_PER_READ];
+  char *scratch;
+  size_t off = 0;
+
+  mtcp_get_image_dir(fd, store, sizeof(store) - sizeof(MTCP_CHUNK_STORE_DIR));
+  mtcp_strncat(store, MTCP_CHUNK_STORE_DIR "/",
+               sizeof(MTCP_CHUNK_STORE_DIR "/"));
+  scratch = mtcp_sys_mmap(NULL, MTCP_CHUNK_SIZE, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (scratch == MAP_FAILED) {
+    MTCP_PRINTF("error %d allocating a chunk buffer\n", mtcp_sys_errno);
+    mtcp_abort();
+  }
+
+  while (off < size) {
+    size_t i, n = MIN(mtcp_chunk_refs_size(size - off) / sizeof(refs[0]),
+                      REFS_PER_READ);
+    mtcp_readfile(fd, refs, n * sizeof(refs[0]));
+    for (i = 0; i < n; i++) {
+      if (refs[i].raw_size != MIN(MTCP_CHUNK_SIZE, size - off)) {
+        MTCP_PRINTF("corrupt chunk reference at %p\n", (char *) buf + off);
+        mtcp_abort();
+      }
+      mtcp_read_chunk(store, &refs[i], (char *) buf + off, scratch);
+      off += refs[i].raw_size;
+    }
+  }
+
+  /* Out of the way of the next areas to be mapped */
+  mtcp_sys_munmap(scratch, MTCP_CHUNK_SIZE);
+}
+
+__attribute__ ((visibility ("hidden")))
+void mtcp_skipfile_chunks(int fd, size_t size)
+{
+  mtcp_skipfile(fd, mtcp_chunk_refs_size(size));
+}
@@ -0,0 +1,392 @@
+/*****************************************************************************
+ *   Copyright (C) 2006-2013 by Michael Rieker, Jason Ansel, Kapil Arya, and *
+ *                                                            Gene Cooperman *
+ *   mrieker@nii.net, jansel@csail.mit.edu, kapil@ccs.neu.edu, and           *
+ *                                                          gene@ccs.neu.edu *
+ *                                                                           *
+ *   This file is part of the MTCP module of DMTCP (DMTCP:mtcp).             *
+ *                                                                           *
+ *  DMTCP:mtcp is free software: you can redistribute it and/or              *
+ *  modify it under the terms of the GNU Lesser General Public License as    *
+ *  published by the Free Software Foundation, either version 3 of the       *
+ *  License, or (at your option) any later version.                          *
+ *                                                                           *
+ *  DMTCP:dmtcp/src is distributed in the hope that it will be useful,       *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of           *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the            *
+ *  GNU Lesser General Public License for more details.                      *
+ *                                                                           *
+ *  You should have received a copy of the GNU Lesser General Public         *
+ *  License along with DMTCP:dmtcp/src.  If not, see                         *
+ *  <http://www.gnu.org/licenses/>.                                          *
+ *****************************************************************************/
+
+/*****************************************************************************
+ *
+ *  In-process compression of memory areas (DMTCP_GZIP=1).
+ *
+ *  Blocks are compressed in the LZ4 block format:  a sequence of
+ *  (token, literals, 16-bit offset, match length) with no entropy coding,
+ *  which is fast enough to keep up with a disk.  The decompressor runs
+ *  inside mtcp_restoreverything(), so nothing here may call libc.  This file
+ *  is compiled with -fno-tree-loop-distribute-patterns, so that gcc does not
+ *  replace the copy loops by calls to memcpy().
+ *
+ *  The contents of an area with MTCP_PROT_COMPRESSED are a sequence of
+ *  blocks, each a MtcpCompressBlockHdr followed by stored_size bytes.  If
+ *  stored_size == raw_size, the block did not compress and is stored raw.
+ *  The raw sizes add up to area.size.
+ *
+ *  mtcp_checksum() is the checksum of the blocks in the area index.
+ *
+ *****************************************************************************/
+
+#include <stdint.h>
+#include <sys/mman.h>
+
+#include "mtcp_internal.h"
+#include "mtcp_util.h"
+
+#define MIN_MATCH 4
+#define LAST_LITERALS 5   /* The last 5 bytes are always literals */
+#define MF_LIMIT 12       /* The last match starts 12 bytes before the end */
+#define MAX_OFFSET 65535
+#define HASH_LOG 14
+#define SKIP_TRIGGER 6    /* Go faster through incompressible data */
+
+typedef struct { uint32_t v; } __attribute__ ((packed)) unaligned_u32;
+typedef struct { uint64_t v; } __attribute__ ((packed)) unaligned_u64;
+
+static inline uint32_t read32(const unsigned char *p)
+{
+  return ((const unaligned_u32 *) p)->v;
+}
+
+static inline uint64_t read64(const unsigned char *p)
+{
+  return ((const unaligned_u64 *) p)->v;
+}
+
+static inline void write64(unsigned char *p, uint64_t v)
+{
+  ((unaligned_u64 *) p)->v = v;
+}
+
+static inline uint32_t hash32(uint32_t v)
+{
+  return (v * 2654435761U) >> (32 - HASH_LOG);
+}
+
+/* Also correct for overlapping match copies, as long as s + 8 <= d. */
+static inline void copy_bytes(unsigned char *d, const unsigned char *s,
+                              size_t n)
+{
+  while (n >= 8) {
+    write64(d, read64(s));
+    d += 8;
+    s += 8;
+    n -= 8;
+  }
+  while (n-- > 0) {
+    *d++ = *s++;
+  }
+}
+
+static inline unsigned char *write_length(unsigned char *op, size_t len)
+{
+  while (len >= 255) {
+    *op++ = 255;
+    len -= 255;
+  }
+  *op++ = (unsigned char) len;
+  return op;
+}
+
+/* Compress size bytes at src into dst, of which at most dst_size bytes
+ * may be used.  scratch must hold MTCP_COMPRESS_SCRATCH_SIZE bytes.
+ * Returns the compressed size, or 0 if the result would not fit:  the
+ * caller then stores the block raw.  size must be at most
+ * MTCP_COMPRESS_BLOCK_SIZE.
+ */
+__attribute__ ((visibility ("hidden")))
+size_t mtcp_compress_block(const void *src, size_t size,
+                           void *dst, size_t dst_size, void *scratch)
+{
+  uint32_t *table = (uint32_t *) scratch;
+  const unsigned char *base = (const unsigned char *) src;
+  const unsigned char *ip = base;
+  const unsigned char *anchor = base;
+  const unsigned char *iend = base + size;
+  const unsigned char *mflimit = iend - MF_LIMIT;
+  const unsigned char *matchlimit = iend - LAST_LITERALS;
+  unsigned char *op = (unsigned char *) dst;
+  unsigned char *oend = op + dst_size;
+  size_t lit_len;
+  size_t i;
+
+  for (i = 0; i < (1 << HASH_LOG); i++) {
+    table[i] = 0;
+  }
+
+  if (size < MF_LIMIT + 1) {
+    goto last_literals;
+  }
+
+  ip++;
+  while (ip < mflimit) {
+    const unsigned char *match;
+    unsigned char *token;
+    unsigned int attempts = 1 << SKIP_TRIGGER;
+    size_t match_len;
+    uint32_t h;
+
+    /* Find a match: candidates come from the hash of the next 4 bytes. */
+    while (1) {
+      h = hash32(read32(ip));
+      match = base + table[h];
+      table[h] = (uint32_t) (ip - base);
+      if (ip - match <= MAX_OFFSET && read32(match) == read32(ip)) {
+        break;
+      }
+      ip += attempts++ >> SKIP_TRIGGER;
+      if (ip >= mflimit) {
+        goto last_literals;
+      }
+    }
+
+    while (ip > anchor && match > base && ip[-1] == match[-1]) {
+      ip--;
+      match--;
+    }
+    match_len = MIN_MATCH;
+    while (ip + match_len + 8 <= matchlimit &&
+           read64(ip + match_len) == read64(match + match_len)) {
+      match_len += 8;
+    }
+    while (ip + match_len < matchlimit && ip[match_len] == match[match_len]) {
+      match_len++;
+    }
+
+    lit_len = ip - anchor;
+    if (op + 1 + lit_len + lit_len / 255 + 1 + 2 +
+        (match_len - MIN_MATCH) / 255 + 1 > oend) {
+      return 0;
+    }
+    token = op++;
+    if (lit_len >= 15) {
+      *token = 15 << 4;
+      op = write_length(op, lit_len - 15);
+    } else {
+      *token = (unsigned char) (lit_len << 4);
+    }
+    copy_bytes(op, anchor, lit_len);
+    op += lit_len;
+
+    *op++ = (unsigned char) ((ip - match) & 0xff);
+    *op++ = (unsigned char) ((ip - match) >> 8);
+    if (match_len - MIN_MATCH >= 15) {
+      *token |= 15;
+      op = write_length(op, match_len - MIN_MATCH - 15);
+    } else {
+      *token |= (unsigned char) (match_len - MIN_MATCH);
+    }
+
+    ip += match_len;
+    anchor = ip;
+    if (ip < mflimit) {
+      table[hash32(read32(ip - 2))] = (uint32_t) (ip - 2 - base);
+    }
+  }
+
+last_literals:
+  lit_len = iend - anchor;
+  if (op + 1 + lit_len + lit_len / 255 + 1 > oend) {
+    return 0;
+  }
+  if (lit_len >= 15) {
+    *op++ = 15 << 4;
+    op = write_length(op, lit_len - 15);
+  } else {
+    *op++ = (unsigned char) (lit_len << 4);
+  }
+  copy_bytes(op, anchor, lit_len);
+  op += lit_len;
+  return op - (unsigned char *) dst;
+}
+
+static inline int read_length(const unsigned char **ip,
+                              const unsigned char *iend, size_t *len)
+{
+  unsigned char b;
+  do {
+    if (*ip >= iend) {
+      return -1;
+    }
+    b = *(*ip)++;
+    *len += b;
+  } while (b == 255);
+  return 0;
+}
+
+/* Decompress src_size bytes at src, which must expand to exactly dst_size
+ * bytes at dst.  Every length and offset is checked, so a corrupt image
+ * cannot write outside of dst.  Returns 0 on success, -1 if corrupt.
+ */
+__attribute__ ((visibility ("hidden")))
+int mtcp_decompress_block(const void *src, size_t src_size,
+                          void *dst, size_t dst_size)
+{
+  const unsigned char *ip = (const unsigned char *) src;
+  const unsigned char *iend = ip + src_size;
+  unsigned char *op = (unsigned char *) dst;
+  unsigned char *oend = op + dst_size;
+
+  while (ip < iend) {
+    unsigned char token = *ip++;
+    size_t len = token >> 4;
+    size_t offset;
+    const unsigned char *match;
+
+    if (len == 15 && read_length(&ip, iend, &len) == -1) {
+      return -1;
+    }
+    if (len > (size_t) (iend - ip) || len > (size_t) (oend - op)) {
+      return -1;
+    }
+    copy_bytes(op, ip, len);
+    op += len;
+    ip += len;
+    if (ip == iend) {
+      break;   /* The last sequence has literals only */
+    }
+
+    if (iend - ip < 2) {
+      return -1;
+    }
+    offset = ip[0] | (ip[1] << 8);
+    ip += 2;
+    if (offset == 0 || offset > (size_t) (op - (unsigned char *) dst)) {
+      return -1;
+    }
+    len = token & 15;
+    if (len == 15 && read_length(&ip, iend, &len) == -1) {
+      return -1;
+    }
+    len += MIN_MATCH;
+    if (len > (size_t) (oend - op)) {
+      return -1;
+    }
+    match = op - offset;
+    if (offset < 8) {
+      /* A repeating pattern (e.g. a run of zeros) also repeats with any
+       * multiple of its period:  after one byte-wise copy of at least 8
+       * bytes, copy 8 bytes at a time.
+       */
+      size_t period = offset * ((8 + offset - 1) / offset);
+      size_t n = MIN(len, period);
+      len -= n;
+      while (n-- > 0) {
+        *op++ = *match++;
+      }
+      match = op - period;
+    }
+    copy_bytes(op, match, len);
+    op += len;
+  }
+  return op == oend ? 0 : -1;
+}
+
+/* Read the blocks of a compressed area of size bytes into buf. */
+__attribute__ ((visibility ("hidden")))
+void mtcp_readfile_compressed(int fd, void *buf, size_t size)
+{
+  MtcpCompressBlockHdr hdr;
+  char *stored = MAP_FAILED;
+  size_t off;
+
+  for (off = 0; off < size; off += hdr.raw_size) {
+    mtcp_readfile(fd, &hdr, sizeof(hdr));
+    if (hdr.raw_size == 0 || hdr.raw_size > MTCP_COMPRESS_BLOCK_SIZE ||
+        hdr.raw_size > size - off ||
+        hdr.stored_size == 0 || hdr.stored_size > hdr.raw_size) {
+      MTCP_PRINTF("corrupt compressed block at %p (%u/%u bytes)\n",
+                  (char *) buf + off, hdr.stored_size, hdr.raw_size);
+      mtcp_abort();
+    }
+    if (hdr.stored_size == hdr.raw_size) {
+      mtcp_readfile(fd, (char *) buf + off, hdr.raw_size);
+      continue;
+    }
+
+    /* Not malloc:  this also runs in mtcp_restoreverything().  The buffer
+     * is unmapped before returning, so that it cannot be in the way of the
+     * memory areas that are restored next.
+     */
+    if (stored == MAP_FAILED) {
+      stored = mtcp_sys_mmap(NULL, MTCP_COMPRESS_BLOCK_SIZE,
+                             PROT_READ | PROT_WRITE,
+                             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+      if (stored == MAP_FAILED) {
+        MTCP_PRINTF("error %d allocating decompression buffer\n",
+                    mtcp_sys_errno);
+        mtcp_abort();
+      }
+    }
+    mtcp_readfile(fd, stored, hdr.stored_size);
+    if (mtcp_decompress_block(stored, hdr.stored_size,
+                              (char *) buf + off, hdr.raw_size) == -1) {
+      MTCP_PRINTF("corrupt compressed block at %p (%u/%u bytes)\n",
+                  (char *) buf + off, hdr.stored_size, hdr.raw_size);
+      mtcp_abort();
+    }
+  }
+
+  if (stored != MAP_FAILED &&
+      mtcp_sys_munmap(stored, MTCP_COMPRESS_BLOCK_SIZE) == -1) {
+    MTCP_PRINTF("error %d unmapping decompression buffer\n", mtcp_sys_errno);
+  }
+}
+
+/* Skip over the blocks of a compressed area of size bytes. */
+__attribute__ ((visibility ("hidden")))
+void mtcp_skipfile_compressed(int fd, size_t size)
+{
+  MtcpCompressBlockHdr hdr;
+  size_t off;
+
+  for (off = 0; off < size; off += hdr.raw_size) {
+    mtcp_readfile(fd, &hdr, sizeof(hdr));
+    if (hdr.raw_size == 0 || hdr.raw_size > size - off ||
+        hdr.stored_size == 0 || hdr.stored_size > hdr.raw_size) {
+      MTCP_PRINTF("corrupt compressed block (%u/%u bytes)\n",
+                  hdr.stored_size, hdr.raw_size);
+      mtcp_abort();
+    }
+    mtcp_skipfile(fd, hdr.stored_size);
+  }
+}
+
+/* A fast 64-bit checksum (not cryptographic):  four independent
+ * multiply-add lanes over 8-byte words, so that it keeps up with the
+ * compressor.
+ */
+__attribute__ ((visibility ("hidden")))
+uint64_t mtcp_checksum(const void *buf, size_t size)
+{
+  const uint64_t prime = 0x9E3779B185EBCA87ULL;
+  const unsigned char *p = (const unsigned char *) buf;
+  uint64_t h0 = 1, h1 = 2, h2 = 3, h3 = 4;
+  uint64_t h = size;
+
+  for (; size >= 32; p += 32, size -= 32) {
+    h0 = (h0 + read64(p)) * prime;
+    h1 = (h1 + read64(p + 8)) * prime;
+    h2 = (h2 + read64(p + 16)) * prime;
+    h3 = (h3 + read64(p + 24)) * prime;
+  }
+  h ^= h0 ^ (h1 << 1 | h1 >> 63) ^ (h2 << 2 | h2 >> 62) ^ (h3 << 3 | h3 >> 61);
+  for (; size > 0; p++, size--) {
+    h = (h ^ *p) * prime;
+  }
+  return h ^ (h >> 29);
+}
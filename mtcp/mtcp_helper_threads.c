@@ -0,0 +1,254 @@
+/*****************************************************************************
+ *   Copyright (C) 2006-2013 by Michael Rieker, Jason Ansel, Kapil Arya, and *
+ *                                                            Gene Cooperman *
+ *   mrieker@nii.net, jansel@csail.mit.edu, kapil@ccs.neu.edu, and           *
+ *                                                          gene@ccs.neu.edu *
+ *                                                                           *
+ *   This file is part of the MTCP module of DMTCP (DMTCP:mtcp).             *
+ *                                                                           *
+ *  DMTCP:mtcp is free software: you can redistribute it and/or              *
+ *  modify it under the terms of the GNU Lesser General Public License as    *
+ *  published by the Free Software Foundation, either version 3 of the       *
+ *  License, or (at your option) any later version.                          *
+ *                                                                           *
+ *  DMTCP:dmtcp/src is distributed in the hope that it will be useful,       *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of           *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the            *
+ *  GNU Lesser General Public License for more details.                      *
+ *                                                                           *
+ *  You should have received a copy of the GNU Lesser General Public         *
+ *  License along with DMTCP:dmtcp/src.  If not, see                         *
+ *  <http://www.gnu.org/licenses/>.                                          *
+ *****************************************************************************/
+
+/*****************************************************************************
+ *
+ *  Short-lived helper threads for MTCP.
+ *
+ *  The checkpoint thread uses these to write large memory areas while the
+ *  user threads are suspended.  The helpers are created with a raw clone()
+ *  kernel call, so that neither libpthread nor the DMTCP clone wrappers
+ *  ever see them.  They share the address space, the file table and the TLS
+ *  of their creator.  Therefore, the work functions run on them must use
+ *  only mtcp_sys_XXX() calls:  no malloc, no stdio, no errno.
+ *
+ *  The helpers are joined before mtcp_run_helper_threads() returns.  A
+ *  single helper started by mtcp_start_helper_thread() keeps running until
+ *  its work function returns;  the restart code uses one to restore memory
+ *  in the background.
+ *
+ *****************************************************************************/
+
+// Set _GNU_SOURCE in order to expose the CLONE_XXX flags in <sched.h>
+#ifndef _GNU_SOURCE
+# define _GNU_SOURCE
+#endif
+#include <errno.h>
+#include <sched.h>
+#include <signal.h>
+#include <sys/mman.h>
+
+#include "mtcp_internal.h"
+#include "mtcp_util.h"
+#include "mtcp_futex.h"
+
+#define HELPER_STACK_SIZE (256 * 1024)
+
+typedef struct HelperThread {
+  int volatile tid;  /* Set by clone(); cleared by the kernel at thread exit */
+  int idx;
+  mtcp_helper_fn_t fn;
+  void *arg;
+} HelperThread;
+
+#if defined(__x86_64__)
+# define HAVE_HELPER_CLONE
+
+/* Minimal version of glibc's clone():  the child pops fn and arg from its
+ * new stack, calls fn(arg), and exits the thread (not the thread group)
+ * with fn's return value.  Returns the child tid, or -errno on failure.
+ */
+static long int helper_clone(int (*fn)(void *), void *child_stack, int flags,
+                             void *arg, int volatile *ptid, int volatile *ctid)
+{
+  long int rc;
+  void **sp = (void **) child_stack;
+  register long int r10 asm ("r10") = (long int) ctid;
+  register long int r8 asm ("r8") = 0;
+
+  *--sp = arg;
+  *--sp = (void *) fn;
+
+  asm volatile ("syscall\n\t"
+                "testq %%rax,%%rax\n\t"
+                "jnz 1f\n\t"
+                /* Child:  we are now on child_stack */
+                "xorl %%ebp,%%ebp\n\t"
+                "popq %%rax\n\t"
+                "popq %%rdi\n\t"
+                "call *%%rax\n\t"
+                "movq %%rax,%%rdi\n\t"
+                "movl %7,%%eax\n\t"
+                "syscall\n\t"
+                "hlt\n"
+                "1:\n\t"
+                : "=a" (rc)
+                : "0" (__NR_clone), "D" ((long int) flags), "S" (sp),
+                  "d" (ptid), "r" (r10), "r" (r8), "i" (__NR_exit)
+                : "memory", "cc", "rcx", "r11");
+  return rc;
+}
+#endif
+
+static int helper_thread_start(void *arg)
+{
+  HelperThread *ht = (HelperThread *) arg;
+  (*ht->fn)(ht->arg, ht->idx);
+  return 0;
+}
+
+#ifdef HAVE_HELPER_CLONE
+/* Start helper idx on the stack at [stack, stack + HELPER_STACK_SIZE).  Its
+ * control block sits at the bottom of that stack.  The caller must block
+ * all signals first, so that the helper inherits a fully blocked signal
+ * mask:  no signal meant for the user process is ever delivered to it.
+ */
+static int clone_helper_thread(char *stack, int idx,
+                               mtcp_helper_fn_t fn, void *arg)
+{
+  const int flags = CLONE_VM | CLONE_FS | CLONE_FILES | CLONE_SIGHAND |
+                    CLONE_THREAD | CLONE_SYSVSEM |
+                    CLONE_PARENT_SETTID | CLONE_CHILD_CLEARTID;
+  HelperThread *ht = (HelperThread *) stack;
+  long int rc;
+
+  ht->tid = 0;
+  ht->idx = idx;
+  ht->fn = fn;
+  ht->arg = arg;
+  rc = helper_clone(helper_thread_start, stack + HELPER_STACK_SIZE, flags,
+                    ht, &ht->tid, &ht->tid);
+  if (rc < 0) {
+    DPRINTF("error %d creating helper thread %d\n", (int) -rc, idx);
+    return -1;
+  }
+  return 0;
+}
+
+static void wait_for_helper_thread(HelperThread *ht)
+{
+  int tid;
+  while ((tid = ht->tid) != 0) {
+    mtcp_futex((int *) &ht->tid, FUTEX_WAIT, tid, NULL);
+  }
+}
+#endif
+
+/* Run fn(arg, idx) on up to nthreads threads, including the caller (which
+ * always runs idx 0), and wait for all of them to return.  The work must be
+ * handed out dynamically by fn (e.g. via an atomic counter in arg):  fewer
+ * threads than requested may be started, and on architectures without a
+ * helper clone trampoline, the caller does all of the work itself.
+ * Returns the number of threads that ran fn.
+ */
+__attribute__ ((visibility ("hidden")))
+int mtcp_run_helper_threads(int nthreads, mtcp_helper_fn_t fn, void *arg)
+{
+  int started = 1;
+#ifdef HAVE_HELPER_CLONE
+  char *stacks = MAP_FAILED;
+  size_t stacks_size = 0;
+  int i;
+
+  if (nthreads > MTCP_MAX_HELPER_THREADS) {
+    nthreads = MTCP_MAX_HELPER_THREADS;
+  }
+  if (nthreads > 1) {
+    stacks_size = (nthreads - 1) * HELPER_STACK_SIZE;
+    stacks = mtcp_sys_mmap(NULL, stacks_size, PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+                           -1, 0);
+    if (stacks == MAP_FAILED) {
+      DPRINTF("error %d allocating helper thread stacks; running serially\n",
+              mtcp_sys_errno);
+    }
+  }
+
+  if (stacks != MAP_FAILED) {
+    sigset_t allsigs, oldsigs;
+
+    mtcp_memset((char *) &allsigs, 0xff, sizeof(allsigs));
+    mtcp_sys_rt_sigprocmask(SIG_SETMASK, &allsigs, &oldsigs, _NSIG / 8);
+
+    for (i = 1; i < nthreads; i++) {
+      if (clone_helper_thread(stacks + (i - 1) * HELPER_STACK_SIZE, i,
+                              fn, arg) == -1) {
+        break;
+      }
+      started++;
+    }
+
+    mtcp_sys_rt_sigprocmask(SIG_SETMASK, &oldsigs, NULL, _NSIG / 8);
+  }
+#endif
+
+  (*fn)(arg, 0);
+
+#ifdef HAVE_HELPER_CLONE
+  for (i = 1; i < started; i++) {
+    wait_for_helper_thread(
+      (HelperThread *) (stacks + (i - 1) * HELPER_STACK_SIZE));
+  }
+  if (stacks != MAP_FAILED && mtcp_sys_munmap(stacks, stacks_size) == -1) {
+    MTCP_PRINTF("error %d unmapping helper thread stacks\n", mtcp_sys_errno);
+  }
+#endif
+  return started;
+}
+
+/* Run fn(arg, 0) on a new helper thread, and return without waiting for it.
+ * Returns NULL if no thread could be started (always, on architectures
+ * without a helper clone trampoline).  The thread must eventually be passed
+ * to mtcp_join_helper_thread(), which frees its stack.
+ */
+__attribute__ ((visibility ("hidden")))
+mtcp_helper_thread_t mtcp_start_helper_thread(mtcp_helper_fn_t fn, void *arg)
+{
+#ifdef HAVE_HELPER_CLONE
+  char *stack;
+  sigset_t allsigs, oldsigs;
+  int rc;
+
+  stack = mtcp_sys_mmap(NULL, HELPER_STACK_SIZE, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (stack == MAP_FAILED) {
+    DPRINTF("error %d allocating helper thread stack\n", mtcp_sys_errno);
+    return NULL;
+  }
+
+  mtcp_memset((char *) &allsigs, 0xff, sizeof(allsigs));
+  mtcp_sys_rt_sigprocmask(SIG_SETMASK, &allsigs, &oldsigs, _NSIG / 8);
+  rc = clone_helper_thread(stack, 0, fn, arg);
+  mtcp_sys_rt_sigprocmask(SIG_SETMASK, &oldsigs, NULL, _NSIG / 8);
+
+  if (rc == -1) {
+    mtcp_sys_munmap(stack, HELPER_STACK_SIZE);
+    return NULL;
+  }
+  return (mtcp_helper_thread_t) stack;
+#else
+  return NULL;
+#endif
+}
+
+/* Wait for a thread from mtcp_start_helper_thread() to return. */
+__attribute__ ((visibility ("hidden")))
+void mtcp_join_helper_thread(mtcp_helper_thread_t ht)
+{
+#ifdef HAVE_HELPER_CLONE
+  wait_for_helper_thread(ht);
+  if (mtcp_sys_munmap(ht, HELPER_STACK_SIZE) == -1) {
+    MTCP_PRINTF("error %d unmapping helper thread stack\n", mtcp_sys_errno);
+  }
+#endif
+}
@@ -40,6 +40,7 @@
 
 #include <pthread.h>
 #include <signal.h>
+#include <stdint.h>
 #include <sys/types.h>
 #include <sys/resource.h>
 #include <linux/version.h>
@@ -326,6 +327,12 @@ struct Thread { Thread *next;         // next thread in 'threads' list
  * This assumes: PROT_READ == 0x1, PROT_WRITE == 0x2, and PROT_EXEC == 0x4
  */
 #define MTCP_PROT_ZERO_PAGE (PROT_EXEC << 1)
+/* The area contents are compressed blocks (see mtcp_compress.c) */
+#define MTCP_PROT_COMPRESSED (PROT_EXEC << 2)
+/* No contents:  the pages are unchanged since the parent image */
+#define MTCP_PROT_PARENT_PAGE (PROT_EXEC << 3)
+/* The area contents are references into the chunk store */
+#define MTCP_PROT_CHUNKS (PROT_EXEC << 4)
 
 #define STACKSIZE 1024      // size of temporary stack (in quadwords)
 //#define MTCP_MAX_PATH 256   // maximum path length for mtcp_find_executable
@@ -364,8 +371,54 @@ typedef struct mtcp_ckpt_image_hdr {
   VA restore_start_fptr; /* will be bound to fnc, mtcp_restore_start */
   VA finish_restore_fptr; /* will be bound to fnc, finishrestore */
   struct rlimit stack_rlimit;
+  /* Incremental image:  file name of the parent image, in the same
+   * directory.  Empty for a full image.
+   */
+  char parent_name[FILENAMESIZE];
 } mtcp_ckpt_image_hdr_t;
 
+/* Version 2 images end with an area index (see mtcp_writeckpt.c).  The
+ * sequence of Area records in front of it is the same as in version 0.
+ * Version 3 images may be incremental:  MTCP_PROT_PARENT_PAGE records
+ * refer to the image named by parent_name.  Version 4 images may keep
+ * area contents in the chunk store (see mtcp_chunk_store.c).
+ * In every version, the Area records are page-sized and the raw contents
+ * of an area are a whole number of pages, so that in an uncompressed image
+ * the contents of every area start at a page boundary:  mtcp_restart
+ * --fast-restart maps them from there.
+ */
+#define MTCP_CKPT_IMAGE_VERSION 4
+/* Longest chain of incremental images restart will follow */
+#define MTCP_MAX_PARENT_IMAGES 64
+
+/* One entry per block of area contents:  per MTCP_COMPRESS_BLOCK_SIZE bytes
+ * (cut at addresses that are multiples of it, if not compressed), per
+ * chunk, and per run of zero pages.  offset is from the beginning of the
+ * image (MAGIC).
+ */
+#define MTCP_INDEX_COMPRESSED 1   /* stored in the LZ4 block format */
+#define MTCP_INDEX_ZERO_PAGES 2   /* not stored */
+#define MTCP_INDEX_PARENT_PAGES 4 /* not stored:  see the parent image */
+#define MTCP_INDEX_CHUNK 8        /* stored as a MtcpChunkRef */
+typedef struct MtcpIndexEntry {
+  uint64_t addr;
+  uint64_t raw_size;
+  uint64_t offset;       /* of the stored bytes */
+  uint64_t stored_size;
+  uint64_t checksum;     /* mtcp_checksum() of the stored bytes */
+  uint32_t flags;
+  uint32_t padding;
+} MtcpIndexEntry;
+
+/* Last bytes of the file:  find the index from here. */
+#define MTCP_INDEX_MAGIC "MTCP_AREA_INDEX"
+typedef struct MtcpIndexTrailer {
+  uint64_t offset;       /* of the first MtcpIndexEntry */
+  uint64_t num_entries;
+  uint64_t checksum;     /* of the entries */
+  char magic[16];
+} MtcpIndexTrailer;
+
 // order must match that in mtcp_jmpbuf.s
 // struct Jmpbuf { uLong ebx, esi, edi, ebp, esp;
 //                 uLong eip;
@@ -470,6 +523,7 @@ extern __attribute__ ((visibility ("hidden"))) int mtcp_restore_cpfd;
 extern __attribute__ ((visibility ("hidden"))) int mtcp_restore_verify;
 extern __attribute__ ((visibility ("hidden"))) pid_t mtcp_restore_gzip_child_pid;
 extern __attribute__ ((visibility ("hidden"))) char mtcp_ckpt_newname[];
+extern __attribute__ ((visibility ("hidden"))) char mtcp_mapped_image_name[];
 extern __attribute__ ((visibility ("hidden"))) char *mtcp_restore_cmd_file;
 extern __attribute__ ((visibility ("hidden"))) char *mtcp_restore_argv[];
 extern __attribute__ ((visibility ("hidden"))) char *mtcp_restore_envp[];
@@ -495,7 +549,7 @@ __attribute__ ((visibility ("hidden")))
    int mtcp_state_value(MtcpState * state);
 
 __attribute__ ((visibility ("hidden")))
-void mtcp_restoreverything (int should_mmap_ckpt_image, VA finishrestore_fptr);
+void mtcp_restoreverything (int restore_flags, VA finishrestore_fptr);
 __attribute__ ((visibility ("hidden")))
 void mtcp_printf (char const *format, ...);
 void mtcp_maybebpt (void);
@@ -520,7 +574,13 @@ int mtcp_selfmap_close(int selfmapfd);
 void mtcp_checkpointeverything(const char *temp_ckpt_filename,
                                const char *perm_ckpt_filename);
 void mtcp_finishrestore(void);
-void mtcp_restore_start(int fd, int verify, int should_mmap_ckpt_image,
+/* Flags for the restore_flags argument of mtcp_restore_start() */
+#define MTCP_RESTORE_MMAP_IMAGE 1   /* mtcp_restart --fast-restart */
+#define MTCP_RESTORE_LAZY 2         /* mtcp_restart --lazy */
+/* The remaining bits:  mtcp_restart --restore-threads N */
+#define MTCP_RESTORE_THREADS_SHIFT 8
+#define MTCP_RESTORE_THREADS(flags) ((flags) >> MTCP_RESTORE_THREADS_SHIFT)
+void mtcp_restore_start(int fd, int verify, int restore_flags,
                         pid_t gzip_child_pid,
                         char *ckpt_newname, char *cmd_file,
                         char *argv[], char *envp[]);
@@ -0,0 +1,826 @@
+/*****************************************************************************
+ *   Copyright (C) 2006-2013 by Michael Rieker, Jason Ansel, Kapil Arya, and *
+ *                                                            Gene Cooperman *
+ *   mrieker@nii.net, jansel@csail.mit.edu, kapil@ccs.neu.edu, and           *
+ *                                                          gene@ccs.neu.edu *
+ *                                                                           *
+ *   This file is part of the MTCP module of DMTCP (DMTCP:mtcp).             *
+ *                                                                           *
+ *  DMTCP:mtcp is free software: you can redistribute it and/or              *
+ *  modify it under the terms of the GNU Lesser General Public License as    *
+ *  published by the Free Software Foundation, either version 3 of the       *
+ *  License, or (at your option) any later version.                          *
+ *                                                                           *
+ *  DMTCP:dmtcp/src is distributed in the hope that it will be useful,       *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of           *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the            *
+ *  GNU Lesser General Public License for more details.                      *
+ *                                                                           *
+ *  You should have received a copy of the GNU Lesser General Public         *
+ *  License along with DMTCP:dmtcp/src.  If not, see                         *
+ *  <http://www.gnu.org/licenses/>.                                          *
+ *****************************************************************************/
+
+/*****************************************************************************
+ *
+ *  Lazy restore (mtcp_restart --lazy).
+ *
+ *  Instead of reading the contents of the large private anonymous areas
+ *  before the restarted process resumes, readmemoryareas() registers them
+ *  with a userfaultfd and skips their contents.  Once all areas are mapped,
+ *  a helper thread fills them in from the checkpoint image:  it serves the
+ *  page faults of the user threads first, and otherwise reads the image
+ *  sequentially.  It finds the contents of each block through the area
+ *  index at the end of the image, so this needs a seekable image with an
+ *  index (MTCP_CKPT_IMAGE_VERSION 2).  When anything is missing (an older
+ *  image, a pipe from gzip, a kernel without userfaultfd or one that
+ *  refuses it to this user), the areas are simply read as usual.
+ *
+ *  The user threads may discard (MADV_DONTNEED), unmap or move (mremap())
+ *  parts of these areas before they are filled in.  The kernel reports such
+ *  changes as userfaultfd events, and the helper thread replays them on the
+ *  blocks it fills in later, so that the old contents do not come back.
+ *
+ *  The helper thread runs while the user threads do.  Pages that it has not
+ *  filled in yet look like holes to fork() and to /proc/self/pagemap, so
+ *  the checkpoint thread and the DMTCP fork() wrapper first call
+ *  mtcp_wait_for_lazy_restore().
+ *
+ *  Everything before mtcp_lazy_restore_start() runs inside
+ *  mtcp_restoreverything(), and the helper thread shares its lack of TLS:
+ *  only mtcp_sys_XXX() calls here, and the _raw ones on the helper thread.
+ *
+ *****************************************************************************/
+
+// Set _GNU_SOURCE in order to expose MREMAP_MAYMOVE in <sys/mman.h>
+#ifndef _GNU_SOURCE
+# define _GNU_SOURCE
+#endif
+#include <errno.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+
+#include "mtcp_internal.h"
+#include "mtcp_util.h"
+
+#if defined(__NR_userfaultfd) && defined(__has_include)
+# if __has_include(<linux/userfaultfd.h>)
+#  include <linux/userfaultfd.h>
+#  ifdef UFFD_FEATURE_EVENT_UNMAP
+#   define HAVE_USERFAULTFD
+#  endif
+# endif
+#endif
+
+/* Smaller areas are read eagerly:  a fault costs more than reading them. */
+#define LAZY_MIN_AREA_SIZE (1024 * 1024)
+#define LAZY_MAX_AREAS 512
+/* Not stored in the image:  marks index entries already filled in */
+#define LAZY_FILLED 0x80000000
+#define LAZY_MAX_PIECES (MTCP_COMPRESS_BLOCK_SIZE / MTCP_PAGE_SIZE + 2)
+
+typedef struct LazyArea {
+  VA addr;
+  size_t size;
+  int prot;
+  int compressed;
+  off_t offset;      /* of the area contents in the image */
+  VA next;           /* end of the index entries found so far */
+  int eager;         /* not in the index after all:  read eagerly */
+} LazyArea;
+
+/* A change that the user threads made to the memory map of the lazily
+ * restored areas:  the kernel reports these as events on the userfaultfd.
+ */
+typedef struct MapChange {
+  int event;         /* UFFD_EVENT_REMOVE, _UNMAP or _REMAP */
+  VA start;
+  VA end;
+  VA to;             /* UFFD_EVENT_REMAP:  the new address of start */
+} MapChange;
+
+/* The pages [src, src + size) of a block are at dest now. */
+typedef struct Piece {
+  VA src;
+  size_t size;
+  VA dest;
+} Piece;
+
+static int lazy_enabled = 0;
+static int uffd = -1;
+static int ckpt_fd = -1;
+static off_t image_begin;
+static off_t index_offset;
+static MtcpIndexTrailer trailer;
+static LazyArea areas[LAZY_MAX_AREAS];
+static int num_areas = 0;
+static MtcpIndexEntry *entries = MAP_FAILED;
+static size_t entries_size;
+static size_t num_entries = 0;
+static char *buffers = MAP_FAILED;    /* raw block, then stored block */
+static MapChange *changes = MAP_FAILED;
+static size_t changes_size;
+static size_t num_changes = 0;
+static VA *pending = MAP_FAILED;      /* faults to serve */
+static size_t pending_size;
+static size_t num_pending = 0;
+static size_t num_faults, num_prefetched;
+static mtcp_helper_thread_t volatile filler = NULL;
+
+#ifdef HAVE_USERFAULTFD
+/* Move fd out of the way of the file descriptors of the restarted process,
+ * which DMTCP restores later with dup2().
+ */
+static int move_to_high_fd(int fd)
+{
+  struct rlimit rlim;
+  int newfd;
+
+  if (mtcp_sys_getrlimit(RLIMIT_NOFILE, &rlim) == -1 || rlim.rlim_cur < 64) {
+    return fd;
+  }
+  newfd = mtcp_sys_fcntl3(fd, F_DUPFD_CLOEXEC,
+                          MIN(rlim.rlim_cur, 1024 * 1024) - 16);
+  if (newfd == -1) {
+    return fd;
+  }
+  mtcp_sys_close(fd);
+  return newfd;
+}
+
+static void pread_all(void *buf, size_t size, off_t offset)
+{
+  char *p = (char *) buf;
+  while (size > 0) {
+    long rc = mtcp_sys_pread_raw(ckpt_fd, p, size, offset);
+    if (rc == -EINTR) {
+      continue;
+    }
+    if (rc <= 0) {
+      MTCP_PRINTF("error %d reading %u bytes at offset %u of the image\n",
+                  (int) -rc, (unsigned) size, (unsigned) offset);
+      mtcp_abort();
+    }
+    p += rc;
+    size -= rc;
+    offset += rc;
+  }
+}
+
+/* Double the size of an array mapped by mtcp_lazy_restore_start(). */
+static void *grow_array(void *array, size_t *size)
+{
+  long rc = mtcp_sys_mremap_raw(array, *size, 2 * *size, MREMAP_MAYMOVE);
+  if (rc < 0 && rc > -4096) {
+    MTCP_PRINTF("error %d growing %p bytes at %p\n", (int) -rc, *size, array);
+    mtcp_abort();
+  }
+  *size *= 2;
+  return (void *) rc;
+}
+
+/* Install the pages [addr, addr + size) from src, skipping those that are
+ * already there.  Returns -1 if the kernel refused because the memory map
+ * is being changed:  retry once the event for that change has been read.
+ */
+static int copy_pages(VA addr, char *src, size_t size)
+{
+  while (size > 0) {
+    struct uffdio_copy copy;
+    size_t done;
+    long rc;
+
+    copy.dst = (unsigned long) addr;
+    copy.src = (unsigned long) src;
+    copy.len = size;
+    copy.mode = 0;
+    copy.copy = 0;
+    rc = mtcp_sys_ioctl_raw(uffd, UFFDIO_COPY, &copy);
+    if (rc == 0) {
+      return 0;
+    }
+    if (copy.copy > 0) {
+      done = copy.copy;
+    } else if (rc == -EEXIST) {
+      done = MTCP_PAGE_SIZE;
+    } else if (rc == -EAGAIN) {
+      return -1;
+    } else {
+      DPRINTF("error %d filling in %p bytes at %p\n", (int) -rc, size, addr);
+      return 0;
+    }
+    addr += done;
+    src += done;
+    size -= done;
+  }
+  return 0;
+}
+
+/* As copy_pages(), for pages of zeros. */
+static int zero_pages(VA addr, size_t size)
+{
+  struct uffdio_zeropage zp;
+  long rc;
+
+  zp.range.start = (unsigned long) addr;
+  zp.range.len = size;
+  zp.mode = 0;
+  rc = mtcp_sys_ioctl_raw(uffd, UFFDIO_ZEROPAGE, &zp);
+  if (rc == -EAGAIN) {
+    return -1;
+  }
+  if (rc < 0 && rc != -EEXIST) {
+    DPRINTF("error %d zero-filling %p bytes at %p\n", (int) -rc, size, addr);
+  }
+  return 0;
+}
+
+static void wake_page(VA addr)
+{
+  struct uffdio_range range;
+
+  range.start = (unsigned long) addr;
+  range.len = MTCP_PAGE_SIZE;
+  mtcp_sys_ioctl_raw(uffd, UFFDIO_WAKE, &range);
+}
+
+static void record_change(int event, VA start, VA end, VA to)
+{
+  if ((num_changes + 1) * sizeof(MapChange) > changes_size) {
+    changes = grow_array(changes, &changes_size);
+  }
+  changes[num_changes].event = event;
+  changes[num_changes].start = start;
+  changes[num_changes].end = end;
+  changes[num_changes].to = to;
+  num_changes++;
+}
+
+/* Where the pages of e are now:  replay the changes to the memory map on
+ * them.  Returns the number of pieces left.
+ */
+static int find_pieces(const MtcpIndexEntry *e, Piece *p)
+{
+  size_t c;
+  int i, k, n = 1;
+
+  p[0].src = (VA) e->addr;
+  p[0].size = e->raw_size;
+  p[0].dest = (VA) e->addr;
+  for (c = 0; c < num_changes && n > 0; c++) {
+    const MapChange *m = &changes[c];
+
+    for (i = 0, k = n; i < k; i++) {
+      VA lo = MAX(p[i].dest, m->start);
+      VA hi = MIN(p[i].dest + p[i].size, m->end);
+
+      if (lo >= hi) {
+        continue;
+      }
+      if (n + 2 > LAZY_MAX_PIECES) {
+        MTCP_PRINTF("block at %p was split into too many pieces\n",
+                    (VA) e->addr);
+        mtcp_abort();
+      }
+      /* Split off the parts outside the range changed. */
+      if (p[i].dest + p[i].size > hi) {
+        p[n].src = p[i].src + (hi - p[i].dest);
+        p[n].size = p[i].dest + p[i].size - hi;
+        p[n].dest = hi;
+        n++;
+      }
+      if (p[i].dest < lo) {
+        p[n].src = p[i].src;
+        p[n].size = lo - p[i].dest;
+        p[n].dest = p[i].dest;
+        n++;
+      }
+      p[i].src += lo - p[i].dest;
+      p[i].size = hi - lo;
+      if (m->event == UFFD_EVENT_REMAP) {
+        p[i].dest = m->to + (lo - m->start);
+      } else {
+        p[i].size = 0;
+      }
+    }
+    for (i = k = 0; i < n; i++) {
+      if (p[i].size > 0) {
+        p[k++] = p[i];
+      }
+    }
+    n = k;
+  }
+  return n;
+}
+
+/* The inverse of find_pieces():  where the page now at addr was at restart
+ * time, or NULL if it was discarded since (and so reads as zeros).
+ */
+static VA original_address(VA addr)
+{
+  size_t c = num_changes;
+
+  while (c-- > 0) {
+    const MapChange *m = &changes[c];
+
+    if (m->event == UFFD_EVENT_REMAP &&
+        addr >= m->to && addr < m->to + (m->end - m->start)) {
+      addr = m->start + (addr - m->to);
+    } else if (addr >= m->start && addr < m->end) {
+      return NULL;
+    }
+  }
+  return addr;
+}
+
+/* Fill in the pages of e that the user threads have not discarded, wherever
+ * they are now.  Returns -1 if this must be retried (see copy_pages()).
+ */
+static int fill_entry(MtcpIndexEntry *e)
+{
+  Piece pieces[LAZY_MAX_PIECES];
+  char *raw = NULL;
+  char *stored = buffers + MTCP_COMPRESS_BLOCK_SIZE;
+  int i, n, rc;
+
+  if (e->flags & LAZY_FILLED) {
+    return 0;
+  }
+  n = find_pieces(e, pieces);
+
+  if (n > 0 && (e->flags & MTCP_INDEX_COMPRESSED)) {
+    raw = buffers;
+    pread_all(stored, e->stored_size, image_begin + e->offset);
+    if (mtcp_decompress_block(stored, e->stored_size,
+                              raw, e->raw_size) == -1) {
+      MTCP_PRINTF("corrupt compressed block at %p (%u/%u bytes)\n",
+                  (VA) e->addr, (unsigned) e->stored_size,
+                  (unsigned) e->raw_size);
+      mtcp_abort();
+    }
+  } else if (n > 0 && !(e->flags & MTCP_INDEX_ZERO_PAGES)) {
+    raw = buffers;
+    pread_all(raw, e->raw_size, image_begin + e->offset);
+  }
+  for (i = 0; i < n; i++) {
+    if (raw == NULL) {
+      rc = zero_pages(pieces[i].dest, pieces[i].size);
+    } else {
+      rc = copy_pages(pieces[i].dest, raw + (pieces[i].src - (VA) e->addr),
+                      pieces[i].size);
+    }
+    if (rc == -1) {
+      return -1;
+    }
+  }
+  e->flags |= LAZY_FILLED;
+  return 0;
+}
+
+static MtcpIndexEntry *find_entry(VA addr)
+{
+  size_t lo = 0, hi = num_entries;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if ((VA) entries[mid].addr + entries[mid].raw_size <= addr) {
+      lo = mid + 1;
+    } else if ((VA) entries[mid].addr > addr) {
+      hi = mid;
+    } else {
+      return &entries[mid];
+    }
+  }
+  return NULL;
+}
+
+static LazyArea *find_area(VA addr)
+{
+  int lo = 0, hi = num_areas;
+  while (lo < hi) {
+    int mid = lo + (hi - lo) / 2;
+    if (areas[mid].addr + areas[mid].size <= addr) {
+      lo = mid + 1;
+    } else if (areas[mid].addr > addr) {
+      hi = mid;
+    } else {
+      return &areas[mid];
+    }
+  }
+  return NULL;
+}
+
+/* Returns -1 if this must be retried (see copy_pages()). */
+static int serve_fault(VA addr)
+{
+  VA page = (VA) ((unsigned long) addr & MTCP_PAGE_MASK);
+  VA orig = original_address(page);
+  MtcpIndexEntry *e = orig == NULL ? NULL : find_entry(orig);
+
+  if (e != NULL && !(e->flags & LAZY_FILLED)) {
+    if (fill_entry(e) == -1) {
+      return -1;
+    }
+    num_faults++;
+  } else {
+    /* Discarded (MADV_DONTNEED) since the restart, or after its block was
+     * filled in:  it reads as zeros.  Otherwise the UFFDIO_COPY for it
+     * raced with this fault, and this finds the page already there.
+     */
+    if (e == NULL && orig != NULL) {
+      MTCP_PRINTF("no contents for lazily restored page at %p\n", addr);
+    }
+    if (zero_pages(page, MTCP_PAGE_SIZE) == -1) {
+      return -1;
+    }
+  }
+  /* In case the page was there already:  do not leave the thread hanging. */
+  wake_page(page);
+  return 0;
+}
+
+/* Queue the faults, and record the changes to the memory map.  The kernel
+ * holds up the thread that makes a change until its event is read here.
+ */
+static void read_messages()
+{
+  struct uffd_msg msgs[16];
+  long rc;
+  int i;
+
+  while ((rc = mtcp_sys_read_raw(uffd, msgs, sizeof(msgs))) > 0) {
+    for (i = 0; i < rc / (long) sizeof(msgs[0]); i++) {
+      struct uffd_msg *msg = &msgs[i];
+
+      switch (msg->event) {
+      case UFFD_EVENT_PAGEFAULT:
+        if ((num_pending + 1) * sizeof(VA) > pending_size) {
+          pending = grow_array(pending, &pending_size);
+        }
+        pending[num_pending++] =
+          (VA) (unsigned long) msg->arg.pagefault.address;
+        break;
+      case UFFD_EVENT_REMOVE:
+      case UFFD_EVENT_UNMAP:
+        record_change(msg->event, (VA) (unsigned long) msg->arg.remove.start,
+                      (VA) (unsigned long) msg->arg.remove.end, NULL);
+        break;
+      case UFFD_EVENT_REMAP:
+        record_change(msg->event, (VA) (unsigned long) msg->arg.remap.from,
+                      (VA) (unsigned long) (msg->arg.remap.from +
+                                            msg->arg.remap.len),
+                      (VA) (unsigned long) msg->arg.remap.to);
+        break;
+      }
+    }
+  }
+}
+
+/* Fill in every lazily restored area, faults first, then clean up. */
+static void lazy_fill(void *arg, int idx)
+{
+  size_t next = 0;
+  size_t i, j;
+
+  while (1) {
+    read_messages();
+    for (i = 0; i < num_pending && serve_fault(pending[i]) == 0; i++) {
+    }
+    for (j = i; j < num_pending; j++) {
+      pending[j - i] = pending[j];
+    }
+    num_pending -= i;
+    if (num_pending > 0) {
+      continue;   /* The memory map is being changed:  read the event. */
+    }
+    while (next < num_entries && (entries[next].flags & LAZY_FILLED)) {
+      next++;
+    }
+    if (next == num_entries) {
+      break;
+    }
+    if (fill_entry(&entries[next]) == 0) {
+      num_prefetched++;
+    }
+  }
+  DPRINTF("lazy restore done: %u blocks on fault, %u prefetched, "
+          "%u changes to the memory map\n", (unsigned) num_faults,
+          (unsigned) num_prefetched, (unsigned) num_changes);
+
+  /* Closing the userfaultfd also unregisters the areas, and the threads
+   * still waiting on it retry their faults as usual.
+   */
+  mtcp_sys_close(uffd);
+  mtcp_sys_close(ckpt_fd);
+  uffd = ckpt_fd = -1;
+  mtcp_sys_munmap(entries, entries_size);
+  mtcp_sys_munmap(buffers, 2 * MTCP_COMPRESS_BLOCK_SIZE);
+  mtcp_sys_munmap(changes, changes_size);
+  mtcp_sys_munmap(pending, pending_size);
+  entries = MAP_FAILED;
+  buffers = MAP_FAILED;
+  changes = MAP_FAILED;
+  pending = MAP_FAILED;
+}
+#endif
+
+/* Called before readmemoryareas().  Returns 0 if the areas can be restored
+ * lazily, or -1 (and restore everything eagerly) if not.
+ */
+__attribute__ ((visibility ("hidden")))
+int mtcp_lazy_restore_init(int fd)
+{
+#ifdef HAVE_USERFAULTFD
+  struct uffdio_api api;
+  off_t cur, end;
+
+  lazy_enabled = 0;
+  num_areas = 0;
+  num_entries = 0;
+  num_changes = num_pending = 0;
+  num_faults = num_prefetched = 0;
+  filler = NULL;
+
+  cur = mtcp_sys_lseek(fd, 0, SEEK_CUR);
+  end = mtcp_sys_lseek(fd, 0, SEEK_END);
+  if (cur == -1 || end == -1 || mtcp_sys_lseek(fd, cur, SEEK_SET) != cur) {
+    MTCP_PRINTF("checkpoint image is not seekable; not restoring lazily\n");
+    return -1;
+  }
+  ckpt_fd = fd;
+  if (end < cur + (off_t) sizeof(trailer)) {
+    MTCP_PRINTF("checkpoint image has no area index; not restoring lazily\n");
+    return -1;
+  }
+  pread_all(&trailer, sizeof(trailer), end - sizeof(trailer));
+  index_offset = end - sizeof(trailer) -
+                 trailer.num_entries * sizeof(MtcpIndexEntry);
+  image_begin = index_offset - trailer.offset;
+  if (mtcp_memcmp(trailer.magic, MTCP_INDEX_MAGIC, sizeof(MTCP_INDEX_MAGIC))
+      != 0 || trailer.num_entries == 0 ||
+      index_offset < cur || image_begin < 0 || image_begin > cur) {
+    MTCP_PRINTF("checkpoint image has no area index; not restoring lazily\n");
+    return -1;
+  }
+
+  uffd = mtcp_sys_userfaultfd(O_CLOEXEC | O_NONBLOCK);
+  if (uffd == -1) {
+    MTCP_PRINTF("userfaultfd() failed (error %d); not restoring lazily\n"
+                "  (Does /proc/sys/vm/unprivileged_userfaultfd allow it?)\n",
+                mtcp_sys_errno);
+    return -1;
+  }
+  /* Without these events, filling in a block could bring back pages that
+   * the user threads discarded or moved meanwhile.
+   */
+  api.api = UFFD_API;
+  api.features = UFFD_FEATURE_EVENT_REMOVE | UFFD_FEATURE_EVENT_UNMAP |
+                 UFFD_FEATURE_EVENT_REMAP;
+  api.ioctls = 0;
+  if (mtcp_sys_ioctl(uffd, UFFDIO_API, &api) == -1) {
+    MTCP_PRINTF("UFFDIO_API failed (error %d); not restoring lazily\n"
+                "  (Linux 4.11 or later is needed.)\n", mtcp_sys_errno);
+    mtcp_sys_close(uffd);
+    uffd = -1;
+    return -1;
+  }
+  uffd = move_to_high_fd(uffd);
+  lazy_enabled = 1;
+  return 0;
+#else
+  MTCP_PRINTF("built without userfaultfd support; not restoring lazily\n");
+  return -1;
+#endif
+}
+
+#ifdef HAVE_USERFAULTFD
+/* Find the end of the contents of the area ending at end_addr in the image,
+ * by a binary search of the index on disk.  Returns -1 if not found.
+ */
+static off_t find_end_of_contents(VA end_addr)
+{
+  uint64_t lo = 0, hi = trailer.num_entries;
+  MtcpIndexEntry e;
+
+  while (lo < hi) {
+    uint64_t mid = lo + (hi - lo) / 2;
+    pread_all(&e, sizeof(e), index_offset + mid * sizeof(e));
+    if ((VA) e.addr + e.raw_size < end_addr) {
+      lo = mid + 1;
+    } else if ((VA) e.addr >= end_addr) {
+      hi = mid;
+    } else if ((VA) e.addr + e.raw_size == end_addr &&
+               !(e.flags & MTCP_INDEX_ZERO_PAGES)) {
+      return image_begin + e.offset + e.stored_size;
+    } else {
+      break;
+    }
+  }
+  return -1;
+}
+#endif
+
+/* Called by readmemoryareas() for each private anonymous area, once it is
+ * mapped (writable) and before its contents are read.  Returns 1 if the
+ * area will be restored lazily:  its contents have then been skipped, and
+ * mtcp_lazy_restore_start() sets its protection.
+ */
+__attribute__ ((visibility ("hidden")))
+int mtcp_lazy_restore_area(Area *area, int compressed)
+{
+#ifdef HAVE_USERFAULTFD
+  struct uffdio_register reg;
+  LazyArea *la = &areas[num_areas];
+  off_t begin, end;
+
+  if (!lazy_enabled || area->size < LAZY_MIN_AREA_SIZE ||
+      !(area->prot & PROT_READ) || num_areas == LAZY_MAX_AREAS ||
+      (num_areas > 0 && area->addr < la[-1].addr + la[-1].size)) {
+    return 0;
+  }
+  begin = mtcp_sys_lseek(mtcp_restore_cpfd, 0, SEEK_CUR);
+  end = find_end_of_contents(area->addr + area->size);
+  if (begin == -1 || end <= begin) {
+    return 0;
+  }
+
+  reg.range.start = (unsigned long) area->addr;
+  reg.range.len = area->size;
+  reg.mode = UFFDIO_REGISTER_MODE_MISSING;
+  if (mtcp_sys_ioctl(uffd, UFFDIO_REGISTER, &reg) == -1) {
+    DPRINTF("error %d registering area at %p for lazy restore\n",
+            mtcp_sys_errno, area->addr);
+    return 0;
+  }
+
+  la->addr = area->addr;
+  la->size = area->size;
+  la->prot = area->prot;
+  la->compressed = compressed;
+  la->offset = begin;
+  la->next = area->addr;
+  la->eager = 0;
+  num_areas++;
+
+  if (mtcp_sys_lseek(mtcp_restore_cpfd, end, SEEK_SET) != end) {
+    MTCP_PRINTF("error %d seeking in checkpoint image\n", mtcp_sys_errno);
+    mtcp_abort();
+  }
+  return 1;
+#else
+  return 0;
+#endif
+}
+
+#ifdef HAVE_USERFAULTFD
+/* The index does not describe this area as expected:  read it now. */
+static void restore_area_eagerly(LazyArea *la)
+{
+  struct uffdio_range range;
+
+  MTCP_PRINTF("area at %p is not in the area index; reading it now\n",
+              la->addr);
+  range.start = (unsigned long) la->addr;
+  range.len = la->size;
+  if (mtcp_sys_ioctl(uffd, UFFDIO_UNREGISTER, &range) == -1 ||
+      mtcp_sys_lseek(ckpt_fd, la->offset, SEEK_SET) != la->offset) {
+    MTCP_PRINTF("error %d restoring area at %p\n", mtcp_sys_errno, la->addr);
+    mtcp_abort();
+  }
+  if (la->compressed) {
+    mtcp_readfile_compressed(ckpt_fd, la->addr, la->size);
+  } else {
+    mtcp_readfile(ckpt_fd, la->addr, la->size);
+  }
+  la->eager = 1;
+}
+
+/* Keep the index entries that describe the lazily restored areas, and check
+ * that they cover each area exactly.  Returns 0 if the entries kept are not
+ * sorted by address (find_entry() needs them sorted).
+ */
+static int select_index_entries()
+{
+  size_t i, n = 0;
+  int j, sorted = 1;
+
+  for (i = 0; i < num_entries; i++) {
+    MtcpIndexEntry *e = &entries[i];
+    LazyArea *la = find_area((VA) e->addr);
+    if (la == NULL) {
+      continue;
+    }
+    if ((VA) e->addr != la->next || e->raw_size == 0 ||
+        e->raw_size > MTCP_COMPRESS_BLOCK_SIZE ||
+        e->raw_size > (size_t) (la->addr + la->size - la->next) ||
+        ((e->flags & MTCP_INDEX_COMPRESSED) &&
+         (e->stored_size == 0 || e->stored_size > e->raw_size))) {
+      continue;
+    }
+    e->flags &= ~LAZY_FILLED;
+    la->next += e->raw_size;
+    entries[n++] = *e;
+  }
+  num_entries = n;
+
+  for (j = 0; j < num_areas; j++) {
+    if (areas[j].next != areas[j].addr + areas[j].size) {
+      restore_area_eagerly(&areas[j]);
+    }
+  }
+
+  /* Drop the entries of the areas that were just read. */
+  for (i = n = 0; i < num_entries; i++) {
+    LazyArea *la = find_area((VA) entries[i].addr);
+    if (la != NULL && !la->eager) {
+      if (n > 0 && entries[n - 1].addr > entries[i].addr) {
+        sorted = 0;
+      }
+      entries[n++] = entries[i];
+    }
+  }
+  num_entries = n;
+  return sorted;
+}
+#endif
+
+/* Called after readmemoryareas(), when the memory map of the restarted
+ * process is complete, and before mtcp_restore_cpfd is closed.  Starts the
+ * helper thread that fills in the lazily restored areas.
+ */
+__attribute__ ((visibility ("hidden")))
+void mtcp_lazy_restore_start()
+{
+#ifdef HAVE_USERFAULTFD
+  int j, sorted;
+
+  if (!lazy_enabled) {
+    return;
+  }
+  lazy_enabled = 0;
+  if (num_areas == 0) {
+    mtcp_sys_close(uffd);
+    uffd = -1;
+    return;
+  }
+
+  ckpt_fd = move_to_high_fd(mtcp_sys_dup(mtcp_restore_cpfd));
+  entries_size = (trailer.num_entries * sizeof(MtcpIndexEntry) +
+                  MTCP_PAGE_SIZE - 1) & MTCP_PAGE_MASK;
+  entries = mtcp_sys_mmap(NULL, entries_size, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  buffers = mtcp_sys_mmap(NULL, 2 * MTCP_COMPRESS_BLOCK_SIZE,
+                          PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  changes_size = pending_size = MTCP_PAGE_SIZE;
+  changes = mtcp_sys_mmap(NULL, changes_size, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  pending = mtcp_sys_mmap(NULL, pending_size, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (ckpt_fd == -1 || entries == MAP_FAILED || buffers == MAP_FAILED ||
+      changes == MAP_FAILED || pending == MAP_FAILED) {
+    MTCP_PRINTF("error %d setting up lazy restore\n", mtcp_sys_errno);
+    mtcp_abort();
+  }
+  num_entries = trailer.num_entries;
+  pread_all(entries, num_entries * sizeof(MtcpIndexEntry), index_offset);
+  if (mtcp_checksum(entries, num_entries * sizeof(MtcpIndexEntry))
+      != trailer.checksum) {
+    MTCP_PRINTF("bad checksum of the area index\n");
+    num_entries = 0;
+  }
+  sorted = select_index_entries();
+
+  /* readmemoryareas() left these areas writable for UFFDIO_COPY, which
+   * does not need it.
+   */
+  for (j = 0; j < num_areas; j++) {
+    if (!(areas[j].prot & PROT_WRITE) &&
+        mtcp_sys_mprotect(areas[j].addr, areas[j].size, areas[j].prot) < 0) {
+      MTCP_PRINTF("error %d write-protecting %p bytes at %p\n",
+                  mtcp_sys_errno, areas[j].size, areas[j].addr);
+      mtcp_abort();
+    }
+  }
+
+  DPRINTF("restoring %u blocks lazily\n", (unsigned) num_entries);
+  if (sorted) {
+    filler = mtcp_start_helper_thread(lazy_fill, NULL);
+  }
+  if (filler == NULL) {
+    DPRINTF("no helper thread for lazy restore; filling in areas now\n");
+    lazy_fill(NULL, 0);
+  }
+#endif
+}
+
+/* Wait until all lazily restored areas are filled in.  Not for concurrent
+ * use:  the callers hold off checkpoints and each other.
+ */
+void mtcp_wait_for_lazy_restore()
+{
+  mtcp_helper_thread_t ht = filler;
+  if (ht != NULL) {
+    mtcp_join_helper_thread(ht);
+    filler = NULL;
+  }
+}
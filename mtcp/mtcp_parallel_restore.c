@@ -0,0 +1,373 @@
+/*****************************************************************************
+ *   Copyright (C) 2006-2013 by Michael Rieker, Jason Ansel, Kapil Arya, and *
+ *                                                            Gene Cooperman *
+ *   mrieker@nii.net, jansel@csail.mit.edu, kapil@ccs.neu.edu, and           *
+ *                                                          gene@ccs.neu.edu *
+ *                                                                           *
+ *   This file is part of the MTCP module of DMTCP (DMTCP:mtcp).             *
+ *                                                                           *
+ *  DMTCP:mtcp is free software: you can redistribute it and/or              *
+ *  modify it under the terms of the GNU Lesser General Public License as    *
+ *  published by the Free Software Foundation, either version 3 of the       *
+ *  License, or (at your option) any later version.                          *
+ *                                                                           *
+ *  DMTCP:dmtcp/src is distributed in the hope that it will be useful,       *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of           *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the            *
+ *  GNU Lesser General Public License for more details.                      *
+ *                                                                           *
+ *  You should have received a copy of the GNU Lesser General Public         *
+ *  License along with DMTCP:dmtcp/src.  If not, see                         *
+ *  <http://www.gnu.org/licenses/>.                                          *
+ *****************************************************************************/
+
+/*****************************************************************************
+ *
+ *  Parallel restore (mtcp_restart --restore-threads N).
+ *
+ *  readmemoryareas() maps every area in image order, as usual, but skips
+ *  the contents of the large private anonymous areas instead of reading
+ *  them.  Once the memory map is complete, mtcp_parallel_restore_finish()
+ *  reads those contents with several helper threads:  each block listed
+ *  in the area index at the end of the image is read with pread() into its
+ *  place (and decompressed there, for in-process compressed images), and
+ *  the blocks are disjoint, so the threads need no locking.  Like lazy
+ *  restore, this needs a seekable image with an index;  otherwise, and for
+ *  areas that the index does not describe, the areas are read serially.
+ *
+ *  Nothing may be mapped here before the memory map is complete:  a later
+ *  area could be mapped over it with MAP_FIXED.  Hence the static tables.
+ *  Everything runs inside mtcp_restoreverything(), without TLS:  only
+ *  mtcp_sys_XXX() calls here.
+ *
+ *****************************************************************************/
+
+#include <errno.h>
+
+#include "mtcp_internal.h"
+#include "mtcp_util.h"
+
+/* Smaller areas are read serially:  not worth the seeks. */
+#define PARALLEL_MIN_AREA_SIZE (1024 * 1024)
+#define PARALLEL_MAX_AREAS 512
+
+typedef struct ParallelArea {
+  VA addr;
+  size_t size;
+  int prot;
+  int compressed;
+  off_t offset;      /* of the area contents in the image */
+  VA next;           /* end of the index entries found so far */
+  int serial;        /* not in the index after all:  read serially */
+} ParallelArea;
+
+typedef struct ParallelFill {
+  size_t volatile next_entry;
+  size_t volatile bytes_read;
+} ParallelFill;
+
+static int parallel_enabled = 0;
+static int num_threads = 1;
+static int ckpt_fd = -1;
+static off_t image_begin;
+static off_t index_offset;
+static MtcpIndexTrailer trailer;
+static ParallelArea areas[PARALLEL_MAX_AREAS];
+static int num_areas = 0;
+static MtcpIndexEntry *entries = MAP_FAILED;
+static size_t entries_size;
+static size_t num_entries = 0;
+static char *buffers = MAP_FAILED;    /* a stored block per thread */
+static size_t buffers_size;
+
+/* pread() leaves the file offset alone, so the threads share ckpt_fd.  This
+ * runs on helper threads, so it must not touch mtcp_sys_errno.
+ */
+static void pread_all(void *buf, size_t size, off_t offset)
+{
+  char *p = (char *) buf;
+  while (size > 0) {
+    long rc = mtcp_sys_pread_raw(ckpt_fd, p, size, offset);
+    if (rc <= 0) {
+      if (rc == -EINTR) {
+        continue;
+      }
+      MTCP_PRINTF("error %d reading %u bytes at offset %u of the image\n",
+                  (int) -rc, (unsigned) size, (unsigned) offset);
+      mtcp_abort();
+    }
+    p += rc;
+    size -= rc;
+    offset += rc;
+  }
+}
+
+/* Called before readmemoryareas().  Returns 0 if the areas can be read by
+ * nthreads threads, or -1 (and read everything serially) if not.
+ */
+__attribute__ ((visibility ("hidden")))
+int mtcp_parallel_restore_init(int fd, int nthreads)
+{
+  off_t cur, end;
+
+  parallel_enabled = 0;
+  num_areas = 0;
+  num_entries = 0;
+  if (nthreads <= 1) {
+    return -1;
+  }
+  num_threads = MIN(nthreads, MTCP_MAX_HELPER_THREADS);
+
+  cur = mtcp_sys_lseek(fd, 0, SEEK_CUR);
+  end = mtcp_sys_lseek(fd, 0, SEEK_END);
+  if (cur == -1 || end == -1 || mtcp_sys_lseek(fd, cur, SEEK_SET) != cur) {
+    MTCP_PRINTF("checkpoint image is not seekable; reading it serially\n");
+    return -1;
+  }
+  ckpt_fd = fd;
+  if (end < cur + (off_t) sizeof(trailer)) {
+    MTCP_PRINTF("checkpoint image has no area index; reading it serially\n");
+    return -1;
+  }
+  pread_all(&trailer, sizeof(trailer), end - sizeof(trailer));
+  index_offset = end - sizeof(trailer) -
+                 trailer.num_entries * sizeof(MtcpIndexEntry);
+  image_begin = index_offset - trailer.offset;
+  if (mtcp_memcmp(trailer.magic, MTCP_INDEX_MAGIC, sizeof(MTCP_INDEX_MAGIC))
+      != 0 || trailer.num_entries == 0 ||
+      index_offset < cur || image_begin < 0 || image_begin > cur) {
+    MTCP_PRINTF("checkpoint image has no area index; reading it serially\n");
+    return -1;
+  }
+  parallel_enabled = 1;
+  return 0;
+}
+
+/* Find the end of the contents of the area ending at end_addr in the image,
+ * by a binary search of the index on disk.  Returns -1 if not found.
+ */
+static off_t find_end_of_contents(VA end_addr)
+{
+  uint64_t lo = 0, hi = trailer.num_entries;
+  MtcpIndexEntry e;
+
+  while (lo < hi) {
+    uint64_t mid = lo + (hi - lo) / 2;
+    pread_all(&e, sizeof(e), index_offset + mid * sizeof(e));
+    if ((VA) e.addr + e.raw_size < end_addr) {
+      lo = mid + 1;
+    } else if ((VA) e.addr >= end_addr) {
+      hi = mid;
+    } else if ((VA) e.addr + e.raw_size == end_addr &&
+               !(e.flags & MTCP_INDEX_ZERO_PAGES)) {
+      return image_begin + e.offset + e.stored_size;
+    } else {
+      break;
+    }
+  }
+  return -1;
+}
+
+/* Called by readmemoryareas() for each private anonymous area, once it is
+ * mapped (writable) and before its contents are read.  Returns 1 if the
+ * area will be read by mtcp_parallel_restore_finish():  its contents have
+ * then been skipped, and mtcp_parallel_restore_finish() sets its protection.
+ */
+__attribute__ ((visibility ("hidden")))
+int mtcp_parallel_restore_area(Area *area, int compressed)
+{
+  ParallelArea *pa = &areas[num_areas];
+  off_t begin, end;
+
+  if (!parallel_enabled || area->size < PARALLEL_MIN_AREA_SIZE ||
+      num_areas == PARALLEL_MAX_AREAS ||
+      (num_areas > 0 && area->addr < pa[-1].addr + pa[-1].size)) {
+    return 0;
+  }
+  begin = mtcp_sys_lseek(mtcp_restore_cpfd, 0, SEEK_CUR);
+  end = find_end_of_contents(area->addr + area->size);
+  if (begin == -1 || end <= begin) {
+    return 0;
+  }
+
+  pa->addr = area->addr;
+  pa->size = area->size;
+  pa->prot = area->prot;
+  pa->compressed = compressed;
+  pa->offset = begin;
+  pa->next = area->addr;
+  pa->serial = 0;
+  num_areas++;
+
+  if (mtcp_sys_lseek(mtcp_restore_cpfd, end, SEEK_SET) != end) {
+    MTCP_PRINTF("error %d seeking in checkpoint image\n", mtcp_sys_errno);
+    mtcp_abort();
+  }
+  return 1;
+}
+
+static ParallelArea *find_area(VA addr)
+{
+  int lo = 0, hi = num_areas;
+  while (lo < hi) {
+    int mid = lo + (hi - lo) / 2;
+    if (areas[mid].addr + areas[mid].size <= addr) {
+      lo = mid + 1;
+    } else if (areas[mid].addr > addr) {
+      hi = mid;
+    } else {
+      return &areas[mid];
+    }
+  }
+  return NULL;
+}
+
+/* The index does not describe this area as expected:  read it now.  The
+ * other threads have not started yet, so the file offset is ours.
+ */
+static void restore_area_serially(ParallelArea *pa)
+{
+  MTCP_PRINTF("area at %p is not in the area index; reading it serially\n",
+              pa->addr);
+  if (mtcp_sys_lseek(ckpt_fd, pa->offset, SEEK_SET) != pa->offset) {
+    MTCP_PRINTF("error %d restoring area at %p\n", mtcp_sys_errno, pa->addr);
+    mtcp_abort();
+  }
+  if (pa->compressed) {
+    mtcp_readfile_compressed(ckpt_fd, pa->addr, pa->size);
+  } else {
+    mtcp_readfile(ckpt_fd, pa->addr, pa->size);
+  }
+  pa->serial = 1;
+}
+
+/* Keep the index entries that describe the areas skipped by
+ * readmemoryareas(), and check that they cover each area exactly.
+ */
+static void select_index_entries()
+{
+  size_t i, n = 0;
+  int j;
+
+  for (i = 0; i < num_entries; i++) {
+    MtcpIndexEntry *e = &entries[i];
+    ParallelArea *pa = find_area((VA) e->addr);
+    if (pa == NULL) {
+      continue;
+    }
+    if ((VA) e->addr != pa->next || e->raw_size == 0 ||
+        e->raw_size > MTCP_COMPRESS_BLOCK_SIZE ||
+        e->raw_size > (size_t) (pa->addr + pa->size - pa->next) ||
+        (e->flags & (MTCP_INDEX_ZERO_PAGES | MTCP_INDEX_PARENT_PAGES |
+                     MTCP_INDEX_CHUNK)) ||
+        ((e->flags & MTCP_INDEX_COMPRESSED) &&
+         (e->stored_size == 0 || e->stored_size > e->raw_size))) {
+      continue;
+    }
+    pa->next += e->raw_size;
+    entries[n++] = *e;
+  }
+  num_entries = n;
+
+  for (j = 0; j < num_areas; j++) {
+    if (areas[j].next != areas[j].addr + areas[j].size) {
+      restore_area_serially(&areas[j]);
+    }
+  }
+
+  /* Drop the entries of the areas that were just read. */
+  for (i = n = 0; i < num_entries; i++) {
+    ParallelArea *pa = find_area((VA) entries[i].addr);
+    if (pa != NULL && !pa->serial) {
+      entries[n++] = entries[i];
+    }
+  }
+  num_entries = n;
+}
+
+static void fill_entries(void *arg, int idx)
+{
+  ParallelFill *pf = (ParallelFill *) arg;
+  char *stored = buffers + idx * MTCP_COMPRESS_BLOCK_SIZE;
+  size_t i, bytes = 0;
+
+  while ((i = __sync_fetch_and_add(&pf->next_entry, 1)) < num_entries) {
+    MtcpIndexEntry *e = &entries[i];
+    if (e->flags & MTCP_INDEX_COMPRESSED) {
+      pread_all(stored, e->stored_size, image_begin + e->offset);
+      if (mtcp_decompress_block(stored, e->stored_size,
+                                (VA) e->addr, e->raw_size) == -1) {
+        MTCP_PRINTF("corrupt compressed block at %p (%u/%u bytes)\n",
+                    (VA) e->addr, (unsigned) e->stored_size,
+                    (unsigned) e->raw_size);
+        mtcp_abort();
+      }
+    } else {
+      pread_all((VA) e->addr, e->raw_size, image_begin + e->offset);
+    }
+    bytes += e->stored_size;
+  }
+  __sync_fetch_and_add(&pf->bytes_read, bytes);
+}
+
+/* Called after readmemoryareas(), when the memory map of the restarted
+ * process is complete, and before mtcp_restore_cpfd is closed.  Reads the
+ * areas skipped by mtcp_parallel_restore_area() and returns when all of
+ * them are in place.
+ */
+__attribute__ ((visibility ("hidden")))
+void mtcp_parallel_restore_finish()
+{
+  ParallelFill pf;
+  int j;
+
+  if (!parallel_enabled) {
+    return;
+  }
+  parallel_enabled = 0;
+  if (num_areas == 0) {
+    return;
+  }
+
+  entries_size = (trailer.num_entries * sizeof(MtcpIndexEntry) +
+                  MTCP_PAGE_SIZE - 1) & MTCP_PAGE_MASK;
+  entries = mtcp_sys_mmap(NULL, entries_size, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  buffers_size = num_threads * MTCP_COMPRESS_BLOCK_SIZE;
+  buffers = mtcp_sys_mmap(NULL, buffers_size, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (entries == MAP_FAILED || buffers == MAP_FAILED) {
+    MTCP_PRINTF("error %d setting up parallel restore\n", mtcp_sys_errno);
+    mtcp_abort();
+  }
+  num_entries = trailer.num_entries;
+  pread_all(entries, num_entries * sizeof(MtcpIndexEntry), index_offset);
+  if (mtcp_checksum(entries, num_entries * sizeof(MtcpIndexEntry))
+      != trailer.checksum) {
+    MTCP_PRINTF("bad checksum of the area index\n");
+    num_entries = 0;
+  }
+  select_index_entries();
+
+  pf.next_entry = 0;
+  pf.bytes_read = 0;
+  mtcp_run_helper_threads(num_threads, fill_entries, &pf);
+  DPRINTF("read %u blocks (%p bytes) in parallel\n",
+          (unsigned) num_entries, (size_t) pf.bytes_read);
+
+  /* readmemoryareas() left these areas writable for us. */
+  for (j = 0; j < num_areas; j++) {
+    if (!(areas[j].prot & PROT_WRITE) &&
+        mtcp_sys_mprotect(areas[j].addr, areas[j].size, areas[j].prot) < 0) {
+      MTCP_PRINTF("error %d write-protecting %p bytes at %p\n",
+                  mtcp_sys_errno, areas[j].size, areas[j].addr);
+      mtcp_abort();
+    }
+  }
+
+  mtcp_sys_munmap(entries, entries_size);
+  mtcp_sys_munmap(buffers, buffers_size);
+  entries = MAP_FAILED;
+  buffers = MAP_FAILED;
+  num_areas = 0;
+}
@@ -0,0 +1,305 @@
+/*****************************************************************************
+ *   Copyright (C) 2006-2013 by Michael Rieker, Jason Ansel, Kapil Arya, and *
+ *                                                            Gene Cooperman *
+ *   mrieker@nii.net, jansel@csail.mit.edu, kapil@ccs.neu.edu, and           *
+ *                                                          gene@ccs.neu.edu *
+ *                                                                           *
+ *   This file is part of the MTCP module of DMTCP (DMTCP:mtcp).             *
+ *                                                                           *
+ *  DMTCP:mtcp is free software: you can redistribute it and/or              *
+ *  modify it under the terms of the GNU Lesser General Public License as    *
+ *  published by the Free Software Foundation, either version 3 of the       *
+ *  License, or (at your option) any later version.                          *
+ *                                                                           *
+ *  DMTCP:dmtcp/src is distributed in the hope that it will be useful,       *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of           *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the            *
+ *  GNU Lesser General Public License for more details.                      *
+ *                                                                           *
+ *  You should have received a copy of the GNU Lesser General Public         *
+ *  License along with DMTCP:dmtcp/src.  If not, see                         *
+ *  <http://www.gnu.org/licenses/>.                                          *
+ *****************************************************************************/
+
+/*****************************************************************************
+ *
+ *  Restart from an incremental image (see mtcp_writeckpt.c).
+ *
+ *  readmemoryareas() maps each MTCP_PROT_PARENT_PAGE record as fresh
+ *  anonymous memory, and mtcp_restore_parent_pages() reads its contents
+ *  from the parent image named in the header.  The area index of the parent
+ *  tells where each block is;  where the parent has MTCP_INDEX_PARENT_PAGES
+ *  entries in turn, the pages come from its own parent, and so on.  Blocks
+ *  with MTCP_INDEX_CHUNK are read from the chunk store.  The parent images
+ *  are opened as needed, in the directory of the image being restored, and
+ *  closed by mtcp_parent_images_close().
+ *
+ *  This runs inside mtcp_restoreverything(), on the small temporary stack:
+ *  only mtcp_sys_XXX() calls, no recursion, and the state is static.
+ *
+ *****************************************************************************/
+
+#include <errno.h>
+
+#include "mtcp_internal.h"
+#include "mtcp_util.h"
+
+typedef struct ParentImage {
+  int fd;
+  off_t image_begin;      /* Offset of the MAGIC */
+  off_t index_offset;
+  uint64_t num_entries;
+  uint64_t last_entry;    /* Found by the last search */
+} ParentImage;
+
+/* images[0] is the image being restored, images[k + 1] the parent of
+ * images[k].
+ */
+static ParentImage images[MTCP_MAX_PARENT_IMAGES + 1];
+static int num_images = 0;
+static char image_dir[PATH_MAX];
+static char chunk_store[PATH_MAX];
+static char path[PATH_MAX];
+static char header[MAGIC_LEN + sizeof(mtcp_ckpt_image_hdr_t)];
+/* Stored block, then raw block;  mapped during one call only */
+static char *buffers = MAP_FAILED;
+static int buffer_image;      /* The raw block holds this image's block */
+static uint64_t buffer_offset;
+
+static void pread_all(int fd, void *buf, size_t size, off_t offset)
+{
+  char *p = (char *) buf;
+  while (size > 0) {
+    ssize_t rc = mtcp_sys_pread(fd, p, size, offset);
+    if (rc <= 0) {
+      if (rc == -1 && mtcp_sys_errno == EINTR) {
+        continue;
+      }
+      MTCP_PRINTF("error %d reading %u bytes at offset %u of a parent image\n",
+                  rc == 0 ? 0 : mtcp_sys_errno, (unsigned) size,
+                  (unsigned) offset);
+      mtcp_abort();
+    }
+    p += rc;
+    size -= rc;
+    offset += rc;
+  }
+}
+
+/* Find the area index of the image open on fd. */
+static void open_image(ParentImage *img, int fd, const char *name)
+{
+  MtcpIndexTrailer trailer;
+  off_t cur = mtcp_sys_lseek(fd, 0, SEEK_CUR);
+  off_t end = mtcp_sys_lseek(fd, 0, SEEK_END);
+
+  if (cur == -1 || end == -1 || mtcp_sys_lseek(fd, cur, SEEK_SET) != cur ||
+      end < (off_t) sizeof(trailer)) {
+    MTCP_PRINTF("%s is not seekable;  cannot restore incremental image\n",
+                name);
+    mtcp_abort();
+  }
+  pread_all(fd, &trailer, sizeof(trailer), end - sizeof(trailer));
+  img->fd = fd;
+  img->num_entries = trailer.num_entries;
+  img->index_offset = end - sizeof(trailer) -
+                      trailer.num_entries * sizeof(MtcpIndexEntry);
+  img->image_begin = img->index_offset - trailer.offset;
+  img->last_entry = 0;
+  if (mtcp_memcmp(trailer.magic, MTCP_INDEX_MAGIC, sizeof(MTCP_INDEX_MAGIC))
+      != 0 || img->index_offset < 0 || img->image_begin < 0) {
+    MTCP_PRINTF("%s has no area index;  cannot restore incremental image\n",
+                name);
+    mtcp_abort();
+  }
+}
+
+/* Open the parent of images[k] as images[k + 1]. */
+static void open_parent(int k)
+{
+  mtcp_ckpt_image_hdr_t *hdr = (mtcp_ckpt_image_hdr_t *) &header[MAGIC_LEN];
+  int fd;
+
+  if (k == MTCP_MAX_PARENT_IMAGES) {
+    MTCP_PRINTF("more than %d parent images\n", MTCP_MAX_PARENT_IMAGES);
+    mtcp_abort();
+  }
+  pread_all(images[k].fd, header, sizeof(header), images[k].image_begin);
+  hdr->parent_name[sizeof(hdr->parent_name) - 1] = '\0';
+  if (mtcp_memcmp(header, MAGIC, MAGIC_LEN) != 0 || hdr->version < 3 ||
+      hdr->parent_name[0] == '\0') {
+    MTCP_PRINTF("image %d of the chain has pages of a parent image,"
+                " but no parent\n", k);
+    mtcp_abort();
+  }
+  if (mtcp_strlen(image_dir) + mtcp_strlen(hdr->parent_name) >= PATH_MAX) {
+    MTCP_PRINTF("parent image name too long: %s\n", hdr->parent_name);
+    mtcp_abort();
+  }
+  mtcp_strncpy(path, image_dir, sizeof(path));
+  mtcp_strncat(path, hdr->parent_name, mtcp_strlen(hdr->parent_name) + 1);
+
+  fd = mtcp_sys_open2(path, O_RDONLY);
+  if (fd < 0) {
+    MTCP_PRINTF("error %d opening parent image %s\n", mtcp_sys_errno, path);
+    mtcp_abort();
+  }
+  DPRINTF("parent image %d is %s\n", k + 1, path);
+  open_image(&images[k + 1], fd, path);
+  num_images = k + 2;
+}
+
+static int entry_contains(MtcpIndexEntry *e, VA addr)
+{
+  return (VA) e->addr <= addr && addr < (VA) e->addr + e->raw_size;
+}
+
+/* Find the index entry of img containing addr:  usually the one found last
+ * time, or the next one.  Else search the index on disk, sorted by address.
+ */
+static int find_entry(ParentImage *img, VA addr, MtcpIndexEntry *e)
+{
+  uint64_t lo = 0, hi = img->num_entries, i;
+
+  for (i = img->last_entry; i < img->last_entry + 2; i++) {
+    if (i < img->num_entries) {
+      pread_all(img->fd, e, sizeof(*e),
+                img->index_offset + i * sizeof(*e));
+      if (entry_contains(e, addr)) {
+        img->last_entry = i;
+        return 1;
+      }
+    }
+  }
+  while (lo < hi) {
+    uint64_t mid = lo + (hi - lo) / 2;
+    pread_all(img->fd, e, sizeof(*e), img->index_offset + mid * sizeof(*e));
+    if ((VA) e->addr + e->raw_size <= addr) {
+      lo = mid + 1;
+    } else if ((VA) e->addr > addr) {
+      hi = mid;
+    } else {
+      img->last_entry = mid;
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/* Copy size bytes at addr from the block of entry e of images[k]. */
+static void copy_from_entry(int k, MtcpIndexEntry *e, VA addr, size_t size)
+{
+  ParentImage *img = &images[k];
+  size_t skip = addr - (VA) e->addr;
+  char *stored, *raw;
+  size_t i;
+
+  if (e->flags & MTCP_INDEX_ZERO_PAGES) {
+    return;  /* Freshly mapped:  zero already */
+  }
+  if (!(e->flags & (MTCP_INDEX_COMPRESSED | MTCP_INDEX_CHUNK))) {
+    pread_all(img->fd, addr, size, img->image_begin + e->offset + skip);
+    return;
+  }
+
+  if (e->raw_size > MTCP_COMPRESS_BLOCK_SIZE ||
+      e->stored_size > e->raw_size) {
+    MTCP_PRINTF("bad index entry for %p in parent image %d\n", addr, k);
+    mtcp_abort();
+  }
+  if (buffers == MAP_FAILED) {
+    buffers = mtcp_sys_mmap(NULL, 2 * MTCP_COMPRESS_BLOCK_SIZE,
+                            PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (buffers == MAP_FAILED) {
+      MTCP_PRINTF("error %d allocating decompression buffers\n",
+                  mtcp_sys_errno);
+      mtcp_abort();
+    }
+    buffer_image = -1;
+  }
+  stored = buffers;
+  raw = buffers + MTCP_COMPRESS_BLOCK_SIZE;
+  if (buffer_image != k || buffer_offset != e->offset) {
+    pread_all(img->fd, stored, e->stored_size,
+              img->image_begin + e->offset);
+    if (e->flags & MTCP_INDEX_CHUNK) {
+      MtcpChunkRef *ref = (MtcpChunkRef *) stored;
+      if (e->stored_size != sizeof(*ref) || ref->raw_size != e->raw_size) {
+        MTCP_PRINTF("bad chunk reference for %p in parent image %d\n",
+                    addr, k);
+        mtcp_abort();
+      }
+      mtcp_read_chunk(chunk_store, ref, raw, stored + sizeof(*ref));
+    } else if (mtcp_decompress_block(stored, e->stored_size,
+                                     raw, e->raw_size) == -1) {
+      MTCP_PRINTF("corrupt compressed block at %p in parent image %d\n",
+                  (VA) e->addr, k);
+      mtcp_abort();
+    }
+    buffer_image = k;
+    buffer_offset = e->offset;
+  }
+  for (i = 0; i < size; i++) {
+    addr[i] = raw[skip + i];
+  }
+}
+
+/* Called by readmemoryareas() for each MTCP_PROT_PARENT_PAGE record, once
+ * [addr, addr + size) is mapped writable.  Each piece of it is looked up in
+ * the image being restored, then in its parents, until one has contents.
+ */
+__attribute__ ((visibility ("hidden")))
+void mtcp_restore_parent_pages(VA addr, size_t size)
+{
+  if (num_images == 0) {
+    open_image(&images[0], mtcp_restore_cpfd, "checkpoint image");
+    mtcp_get_image_dir(mtcp_restore_cpfd, image_dir,
+                       sizeof(image_dir) - sizeof(MTCP_CHUNK_STORE_DIR));
+    mtcp_strncpy(chunk_store, image_dir, sizeof(chunk_store));
+    mtcp_strncat(chunk_store, MTCP_CHUNK_STORE_DIR "/",
+                 sizeof(MTCP_CHUNK_STORE_DIR "/"));
+    num_images = 1;
+  }
+
+  while (size > 0) {
+    MtcpIndexEntry e;
+    size_t n = size;
+    int k = 0;
+
+    while (1) {
+      if (!find_entry(&images[k], addr, &e)) {
+        MTCP_PRINTF("page at %p is not in image %d of the chain\n", addr, k);
+        mtcp_abort();
+      }
+      n = MIN(n, (size_t) ((VA) e.addr + e.raw_size - addr));
+      if (!(e.flags & MTCP_INDEX_PARENT_PAGES)) {
+        break;
+      }
+      if (k + 1 == num_images) {
+        open_parent(k);
+      }
+      k++;
+    }
+    copy_from_entry(k, &e, addr, n);
+    addr += n;
+    size -= n;
+  }
+
+  /* Out of the way of the next areas to be mapped */
+  if (buffers != MAP_FAILED) {
+    mtcp_sys_munmap(buffers, 2 * MTCP_COMPRESS_BLOCK_SIZE);
+    buffers = MAP_FAILED;
+  }
+}
+
+/* Called after readmemoryareas(). */
+__attribute__ ((visibility ("hidden")))
+void mtcp_parent_images_close()
+{
+  int k;
+  for (k = 1; k < num_images; k++) {
+    mtcp_sys_close(images[k].fd);
+  }
+  num_images = 0;
+}
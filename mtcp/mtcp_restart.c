@@ -76,6 +76,16 @@ static const char* theUsage =
       " <ckeckpointfile>\n\n"
   "mtcp_restart [--fd <ckpt-fd>] [--gzip-child-pid <pid>]"
       " [--rename-ckpt <newname>] [--stderr-fd <fd>]\n\n"
+  "  --fast-restart:\n"
+  "               Map the read-only anonymous memory of an uncompressed\n"
+  "               checkpoint file from the file, copy-on-write, instead of\n"
+  "               reading it.\n"
+  "  --lazy:      Resume before the memory is restored, and fill it in on\n"
+  "               demand from the (uncompressed or in-process compressed)\n"
+  "               checkpoint file.  Needs userfaultfd() from the kernel.\n"
+  "  --restore-threads <n>:\n"
+  "               Read the large memory areas of a seekable (uncompressed or\n"
+  "               in-process compressed) checkpoint file with n threads.\n"
   "  --help:      Print this message and exit.\n"
   "  --version:   Print version information and exit.\n"
   "\n"
@@ -86,9 +96,9 @@ int main (int argc, char *argv[], char *envp[])
 {
   char *restorename;
   int fd, verify;
-  int should_mmap_ckpt_image = 0;
+  int restore_flags = 0;
   size_t offset=0;
-  void (*restore_start) (int fd, int verify, int should_mmap_ckpt_image,
+  void (*restore_start) (int fd, int verify, int restore_flags,
                          pid_t decomp_child_pid,
                          char *ckpt_newname, char *cmd_file,
                          char *argv[], char *envp[]);
@@ -141,8 +151,16 @@ int main (int argc, char *argv[], char *envp[])
       dmtcp_info_stderr_fd = mtcp_atoi(argv[1]);
       shift; shift;
     } else if (mtcp_strcmp (argv[0], "--fast-restart") == 0 && argc >= 2) {
-      should_mmap_ckpt_image = 1;
+      restore_flags |= MTCP_RESTORE_MMAP_IMAGE;
       shift;
+    } else if (mtcp_strcmp (argv[0], "--lazy") == 0 && argc >= 2) {
+      restore_flags |= MTCP_RESTORE_LAZY;
+      shift;
+    } else if (mtcp_strcmp (argv[0], "--restore-threads") == 0 && argc >= 3) {
+      int n = MIN(MAX(mtcp_atoi(argv[1]), 1), MTCP_MAX_HELPER_THREADS);
+      restore_flags &= (1 << MTCP_RESTORE_THREADS_SHIFT) - 1;
+      restore_flags |= n << MTCP_RESTORE_THREADS_SHIFT;
+      shift; shift;
     } else if (mtcp_strcmp (argv[0], "--") == 0 && argc == 2) {
       restorename = argv[1];
       break;
@@ -159,7 +177,7 @@ int main (int argc, char *argv[], char *envp[])
   argc = orig_argc;
 
 #ifdef FAST_RST_VIA_MMAP
-  should_mmap_ckpt_image = 1;
+  restore_flags |= MTCP_RESTORE_MMAP_IMAGE;
 #endif
 
   /* XXX XXX XXX:
@@ -212,7 +230,8 @@ int main (int argc, char *argv[], char *envp[])
   }
 
   if (restorename != NULL) {
-    fd = open_ckpt_to_read(restorename, should_mmap_ckpt_image, envp);
+    fd = open_ckpt_to_read(restorename,
+                           restore_flags & MTCP_RESTORE_MMAP_IMAGE, envp);
   }
   if (offset > 0) {
     //skip into the file a bit
@@ -252,7 +271,7 @@ int main (int argc, char *argv[], char *envp[])
 #endif
 
   /* Now call it - it shouldn't return */
-  (*restore_start) (fd, verify, should_mmap_ckpt_image, decomp_child_pid,
+  (*restore_start) (fd, verify, restore_flags, decomp_child_pid,
                     ckpt_newname, cmd_file, argv, envp);
   MTCP_PRINTF("restore routine returned (it should never do this!)\n");
   mtcp_abort ();
@@ -436,8 +455,8 @@ static int open_ckpt_to_read(char *filename, int should_mmap_ckpt_image,
   }
 
   if (should_mmap_ckpt_image) {
-    MTCP_PRINTF("***ERROR: --fast-restart not supported with compressed files\n");
-    mtcp_abort();
+    MTCP_PRINTF("WARNING: --fast-restart not supported with compressed files;"
+                " reading the image\n");
   }
 
   if (tmpBuf[0] == GZIP_FIRST
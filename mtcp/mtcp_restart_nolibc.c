@@ -60,6 +60,8 @@ __attribute__ ((visibility ("hidden")))
   pid_t mtcp_restore_gzip_child_pid = -1; // '-1' puts it in regular data
                                           // instead of common
 __attribute__ ((visibility ("hidden"))) char mtcp_ckpt_newname[PATH_MAX+1];
+/* The image that areas were mapped from by --fast-restart, or "" */
+__attribute__ ((visibility ("hidden"))) char mtcp_mapped_image_name[PATH_MAX];
 #define MAX_ARGS 50
 __attribute__ ((visibility ("hidden"))) char *mtcp_restore_cmd_file;
 
@@ -89,9 +91,14 @@ asm (".text");
 	/* Internal routines */
 
 static void readfiledescrs (void);
-static void readmemoryareas (int should_mmap_ckpt_image);
+static void readmemoryareas (int should_mmap_ckpt_image, int lazy,
+                             int parallel);
+static int can_mmap_contents(Area *area, int encoding);
 static void mmapfile(int fd, void *buf, size_t size, int prot, int flags);
-static void read_shared_memory_area_from_file(Area* area, int flags);
+static void read_shared_memory_area_from_file(Area* area, int flags,
+                                              int encoding);
+static void readareacontents(Area *area, int encoding);
+static void skipareacontents(Area *area, int encoding);
 static VA highest_userspace_address (VA *vdso_addr, VA *vsyscall_addr,
                                      VA * stack_end_addr);
 static char* fix_filename_if_new_cwd(char* filename);
@@ -109,10 +116,10 @@ static VA global_vdso_addr = 0;
  *****************************************************************************/
 
 __attribute__ ((visibility ("hidden")))
-void mtcp_restoreverything (int should_mmap_ckpt_image, VA finishrestore_fptr)
+void mtcp_restoreverything (int restore_flags, VA finishrestore_fptr)
 
 {
-  int rc;
+  int rc, lazy, parallel;
   VA holebase, highest_va;
   VA vdso_addr = NULL, vsyscall_addr = NULL, stack_end_addr = NULL;
   VA current_brk;
@@ -271,7 +278,33 @@ void mtcp_restoreverything (int should_mmap_ckpt_image, VA finishrestore_fptr)
 
   global_vdso_addr = vdso_addr;/* This global var goes away when linker used. */
   DPRINTF("restoring memory areas\n");
-  readmemoryareas (should_mmap_ckpt_image);
+  /* The next checkpoint must not take the pages mapped from the image for
+   * holes (see mtcp_writeckpt.c).
+   */
+  mtcp_mapped_image_name[0] = '\0';
+  if ((restore_flags & MTCP_RESTORE_MMAP_IMAGE) &&
+      mtcp_get_fd_path(mtcp_restore_cpfd, mtcp_mapped_image_name,
+                       sizeof(mtcp_mapped_image_name)) <= 0) {
+    MTCP_PRINTF("cannot find the checkpoint image file; reading it\n");
+    mtcp_mapped_image_name[0] = '\0';
+    restore_flags &= ~MTCP_RESTORE_MMAP_IMAGE;
+  }
+  lazy = (restore_flags & MTCP_RESTORE_LAZY) &&
+         mtcp_lazy_restore_init(mtcp_restore_cpfd) == 0;
+  parallel = !lazy &&
+             mtcp_parallel_restore_init(mtcp_restore_cpfd,
+                                        MTCP_RESTORE_THREADS(restore_flags))
+             == 0;
+  readmemoryareas (restore_flags & MTCP_RESTORE_MMAP_IMAGE, lazy, parallel);
+  mtcp_parent_images_close();
+  if (lazy) {
+    /* Fills in the rest of memory in the background, from a dup of cpfd */
+    mtcp_lazy_restore_start();
+  }
+  if (parallel) {
+    /* Reads the large areas skipped by readmemoryareas() with helpers */
+    mtcp_parallel_restore_finish();
+  }
 
   /* Everything restored, close file and finish up */
 
@@ -397,7 +430,8 @@ static void readfiledescrs (void)
  *
  **************************************************************************/
 
-static void readmemoryareas (int should_mmap_ckpt_image)
+static void readmemoryareas (int should_mmap_ckpt_image, int lazy,
+                             int parallel)
 {
   Area area;
   int flags, imagefd;
@@ -405,9 +439,14 @@ static void readmemoryareas (int should_mmap_ckpt_image)
 
   while (1) {
     int try_skipping_existing_segment = 0;
+    int encoding;
     mtcp_readfile(mtcp_restore_cpfd, &area, sizeof area);
     if (area.size == -1) break;
 
+    /* Not real protection bits:  must not get to mmap() or mprotect() */
+    encoding = area.prot & (MTCP_PROT_COMPRESSED | MTCP_PROT_CHUNKS);
+    area.prot &= ~encoding;
+
     if (area.name && mtcp_strstr(area.name, "[heap]")
         && mtcp_sys_brk(NULL) != area.addr + area.size) {
       DPRINTF("WARNING: break (%p) not equal to end of heap (%p)\n",
@@ -420,7 +459,28 @@ static void readmemoryareas (int should_mmap_ckpt_image)
 		  "*** Turning off MAP_ANONYMOUS and hoping for best.\n\n");
     }
 
-    if ((area.prot & MTCP_PROT_ZERO_PAGE) != 0) {
+    if ((area.prot & MTCP_PROT_PARENT_PAGE) != 0) {
+      /* Incremental image:  the contents are in the parent image(s) */
+      area.prot &= ~MTCP_PROT_PARENT_PAGE;
+      DPRINTF("restoring anonymous area %p at %p from parent image\n",
+              area.size, area.addr);
+      mmappedat = mtcp_sys_mmap (area.addr, area.size, area.prot | PROT_WRITE,
+                                 area.flags | MAP_FIXED, -1, 0);
+      if (mmappedat != area.addr) {
+        MTCP_PRINTF("error %d mapping %p bytes at %p\n",
+                    mtcp_sys_errno, area.size, area.addr);
+        mtcp_abort ();
+      }
+      mtcp_restore_parent_pages(area.addr, area.size);
+      if (!(area.prot & PROT_WRITE) &&
+          mtcp_sys_mprotect (area.addr, area.size, area.prot) < 0) {
+        MTCP_PRINTF("error %d write-protecting %p bytes at %p\n",
+                    mtcp_sys_errno, area.size, area.addr);
+        mtcp_abort ();
+      }
+    }
+
+    else if ((area.prot & MTCP_PROT_ZERO_PAGE) != 0) {
       DPRINTF("restoring non-rwx anonymous area %p at %p\n",
               area.size, area.addr);
       mmappedat = mtcp_sys_mmap (area.addr, area.size,
@@ -434,9 +494,11 @@ static void readmemoryareas (int should_mmap_ckpt_image)
       }
     }
 
-    else if (should_mmap_ckpt_image && (area.flags & MAP_ANONYMOUS)) {
-      mmapfile (mtcp_restore_cpfd, area.addr, area.size, area.prot | PROT_WRITE,
-                area.flags & ~MAP_ANONYMOUS);
+    else if (should_mmap_ckpt_image && can_mmap_contents(&area, encoding)) {
+      DPRINTF("mapping anonymous area %p at %p from the image\n",
+              area.size, area.addr);
+      mmapfile (mtcp_restore_cpfd, area.addr, area.size, area.prot,
+                (area.flags & ~MAP_ANONYMOUS) | MAP_FIXED);
     }
 
     /* CASE MAP_ANONYMOUS (usually implies MAP_PRIVATE):
@@ -511,12 +573,12 @@ static void readmemoryareas (int should_mmap_ckpt_image)
         }
 # else
         // This fails in CERN Linux 2.6.9; can't readfile on top of vsyscall
-        mtcp_readfile(mtcp_restore_cpfd, area.addr, area.size);
+        readareacontents(&area, encoding);
 # endif
 #else
 # ifdef __x86_64__
         // This fails on teracluster.  Presumably extra symbols cause overflow.
-        mtcp_skipfile(mtcp_restore_cpfd, area.size);
+        skipareacontents(&area, encoding);
 # else
         // With Red Hat Release 5.2, Red Hat allows vdso to go almost anywhere.
         // If we were unlucky and it was randomized onto our memory area, re-exec.
@@ -537,22 +599,27 @@ static void readmemoryareas (int should_mmap_ckpt_image)
                                     mtcp_restore_argv, mtcp_restore_envp))
             DPRINTF("execve failed.  Restart may fail.\n");
         } else {
-          mtcp_skipfile(mtcp_restore_cpfd, area.size);
+          skipareacontents(&area, encoding);
         }
 # endif
 #endif
       } else {
-        /* This mmapfile after prev. mmap is okay; use same args again.
-         *  Posix says prev. map will be munmapped.
-         */
-        /* ANALYZE THE CONDITION FOR DOING mmapfile MORE CAREFULLY. */
-        if (should_mmap_ckpt_image
-            && mtcp_strstr(area.name, "[vdso]")
-            && mtcp_strstr(area.name, "[vsyscall]")) {
-          mmapfile (mtcp_restore_cpfd, area.addr, area.size,
-                    area.prot | PROT_WRITE, area.flags);
+        if (lazy && (area.flags & MAP_ANONYMOUS)
+            && (area.flags & MAP_PRIVATE)
+            && encoding != MTCP_PROT_CHUNKS
+            && mtcp_lazy_restore_area(&area, encoding != 0)) {
+          /* Contents skipped.  mtcp_lazy_restore_start() write-protects. */
+          continue;
+        } else if (parallel && (area.flags & MAP_ANONYMOUS)
+                   && (area.flags & MAP_PRIVATE)
+                   && encoding != MTCP_PROT_CHUNKS
+                   && mtcp_parallel_restore_area(&area, encoding != 0)) {
+          /* Contents skipped.  mtcp_parallel_restore_finish() reads them
+           * and write-protects.
+           */
+          continue;
         } else {
-          mtcp_readfile(mtcp_restore_cpfd, area.addr, area.size);
+          readareacontents(&area, encoding);
         }
         if (!(area.prot & PROT_WRITE))
           if (mtcp_sys_mprotect (area.addr, area.size, area.prot) < 0) {
@@ -581,7 +648,7 @@ static void readmemoryareas (int should_mmap_ckpt_image)
       }
 
       if (area.prot & MAP_SHARED) {
-        read_shared_memory_area_from_file(&area, flags);
+        read_shared_memory_area_from_file(&area, flags, encoding);
       } else { /* not MAP_ANONYMOUS, not MAP_SHARED */
         /* During checkpoint, MAP_ANONYMOUS flag is forced whenever MAP_PRIVATE
          * is set. There is no reason for any mapping to have MAP_PRIVATE and
@@ -595,6 +662,31 @@ static void readmemoryareas (int should_mmap_ckpt_image)
   }
 }
 
+/* Read the contents of an area from the checkpoint image into area->addr.
+ * encoding is MTCP_PROT_COMPRESSED, MTCP_PROT_CHUNKS or 0 (raw).
+ */
+static void readareacontents(Area *area, int encoding)
+{
+  if (encoding == MTCP_PROT_CHUNKS) {
+    mtcp_readfile_chunks(mtcp_restore_cpfd, area->addr, area->size);
+  } else if (encoding == MTCP_PROT_COMPRESSED) {
+    mtcp_readfile_compressed(mtcp_restore_cpfd, area->addr, area->size);
+  } else {
+    mtcp_readfile(mtcp_restore_cpfd, area->addr, area->size);
+  }
+}
+
+static void skipareacontents(Area *area, int encoding)
+{
+  if (encoding == MTCP_PROT_CHUNKS) {
+    mtcp_skipfile_chunks(mtcp_restore_cpfd, area->size);
+  } else if (encoding == MTCP_PROT_COMPRESSED) {
+    mtcp_skipfile_compressed(mtcp_restore_cpfd, area->size);
+  } else {
+    mtcp_skipfile(mtcp_restore_cpfd, area->size);
+  }
+}
+
 static void adjust_for_smaller_file_size(Area *area, int fd)
 {
   off_t curr_size = mtcp_sys_lseek(fd, 0, SEEK_END);
@@ -646,7 +738,8 @@ static void adjust_for_smaller_file_size(Area *area, int fd)
  * Other than these, if we can't access the file, we print an error message
  * and quit.
  */
-static void read_shared_memory_area_from_file(Area* area, int flags)
+static void read_shared_memory_area_from_file(Area* area, int flags,
+                                              int encoding)
 {
   void *mmappedat;
   int areaContentsAlreadyRead = 0;
@@ -709,7 +802,7 @@ static void read_shared_memory_area_from_file(Area* area, int flags)
     }
 
     // Overwrite mmap'ed memory region with contents from original ckpt image.
-    mtcp_readfile(mtcp_restore_cpfd, area->addr, area->size);
+    readareacontents(area, encoding);
 
     areaContentsAlreadyRead = 1;
 
@@ -797,7 +890,7 @@ static void read_shared_memory_area_from_file(Area* area, int flags)
 #else
     if (area->prot & PROT_WRITE) {
       MTCP_PRINTF("mapping %s with data from ckpt image\n", area->name);
-      mtcp_readfile(mtcp_restore_cpfd, area->addr, area->size);
+      readareacontents(area, encoding);
     }
 #endif
     // If we have no write permission on file, then we should use data
@@ -838,13 +931,37 @@ static void read_shared_memory_area_from_file(Area* area, int flags)
                       area->name, __FILE__, __LINE__);
         }
       }
-      mtcp_skipfile(mtcp_restore_cpfd, area->size);
+      skipareacontents(area, encoding);
     }
   }
   if (imagefd >= 0)
     mtcp_sys_close (imagefd); // don't leave dangling fd in way of other stuff
 }
 
+/* mtcp_restart --fast-restart maps the contents of an area straight from
+ * the image, copy-on-write, if the area is read-only private anonymous
+ * memory with no name (files, [heap] and [stack] keep theirs, and [vdso]
+ * and [vsyscall] are never mapped) and its contents are stored raw at a
+ * page boundary of the image file.  Uncompressed images keep area contents
+ * page-aligned; an image read through a pipe, or at an odd --offset, is
+ * read instead.  A writable area stays anonymous and its contents are
+ * copied in:  mapped from the image, pages that the process discards with
+ * MADV_DONTNEED would read back as the image instead of as zeros.
+ */
+static int can_mmap_contents(Area *area, int encoding)
+{
+  off_t offset;
+
+  if (encoding != 0 || area->name[0] != '\0' ||
+      (area->prot & PROT_WRITE) ||
+      (area->flags & (MAP_ANONYMOUS | MAP_PRIVATE))
+        != (MAP_ANONYMOUS | MAP_PRIVATE)) {
+    return 0;
+  }
+  offset = mtcp_sys_lseek(mtcp_restore_cpfd, 0, SEEK_CUR);
+  return offset != -1 && (offset & MTCP_PAGE_OFFSET_MASK) == 0;
+}
+
 static void mmapfile(int fd, void *buf, size_t size, int prot, int flags)
 {
   void *addr;
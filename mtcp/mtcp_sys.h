@@ -240,6 +240,11 @@ static char * mtcp_sys_strcpy(char *dest, const char *source) {
 // Rename it for cosmetic reasons.  We export mtcp_inline_syscall.
 #define mtcp_inline_syscall(name, num_args, args...) \
                                         INLINE_SYSCALL(name, num_args, args)
+/* As mtcp_inline_syscall(), but a failure returns -errno and leaves the
+ * global mtcp_sys_errno alone.  Code running on helper threads uses this.
+ */
+#define mtcp_raw_syscall(name, num_args, args...) \
+                        ((long) INTERNAL_SYSCALL(name, err, num_args, args))
 
 /* We allocate this in mtcp_safemmap.c.  Files using mtcp_sys.h
  * are also linking with mtcp_safemmap.c.
@@ -369,6 +374,8 @@ struct linux_dirent {
 #define mtcp_sys_access(args...)  mtcp_inline_syscall(access,2,args)
 #define mtcp_sys_fchmod(args...)  mtcp_inline_syscall(fchmod,2,args)
 #define mtcp_sys_rename(args...)  mtcp_inline_syscall(rename,2,args)
+#define mtcp_sys_unlink(args...)  mtcp_inline_syscall(unlink,1,args)
+#define mtcp_sys_fsync(args...)  mtcp_inline_syscall(fsync,1,args)
 #define mtcp_sys_exit(args...)  mtcp_inline_syscall(exit,1,args)
 #define mtcp_sys_pipe(args...)  mtcp_inline_syscall(pipe,1,args)
 #define mtcp_sys_dup(args...)  mtcp_inline_syscall(dup,1,args)
@@ -392,11 +399,55 @@ struct linux_dirent {
 #define mtcp_sys_mremap(args...)  (void *)mtcp_inline_syscall(mremap,4,args)
 #define mtcp_sys_munmap(args...)  mtcp_inline_syscall(munmap,2,args)
 #define mtcp_sys_mprotect(args...)  mtcp_inline_syscall(mprotect,3,args)
+#define mtcp_sys_madvise(args...)  mtcp_inline_syscall(madvise,3,args)
 #define mtcp_sys_nanosleep(args...)  mtcp_inline_syscall(nanosleep,2,args)
 #define mtcp_sys_brk(args...)  (void *)(mtcp_inline_syscall(brk,1,args))
 #define mtcp_sys_rt_sigaction(args...) mtcp_inline_syscall(rt_sigaction,4,args)
 #define mtcp_sys_set_tid_address(args...) \
   mtcp_inline_syscall(set_tid_address,1,args)
+#define mtcp_sys_rt_sigprocmask(args...) \
+  mtcp_inline_syscall(rt_sigprocmask,4,args)
+
+/* pread/pwrite take a 64-bit file offset.  On 32-bit kernels, it is passed
+ * as two registers (low word first), and ARM EABI aligns it to an even
+ * register pair.
+ */
+#if defined(__x86_64__)
+# define MTCP_PRW_SYSCALL(call,name,fd,buf,count,offset) \
+   call(name,4,fd,buf,count,offset)
+#elif defined(__i386__)
+# define MTCP_PRW_SYSCALL(call,name,fd,buf,count,offset) \
+   call(name,5,fd,buf,count, \
+        (unsigned long)(offset), \
+        (unsigned long)((unsigned long long)(offset) >> 32))
+#elif defined(__arm__)
+# define MTCP_PRW_SYSCALL(call,name,fd,buf,count,offset) \
+   call(name,6,fd,buf,count,0, \
+        (unsigned long)(offset), \
+        (unsigned long)((unsigned long long)(offset) >> 32))
+#else
+# error "pread/pwrite kernel call not implemented in this architecture"
+#endif
+#define mtcp_sys_pread(fd,buf,count,offset) \
+  MTCP_PRW_SYSCALL(mtcp_inline_syscall,pread64,fd,buf,count,offset)
+#define mtcp_sys_pwrite(fd,buf,count,offset) \
+  MTCP_PRW_SYSCALL(mtcp_inline_syscall,pwrite64,fd,buf,count,offset)
+/* For helper threads; see mtcp_raw_syscall(). */
+#define mtcp_sys_pread_raw(fd,buf,count,offset) \
+  MTCP_PRW_SYSCALL(mtcp_raw_syscall,pread64,fd,buf,count,offset)
+#define mtcp_sys_pwrite_raw(fd,buf,count,offset) \
+  MTCP_PRW_SYSCALL(mtcp_raw_syscall,pwrite64,fd,buf,count,offset)
+#define mtcp_sys_madvise_raw(args...)  mtcp_raw_syscall(madvise,3,args)
+#define mtcp_sys_read_raw(args...)  mtcp_raw_syscall(read,3,args)
+#define mtcp_sys_ioctl_raw(args...)  mtcp_raw_syscall(ioctl,3,args)
+#define mtcp_sys_mremap_raw(args...)  mtcp_raw_syscall(mremap,4,args)
+#define mtcp_sys_open_raw(args...)  mtcp_raw_syscall(open,3,args)
+#define mtcp_sys_write_raw(args...)  mtcp_raw_syscall(write,3,args)
+#define mtcp_sys_close_raw(args...)  mtcp_raw_syscall(close,1,args)
+#define mtcp_sys_fsync_raw(args...)  mtcp_raw_syscall(fsync,1,args)
+#define mtcp_sys_rename_raw(args...)  mtcp_raw_syscall(rename,2,args)
+#define mtcp_sys_unlink_raw(args...)  mtcp_raw_syscall(unlink,1,args)
+#define mtcp_sys_utimensat_raw(args...)  mtcp_raw_syscall(utimensat,4,args)
 
 //#define mtcp_sys_stat(args...) mtcp_inline_syscall(stat, 2, args)
 #define mtcp_sys_getuid(args...) mtcp_inline_syscall(getuid, 0)
@@ -427,6 +478,10 @@ struct linux_dirent {
 
 #define mtcp_sys_fcntl2(args...) mtcp_inline_syscall(fcntl,2,args)
 #define mtcp_sys_fcntl3(args...) mtcp_inline_syscall(fcntl,3,args)
+#define mtcp_sys_ioctl(args...) mtcp_inline_syscall(ioctl,3,args)
+#ifdef __NR_userfaultfd
+# define mtcp_sys_userfaultfd(args...) mtcp_inline_syscall(userfaultfd,1,args)
+#endif
 #define mtcp_sys_mkdir(args...) mtcp_inline_syscall(mkdir,2,args)
 
 /* These functions are not defined for x86_64. */
@@ -399,6 +399,49 @@ void mtcp_rename_ckptfile(const char *tempckpt, const char *permckpt)
   }
 }
 
+/* The path of the file open on fd.  Returns its length, or -1. */
+__attribute__ ((visibility ("hidden")))
+ssize_t mtcp_get_fd_path(int fd, char *path, size_t size)
+{
+  char proc_fd[32] = "/proc/self/fd/";
+  char digits[16];
+  int i = 0, len = mtcp_strlen(proc_fd);
+  ssize_t n;
+
+  do {
+    digits[i++] = '0' + fd % 10;
+    fd /= 10;
+  } while (fd > 0);
+  while (i > 0) {
+    proc_fd[len++] = digits[--i];
+  }
+  proc_fd[len] = '\0';
+
+  n = mtcp_sys_readlink(proc_fd, path, size - 1);
+  if (n < 0) {
+    DPRINTF("error %d reading %s\n", mtcp_sys_errno, proc_fd);
+    return -1;
+  }
+  path[n] = '\0';
+  return n;
+}
+
+/* The directory of the file open on fd, with a trailing '/' */
+__attribute__ ((visibility ("hidden")))
+void mtcp_get_image_dir(int fd, char *dir, size_t size)
+{
+  ssize_t n = mtcp_get_fd_path(fd, dir, size);
+
+  if (n < 0) {
+    MTCP_PRINTF("cannot find the directory of fd %d\n", fd);
+    mtcp_abort();
+  }
+  while (n > 0 && dir[n - 1] != '/') {
+    n--;
+  }
+  dir[n] = '\0';
+}
+
 /*****************************************************************************
  *
  *  Read /proc/self/maps line, converting it to an Area descriptor struct
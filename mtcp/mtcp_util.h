@@ -58,6 +58,71 @@ int mtcp_atoi(const char *nptr);
 int mtcp_get_controlling_term(char* ttyName, size_t len);
 const char* mtcp_getenv(const char* name);
 void mtcp_rename_ckptfile(const char *tempckpt, const char *permckpt);
+ssize_t mtcp_get_fd_path(int fd, char *path, size_t size);
+void mtcp_get_image_dir(int fd, char *dir, size_t size);
 int mtcp_readmapsline (int mapsfd, Area *area, DeviceInfo *dev_info);
 void mtcp_get_memory_region_of_this_library(VA *startaddr, VA *endaddr);
+
+/* mtcp_zero_page.c */
+typedef int (*mtcp_zero_page_fn_t)(const void *page);
+int mtcp_is_zero_page(const void *page);
+mtcp_zero_page_fn_t mtcp_zero_page_kernel(const char *name);
+
+/* mtcp_helper_threads.c */
+#define MTCP_MAX_HELPER_THREADS 64
+typedef void (*mtcp_helper_fn_t)(void *arg, int idx);
+int mtcp_run_helper_threads(int nthreads, mtcp_helper_fn_t fn, void *arg);
+typedef struct HelperThread *mtcp_helper_thread_t;
+mtcp_helper_thread_t mtcp_start_helper_thread(mtcp_helper_fn_t fn, void *arg);
+void mtcp_join_helper_thread(mtcp_helper_thread_t ht);
+
+/* mtcp_compress.c */
+#define MTCP_COMPRESS_BLOCK_SIZE (1024 * 1024)
+#define MTCP_COMPRESS_SCRATCH_SIZE (64 * 1024)
+typedef struct MtcpCompressBlockHdr {
+  unsigned int raw_size;
+  unsigned int stored_size;   /* == raw_size if stored raw */
+} MtcpCompressBlockHdr;
+size_t mtcp_compress_block(const void *src, size_t size,
+                           void *dst, size_t dst_size, void *scratch);
+int mtcp_decompress_block(const void *src, size_t src_size,
+                          void *dst, size_t dst_size);
+void mtcp_readfile_compressed(int fd, void *buf, size_t size);
+void mtcp_skipfile_compressed(int fd, size_t size);
+uint64_t mtcp_checksum(const void *buf, size_t size);
+
+/* mtcp_chunk_store.c */
+#define MTCP_CHUNK_SIZE (64 * 1024)
+#define MTCP_CHUNK_STORE_DIR "mtcp_chunks"
+#define MTCP_CHUNK_NAME_SIZE 34    /* "xx/" and 30 more hex digits */
+typedef struct MtcpChunkRef {
+  uint64_t hash[2];           /* mtcp_chunk_hash() of the contents */
+  uint32_t raw_size;
+  uint32_t padding;
+} MtcpChunkRef;
+void mtcp_chunk_hash(const void *buf, size_t size, uint64_t hash[2]);
+void mtcp_chunk_name(char *name, const uint64_t hash[2]);
+int mtcp_store_chunk(const char *store, const char *tmp_suffix,
+                     const void *buf, size_t size, MtcpChunkRef *ref,
+                     void *compress_buf, void *scratch);
+int mtcp_sync_chunk_dir(const char *store, int first_byte);
+void mtcp_read_chunk(const char *store, const MtcpChunkRef *ref,
+                     void *dst, void *scratch);
+size_t mtcp_chunk_refs_size(size_t size);
+void mtcp_readfile_chunks(int fd, void *buf, size_t size);
+void mtcp_skipfile_chunks(int fd, size_t size);
+
+/* mtcp_parent_images.c */
+void mtcp_restore_parent_pages(VA addr, size_t size);
+void mtcp_parent_images_close(void);
+
+/* mtcp_lazy_restore.c */
+int mtcp_lazy_restore_init(int fd);
+int mtcp_lazy_restore_area(Area *area, int compressed);
+void mtcp_lazy_restore_start(void);
+
+/* mtcp_parallel_restore.c */
+int mtcp_parallel_restore_init(int fd, int nthreads);
+int mtcp_parallel_restore_area(Area *area, int compressed);
+void mtcp_parallel_restore_finish(void);
 #endif
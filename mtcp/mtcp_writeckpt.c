@@ -21,7 +21,10 @@
  *  <http://www.gnu.org/licenses/>.                                          *
  *****************************************************************************/
 
-
+// Set _GNU_SOURCE in order to expose MREMAP_MAYMOVE in <sys/mman.h>
+#ifndef _GNU_SOURCE
+# define _GNU_SOURCE
+#endif
 #include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
@@ -43,18 +46,21 @@
 #include <unistd.h>
 #include <sys/types.h>     // for gettid, tgkill, waitpid
 #include <sys/wait.h>	   // for waitpid
+#include <stdint.h>
 #include <asm/unistd.h>  // for gettid, tgkill
 
 #include "mtcp_internal.h"
 #include "mtcp_util.h"
 
+#ifdef HBICT_DELTACOMP
 static int test_use_compression(char *compressor, char *command, char *path,
                                 int def);
 static int open_ckpt_to_write(int fd, int pipe_fds[2], char **args);
+#endif
 static size_t writefiledescrs (int fd, int fdCkptFileOnDisk);
 static void writememoryarea (int fd, Area *area,
 			     int stack_was_seen, int vsyscall_exists);
-//static void writefile (int fd, void const *buff, size_t size);
+static size_t writefile (int fd, void const *buff, size_t size);
 static void preprocess_special_segments(int *vsyscall_exists);
 
 #define FORKED_CKPT_FAILED 0
@@ -63,24 +69,65 @@ static void preprocess_special_segments(int *vsyscall_exists);
 
 #ifdef HBICT_DELTACOMP
 static int open_ckpt_to_write_hbict(int fd, int pipe_fds[2], char *hbict_path,
-                                    char *gzip_path);
+                                    int use_gzip);
 #endif
-static int open_ckpt_to_write_gz(int fd, int pipe_fds[2], char *gzip_path);
+static int test_use_builtin_compression();
 
 static int test_and_prepare_for_forked_ckpt();
+static int sync_ckpt_image(const char *perm_ckpt_filename);
 static int perform_open_ckpt_image_fd(const char *temp_ckpt_filename,
                                       int *use_compression,
                                       int *fdCkptFileOnDisk);
 static void write_ckpt_to_file(int fd, int fdCkptFileOnDisk);
+static int get_num_writer_threads();
+static void open_pagemap();
+static void close_pagemap();
+static int alloc_compress_bufs();
+static void free_compress_bufs();
+static int test_use_chunk_store();
+static int prepare_chunk_store(const char *perm_ckpt_filename);
+static void free_chunk_bufs();
+static void finish_chunk_store(const char *perm_ckpt_filename);
+static void add_zero_index_entry(VA addr, size_t size);
+static void add_parent_index_entry(VA addr, size_t size);
+static void write_area_index(int fd);
+static int prepare_incremental_ckpt(const char *perm_ckpt_filename,
+                                    int can_be_incremental);
+static void finish_incremental_ckpt(const char *perm_ckpt_filename,
+                                    int num_stale_parents, int clear_bits);
 
 
 extern int mtcp_verify_count;  // number of checkpoints to go
 extern int mtcp_verify_total;  // value given by envar
 extern VA mtcp_saved_heap_start;
 extern int  (*mtcp_callback_ckpt_fd)(int fd);
+extern void (*mtcp_callback_ckpt_durable)(int durable);
 
 
 static pid_t mtcp_ckpt_extcomp_child_pid = -1;
+static int num_writer_threads = 1;
+static int parallel_write_fd = -1;
+static int compress_ckpt = 0;  /* In-process compression of memory areas */
+static int ckpt_image_pending = 0;  /* A forked child is writing the image */
+static int use_chunk_store = 0;  /* Contents go to the chunk store */
+static off_t ckpt_offset = 0;  /* Bytes written to the image so far */
+static int pagemap_fd = -1;
+static uint64_t zero_page_pfn = 0;
+/* Pages of a private mapping that are neither present nor swapped out
+ * have never been written.  This is not true of a shared mapping, whose
+ * pages may be resident only in the shared memory object.
+ */
+static int area_is_private = 0;
+/* Incremental checkpoints:  see prepare_incremental_ckpt(). */
+static int max_delta_chain = 0;
+static int delta_ckpt = 0;            /* This image has the dirty pages only */
+static int soft_dirty_clear = 0;      /* Bits cleared after the last image */
+static int delta_chain_length = 0;    /* Incremental images since a full one */
+static unsigned int ckpt_generation = 0;   /* Of the last image written */
+static char last_perm_ckpt_filename[PATH_MAX];
+static char parent_name[FILENAMESIZE];
+/* Pages that are not soft-dirty are in the parent image */
+static int area_is_incremental = 0;
 static struct sigaction saved_sigchld_action;
 static void (*restore_start_fptr)(); /* will be bound to fnc, mtcp_restore_start */
 static void (*finish_restore_fptr)(); /* will be bound to fnc, mtcp_restore_start */
@@ -111,6 +158,31 @@ void mtcp_writeckpt_init(VA restore_start_fn, VA finishrestore_fn)
   initialized = 1;
 }
 
+/* Memory areas are compressed in-process (see mtcp_compress.c) if
+ * MTCP_GZIP (or DMTCP_GZIP) is set to a non-zero number.  Default is 0.
+ */
+static int test_use_builtin_compression()
+{
+  char *str = getenv("MTCP_GZIP");
+  char *endptr;
+  long int n;
+
+  if (str == NULL) {
+    str = getenv("DMTCP_GZIP");
+  }
+  if (str == NULL) {
+    return 0;
+  }
+  n = strtol(str, &endptr, 0);
+  if (*str == '\0' || *endptr != '\0') {
+    mtcp_printf("WARNING: MTCP_GZIP/DMTCP_GZIP defined as %s (not a number)\n"
+                "  Checkpoint image will not be compressed.\n", str);
+    return 0;
+  }
+  return n != 0;
+}
+
+#ifdef HBICT_DELTACOMP
 /*
  *
  * This function returns the fd to which the checkpoint file should be written.
@@ -169,29 +241,18 @@ static int test_use_compression(char *compressor, char *command, char *path,
   return 1;
 }
 
-#ifdef HBICT_DELTACOMP
 static int open_ckpt_to_write_hbict(int fd, int pipe_fds[2], char *hbict_path,
-                                    char *gzip_path)
+                                    int use_gzip)
 {
   char *hbict_args[] = { "hbict", "-a", NULL, NULL };
   hbict_args[0] = hbict_path;
   DPRINTF("open_ckpt_to_write_hbict\n");
 
-  if (gzip_path != NULL){
+  if (use_gzip){
     hbict_args[2] = "-z100";
   }
   return open_ckpt_to_write(fd,pipe_fds,hbict_args);
 }
-#endif
-
-static int open_ckpt_to_write_gz(int fd, int pipe_fds[2], char *gzip_path)
-{
-  char *gzip_args[] = { "gzip", "-1", "-", NULL };
-  gzip_args[0] = gzip_path;
-  DPRINTF("open_ckpt_to_write_gz\n");
-
-  return open_ckpt_to_write(fd,pipe_fds,gzip_args);
-}
 
 int
 open_ckpt_to_write(int fd, int pipe_fds[2], char **extcomp_args)
@@ -259,6 +320,7 @@ open_ckpt_to_write(int fd, int pipe_fds[2], char **extcomp_args)
 
   return fd;
 }
+#endif
 
 
 /*****************************************************************************
@@ -274,6 +336,7 @@ void mtcp_checkpointeverything(const char *temp_ckpt_filename,
   DPRINTF("thread:%d performing checkpoint.\n", mtcp_sys_kernel_gettid ());
 
   int forked_ckpt_status = test_and_prepare_for_forked_ckpt();
+  ckpt_image_pending = (forked_ckpt_status == FORKED_CKPT_PARENT);
   if (forked_ckpt_status == FORKED_CKPT_PARENT) {
     DPRINTF("*** Using forked checkpointing.\n");
     return;
@@ -285,6 +348,9 @@ void mtcp_checkpointeverything(const char *temp_ckpt_filename,
   int use_compression = 0;
   int fdCkptFileOnDisk = -1;
   int fd = -1;
+  int num_stale_parents;
+
+  compress_ckpt = 0;
 
   /* Allow target application to write ckpt-image according to their own
    * preference. If the symbol is defined, MTCP will not create the checkpoint
@@ -297,7 +363,39 @@ void mtcp_checkpointeverything(const char *temp_ckpt_filename,
     MTCP_ASSERT( use_compression || fd == fdCkptFileOnDisk );
   }
 
+  /* An incremental image needs the parent image on disk, and this process
+   * to clear the soft-dirty bits afterwards.
+   */
+  num_stale_parents =
+    prepare_incremental_ckpt(perm_ckpt_filename,
+                             mtcpHookWriteCkptData == NULL && !use_compression
+                             && forked_ckpt_status != FORKED_CKPT_CHILD
+                             && mtcp_verify_total == 0);
+
+  /* Large memory areas can be written in parallel with pwrite(), but only
+   * when writing uncompressed data to the checkpoint file itself.  With
+   * in-process compression, the writer threads compress instead.
+   */
+  num_writer_threads = get_num_writer_threads();
+  /* The chunk store is next to the image on disk, where restart finds it.
+   * The writer threads then store chunks (compressing them, with
+   * compress_ckpt) instead.
+   */
+  use_chunk_store = mtcpHookWriteCkptData == NULL && !use_compression &&
+                    test_use_chunk_store() &&
+                    prepare_chunk_store(perm_ckpt_filename) == 0;
+  if (compress_ckpt && !use_chunk_store && alloc_compress_bufs() == -1) {
+    compress_ckpt = 0;
+  }
+  parallel_write_fd = -1;
+  if (mtcpHookWriteCkptData == NULL && !use_compression && !compress_ckpt &&
+      !use_chunk_store) {
+    parallel_write_fd = fd;
+  }
+
   write_ckpt_to_file(fd, fdCkptFileOnDisk);
+  free_compress_bufs();
+  free_chunk_bufs();
 
   if (mtcpHookWriteCkptData == NULL) {
     if (use_compression) {
@@ -339,11 +437,28 @@ void mtcp_checkpointeverything(const char *temp_ckpt_filename,
      * So, gzip process can continue to write to file even after renaming.
      */
 
-    else mtcp_rename_ckptfile(temp_ckpt_filename, perm_ckpt_filename);
+    else {
+      mtcp_rename_ckptfile(temp_ckpt_filename, perm_ckpt_filename);
+      if (use_chunk_store) {
+        finish_chunk_store(perm_ckpt_filename);
+      }
+      finish_incremental_ckpt(perm_ckpt_filename, num_stale_parents,
+                              forked_ckpt_status != FORKED_CKPT_CHILD);
+    }
 
   }
-  if (forked_ckpt_status == FORKED_CKPT_CHILD)
+  if (forked_ckpt_status == FORKED_CKPT_CHILD) {
+    /* The parent resumed long ago.  Tell DMTCP whether the image is safe
+     * now.  An image still to be verified, or one that could not be synced,
+     * is reported as not durable.
+     */
+    if (mtcp_callback_ckpt_durable != NULL) {
+      int durable = mtcpHookWriteCkptData == NULL && mtcp_verify_total == 0 &&
+                    sync_ckpt_image(perm_ckpt_filename) == 0;
+      (*mtcp_callback_ckpt_durable)(durable);
+    }
     mtcp_sys_exit (0); /* grandchild exits */
+  }
 
   DPRINTF("checkpoint complete\n");
 }
@@ -370,12 +485,10 @@ static int perform_open_ckpt_image_fd(const char *temp_ckpt_filename,
 #endif
 
   /* 2. Test if using GZIP/HBICT compression */
-  /* 2a. Test if using GZIP compression */
+  /* 2a. Test if using GZIP compression (now done in-process) */
   int use_gzip_compression = 0;
   int use_deltacompression = 0;
-  char *gzip_cmd = "gzip";
-  char gzip_path[PATH_MAX];
-  use_gzip_compression = test_use_compression("GZIP", gzip_cmd, gzip_path, 1);
+  use_gzip_compression = test_use_builtin_compression();
 
   /* 2b. Test if using HBICT compression */
 # ifdef HBICT_DELTACOMP
@@ -386,12 +499,16 @@ static int perform_open_ckpt_image_fd(const char *temp_ckpt_filename,
   use_deltacompression = test_use_compression("HBICT", hbict_cmd, hbict_path, 1);
 # endif
 
-  /* 3. We now have the information to pipe to gzip, or directly to fd.
-  *     We do it this way, so that gzip will be direct child of forked process
+  /* 3. We now have the information to pipe to hbict, or directly to fd.
+  *     We do it this way, so that hbict will be direct child of forked process
   *       when using forked checkpointing.
+  *     hbict does its own gzip compression (-z100).  Otherwise, the memory
+  *       areas are compressed by write_compressed_area().
   */
 
-  if (use_deltacompression || use_gzip_compression) { /* fork a hbict process */
+  if (!use_deltacompression) {
+    compress_ckpt = use_gzip_compression;
+  } else { /* fork a hbict process */
     /* 3a. Set SIGCHLD to ignore; user handling is restored after gzip finishes.
      *
      * NOTE: Although the default action for SIGCHLD is supposedly SIG_IGN,
@@ -411,28 +528,21 @@ static int perform_open_ckpt_image_fd(const char *temp_ckpt_filename,
     if (mtcp_sys_pipe(pipe_fds) == -1) {
       MTCP_PRINTF("WARNING: error creating pipe. Compression will "
           "not be used.\n");
-      use_gzip_compression = use_deltacompression = 0;
+      use_deltacompression = 0;
     }
 
     /* 3c. Fork compressor child */
     if (use_deltacompression) { /* fork a hbict process */
 # ifdef HBICT_DELTACOMP
       *use_compression = 1;
-      if ( use_gzip_compression ) // We may want hbict compression only
-        fd = open_ckpt_to_write_hbict(fd, pipe_fds, hbict_path, gzip_path);
-      else
-        fd = open_ckpt_to_write_hbict(fd, pipe_fds, hbict_path, NULL);
-# endif
-    } else if (use_gzip_compression) {/* fork a gzip process */
-      *use_compression = 1;
-      fd = open_ckpt_to_write_gz(fd, pipe_fds, gzip_path);
+      // We may want hbict compression only
+      fd = open_ckpt_to_write_hbict(fd, pipe_fds, hbict_path,
+                                    use_gzip_compression);
       if (pipe_fds[0] == -1) {
-        /* If open_ckpt_to_write_gz() failed to fork the gzip process */
+        /* If open_ckpt_to_write() failed to fork the hbict process */
         *use_compression = 0;
       }
-    } else {
-      MTCP_PRINTF("Not Reached!\n");
-      mtcp_abort();
+# endif
     }
   }
 
@@ -476,6 +586,75 @@ static int test_and_prepare_for_forked_ckpt()
   return FORKED_CKPT_CHILD;
 }
 
+int mtcp_ckpt_image_pending(void)
+{
+  return ckpt_image_pending;
+}
+
+/* Make the entries of the directory dir durable.  Returns 0, or -1 with
+ * mtcp_sys_errno set.
+ */
+static int sync_dir(const char *dir)
+{
+  int fd = mtcp_sys_open2(dir, O_RDONLY | O_DIRECTORY);
+  int rc;
+
+  if (fd < 0) {
+    return -1;
+  }
+  rc = mtcp_sys_fsync(fd);
+  mtcp_sys_close(fd);
+  return rc;
+}
+
+/* As sync_dir(), for the directory that holds filename. */
+static int sync_dir_of(const char *filename)
+{
+  const char *base = strrchr(filename, '/');
+  char dir[PATH_MAX];
+
+  if (base == NULL) {
+    return sync_dir(".");
+  }
+  if (snprintf(dir, sizeof(dir), "%.*s", (int) (base + 1 - filename),
+               filename) >= (int) sizeof(dir)) {
+    mtcp_sys_errno = ENAMETOOLONG;
+    return -1;
+  }
+  return sync_dir(dir);
+}
+
+/* Nobody waits for a forked checkpoint, so flush the image, and its name in
+ * the directory, to the disk before reporting it.  Returns 0 once both are
+ * durable, or -1.
+ */
+static int sync_ckpt_image(const char *perm_ckpt_filename)
+{
+  int fd = mtcp_sys_open2(perm_ckpt_filename, O_RDONLY);
+  int rc;
+
+  if (fd < 0) {
+    MTCP_PRINTF("error opening %s: %s\n",
+                perm_ckpt_filename, strerror(mtcp_sys_errno));
+    return -1;
+  }
+  rc = mtcp_sys_fsync(fd);
+  if (rc < 0) {
+    MTCP_PRINTF("fsync error on checkpoint file: %s\n",
+                strerror(mtcp_sys_errno));
+  }
+  mtcp_sys_close(fd);
+  if (rc < 0) {
+    return -1;
+  }
+  if (sync_dir_of(perm_ckpt_filename) == -1) {
+    MTCP_PRINTF("fsync error on the directory of %s: %s\n",
+                perm_ckpt_filename, strerror(mtcp_sys_errno));
+    return -1;
+  }
+  return 0;
+}
+
 /* FIXME:
  * We should read /proc/self/maps into temporary array and mtcp_readmapsline
  * should then read from it.  This is cleaner than this hack here.
@@ -506,6 +685,16 @@ static void remap_nscd_areas(Area remap_nscd_areas_array[],
   }
 }
 
+/* Write to the checkpoint image, keeping track of the offset for the
+ * area index.
+ */
+static size_t writefile (int fd, void const *buff, size_t size)
+{
+  mtcp_writefile(fd, buff, size);
+  ckpt_offset += size;
+  return size;
+}
+
 static void write_header_and_restore_image(int fd, int fdCkptFileOnDisk)
 {
   size_t num_written = 0;
@@ -517,32 +706,47 @@ static void write_header_and_restore_image(int fd, int fdCkptFileOnDisk)
   memcpy(tmpBuf, MAGIC, MAGIC_LEN);
   ckpt_hdr = (mtcp_ckpt_image_hdr_t*) &tmpBuf[MAGIC_LEN];
 
+  ckpt_hdr->version = MTCP_CKPT_IMAGE_VERSION;
   getrlimit(RLIMIT_STACK, &ckpt_hdr->stack_rlimit);
   ckpt_hdr->libmtcp_begin = mtcp_shareable_begin;
   ckpt_hdr->libmtcp_size = mtcp_shareable_end - mtcp_shareable_begin;
   ckpt_hdr->restore_start_fptr = (VA) restore_start_fptr;
   ckpt_hdr->finish_restore_fptr = (VA) finish_restore_fptr;
+  mtcp_strncpy(ckpt_hdr->parent_name, parent_name,
+               sizeof(ckpt_hdr->parent_name));
 
   DPRINTF("saved stack resource limit: soft_lim:%p, hard_lim:%p\n",
           ckpt_hdr->stack_rlimit.rlim_cur, ckpt_hdr->stack_rlimit.rlim_max);
   DPRINTF("restore_begin %X at %p from [libmtcp.so]\n",
           ckpt_hdr->libmtcp_size, ckpt_hdr->libmtcp_begin);
 
-  num_written = mtcp_writefile(fd, tmpBuf, sizeof(tmpBuf));
+  num_written = writefile(fd, tmpBuf, sizeof(tmpBuf));
   MTCP_ASSERT((num_written & MTCP_PAGE_OFFSET_MASK) == 0);
 
-  num_written += mtcp_writefile(fd, ckpt_hdr->libmtcp_begin,
+  num_written += writefile(fd, ckpt_hdr->libmtcp_begin,
                                 ckpt_hdr->libmtcp_size);
   MTCP_ASSERT((num_written & MTCP_PAGE_OFFSET_MASK) == 0);
 
   /* Write out file descriptors */
   num_written += writefiledescrs (fd, fdCkptFileOnDisk);
   if ((num_written & MTCP_PAGE_OFFSET_MASK) != 0) {
-    num_written += mtcp_writefile(fd, tmpBuf, MTCP_PAGE_SIZE -
+    num_written += writefile(fd, tmpBuf, MTCP_PAGE_SIZE -
                                   (num_written & MTCP_PAGE_OFFSET_MASK));
   }
 }
 
+/* Is name the checkpoint image that areas were mapped from at restart?
+ * A later checkpoint may have replaced it by now.
+ */
+static int is_mapped_image(const char *name)
+{
+  size_t len = mtcp_strlen(mtcp_mapped_image_name);
+
+  return len > 0 && mtcp_strncmp(name, mtcp_mapped_image_name, len) == 0 &&
+         (name[len] == '\0' ||
+          mtcp_strcmp(name + len, DELETED_FILE_SUFFIX) == 0);
+}
+
 /* fd is file descriptor for gzip or other compression process */
 static void write_ckpt_to_file(int fd, int fdCkptFileOnDisk)
 {
@@ -552,6 +756,8 @@ static void write_ckpt_to_file(int fd, int fdCkptFileOnDisk)
   VA restore_begin = mtcp_shareable_begin;
   VA restore_end = mtcp_shareable_end;
 
+  ckpt_offset = 0;
+
   /* Drain stdin and stdout before checkpoint */
   tcdrain(STDOUT_FILENO);
   tcdrain(STDERR_FILENO);
@@ -575,12 +781,22 @@ static void write_ckpt_to_file(int fd, int fdCkptFileOnDisk)
   Area remap_nscd_areas_array[10];
   remap_nscd_areas_array[9].flags = END_OF_NSCD_AREAS;
 
+  open_pagemap();
+
   int mapsfd = mtcp_sys_open2 ("/proc/self/maps", O_RDONLY);
 
   while (mtcp_readmapsline (mapsfd, &area, &dev_info)) {
     VA area_begin = area.addr;
     VA area_end   = area_begin + area.size;
 
+    /* Before any shared area below is relabelled as private anonymous. */
+    area_is_private = (area.flags & MAP_PRIVATE) != 0;
+    /* This thread keeps writing to its own stack (and TLS) after saving it,
+     * and the soft-dirty bits are cleared only at the end:  write it all.
+     */
+    area_is_incremental = delta_ckpt && area_is_private &&
+                          !((VA) &area >= area_begin && (VA) &area < area_end);
+
     /* Original comment:  Skip anything in kernel address space ---
      *   beats me what's at FFFFE000..FFFFFFFF - we can't even read it;
      * Added: That's the vdso section for earlier Linux 2.6 kernels.  For later
@@ -635,8 +851,17 @@ static void write_ckpt_to_file(int fd, int fdCkptFileOnDisk)
       continue;
     }
 
-    if (mtcp_strstartswith(area.name, DEV_ZERO_DELETED_STR) ||
-        mtcp_strstartswith(area.name, DEV_NULL_DELETED_STR)) {
+    if (is_mapped_image(area.name)) {
+      /* Mapped copy-on-write from the checkpoint image by mtcp_restart
+       * --fast-restart.  Save it as anonymous memory, and read all of it:
+       * the pages not touched since then are not in /proc/self/pagemap.
+       */
+      DPRINTF("saving area \"%s\" as Anonymous\n", area.name);
+      area.flags = MAP_PRIVATE | MAP_ANONYMOUS;
+      area.name[0] = '\0';
+      area_is_private = area_is_incremental = 0;
+    } else if (mtcp_strstartswith(area.name, DEV_ZERO_DELETED_STR) ||
+               mtcp_strstartswith(area.name, DEV_NULL_DELETED_STR)) {
       /* If the process has an area labelled as "/dev/zero (deleted)", we mark
        *   the area as Anonymous and save the contents to the ckpt image file.
        * If this area has a MAP_SHARED attribute, it should be replaced with
@@ -780,9 +1005,11 @@ static void write_ckpt_to_file(int fd, int fdCkptFileOnDisk)
   remap_nscd_areas(remap_nscd_areas_array, num_remap_nscd_areas);
 
   close (mapsfd);
+  close_pagemap();
 
   area.size = -1; // End of data
-  mtcp_writefile(fd, &area, sizeof(area));
+  writefile(fd, &area, sizeof(area));
+  write_area_index(fd);
 
   /* That's all folks */
   if (mtcp_sys_close (fd) < 0) {
@@ -898,7 +1125,7 @@ static size_t writefiledescrs (int fd, int fdCkptFileOnDisk)
             area.fdinfo.statbuf = statbuf;
             area.fdinfo.offset = offset;
             strcpy(area.name, linkbuf);
-            num_written += mtcp_writefile(fd, &area, sizeof area);
+            num_written += writefile(fd, &area, sizeof area);
           }
         }
       }
@@ -915,95 +1142,1413 @@ static size_t writefiledescrs (int fd, int fdCkptFileOnDisk)
 
   area.fdinfo.fdnum = -1;
   linkbuf[0] = '\0';
-  num_written += mtcp_writefile(fd, &area, sizeof area);
+  num_written += writefile(fd, &area, sizeof area);
   return num_written;
 }
 
-/* This function detects if the given pages are zero pages or not. There is
- * scope of improving this function using some optimizations.
- *
- * TODO: One can use /proc/self/pagemap to detect if the page is backed by a
- * shared zero page.
+/* /proc/self/pagemap has one 64-bit entry per virtual page.  Bit 63 is set
+ * if the page is present in RAM, bit 62 if it is swapped out, bit 55 if it
+ * was written since the soft-dirty bits were cleared, and bits 0-54 hold the
+ * page frame number (reported as 0 to unprivileged processes on newer
+ * kernels).
  */
-static int mtcp_are_zero_pages(void *addr, size_t num_pages)
+#define PAGEMAP_PRESENT (1ULL << 63)
+#define PAGEMAP_SWAPPED (1ULL << 62)
+#define PAGEMAP_SOFT_DIRTY (1ULL << 55)
+#define PAGEMAP_PFN_MASK ((1ULL << 55) - 1)
+#define PAGEMAP_BATCH 256
+
+static void open_pagemap()
 {
-  long long *buf = (long long*) addr;
-  size_t i;
-  size_t end = num_pages * MTCP_PAGE_SIZE / sizeof (*buf);
-  long long res = 0;
-  for (i = 0; i + 7 < end; i += 8) {
-    res = buf[i+0] | buf[i+1] | buf[i+2] | buf[i+3] |
-          buf[i+4] | buf[i+5] | buf[i+6] | buf[i+7];
-    if (res != 0) {
-      break;
+  volatile char *page;
+  uint64_t entry;
+
+  pagemap_fd = mtcp_sys_open2("/proc/self/pagemap", O_RDONLY);
+  if (pagemap_fd < 0) {
+    DPRINTF("cannot open /proc/self/pagemap (error %d);"
+            " zero pages will be found by reading them\n", mtcp_sys_errno);
+    pagemap_fd = -1;
+    return;
+  }
+
+  /* Reading an untouched private page maps the kernel's shared zero page.
+   * Find its page frame number, if the kernel tells us.
+   */
+  zero_page_pfn = 0;
+  page = mtcp_sys_mmap(NULL, MTCP_PAGE_SIZE, PROT_READ,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (page != MAP_FAILED) {
+    (void) page[0];
+    if (mtcp_sys_pread(pagemap_fd, &entry, sizeof(entry),
+                       (unsigned long) page / MTCP_PAGE_SIZE * sizeof(entry))
+        == sizeof(entry) && (entry & PAGEMAP_PRESENT)) {
+      zero_page_pfn = entry & PAGEMAP_PFN_MASK;
     }
+    mtcp_sys_munmap((void *) page, MTCP_PAGE_SIZE);
+  }
+}
+
+static void close_pagemap()
+{
+  if (pagemap_fd != -1) {
+    mtcp_sys_close(pagemap_fd);
+    pagemap_fd = -1;
   }
-  return res == 0;
 }
 
+/* Read the pagemap entries of num_pages pages starting at addr.
+ * Returns 0 if they are not available.
+ */
+static int read_pagemap(VA addr, size_t num_pages, uint64_t *entries)
+{
+  off_t offset = (unsigned long) addr / MTCP_PAGE_SIZE * sizeof(entries[0]);
+  size_t size = num_pages * sizeof(entries[0]);
+
+  return pagemap_fd != -1 && area_is_private &&
+         mtcp_sys_pread(pagemap_fd, entries, size, offset) == (ssize_t) size;
+}
+
+/* Pages are written (PAGE_DATA), or else recorded without contents as
+ * zero pages or, in an incremental image, as pages of the parent image.
+ */
+#define PAGE_DATA 0
+#define PAGE_ZERO 1
+#define PAGE_PARENT 2
+
+/* A page is zero if it was never populated, if it maps the shared zero
+ * page, or else if its contents are zero.  Pages known to be zero from
+ * /proc/self/pagemap are not read, so that checkpointing a sparse area
+ * costs time in proportion to its resident pages only.  Likewise, pages
+ * that are not soft-dirty are not read for an incremental image.
+ */
+static int page_kind(VA page, uint64_t entry, int have_entry)
+{
+  if (have_entry) {
+    if ((entry & (PAGEMAP_PRESENT | PAGEMAP_SWAPPED)) == 0) {
+      return PAGE_ZERO;
+    }
+    if ((entry & PAGEMAP_PRESENT) && zero_page_pfn != 0 &&
+        (entry & PAGEMAP_PFN_MASK) == zero_page_pfn) {
+      return PAGE_ZERO;
+    }
+    if (area_is_incremental && !(entry & PAGEMAP_SOFT_DIRTY)) {
+      return PAGE_PARENT;
+    }
+  }
+  return mtcp_is_zero_page(page) ? PAGE_ZERO : PAGE_DATA;
+}
 
-/* This function returns a range of zero or non-zero pages. If the first page
- * is non-zero, it searches for all contiguous non-zero pages and returns them.
- * If the first page is all-zero, it searches for contiguous zero pages and
- * returns them.
+/* Return the number of consecutive pages, starting at addr and up to
+ * max_pages, of the given kind.
  */
-#if 1
-// Remove the else part once satisfied with the this code
-static void mtcp_get_next_page_range(Area *area, size_t *size, int *is_zero)
+static size_t count_pages(VA addr, size_t max_pages, int kind)
 {
-  char *pg;
-  char *prevAddr;
+  uint64_t entries[PAGEMAP_BATCH];
   size_t count = 0;
-  const size_t one_MB = (1024 * 1024);
-  if (area->size < one_MB) {
-    *size = area->size;
-    *is_zero = 0;
+
+  while (count < max_pages) {
+    size_t i, n = MIN(max_pages - count, PAGEMAP_BATCH);
+    VA page = addr + count * MTCP_PAGE_SIZE;
+    int have_entries = read_pagemap(page, n, entries);
+    for (i = 0; i < n; i++, page += MTCP_PAGE_SIZE) {
+      if (page_kind(page, entries[i], have_entries) != kind) {
+        return count + i;
+      }
+    }
+    count += n;
+  }
+  return count;
+}
+
+static int page_kind_at(VA page)
+{
+  uint64_t entry = 0;
+  return page_kind(page, entry, read_pagemap(page, 1, &entry));
+}
+
+/* Set bit i of zero_bitmap (or of parent_bitmap) for each zero page i (or
+ * page of the parent image) among num_pages pages at addr.  Also called on
+ * the helper threads of the parallel writer.
+ */
+static void page_kind_bitmaps(VA addr, size_t num_pages,
+                              uint64_t *zero_bitmap, uint64_t *parent_bitmap)
+{
+  uint64_t entries[PAGEMAP_BATCH];
+  size_t p = 0;
+
+  while (p < num_pages) {
+    size_t i, n = MIN(num_pages - p, PAGEMAP_BATCH);
+    int have_entries = read_pagemap(addr + p * MTCP_PAGE_SIZE, n, entries);
+    for (i = 0; i < n; i++, p++) {
+      switch (page_kind(addr + p * MTCP_PAGE_SIZE, entries[i], have_entries)) {
+        case PAGE_ZERO:
+          zero_bitmap[p / 64] |= 1ULL << (p % 64);
+          break;
+        case PAGE_PARENT:
+          parent_bitmap[p / 64] |= 1ULL << (p % 64);
+          break;
+      }
+    }
+  }
+}
+
+/* A zero (or parent) record costs a 4 KB header, and it splits the data
+ * around it into two records.  So, only runs of at least this many such
+ * pages are left out of the image; shorter ones are written with the data
+ * around them.
+ */
+#define MIN_ZERO_RUN_PAGES 4
+
+/* This function returns a range of pages and their kind.  If the first
+ * MIN_ZERO_RUN_PAGES pages are all zero pages (or all parent pages), it
+ * returns all contiguous pages of that kind.  Otherwise, it returns all
+ * pages up to the next run of at least MIN_ZERO_RUN_PAGES zero or parent
+ * pages, as PAGE_DATA.
+ */
+static void mtcp_get_next_page_range(Area *area, size_t *size, int *kind)
+{
+  size_t num_pages = area->size / MTCP_PAGE_SIZE;
+  size_t p;
+
+  *kind = page_kind_at(area->addr);
+  p = count_pages(area->addr, num_pages, *kind);
+  if (*kind != PAGE_DATA && p >= MIN_ZERO_RUN_PAGES) {
+    *size = p * MTCP_PAGE_SIZE;
     return;
   }
-  *size = one_MB;
-  *is_zero = mtcp_are_zero_pages(area->addr, one_MB / MTCP_PAGE_SIZE);
-  prevAddr = area->addr;
-  for (pg = area->addr + one_MB;
-       pg < area->addr + area->size;
-       pg += one_MB) {
-    size_t minsize = MIN(one_MB, area->addr + area->size - pg);
-    if (*is_zero != mtcp_are_zero_pages(pg, minsize / MTCP_PAGE_SIZE)) {
-      break;
-    }
-    *size += minsize;
-    if (*is_zero && ++count % 10 == 0) { // madvise every 10MB
-      if (madvise(prevAddr, area->addr + *size - prevAddr,
-                  MADV_DONTNEED) == -1) {
-        MTCP_PRINTF("error %d doing madvise(%p, %d, MADV_DONTNEED)\n",
-                    errno, area->addr, (int)*size);
-        prevAddr = pg;
+
+  *kind = PAGE_DATA;
+  while (p < num_pages) {
+    VA addr = area->addr + p * MTCP_PAGE_SIZE;
+    int run_kind = page_kind_at(addr);
+    size_t run;
+    if (run_kind == PAGE_DATA) {
+      run = count_pages(addr, num_pages - p, PAGE_DATA);
+    } else {
+      run = count_pages(addr, MIN(num_pages - p, MIN_ZERO_RUN_PAGES),
+                        run_kind);
+      if (run == MIN_ZERO_RUN_PAGES) {
+        break;
       }
     }
+    p += run;
   }
+  *size = p * MTCP_PAGE_SIZE;
 }
-#else
-static void mtcp_get_next_page_range(Area *area, size_t *size, int *is_zero)
+
+/*****************************************************************************
+ *
+ *  Incremental checkpoints (MTCP_INCREMENTAL or DMTCP_INCREMENTAL set to N).
+ *
+ *  After each image, the soft-dirty bits of all pages are cleared through
+ *  /proc/self/clear_refs.  The next image then holds only the pages of the
+ *  private anonymous areas (and of the heap) that are soft-dirty again in
+ *  /proc/self/pagemap.  The other pages become MTCP_PROT_PARENT_PAGE
+ *  records:  their contents are in the previous image, which is kept as the
+ *  hard link <perm_ckpt_filename>.gen<G> and named in the header.  Restart
+ *  follows the chain of parents (see mtcp_parent_images.c).  Up to N
+ *  incremental images follow a full one;  the next full image makes the
+ *  chain obsolete.
+ *
+ *  soft_dirty_clear is reset before the image is written, so that a
+ *  restarted process, whose pages are all new to the kernel, starts over
+ *  with a full image.
+ *
+ *****************************************************************************/
+
+static int get_max_delta_chain()
 {
-  char *pg;
-  size_t count = 0;
-  *size = MTCP_PAGE_SIZE;
-  *is_zero = mtcp_are_zero_pages(area->addr);
-  for (pg = area->addr + MTCP_PAGE_SIZE;
-       pg < area->addr + area->size;
-       pg += MTCP_PAGE_SIZE) {
-    if (*is_zero != mtcp_are_zero_pages(pg)) {
-      break;
-    }
-    *size += MTCP_PAGE_SIZE;
-    if (*is_zero && ++count % 1024 == 0) {
-      if (madvise(a.addr, a.size, MADV_DONTNEED) == -1) {
+  char *str = getenv("MTCP_INCREMENTAL");
+  char *endptr;
+  long int n;
+
+  if (str == NULL) {
+    str = getenv("DMTCP_INCREMENTAL");
+  }
+  if (str == NULL) {
+    return 0;
+  }
+  n = strtol(str, &endptr, 0);
+  if (*str == '\0' || *endptr != '\0' || n < 0) {
+    mtcp_printf("WARNING: MTCP_INCREMENTAL/DMTCP_INCREMENTAL defined"
+                " as %s (not a number)\n"
+                "  Checkpoint images will be full ones.\n", str);
+    return 0;
+  }
+  return MIN(n, MTCP_MAX_PARENT_IMAGES);
+}
+
+static int parent_image_filename(char *buf, const char *perm_ckpt_filename,
+                                 unsigned int generation)
+{
+  return snprintf(buf, PATH_MAX, "%s.gen%u", perm_ckpt_filename, generation)
+         < PATH_MAX ? 0 : -1;
+}
+
+/* Decide whether this image can be incremental and, if so, keep the last
+ * image as its parent.  Returns the number of parent images to remove once
+ * this image is complete.
+ */
+static int prepare_incremental_ckpt(const char *perm_ckpt_filename,
+                                    int can_be_incremental)
+{
+  char parent[PATH_MAX];
+  int num_stale_parents = 0;
+
+  delta_ckpt = 0;
+  parent_name[0] = '\0';
+  max_delta_chain = get_max_delta_chain();
+  if (max_delta_chain > 0 && can_be_incremental && soft_dirty_clear &&
+      delta_chain_length < max_delta_chain &&
+      mtcp_strcmp(perm_ckpt_filename, last_perm_ckpt_filename) == 0 &&
+      parent_image_filename(parent, perm_ckpt_filename, ckpt_generation)
+        == 0) {
+    char *base = strrchr(parent, '/');
+    unlink(parent);  /* Left over by an earlier computation */
+    if (link(perm_ckpt_filename, parent) == 0) {
+      delta_ckpt = 1;
+      mtcp_strncpy(parent_name, base == NULL ? parent : base + 1,
+                   sizeof(parent_name));
+    } else {
+      MTCP_PRINTF("WARNING: error %d linking %s to %s.\n"
+                  "  Checkpoint image will be a full one.\n",
+                  errno, perm_ckpt_filename, parent);
+    }
+  }
+  soft_dirty_clear = 0;
+
+  ckpt_generation++;
+  if (delta_ckpt) {
+    delta_chain_length++;
+    DPRINTF("incremental image %d of %d, parent is %s\n",
+            delta_chain_length, max_delta_chain, parent_name);
+  } else {
+    num_stale_parents = delta_chain_length;
+    delta_chain_length = 0;
+  }
+  return num_stale_parents;
+}
+
+/* Clear the soft-dirty bits, and check that the kernel sets them again:
+ * without CONFIG_MEM_SOFT_DIRTY, it never does.
+ */
+static void clear_soft_dirty_bits()
+{
+  static int warned = 0;
+  volatile char probe;
+  uint64_t entry = 0;
+  int fd;
+
+  fd = mtcp_sys_open2("/proc/self/clear_refs", O_WRONLY);
+  if (fd < 0 || mtcp_sys_write(fd, "4", 1) != 1) {
+    if (!warned) {
+      MTCP_PRINTF("WARNING: error %d clearing soft-dirty bits.\n"
+                  "  Checkpoint images will be full ones.\n", mtcp_sys_errno);
+      warned = 1;
+    }
+    if (fd >= 0) {
+      mtcp_sys_close(fd);
+    }
+    return;
+  }
+  mtcp_sys_close(fd);
+
+  probe = 1;
+  fd = mtcp_sys_open2("/proc/self/pagemap", O_RDONLY);
+  if (fd >= 0) {
+    if (mtcp_sys_pread(fd, &entry, sizeof(entry),
+                       (unsigned long) &probe / MTCP_PAGE_SIZE * sizeof(entry))
+        != sizeof(entry)) {
+      entry = 0;
+    }
+    mtcp_sys_close(fd);
+  }
+  if (!(entry & PAGEMAP_SOFT_DIRTY)) {
+    if (!warned) {
+      MTCP_PRINTF("WARNING: this kernel does not track soft-dirty pages.\n"
+                  "  Checkpoint images will be full ones.\n");
+      warned = 1;
+    }
+    return;
+  }
+  soft_dirty_clear = 1;
+}
+
+/* Called once the image has been renamed to perm_ckpt_filename. */
+static void finish_incremental_ckpt(const char *perm_ckpt_filename,
+                                    int num_stale_parents, int clear_bits)
+{
+  char parent[PATH_MAX];
+  unsigned int g;
+
+  /* The chain of parents of the last image, which this full one replaces */
+  for (g = ckpt_generation - 1 - num_stale_parents;
+       g < ckpt_generation - 1; g++) {
+    if (parent_image_filename(parent, last_perm_ckpt_filename, g) == 0 &&
+        unlink(parent) == -1 && errno != ENOENT) {
+      MTCP_PRINTF("WARNING: error %d removing %s\n", errno, parent);
+    }
+  }
+  snprintf(last_perm_ckpt_filename, sizeof(last_perm_ckpt_filename), "%s",
+           perm_ckpt_filename);
+
+  if (clear_bits && max_delta_chain > 0) {
+    clear_soft_dirty_bits();
+  }
+}
+
+/*****************************************************************************
+ *
+ *  Area index.
+ *
+ *  After the end-of-data Area, the image has one MtcpIndexEntry per block of
+ *  area contents, and then a MtcpIndexTrailer, at the very end of the file.
+ *  With it, restart and tools can seek directly to the contents of any
+ *  address, decompress blocks independently, and check each block against
+ *  its checksum.  The entries are collected in an mmap()ed array while the
+ *  areas are written:  no malloc.  Each block is checksummed just before it
+ *  is written, while the writer has it in cache anyway.
+ *
+ *****************************************************************************/
+
+#define INDEX_BLOCK_SIZE MTCP_COMPRESS_BLOCK_SIZE
+
+static MtcpIndexEntry *index_entries = MAP_FAILED;
+static size_t index_num_entries = 0;
+static size_t index_size = 0;     /* Bytes mapped for index_entries */
+
+static MtcpIndexEntry *add_index_entry(VA addr, size_t raw_size, off_t offset,
+                                       size_t stored_size, int flags)
+{
+  MtcpIndexEntry *e;
+
+  if ((index_num_entries + 1) * sizeof(*e) > index_size) {
+    size_t new_size = MAX(index_size * 2, 256 * sizeof(*e));
+    void *p;
+    new_size = (new_size + MTCP_PAGE_SIZE - 1) & MTCP_PAGE_MASK;
+    if (index_entries == MAP_FAILED) {
+      p = mtcp_sys_mmap(NULL, new_size, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    } else {
+      p = mtcp_sys_mremap(index_entries, index_size, new_size, MREMAP_MAYMOVE);
+    }
+    if (p == MAP_FAILED) {
+      MTCP_PRINTF("error %d allocating %p bytes for the area index\n",
+                  mtcp_sys_errno, new_size);
+      mtcp_abort();
+    }
+    index_entries = p;
+    index_size = new_size;
+  }
+
+  e = &index_entries[index_num_entries++];
+  e->addr = (uint64_t) (unsigned long) addr;
+  e->raw_size = raw_size;
+  e->offset = offset;
+  e->stored_size = stored_size;
+  e->checksum = 0;
+  e->flags = flags;
+  e->padding = 0;
+  return e;
+}
+
+static void add_zero_index_entry(VA addr, size_t size)
+{
+  add_index_entry(addr, size, 0, 0, MTCP_INDEX_ZERO_PAGES);
+}
+
+static void add_parent_index_entry(VA addr, size_t size)
+{
+  add_index_entry(addr, size, 0, 0, MTCP_INDEX_PARENT_PAGES);
+}
+
+/* Add entries for size bytes of uncompressed contents at addr, which are
+ * stored at offset.  The checksums are filled in as the blocks are written.
+ */
+static void add_raw_index_entries(VA addr, size_t size, off_t offset)
+{
+  while (size > 0) {
+    VA next = (VA) (((unsigned long) addr + INDEX_BLOCK_SIZE) &
+                    ~(unsigned long) (INDEX_BLOCK_SIZE - 1));
+    size_t n = MIN((size_t) (next - addr), size);
+    add_index_entry(addr, n, offset, n, 0);
+    addr += n;
+    offset += n;
+    size -= n;
+  }
+}
+
+/* Index of the first entry from first on whose address is at least addr. */
+static size_t find_index_entry(size_t first, VA addr)
+{
+  size_t lo = first, hi = index_num_entries;
+  while (lo < hi) {
+    size_t mid = (lo + hi) / 2;
+    if ((VA) (unsigned long) index_entries[mid].addr < addr) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return lo;
+}
+
+static void write_area_index(int fd)
+{
+  MtcpIndexTrailer trailer;
+
+  memset(&trailer, 0, sizeof(trailer));
+  trailer.offset = ckpt_offset;
+  trailer.num_entries = index_num_entries;
+  if (index_num_entries > 0) {
+    size_t size = index_num_entries * sizeof(MtcpIndexEntry);
+    trailer.checksum = mtcp_checksum(index_entries, size);
+    writefile(fd, index_entries, size);
+  }
+  mtcp_strcpy(trailer.magic, MTCP_INDEX_MAGIC);
+  writefile(fd, &trailer, sizeof(trailer));
+
+  if (index_entries != MAP_FAILED &&
+      mtcp_sys_munmap(index_entries, index_size) == -1) {
+    MTCP_PRINTF("error %d unmapping the area index\n", mtcp_sys_errno);
+  }
+  index_entries = MAP_FAILED;
+  index_num_entries = index_size = 0;
+}
+
+/*****************************************************************************
+ *
+ *  Parallel writer for large memory areas.
+ *
+ *  When writing directly to the checkpoint file (no compression pipe), an
+ *  area of at least PARALLEL_WRITE_MIN_SIZE bytes is cut into units of
+ *  WRITE_UNIT_SIZE bytes.  The helper threads first find the zero (and
+ *  parent) pages of each unit, the checkpoint thread then splits the area
+ *  into records (as mtcp_get_next_page_range() would) and computes the file
+ *  offset of every Area header and payload, and finally the helper threads
+ *  pwrite() their units at those offsets.  The result is byte-for-byte the
+ *  same image that the serial writer produces.
+ *
+ *****************************************************************************/
+
+#define WRITE_UNIT_SIZE (1024 * 1024)
+#define WRITE_UNIT_PAGES (WRITE_UNIT_SIZE / MTCP_PAGE_SIZE)
+#define PARALLEL_WRITE_MIN_SIZE (64 * 1024 * 1024)
+
+typedef struct WriteUnit {
+  uint64_t zero_pages[WRITE_UNIT_PAGES / 64];
+  uint64_t parent_pages[WRITE_UNIT_PAGES / 64];
+} WriteUnit;
+
+typedef struct WriteRecord {
+  VA addr;
+  size_t size;
+  off_t hdr_off;
+  int kind;          /* PAGE_DATA, PAGE_ZERO or PAGE_PARENT */
+} WriteRecord;
+
+typedef struct ParallelWrite {
+  int fd;
+  Area *area;
+  size_t num_pages;
+  size_t num_units;
+  WriteUnit *units;
+  size_t num_records;
+  WriteRecord *records;
+  size_t first_index_entry;
+  size_t volatile next_unit;
+  int volatile error;
+} ParallelWrite;
+
+/* Number of threads to write the checkpoint image with, from
+ * MTCP_WRITER_THREADS (or DMTCP_WRITER_THREADS).  Default is 1 (serial).
+ */
+static int get_num_writer_threads()
+{
+  char *str = getenv("MTCP_WRITER_THREADS");
+  char *endptr;
+  long int n;
+
+  if (str == NULL) {
+    str = getenv("DMTCP_WRITER_THREADS");
+  }
+  if (str == NULL) {
+    return 1;
+  }
+  n = strtol(str, &endptr, 0);
+  if (*str == '\0' || *endptr != '\0' || n < 1) {
+    mtcp_printf("WARNING: MTCP_WRITER_THREADS/DMTCP_WRITER_THREADS defined"
+                " as %s (not a positive number)\n"
+                "  Checkpoint image will be written by a single thread.\n",
+                str);
+    return 1;
+  }
+  return MIN(n, MTCP_MAX_HELPER_THREADS);
+}
+
+static int use_parallel_write(int fd, Area *area)
+{
+  return num_writer_threads > 1 && fd == parallel_write_fd &&
+         area->size >= PARALLEL_WRITE_MIN_SIZE;
+}
+
+static int unit_page_kind(ParallelWrite *pw, size_t p)
+{
+  WriteUnit *unit = &pw->units[p / WRITE_UNIT_PAGES];
+  p %= WRITE_UNIT_PAGES;
+  if ((unit->zero_pages[p / 64] >> (p % 64)) & 1) {
+    return PAGE_ZERO;
+  }
+  if ((unit->parent_pages[p / 64] >> (p % 64)) & 1) {
+    return PAGE_PARENT;
+  }
+  return PAGE_DATA;
+}
+
+/* Return the first page at or after p whose kind differs from kind. */
+static size_t next_page_change(ParallelWrite *pw, size_t p, int kind)
+{
+  while (p < pw->num_pages) {
+    size_t q = p % WRITE_UNIT_PAGES;
+    WriteUnit *unit = &pw->units[p / WRITE_UNIT_PAGES];
+    uint64_t zero = unit->zero_pages[q / 64];
+    uint64_t parent = unit->parent_pages[q / 64];
+    /* Bits of the pages of another kind */
+    uint64_t word = kind == PAGE_ZERO ? ~zero :
+                    kind == PAGE_PARENT ? ~parent : zero | parent;
+    word >>= q % 64;
+    if (word != 0) {
+      return MIN(p + __builtin_ctzll(word), pw->num_pages);
+    }
+    p += 64 - q % 64;
+  }
+  return pw->num_pages;
+}
+
+/* Called on helper threads:  mtcp_sys_XXX() calls only. */
+/* Runs on helper threads, so it returns -errno rather than setting the
+ * shared mtcp_sys_errno.
+ */
+static int pwrite_all(int fd, const void *buf, size_t count, off_t offset)
+{
+  const char *ptr = (const char *) buf;
+  size_t num_written = 0;
+
+  while (num_written < count) {
+    long rc = mtcp_sys_pwrite_raw(fd, ptr + num_written, count - num_written,
+                                  offset + num_written);
+    if (rc == -EINTR || rc == -EAGAIN) {
+      continue;
+    }
+    if (rc < 0) {
+      return rc;
+    }
+    if (rc == 0) {
+      return -EIO;
+    }
+    num_written += rc;
+  }
+  return 0;
+}
+
+static void parallel_scan_units(void *arg, int idx)
+{
+  ParallelWrite *pw = (ParallelWrite *) arg;
+  size_t u;
+
+  while ((u = __sync_fetch_and_add(&pw->next_unit, 1)) < pw->num_units) {
+    size_t first = u * WRITE_UNIT_PAGES;
+    page_kind_bitmaps(pw->area->addr + first * MTCP_PAGE_SIZE,
+                      MIN(WRITE_UNIT_PAGES, pw->num_pages - first),
+                      pw->units[u].zero_pages, pw->units[u].parent_pages);
+  }
+}
+
+static void parallel_write_units(void *arg, int idx)
+{
+  ParallelWrite *pw = (ParallelWrite *) arg;
+  Area hdr;
+  long rc;
+  size_t u;
+
+  while ((u = __sync_fetch_and_add(&pw->next_unit, 1)) < pw->num_units) {
+    VA unit_begin = pw->area->addr + u * WRITE_UNIT_SIZE;
+    VA unit_end = MIN(unit_begin + WRITE_UNIT_SIZE,
+                      pw->area->addr + pw->area->size);
+    size_t lo = 0, hi = pw->num_records;
+    WriteRecord *rec;
+
+    /* Find the record containing unit_begin. */
+    while (hi - lo > 1) {
+      size_t mid = (lo + hi) / 2;
+      if (pw->records[mid].addr <= unit_begin) {
+        lo = mid;
+      } else {
+        hi = mid;
+      }
+    }
+
+    for (rec = &pw->records[lo];
+         rec < pw->records + pw->num_records && rec->addr < unit_end;
+         rec++) {
+      VA begin = MAX(rec->addr, unit_begin);
+      VA end = MIN(rec->addr + rec->size, unit_end);
+
+      if (pw->error) {
+        return;
+      }
+      if (rec->addr >= unit_begin) {
+        hdr = *pw->area;
+        hdr.addr = rec->addr;
+        hdr.size = rec->size;
+        hdr.prot |= rec->kind == PAGE_ZERO ? MTCP_PROT_ZERO_PAGE :
+                     rec->kind == PAGE_PARENT ? MTCP_PROT_PARENT_PAGE : 0;
+        rc = pwrite_all(pw->fd, &hdr, sizeof(hdr), rec->hdr_off);
+        if (rc < 0) {
+          pw->error = -rc;
+          return;
+        }
+      }
+      if (rec->kind == PAGE_DATA) {
+        /* Each index block is checksummed by the writer of the unit it
+         * starts in.
+         */
+        size_t i = find_index_entry(pw->first_index_entry, begin);
+        for (; i < index_num_entries &&
+               (VA) (unsigned long) index_entries[i].addr < end; i++) {
+          MtcpIndexEntry *e = &index_entries[i];
+          e->checksum = mtcp_checksum((void *) (unsigned long) e->addr,
+                                      e->stored_size);
+        }
+        rc = pwrite_all(pw->fd, begin, end - begin,
+                        rec->hdr_off + sizeof(hdr) + (begin - rec->addr));
+        if (rc < 0) {
+          pw->error = -rc;
+          return;
+        }
+      } else if (rec->kind == PAGE_ZERO &&
+                 (rc = mtcp_sys_madvise_raw(begin, end - begin,
+                                            MADV_DONTNEED)) < 0) {
         MTCP_PRINTF("error %d doing madvise(%p, %d, MADV_DONTNEED)\n",
-                    errno, a.addr, (int)a.size);
+                    (int) -rc, begin, (int)(end - begin));
       }
     }
   }
 }
-#endif
+
+static void *mmap_array(size_t *size)
+{
+  void *addr;
+
+  *size = (*size + MTCP_PAGE_SIZE - 1) & MTCP_PAGE_MASK;
+  addr = mtcp_sys_mmap(NULL, *size, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (addr == MAP_FAILED) {
+    MTCP_PRINTF("error %d allocating %p bytes for the parallel writer\n",
+                mtcp_sys_errno, *size);
+    mtcp_abort();
+  }
+  return addr;
+}
+
+/* Write the area as one or more (header, payload) records, exactly as the
+ * serial code would, but with num_writer_threads threads.  If
+ * detect_zero_pages is set, runs of zero pages become MTCP_PROT_ZERO_PAGE
+ * records without payload (and runs of parent pages MTCP_PROT_PARENT_PAGE
+ * records).
+ */
+static void parallel_writememoryarea(int fd, Area *area, int detect_zero_pages)
+{
+  ParallelWrite pw;
+  size_t units_size, records_size;
+  size_t first_index_entry = index_num_entries;
+  size_t p, i;
+  off_t offset;
+  WriteRecord *open_rec = NULL;
+
+  pw.fd = fd;
+  pw.area = area;
+  pw.num_pages = area->size / MTCP_PAGE_SIZE;
+  pw.num_units = (pw.num_pages + WRITE_UNIT_PAGES - 1) / WRITE_UNIT_PAGES;
+  pw.num_records = 0;
+  pw.error = 0;
+  /* Zero and parent records have at least MIN_ZERO_RUN_PAGES pages, and
+   * there is at most one data record between two of them.
+   */
+  units_size = pw.num_units * sizeof(WriteUnit);
+  records_size = (2 * (pw.num_pages / MIN_ZERO_RUN_PAGES) + 1) *
+                 sizeof(WriteRecord);
+  pw.units = mmap_array(&units_size);
+  pw.records = mmap_array(&records_size);
+
+  /* 1. Find the zero and parent pages (mmap() cleared the bitmaps for us
+   *    otherwise).
+   */
+  if (detect_zero_pages) {
+    pw.next_unit = 0;
+    mtcp_run_helper_threads(num_writer_threads, parallel_scan_units, &pw);
+  }
+
+  /* 2. Split the area into records and lay them out in the file. */
+  offset = ckpt_offset;
+  for (p = 0; p < pw.num_pages; ) {
+    int kind = unit_page_kind(&pw, p);
+    size_t q = next_page_change(&pw, p, kind);
+    if (kind != PAGE_DATA && q - p >= MIN_ZERO_RUN_PAGES) {
+      WriteRecord *rec = &pw.records[pw.num_records++];
+      rec->addr = area->addr + p * MTCP_PAGE_SIZE;
+      rec->size = (q - p) * MTCP_PAGE_SIZE;
+      rec->hdr_off = offset;
+      rec->kind = kind;
+      offset += sizeof(Area);
+      open_rec = NULL;
+    } else if (open_rec == NULL) {
+      open_rec = &pw.records[pw.num_records++];
+      open_rec->addr = area->addr + p * MTCP_PAGE_SIZE;
+      open_rec->size = (q - p) * MTCP_PAGE_SIZE;
+      open_rec->hdr_off = offset;
+      open_rec->kind = PAGE_DATA;
+      offset += sizeof(Area) + open_rec->size;
+    } else {
+      open_rec->size += (q - p) * MTCP_PAGE_SIZE;
+      offset += (q - p) * MTCP_PAGE_SIZE;
+    }
+    p = q;
+  }
+  for (i = 0; i < pw.num_records; i++) {
+    WriteRecord *rec = &pw.records[i];
+    if (rec->kind == PAGE_ZERO) {
+      add_zero_index_entry(rec->addr, rec->size);
+    } else if (rec->kind == PAGE_PARENT) {
+      add_parent_index_entry(rec->addr, rec->size);
+    } else {
+      add_raw_index_entries(rec->addr, rec->size, rec->hdr_off + sizeof(Area));
+    }
+  }
+  pw.first_index_entry = first_index_entry;
+
+  /* 3. Write them. */
+  pw.next_unit = 0;
+  mtcp_run_helper_threads(num_writer_threads, parallel_write_units, &pw);
+  if (pw.error != 0) {
+    MTCP_PRINTF("error %d writing %p bytes at %p to checkpoint file\n",
+                pw.error, area->size, area->addr);
+    mtcp_abort();
+  }
+
+  if (mtcp_sys_lseek(fd, offset, SEEK_SET) == -1) {
+    MTCP_PRINTF("error %d seeking in checkpoint file\n", mtcp_sys_errno);
+    mtcp_abort();
+  }
+  ckpt_offset = offset;
+  if (mtcp_sys_munmap(pw.units, units_size) == -1 ||
+      mtcp_sys_munmap(pw.records, records_size) == -1) {
+    MTCP_PRINTF("error %d unmapping parallel writer arrays\n", mtcp_sys_errno);
+  }
+}
+
+/*****************************************************************************
+ *
+ *  In-process compression (MTCP_GZIP or DMTCP_GZIP set to 1).
+ *
+ *  The contents of a memory area are cut into blocks of
+ *  MTCP_COMPRESS_BLOCK_SIZE bytes.  COMPRESS_BLOCKS_PER_THREAD blocks per
+ *  writer thread are compressed at a time by the helper threads, and then
+ *  written out in order by the checkpoint thread.  A block that does not
+ *  get smaller is stored raw.
+ *
+ *****************************************************************************/
+
+#define COMPRESS_BLOCKS_PER_THREAD 4
+
+typedef struct CompressBatch {
+  VA addr;
+  size_t size;
+  size_t num_blocks;
+  size_t volatile next_block;
+  size_t stored_size[MTCP_MAX_HELPER_THREADS * COMPRESS_BLOCKS_PER_THREAD];
+  uint64_t checksum[MTCP_MAX_HELPER_THREADS * COMPRESS_BLOCKS_PER_THREAD];
+} CompressBatch;
+
+/* One output slot per block of a batch, then one scratch area per thread.
+ * Not malloc:  the helper threads cannot call it.
+ */
+static char *compress_bufs = MAP_FAILED;
+static size_t compress_bufs_size = 0;
+static size_t compress_batch_blocks = 0;
+
+static int alloc_compress_bufs()
+{
+  compress_batch_blocks = num_writer_threads * COMPRESS_BLOCKS_PER_THREAD;
+  compress_bufs_size = compress_batch_blocks * MTCP_COMPRESS_BLOCK_SIZE +
+                       num_writer_threads * MTCP_COMPRESS_SCRATCH_SIZE;
+  compress_bufs = mtcp_sys_mmap(NULL, compress_bufs_size,
+                                PROT_READ | PROT_WRITE,
+                                MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+                                -1, 0);
+  if (compress_bufs == MAP_FAILED) {
+    MTCP_PRINTF("WARNING: error %d allocating compression buffers.\n"
+                "  Checkpoint image will not be compressed.\n",
+                mtcp_sys_errno);
+    return -1;
+  }
+  return 0;
+}
+
+static void free_compress_bufs()
+{
+  if (compress_bufs != MAP_FAILED &&
+      mtcp_sys_munmap(compress_bufs, compress_bufs_size) == -1) {
+    MTCP_PRINTF("error %d unmapping compression buffers\n", mtcp_sys_errno);
+  }
+  compress_bufs = MAP_FAILED;
+}
+
+static char *compress_slot(size_t i)
+{
+  return compress_bufs + i * MTCP_COMPRESS_BLOCK_SIZE;
+}
+
+static void compress_blocks(void *arg, int idx)
+{
+  CompressBatch *cb = (CompressBatch *) arg;
+  char *scratch = compress_slot(compress_batch_blocks) +
+                  idx * MTCP_COMPRESS_SCRATCH_SIZE;
+  size_t i;
+
+  while ((i = __sync_fetch_and_add(&cb->next_block, 1)) < cb->num_blocks) {
+    size_t off = i * MTCP_COMPRESS_BLOCK_SIZE;
+    size_t raw_size = MIN(MTCP_COMPRESS_BLOCK_SIZE, cb->size - off);
+    size_t n = mtcp_compress_block(cb->addr + off, raw_size,
+                                   compress_slot(i), raw_size - 1, scratch);
+    cb->stored_size[i] = n > 0 ? n : raw_size;
+    cb->checksum[i] = mtcp_checksum(n > 0 ? compress_slot(i) : cb->addr + off,
+                                    cb->stored_size[i]);
+  }
+}
+
+static void write_compressed_area(int fd, Area *area)
+{
+  Area hdr = *area;
+  CompressBatch cb;
+  size_t off, i;
+
+  hdr.prot |= MTCP_PROT_COMPRESSED;
+  writefile(fd, &hdr, sizeof(hdr));
+
+  for (off = 0; off < area->size; off += cb.size) {
+    cb.addr = area->addr + off;
+    cb.size = MIN(area->size - off,
+                  compress_batch_blocks * MTCP_COMPRESS_BLOCK_SIZE);
+    cb.num_blocks = (cb.size + MTCP_COMPRESS_BLOCK_SIZE - 1) /
+                    MTCP_COMPRESS_BLOCK_SIZE;
+    cb.next_block = 0;
+    mtcp_run_helper_threads(MIN(num_writer_threads, cb.num_blocks),
+                            compress_blocks, &cb);
+
+    for (i = 0; i < cb.num_blocks; i++) {
+      MtcpCompressBlockHdr bh;
+      VA raw = cb.addr + i * MTCP_COMPRESS_BLOCK_SIZE;
+      bh.raw_size = MIN(MTCP_COMPRESS_BLOCK_SIZE,
+                        cb.size - i * MTCP_COMPRESS_BLOCK_SIZE);
+      bh.stored_size = cb.stored_size[i];
+      writefile(fd, &bh, sizeof(bh));
+      add_index_entry(raw, bh.raw_size, ckpt_offset, bh.stored_size,
+                      bh.stored_size < bh.raw_size ? MTCP_INDEX_COMPRESSED : 0)
+        ->checksum = cb.checksum[i];
+      writefile(fd, bh.stored_size == bh.raw_size ? raw : compress_slot(i),
+                bh.stored_size);
+    }
+  }
+}
+
+/*****************************************************************************
+ *
+ *  Chunk store (see mtcp_chunk_store.c).
+ *
+ *  The helper threads hash a batch of chunks and store the new ones, then
+ *  sync the directories that got new chunks, and then the checkpoint thread
+ *  writes the MtcpChunkRef of each, in order, and an index entry per chunk.
+ *
+ *  Garbage collection works by generation.  Each image has a stamp file in
+ *  the store, <image>.next while the image is written and <image>.done once
+ *  it is in place, whose modification time is when its checkpoint began.
+ *  Every chunk that the image refers to was written or touched after that.
+ *  Once its image is in place, the first process to finish a generation
+ *  removes the chunks older than the oldest stamp:  no image on disk, nor
+ *  any being written, refers to them.  A chunk is renamed away and checked
+ *  again before it is removed, in case a checkpoint touched it meanwhile.
+ *  Parent images (of incremental checkpoints) keep the stamp of when they
+ *  were written.  The clock is that of the file system throughout.
+ *
+ *****************************************************************************/
+
+#define CHUNKS_PER_THREAD 16
+
+typedef struct ChunkBatch {
+  VA addr;
+  size_t size;
+  size_t num_chunks;
+  size_t volatile next_chunk;
+  size_t volatile num_written;
+  int volatile error;
+  int volatile next_dir;
+  char volatile dir_changed[256];   /* By the first byte of the hash */
+  MtcpChunkRef refs[MTCP_MAX_HELPER_THREADS * CHUNKS_PER_THREAD];
+} ChunkBatch;
+
+static ChunkBatch chunk_batch;      /* Too big for the stack */
+static char chunk_store[PATH_MAX];  /* With a trailing '/' */
+/* One temporary file name suffix per helper thread */
+static char chunk_tmp_suffix[MTCP_MAX_HELPER_THREADS][80];
+/* Per helper thread:  a compressed chunk, then compression scratch space */
+static char *chunk_bufs = MAP_FAILED;
+static size_t chunk_bufs_size = 0;
+static size_t chunks_total = 0;
+static size_t chunks_written = 0;
+static int chunk_stamp_ok = 0;      /* <image>.next was created */
+
+/* Memory areas go to the chunk store if MTCP_CHUNK_STORE (or
+ * DMTCP_CHUNK_STORE) is set to a non-zero number.  Default is 0.
+ */
+static int test_use_chunk_store()
+{
+  char *str = getenv("MTCP_CHUNK_STORE");
+  char *endptr;
+  long int n;
+
+  if (str == NULL) {
+    str = getenv("DMTCP_CHUNK_STORE");
+  }
+  if (str == NULL) {
+    return 0;
+  }
+  n = strtol(str, &endptr, 0);
+  if (*str == '\0' || *endptr != '\0') {
+    mtcp_printf("WARNING: MTCP_CHUNK_STORE/DMTCP_CHUNK_STORE defined as %s"
+                " (not a number)\n"
+                "  Checkpoint image will hold the memory contents.\n", str);
+    return 0;
+  }
+  return n != 0;
+}
+
+/* Returns 1 if dir was created, 0 if it was there, or -1. */
+static int make_chunk_store_dir(const char *dir)
+{
+  if (mtcp_sys_mkdir(dir, 0700) == 0) {
+    return 1;
+  }
+  if (mtcp_sys_errno != EEXIST) {
+    MTCP_PRINTF("WARNING: error %d creating %s.\n"
+                "  Checkpoint image will hold the memory contents.\n",
+                mtcp_sys_errno, dir);
+    return -1;
+  }
+  return 0;
+}
+
+/* path gets the stamp file of the image perm_ckpt_filename, with suffix.
+ * Returns -1 if that is too long.
+ */
+static int chunk_stamp_path(char *path, const char *perm_ckpt_filename,
+                            const char *suffix)
+{
+  const char *base = strrchr(perm_ckpt_filename, '/');
+  int len = snprintf(path, PATH_MAX, "%s%s%s", chunk_store,
+                     base == NULL ? perm_ckpt_filename : base + 1, suffix);
+  return len < 0 || len >= PATH_MAX ? -1 : 0;
+}
+
+/* Create the store, MTCP_CHUNK_STORE_DIR in the directory of the image,
+ * and its subdirectories (one per first byte of the hash).  Other processes
+ * may be doing the same.  Returns -1 if the store cannot be used.
+ */
+static int prepare_chunk_store(const char *perm_ckpt_filename)
+{
+  const char *base = strrchr(perm_ckpt_filename, '/');
+  int dir_len = base == NULL ? 0 : base + 1 - perm_ckpt_filename;
+  char host[64];
+  char subdir[PATH_MAX];
+  char stamp[PATH_MAX];
+  int i, len, rc, new_dirs = 0;
+
+  len = snprintf(chunk_store, sizeof(chunk_store), "%.*s%s/",
+                 dir_len, perm_ckpt_filename, MTCP_CHUNK_STORE_DIR);
+  if (len < 0 || len + MTCP_CHUNK_NAME_SIZE + sizeof(chunk_tmp_suffix[0])
+                 > sizeof(chunk_store)) {
+    MTCP_PRINTF("WARNING: checkpoint directory name too long for the chunk"
+                " store.\n  Checkpoint image will hold the memory contents.\n");
+    return -1;
+  }
+  rc = make_chunk_store_dir(chunk_store);
+  if (rc == -1) {
+    return -1;
+  }
+  if (rc == 1 && sync_dir_of(perm_ckpt_filename) == -1) {
+    MTCP_PRINTF("WARNING: error %d syncing the directory of %s\n",
+                mtcp_sys_errno, chunk_store);
+  }
+  memcpy(subdir, chunk_store, len);
+  for (i = 0; i < 256; i++) {
+    snprintf(subdir + len, 3, "%02x", i);
+    rc = make_chunk_store_dir(subdir);
+    if (rc == -1) {
+      return -1;
+    }
+    new_dirs |= rc;
+  }
+  if (new_dirs && sync_dir(chunk_store) == -1) {
+    MTCP_PRINTF("WARNING: error %d syncing %s\n", mtcp_sys_errno, chunk_store);
+  }
+
+  /* Protect what this image will refer to from collect_chunk_garbage(). */
+  chunk_stamp_ok = 0;
+  if (chunk_stamp_path(stamp, perm_ckpt_filename, ".next") == 0) {
+    int fd = mtcp_sys_open(stamp, O_WRONLY | O_CREAT, 0600);
+    if (fd >= 0) {
+      chunk_stamp_ok = futimens(fd, NULL) == 0;
+      mtcp_sys_close(fd);
+    }
+  }
+  if (!chunk_stamp_ok) {
+    MTCP_PRINTF("WARNING: cannot create the stamp of this image in %s.\n"
+                "  Unused chunks will not be removed.\n", chunk_store);
+  }
+
+  if (gethostname(host, sizeof(host)) == -1) {
+    host[0] = '\0';
+  }
+  host[sizeof(host) - 1] = '\0';
+  for (i = 0; i < num_writer_threads; i++) {
+    snprintf(chunk_tmp_suffix[i], sizeof(chunk_tmp_suffix[i]),
+             ".tmp.%.40s.%d.%d", host, (int) mtcp_sys_getpid(), i);
+  }
+
+  chunk_bufs = MAP_FAILED;
+  if (compress_ckpt) {
+    chunk_bufs_size = num_writer_threads *
+                      (MTCP_CHUNK_SIZE + MTCP_COMPRESS_SCRATCH_SIZE);
+    chunk_bufs = mtcp_sys_mmap(NULL, chunk_bufs_size, PROT_READ | PROT_WRITE,
+                               MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+                               -1, 0);
+    if (chunk_bufs == MAP_FAILED) {
+      MTCP_PRINTF("WARNING: error %d allocating compression buffers.\n"
+                  "  Chunks will not be compressed.\n", mtcp_sys_errno);
+    }
+  }
+  chunks_total = chunks_written = 0;
+  return 0;
+}
+
+static void free_chunk_bufs()
+{
+  if (chunk_bufs != MAP_FAILED &&
+      mtcp_sys_munmap(chunk_bufs, chunk_bufs_size) == -1) {
+    MTCP_PRINTF("error %d unmapping compression buffers\n", mtcp_sys_errno);
+  }
+  chunk_bufs = MAP_FAILED;
+  if (use_chunk_store) {
+    DPRINTF("%d of %d chunks written to %s\n",
+            (int) chunks_written, (int) chunks_total, chunk_store);
+  }
+}
+
+static void store_chunks(void *arg, int idx)
+{
+  ChunkBatch *cb = (ChunkBatch *) arg;
+  char *compress_buf = NULL, *scratch = NULL;
+  size_t i;
+
+  if (chunk_bufs != MAP_FAILED) {
+    compress_buf = chunk_bufs +
+                   idx * (MTCP_CHUNK_SIZE + MTCP_COMPRESS_SCRATCH_SIZE);
+    scratch = compress_buf + MTCP_CHUNK_SIZE;
+  }
+  while ((i = __sync_fetch_and_add(&cb->next_chunk, 1)) < cb->num_chunks) {
+    size_t off = i * MTCP_CHUNK_SIZE;
+    int rc = mtcp_store_chunk(chunk_store, chunk_tmp_suffix[idx],
+                              cb->addr + off,
+                              MIN(MTCP_CHUNK_SIZE, cb->size - off),
+                              &cb->refs[i], compress_buf, scratch);
+    if (rc < 0) {
+      cb->error = -rc;
+    } else if (rc > 0) {
+      __sync_fetch_and_add(&cb->num_written, 1);
+      cb->dir_changed[cb->refs[i].hash[0] >> 56] = 1;
+    }
+  }
+}
+
+static void sync_chunk_dirs(void *arg, int idx)
+{
+  ChunkBatch *cb = (ChunkBatch *) arg;
+  int i;
+
+  while ((i = __sync_fetch_and_add(&cb->next_dir, 1)) < 256) {
+    if (cb->dir_changed[i]) {
+      int rc = mtcp_sync_chunk_dir(chunk_store, i);
+      if (rc < 0) {
+        cb->error = -rc;
+      }
+      cb->dir_changed[i] = 0;
+    }
+  }
+}
+
+static void write_chunked_area(int fd, Area *area)
+{
+  ChunkBatch *cb = &chunk_batch;
+  Area hdr = *area;
+  size_t off, i;
+
+  hdr.prot |= MTCP_PROT_CHUNKS;
+  writefile(fd, &hdr, sizeof(hdr));
+
+  for (off = 0; off < area->size; off += cb->size) {
+    cb->addr = area->addr + off;
+    cb->size = MIN(area->size - off,
+                   num_writer_threads * CHUNKS_PER_THREAD * MTCP_CHUNK_SIZE);
+    cb->num_chunks = (cb->size + MTCP_CHUNK_SIZE - 1) / MTCP_CHUNK_SIZE;
+    cb->next_chunk = 0;
+    cb->num_written = 0;
+    cb->error = 0;
+    mtcp_run_helper_threads(MIN(num_writer_threads, cb->num_chunks),
+                            store_chunks, cb);
+    /* The new chunks must be durable before the references to them. */
+    if (cb->error == 0 && cb->num_written > 0) {
+      cb->next_dir = 0;
+      mtcp_run_helper_threads(MIN(num_writer_threads, cb->num_written),
+                              sync_chunk_dirs, cb);
+    }
+    if (cb->error != 0) {
+      MTCP_PRINTF("error %d writing to the chunk store %s\n",
+                  cb->error, chunk_store);
+      mtcp_abort();
+    }
+
+    for (i = 0; i < cb->num_chunks; i++) {
+      add_index_entry(cb->addr + i * MTCP_CHUNK_SIZE, cb->refs[i].raw_size,
+                      ckpt_offset + i * sizeof(MtcpChunkRef),
+                      sizeof(MtcpChunkRef), MTCP_INDEX_CHUNK)
+        ->checksum = mtcp_checksum(&cb->refs[i], sizeof(MtcpChunkRef));
+    }
+    writefile(fd, cb->refs, cb->num_chunks * sizeof(MtcpChunkRef));
+    chunks_total += cb->num_chunks;
+    chunks_written += cb->num_written;
+  }
+}
+
+struct chunk_dirent64 {
+  uint64_t d_ino;
+  int64_t d_off;
+  unsigned short d_reclen;
+  unsigned char d_type;
+  char d_name[];
+};
+
+/* Call fn for each entry of the directory open on dirfd but "." and "..".
+ * No opendir():  the user threads may hold the malloc lock.
+ */
+static void for_each_entry(int dirfd,
+                           void (*fn)(int dirfd, const char *name, void *arg),
+                           void *arg)
+{
+  char buf[4096];
+  int n, off;
+
+  while ((n = mtcp_sys_getdents64(dirfd, buf, sizeof(buf))) > 0) {
+    for (off = 0; off < n; ) {
+      struct chunk_dirent64 *d = (struct chunk_dirent64 *) (buf + off);
+      off += d->d_reclen;
+      if (strcmp(d->d_name, ".") != 0 && strcmp(d->d_name, "..") != 0) {
+        fn(dirfd, d->d_name, arg);
+      }
+    }
+  }
+}
+
+static int older(const struct timespec *a, const struct timespec *b)
+{
+  return a->tv_sec < b->tv_sec ||
+         (a->tv_sec == b->tv_sec && a->tv_nsec < b->tv_nsec);
+}
+
+static int has_suffix(const char *name, const char *suffix)
+{
+  size_t len = strlen(name), slen = strlen(suffix);
+  return len > slen && strcmp(name + len - slen, suffix) == 0;
+}
+
+typedef struct ChunkGC {
+  const char *ckpt_dir;       /* With a trailing '/', or "" */
+  struct timespec oldest;     /* Of the stamps */
+  size_t removed;
+} ChunkGC;
+
+/* Find the oldest stamp.  Drop the stamps of the images that are gone. */
+static void check_stamp(int dirfd, const char *name, void *arg)
+{
+  ChunkGC *gc = (ChunkGC *) arg;
+  char image[PATH_MAX];
+  struct stat st;
+
+  if (has_suffix(name, ".done")) {
+    if (snprintf(image, sizeof(image), "%s%.*s", gc->ckpt_dir,
+                 (int) (strlen(name) - sizeof(".done") + 1), name)
+        < (int) sizeof(image) &&
+        access(image, F_OK) == -1 && errno == ENOENT) {
+      unlinkat(dirfd, name, 0);
+      return;
+    }
+  } else if (!has_suffix(name, ".next")) {
+    return;
+  }
+  if (fstatat(dirfd, name, &st, 0) == 0 && older(&st.st_mtim, &gc->oldest)) {
+    gc->oldest = st.st_mtim;
+  }
+}
+
+static void collect_chunk(int dirfd, const char *name, void *arg)
+{
+  ChunkGC *gc = (ChunkGC *) arg;
+  char trash[NAME_MAX + sizeof(chunk_tmp_suffix[0])];
+  struct stat st;
+
+  if (fstatat(dirfd, name, &st, AT_SYMLINK_NOFOLLOW) == -1 ||
+      !older(&st.st_mtim, &gc->oldest)) {
+    return;
+  }
+  if (strstr(name, ".tmp.") != NULL) {
+    /* Left over by a writer that died */
+    unlinkat(dirfd, name, 0);
+    return;
+  }
+  if (snprintf(trash, sizeof(trash), "%s%s", name, chunk_tmp_suffix[0])
+      >= (int) sizeof(trash) ||
+      renameat(dirfd, name, dirfd, trash) == -1) {
+    return;
+  }
+  /* After the rename, a checkpoint no longer finds the chunk and writes it
+   * again.  Before it, a checkpoint may have touched it:  then keep it.
+   */
+  if (fstatat(dirfd, trash, &st, AT_SYMLINK_NOFOLLOW) == 0 &&
+      !older(&st.st_mtim, &gc->oldest)) {
+    renameat(dirfd, trash, dirfd, name);
+  } else {
+    unlinkat(dirfd, trash, 0);
+    gc->removed++;
+  }
+}
+
+/* Remove the chunks that no image of this generation refers to.  started
+ * is the stamp of this image.  Once per generation for the whole store.
+ */
+static void collect_chunk_garbage(const char *perm_ckpt_filename,
+                                  const struct timespec *started)
+{
+  const char *base = strrchr(perm_ckpt_filename, '/');
+  char ckpt_dir[PATH_MAX];
+  char subdir[3];
+  struct stat st;
+  ChunkGC gc;
+  int dirfd, fd, i;
+
+  snprintf(ckpt_dir, sizeof(ckpt_dir), "%.*s",
+           base == NULL ? 0 : (int) (base + 1 - perm_ckpt_filename),
+           perm_ckpt_filename);
+  gc.ckpt_dir = ckpt_dir;
+  gc.oldest = *started;
+  gc.removed = 0;
+
+  dirfd = mtcp_sys_open2(chunk_store, O_RDONLY | O_DIRECTORY);
+  if (dirfd < 0) {
+    return;
+  }
+  /* Another process swept the store since this generation began. */
+  if (fstatat(dirfd, ".swept", &st, 0) == 0 && !older(&st.st_mtim, started)) {
+    mtcp_sys_close(dirfd);
+    return;
+  }
+  fd = openat(dirfd, ".swept", O_WRONLY | O_CREAT, 0600);
+  if (fd < 0 || futimens(fd, NULL) == -1) {
+    if (fd >= 0) {
+      mtcp_sys_close(fd);
+    }
+    mtcp_sys_close(dirfd);
+    return;
+  }
+  mtcp_sys_close(fd);
+
+  for_each_entry(dirfd, check_stamp, &gc);
+  for (i = 0; i < 256; i++) {
+    snprintf(subdir, sizeof(subdir), "%02x", i);
+    fd = openat(dirfd, subdir, O_RDONLY | O_DIRECTORY);
+    if (fd >= 0) {
+      for_each_entry(fd, collect_chunk, &gc);
+      mtcp_sys_close(fd);
+    }
+  }
+  mtcp_sys_close(dirfd);
+  DPRINTF("removed %d unused chunks from %s\n", (int) gc.removed,
+          chunk_store);
+}
+
+/* Called once the image has been renamed to perm_ckpt_filename:  its stamp
+ * replaces that of the image before, and unused chunks go.
+ */
+static void finish_chunk_store(const char *perm_ckpt_filename)
+{
+  char next[PATH_MAX], done[PATH_MAX], parent[PATH_MAX];
+  struct stat st;
+
+  if (!chunk_stamp_ok ||
+      chunk_stamp_path(next, perm_ckpt_filename, ".next") == -1 ||
+      chunk_stamp_path(done, perm_ckpt_filename, ".done") == -1) {
+    return;
+  }
+  /* Collect only once the new image surely replaced the one before. */
+  if (sync_dir_of(perm_ckpt_filename) == -1) {
+    MTCP_PRINTF("WARNING: error %d syncing the directory of %s\n",
+                mtcp_sys_errno, perm_ckpt_filename);
+    return;
+  }
+  if (delta_ckpt &&
+      snprintf(parent, sizeof(parent), "%s%s.done", chunk_store,
+               parent_name) < (int) sizeof(parent)) {
+    unlink(parent);
+    link(done, parent);
+  }
+  if (mtcp_sys_rename(next, done) == -1) {
+    MTCP_PRINTF("WARNING: error %d renaming %s\n", mtcp_sys_errno, next);
+    return;
+  }
+  if (stat(done, &st) == 0) {
+    collect_chunk_garbage(perm_ckpt_filename, &st.st_mtim);
+  }
+}
+
+/* Write the Area header and the contents of the area. */
+static void writearea(int fd, Area *area)
+{
+  if (use_chunk_store) {
+    write_chunked_area(fd, area);
+  } else if (compress_ckpt) {
+    write_compressed_area(fd, area);
+  } else {
+    size_t first = index_num_entries;
+    writefile(fd, area, sizeof(*area));
+    MTCP_ASSERT((ckpt_offset & MTCP_PAGE_OFFSET_MASK) == 0);
+    size_t i;
+    add_raw_index_entries(area->addr, area->size, ckpt_offset);
+    for (i = first; i < index_num_entries; i++) {
+      MtcpIndexEntry *e = &index_entries[i];
+      void *addr = (void *) (unsigned long) e->addr;
+      e->checksum = mtcp_checksum(addr, e->stored_size);
+      writefile(fd, addr, e->stored_size);
+    }
+  }
+}
 
 static void mtcp_write_non_rwx_and_anonymous_pages(int fd, Area *orig_area)
 {
@@ -1019,7 +2564,8 @@ static void mtcp_write_non_rwx_and_anonymous_pages(int fd, Area *orig_area)
    * code and that should reset the /proc/self/maps files to its original
    * condition.
    */
-  if (orig_area->name[0] != '\0') {
+  if (orig_area->name[0] != '\0' &&
+      mtcp_strcmp(orig_area->name, "[heap]") != 0) {
     MTCP_PRINTF("NOTREACHED\n");
     mtcp_abort();
   }
@@ -1033,20 +2579,30 @@ static void mtcp_write_non_rwx_and_anonymous_pages(int fd, Area *orig_area)
     }
   }
 
+  if (use_parallel_write(fd, &area)) {
+    parallel_writememoryarea(fd, &area, 1);
+    area.size = 0;
+  }
+
   while (area.size > 0) {
     size_t size;
-    int is_zero;
+    int kind;
     Area a = area;
 
-    mtcp_get_next_page_range(&a, &size, &is_zero);
+    mtcp_get_next_page_range(&a, &size, &kind);
 
-    a.prot |= is_zero ? MTCP_PROT_ZERO_PAGE : 0;
     a.size = size;
 
-    mtcp_writefile(fd, &a, sizeof(a));
-    if (!is_zero) {
-      mtcp_writefile(fd, a.addr, a.size);
+    if (kind == PAGE_DATA) {
+      writearea(fd, &a);
+    } else if (kind == PAGE_PARENT) {
+      a.prot |= MTCP_PROT_PARENT_PAGE;
+      writefile(fd, &a, sizeof(a));
+      add_parent_index_entry(a.addr, a.size);
     } else {
+      a.prot |= MTCP_PROT_ZERO_PAGE;
+      writefile(fd, &a, sizeof(a));
+      add_zero_index_entry(a.addr, a.size);
       if (madvise(a.addr, a.size, MADV_DONTNEED) == -1) {
         MTCP_PRINTF("error %d doing madvise(%p, %d, MADV_DONTNEED)\n",
                     errno, a.addr, (int)a.size);
@@ -1106,10 +2662,12 @@ static void writememoryarea (int fd, Area *area, int stack_was_seen,
   if (area->prot == 0 ||
       (area->name[0] == '\0' &&
        ((area->flags & MAP_ANONYMOUS) != 0) &&
-       ((area->flags & MAP_PRIVATE) != 0))) {
+       ((area->flags & MAP_PRIVATE) != 0)) ||
+      (area_is_incremental && mtcp_strcmp(area->name, "[heap]") == 0)) {
     /* Detect zero pages and do not write them to ckpt image.
      * Currently, we detect zero pages in non-rwx mapping and anonymous
-     * mappings only
+     * mappings only (and in the heap of an incremental image, which
+     * leaves out its clean pages the same way).
      */
     mtcp_write_non_rwx_and_anonymous_pages(fd, area);
   } else if (0 != mtcp_strcmp(area -> name, "[vsyscall]")
@@ -1124,8 +2682,11 @@ static void writememoryarea (int fd, Area *area, int stack_was_seen,
      *   implemented with backing files
      */
     if (area -> flags & MAP_ANONYMOUS || area -> flags & MAP_SHARED) {
-      mtcp_writefile(fd, area, sizeof(*area));
-      mtcp_writefile(fd, area->addr, area->size);
+      if (use_parallel_write(fd, area)) {
+        parallel_writememoryarea(fd, area, 0);
+      } else {
+        writearea(fd, area);
+      }
     } else {
       MTCP_PRINTF("UnImplemented");
       mtcp_abort();
@@ -0,0 +1,171 @@
+/*****************************************************************************
+ *   Copyright (C) 2006-2013 by Michael Rieker, Jason Ansel, Kapil Arya, and *
+ *                                                            Gene Cooperman *
+ *   mrieker@nii.net, jansel@csail.mit.edu, kapil@ccs.neu.edu, and           *
+ *                                                          gene@ccs.neu.edu *
+ *                                                                           *
+ *   This file is part of the MTCP module of DMTCP (DMTCP:mtcp).             *
+ *                                                                           *
+ *  DMTCP:mtcp is free software: you can redistribute it and/or              *
+ *  modify it under the terms of the GNU Lesser General Public License as    *
+ *  published by the Free Software Foundation, either version 3 of the       *
+ *  License, or (at your option) any later version.                          *
+ *                                                                           *
+ *  DMTCP:dmtcp/src is distributed in the hope that it will be useful,       *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of           *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the            *
+ *  GNU Lesser General Public License for more details.                      *
+ *                                                                           *
+ *  You should have received a copy of the GNU Lesser General Public         *
+ *  License along with DMTCP:dmtcp/src.  If not, see                         *
+ *  <http://www.gnu.org/licenses/>.                                          *
+ *****************************************************************************/
+
+/*****************************************************************************
+ *
+ *  Test whether a page is all zero.  This is the inner loop of the zero-page
+ *  detection in mtcp_writeckpt.c, so there is one version per instruction
+ *  set; the fastest one that the CPU (and kernel) support is selected on
+ *  first use.  No libc calls:  these also run on the writer helper threads.
+ *
+ *  See zeropagebench.c for a comparison of the versions.
+ *
+ *****************************************************************************/
+
+#include <stdint.h>
+
+#include "mtcp_internal.h"
+#include "mtcp_util.h"
+
+#if (defined(__x86_64__) || defined(__i386__)) && \
+    (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))
+# define HAVE_X86_ZERO_PAGE_KERNELS
+# include <cpuid.h>
+# include <immintrin.h>
+#endif
+
+__attribute__ ((visibility ("hidden")))
+int mtcp_is_zero_page_scalar(const void *page)
+{
+  const uint64_t *buf = (const uint64_t *) page;
+  size_t i;
+
+  for (i = 0; i < MTCP_PAGE_SIZE / sizeof(*buf); i += 8) {
+    if ((buf[i+0] | buf[i+1] | buf[i+2] | buf[i+3] |
+         buf[i+4] | buf[i+5] | buf[i+6] | buf[i+7]) != 0) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+#ifdef HAVE_X86_ZERO_PAGE_KERNELS
+__attribute__ ((visibility ("hidden"), target ("sse2")))
+int mtcp_is_zero_page_sse2(const void *page)
+{
+  const __m128i *buf = (const __m128i *) page;
+  const __m128i zero = _mm_setzero_si128();
+  size_t i;
+
+  for (i = 0; i < MTCP_PAGE_SIZE / sizeof(*buf); i += 8) {
+    __m128i v = _mm_or_si128(_mm_or_si128(_mm_or_si128(buf[i+0], buf[i+1]),
+                                          _mm_or_si128(buf[i+2], buf[i+3])),
+                             _mm_or_si128(_mm_or_si128(buf[i+4], buf[i+5]),
+                                          _mm_or_si128(buf[i+6], buf[i+7])));
+    if (_mm_movemask_epi8(_mm_cmpeq_epi8(v, zero)) != 0xffff) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+__attribute__ ((visibility ("hidden"), target ("avx2")))
+int mtcp_is_zero_page_avx2(const void *page)
+{
+  const __m256i *buf = (const __m256i *) page;
+  size_t i;
+
+  for (i = 0; i < MTCP_PAGE_SIZE / sizeof(*buf); i += 8) {
+    __m256i v =
+      _mm256_or_si256(_mm256_or_si256(_mm256_or_si256(buf[i+0], buf[i+1]),
+                                      _mm256_or_si256(buf[i+2], buf[i+3])),
+                      _mm256_or_si256(_mm256_or_si256(buf[i+4], buf[i+5]),
+                                      _mm256_or_si256(buf[i+6], buf[i+7])));
+    if (!_mm256_testz_si256(v, v)) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+static int cpu_has_sse2()
+{
+  unsigned int a, b, c, d;
+  return __get_cpuid(1, &a, &b, &c, &d) && (d & bit_SSE2);
+}
+
+/* AVX2 needs both the CPU bit and the kernel saving the YMM registers. */
+static int cpu_has_avx2()
+{
+  /* Not eax, etc.:  mtcp_sys.h #defines those names on x86_64. */
+  unsigned int a, b, c, d;
+  unsigned int xcr0_lo, xcr0_hi;
+
+  if (!__get_cpuid(1, &a, &b, &c, &d) ||
+      (c & (bit_OSXSAVE | bit_AVX)) != (bit_OSXSAVE | bit_AVX)) {
+    return 0;
+  }
+  asm volatile (".byte 0x0f, 0x01, 0xd0" /* xgetbv */
+                : "=a" (xcr0_lo), "=d" (xcr0_hi) : "c" (0));
+  if ((xcr0_lo & 0x6) != 0x6) {
+    return 0;
+  }
+  if (__get_cpuid_max(0, NULL) < 7) {
+    return 0;
+  }
+  __cpuid_count(7, 0, a, b, c, d);
+  return (b & bit_AVX2) != 0;
+}
+#endif
+
+/* Returns the kernel named "scalar", "sse2" or "avx2", or NULL if this CPU
+ * cannot run it.  A NULL name selects the fastest kernel available.
+ */
+__attribute__ ((visibility ("hidden")))
+mtcp_zero_page_fn_t mtcp_zero_page_kernel(const char *name)
+{
+#ifdef HAVE_X86_ZERO_PAGE_KERNELS
+  if (name == NULL) {
+    return cpu_has_avx2() ? mtcp_is_zero_page_avx2 :
+           cpu_has_sse2() ? mtcp_is_zero_page_sse2 : mtcp_is_zero_page_scalar;
+  }
+  if (mtcp_strcmp(name, "avx2") == 0) {
+    return cpu_has_avx2() ? mtcp_is_zero_page_avx2 : NULL;
+  }
+  if (mtcp_strcmp(name, "sse2") == 0) {
+    return cpu_has_sse2() ? mtcp_is_zero_page_sse2 : NULL;
+  }
+#else
+  if (name == NULL) {
+    return mtcp_is_zero_page_scalar;
+  }
+#endif
+  if (mtcp_strcmp(name, "scalar") == 0) {
+    return mtcp_is_zero_page_scalar;
+  }
+  return NULL;
+}
+
+static mtcp_zero_page_fn_t is_zero_page = NULL;
+
+/* page must be page-aligned.  Several threads may race to select the
+ * kernel;  they all store the same value.
+ */
+__attribute__ ((visibility ("hidden")))
+int mtcp_is_zero_page(const void *page)
+{
+  if (is_zero_page == NULL) {
+    is_zero_page = mtcp_zero_page_kernel(NULL);
+  }
+  return (*is_zero_page)(page);
+}
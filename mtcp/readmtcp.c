@@ -5,6 +5,7 @@
  */
 
 #include <errno.h>
+#include <fcntl.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <string.h>
@@ -15,6 +16,8 @@
 
 int mtcp_restore_cpfd = -1; // '= -1' puts it in regular data instead of common
 
+static int check_area_index(int fd, off_t image_begin);
+
 static const char* theUsage =
   "USAGE:\n"
   "readmtcp <ckpt_image_filename>\n"
@@ -67,10 +70,21 @@ int main(int argc, char **argv)
     exit( system(command) );
   }
 
+  /* Offsets in the area index are from the MAGIC;  -1 if reading a pipe. */
+  off_t image_begin = lseek(fd, 0, SEEK_CUR);
+  if (image_begin != -1)
+    image_begin -= MAGIC_LEN;
+
   char tmpBuf[MTCP_PAGE_SIZE];
   mtcp_readfile(fd, &tmpBuf, MTCP_PAGE_SIZE - MAGIC_LEN);
   mtcp_ckpt_image_hdr_t *ckpt_hdr = (mtcp_ckpt_image_hdr_t*) tmpBuf;
 
+  printf("image format version: %d\n", ckpt_hdr->version);
+  if (ckpt_hdr->version >= 3 && ckpt_hdr->parent_name[0] != '\0') {
+    printf("incremental image;  parent image: %.*s\n",
+           (int) sizeof(ckpt_hdr->parent_name), ckpt_hdr->parent_name);
+  }
+
   printf("mtcp_restart: saved stack resource limit:" \
 	 " soft_lim: %lu, hard_lim: %lu\n",
 	 ckpt_hdr->stack_rlimit.rlim_cur, ckpt_hdr->stack_rlimit.rlim_max);
@@ -116,7 +130,12 @@ int main(int argc, char **argv)
     Area area;
     mtcp_readfile(fd, &area, sizeof area);
     if (area.size == -1) break;
-    if ((area.prot & MTCP_PROT_ZERO_PAGE) == 0) {
+    if ((area.prot & MTCP_PROT_COMPRESSED) != 0) {
+      mtcp_skipfile_compressed (fd, area.size);
+    } else if ((area.prot & MTCP_PROT_CHUNKS) != 0) {
+      mtcp_skipfile_chunks (fd, area.size);
+    } else if ((area.prot &
+                (MTCP_PROT_ZERO_PAGE | MTCP_PROT_PARENT_PAGE)) == 0) {
       mtcp_skipfile (fd, area.size);
     }
     printf("%p-%p %c%c%c%c %8x 00:00 0          %s\n",
@@ -126,11 +145,177 @@ int main(int argc, char **argv)
 	    ( area.prot & PROT_EXEC  ? 'x' : '-' ),
 	    ( area.flags & MAP_SHARED ? 's'
               : ( area.flags & MAP_ANONYMOUS ? 'p' : '-' ) ),
-	    0, area.name);
+	    0, (area.prot & MTCP_PROT_PARENT_PAGE) ? "(in parent image)"
+                                                   : area.name);
+  }
+
+  int rc = 0;
+  if (ckpt_hdr->version >= 2 && image_begin != -1) {
+    rc = check_area_index(fd, image_begin);
   }
 
   printf("*** done\n");
    close (fd);
    mtcp_restore_cpfd = -1;
-   return 0;
+   return rc;
+}
+
+static int pread_all(int fd, void *buf, size_t size, off_t offset)
+{
+  size_t done = 0;
+  while (done < size) {
+    ssize_t rc = pread(fd, (char *) buf + done, size - done, offset + done);
+    if (rc <= 0) {
+      if (rc == -1 && errno == EINTR)
+        continue;
+      return -1;
+    }
+    done += rc;
+  }
+  return 0;
+}
+
+/* Check the chunk of ref in store against its hash.  Returns NULL, or
+ * else the problem.
+ */
+static const char *check_chunk(const char *store, const MtcpChunkRef *ref,
+                               char *stored, char *raw)
+{
+  char name[MTCP_CHUNK_NAME_SIZE];
+  char path[PATH_MAX];
+  MtcpCompressBlockHdr hdr;
+  uint64_t hash[2];
+  const char *problem = NULL;
+  int fd;
+
+  mtcp_chunk_name(name, ref->hash);
+  snprintf(path, sizeof(path), "%s%s", store, name);
+  fd = open(path, O_RDONLY);
+  if (fd == -1) {
+    return "missing chunk";
+  }
+  if (pread_all(fd, &hdr, sizeof(hdr), 0) == -1 ||
+      hdr.raw_size != ref->raw_size || hdr.raw_size > MTCP_CHUNK_SIZE ||
+      hdr.stored_size == 0 || hdr.stored_size > hdr.raw_size ||
+      pread_all(fd, stored, hdr.stored_size, sizeof(hdr)) == -1) {
+    problem = "bad chunk";
+  } else if (hdr.stored_size < hdr.raw_size &&
+             mtcp_decompress_block(stored, hdr.stored_size,
+                                   raw, hdr.raw_size) == -1) {
+    problem = "bad compressed chunk";
+  } else {
+    mtcp_chunk_hash(hdr.stored_size < hdr.raw_size ? raw : stored,
+                    hdr.raw_size, hash);
+    if (hash[0] != ref->hash[0] || hash[1] != ref->hash[1]) {
+      problem = "chunk does not match its hash";
+    }
+  }
+  close(fd);
+  return problem;
+}
+
+/* Read the area index at the end of the image, and check every stored
+ * block against its checksum, and every chunk against its hash.  Returns
+ * the number of bad blocks.
+ */
+static int check_area_index(int fd, off_t image_begin)
+{
+  MtcpIndexTrailer trailer;
+  MtcpIndexEntry *entries;
+  char *stored, *raw;
+  off_t end = lseek(fd, 0, SEEK_END);
+  uint64_t i, num_bad = 0, num_compressed = 0, num_zero = 0, num_parent = 0;
+  uint64_t num_chunks = 0;
+  char store[PATH_MAX];
+
+  printf("*** area index\n");
+  if (end < (off_t) sizeof(trailer) ||
+      pread_all(fd, &trailer, sizeof(trailer), end - sizeof(trailer)) == -1 ||
+      memcmp(trailer.magic, MTCP_INDEX_MAGIC, sizeof(MTCP_INDEX_MAGIC)) != 0) {
+    printf("no area index found (truncated image?)\n");
+    return 1;
+  }
+  /* The entries sit between the areas and the trailer. */
+  if (trailer.num_entries > (uint64_t) end / sizeof(*entries) ||
+      trailer.offset > (uint64_t) end ||
+      image_begin + trailer.offset + trailer.num_entries * sizeof(*entries)
+        > end - sizeof(trailer)) {
+    printf("area index is corrupt (%llu entries at offset %llu)\n",
+           (unsigned long long) trailer.num_entries,
+           (unsigned long long) trailer.offset);
+    return 1;
+  }
+  mtcp_get_image_dir(fd, store, sizeof(store) - sizeof(MTCP_CHUNK_STORE_DIR));
+  strcat(store, MTCP_CHUNK_STORE_DIR "/");
+
+  entries = malloc(trailer.num_entries * sizeof(*entries) + 1);
+  stored = malloc(MTCP_COMPRESS_BLOCK_SIZE);
+  raw = malloc(MTCP_COMPRESS_BLOCK_SIZE);
+  assert(entries != NULL && stored != NULL && raw != NULL);
+  if (pread_all(fd, entries, trailer.num_entries * sizeof(*entries),
+                image_begin + trailer.offset) == -1 ||
+      mtcp_checksum(entries, trailer.num_entries * sizeof(*entries))
+        != trailer.checksum) {
+    printf("area index is corrupt\n");
+    num_bad = 1;
+    goto done;
+  }
+
+  for (i = 0; i < trailer.num_entries; i++) {
+    MtcpIndexEntry *e = &entries[i];
+    const char *problem = NULL;
+
+    if (e->flags & MTCP_INDEX_ZERO_PAGES) {
+      num_zero++;
+      continue;
+    }
+    if (e->flags & MTCP_INDEX_PARENT_PAGES) {
+      num_parent++;
+      continue;
+    }
+    if (e->stored_size > MTCP_COMPRESS_BLOCK_SIZE ||
+        e->raw_size > MTCP_COMPRESS_BLOCK_SIZE) {
+      problem = "bad size";
+    } else if (pread_all(fd, stored, e->stored_size,
+                         image_begin + e->offset) == -1) {
+      problem = "truncated";
+    } else if (mtcp_checksum(stored, e->stored_size) != e->checksum) {
+      problem = "bad checksum";
+    } else if ((e->flags & MTCP_INDEX_COMPRESSED) &&
+               mtcp_decompress_block(stored, e->stored_size,
+                                     raw, e->raw_size) == -1) {
+      problem = "bad compressed data";
+    } else if ((e->flags & MTCP_INDEX_CHUNK) &&
+               (e->stored_size != sizeof(MtcpChunkRef) ||
+                ((MtcpChunkRef *) stored)->raw_size != e->raw_size)) {
+      problem = "bad chunk reference";
+    } else if (e->flags & MTCP_INDEX_CHUNK) {
+      problem = check_chunk(store, (MtcpChunkRef *) stored,
+                            raw + MTCP_CHUNK_SIZE, raw);
+    }
+    if (e->flags & MTCP_INDEX_COMPRESSED)
+      num_compressed++;
+    if (e->flags & MTCP_INDEX_CHUNK)
+      num_chunks++;
+    if (problem != NULL) {
+      printf("%p-%p: %s (%llu bytes at offset %llu)\n",
+             (void *) (unsigned long) e->addr,
+             (void *) (unsigned long) (e->addr + e->raw_size), problem,
+             (unsigned long long) e->stored_size,
+             (unsigned long long) e->offset);
+      num_bad++;
+    }
+  }
+  printf("%llu blocks (%llu compressed, %llu in the chunk store,"
+         " %llu zero page runs, %llu runs in parent image), %llu bad\n",
+         (unsigned long long) trailer.num_entries,
+         (unsigned long long) num_compressed, (unsigned long long) num_chunks,
+         (unsigned long long) num_zero, (unsigned long long) num_parent,
+         (unsigned long long) num_bad);
+
+done:
+  free(entries);
+  free(stored);
+  free(raw);
+  return num_bad != 0;
 }
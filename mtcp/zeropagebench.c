@@ -0,0 +1,170 @@
+/*****************************************************************************
+ *   Copyright (C) 2006-2013 by Michael Rieker, Jason Ansel, Kapil Arya, and *
+ *                                                            Gene Cooperman *
+ *   mrieker@nii.net, jansel@csail.mit.edu, kapil@ccs.neu.edu, and           *
+ *                                                          gene@ccs.neu.edu *
+ *                                                                           *
+ *   This file is part of the MTCP module of DMTCP (DMTCP:mtcp).             *
+ *                                                                           *
+ *  DMTCP:mtcp is free software: you can redistribute it and/or              *
+ *  modify it under the terms of the GNU Lesser General Public License as    *
+ *  published by the Free Software Foundation, either version 3 of the       *
+ *  License, or (at your option) any later version.                          *
+ *                                                                           *
+ *  DMTCP:dmtcp/src is distributed in the hope that it will be useful,       *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of           *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the            *
+ *  GNU Lesser General Public License for more details.                      *
+ *                                                                           *
+ *  You should have received a copy of the GNU Lesser General Public         *
+ *  License along with DMTCP:dmtcp/src.  If not, see                         *
+ *  <http://www.gnu.org/licenses/>.                                          *
+ *****************************************************************************/
+
+/* Microbenchmark for the zero-page kernels of mtcp_zero_page.c, against the
+ * 1 MB loop that mtcp_writeckpt.c used before them.
+ *
+ * USAGE:  make zeropagebench; ./zeropagebench [size_in_MB]
+ *
+ * "zero" scans an all-zero buffer (every byte is read).  "sparse" has one
+ * non-zero byte per 64 KB, at a random place:  the old loop must write out
+ * every 1 MB block in full, while the page kernels find the zero pages.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+
+#include "mtcp_internal.h"
+#include "mtcp_util.h"
+
+#define ONE_MB (1024 * 1024)
+
+/* The loop used by mtcp_writeckpt.c for each 1 MB block. */
+static int old_are_zero_pages(void *addr, size_t num_pages)
+{
+  long long *buf = (long long*) addr;
+  size_t i;
+  size_t end = num_pages * MTCP_PAGE_SIZE / sizeof (*buf);
+  long long res = 0;
+  for (i = 0; i + 7 < end; i += 8) {
+    res = buf[i+0] | buf[i+1] | buf[i+2] | buf[i+3] |
+          buf[i+4] | buf[i+5] | buf[i+6] | buf[i+7];
+    if (res != 0) {
+      break;
+    }
+  }
+  return res == 0;
+}
+
+static double now()
+{
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static void bench_old(const char *pattern, char *buf, size_t size)
+{
+  double start = now();
+  size_t off, zero_bytes = 0;
+
+  for (off = 0; off < size; off += ONE_MB) {
+    if (old_are_zero_pages(buf + off, ONE_MB / MTCP_PAGE_SIZE)) {
+      zero_bytes += ONE_MB;
+    }
+  }
+  printf("%-7s %-12s %8.0f MB/s  %6zu MB found zero\n", pattern, "old-1MB",
+         size / ONE_MB / (now() - start), zero_bytes / ONE_MB);
+}
+
+static void bench_kernel(const char *pattern, const char *name,
+                         char *buf, size_t size)
+{
+  mtcp_zero_page_fn_t fn = mtcp_zero_page_kernel(name);
+  double start;
+  size_t off, zero_bytes = 0;
+
+  if (fn == NULL) {
+    printf("%-7s %-12s not supported by this CPU\n", pattern, name);
+    return;
+  }
+  start = now();
+  for (off = 0; off < size; off += MTCP_PAGE_SIZE) {
+    if ((*fn)(buf + off)) {
+      zero_bytes += MTCP_PAGE_SIZE;
+    }
+  }
+  printf("%-7s %-12s %8.0f MB/s  %6zu MB found zero\n", pattern, name,
+         size / ONE_MB / (now() - start), zero_bytes / ONE_MB);
+}
+
+/* All kernels must agree with the scalar one, wherever the non-zero byte. */
+static int check_kernels(char *page)
+{
+  const char *names[] = { "sse2", "avx2" };
+  size_t i, pos;
+
+  for (i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+    mtcp_zero_page_fn_t fn = mtcp_zero_page_kernel(names[i]);
+    if (fn == NULL) {
+      continue;
+    }
+    memset(page, 0, MTCP_PAGE_SIZE);
+    if (!(*fn)(page)) {
+      printf("FAILED: %s says zero page is non-zero\n", names[i]);
+      return 0;
+    }
+    for (pos = 0; pos < MTCP_PAGE_SIZE; pos++) {
+      page[pos] = 1 + pos % 255;
+      if ((*fn)(page)) {
+        printf("FAILED: %s misses non-zero byte at %zu\n", names[i], pos);
+        return 0;
+      }
+      page[pos] = 0;
+    }
+  }
+  return 1;
+}
+
+int main(int argc, char *argv[])
+{
+  size_t size = (argc > 1 ? atoi(argv[1]) : 256) * (size_t) ONE_MB;
+  size_t off;
+  char *buf = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  const char *kernels[] = { "scalar", "sse2", "avx2" };
+  size_t i;
+
+  if (buf == MAP_FAILED) {
+    perror("mmap");
+    return 1;
+  }
+  if (!check_kernels(buf)) {
+    return 1;
+  }
+
+  /* Fault in the buffer, so that we measure the kernels, not page faults. */
+  memset(buf, 0, size);
+  bench_old("zero", buf, size);
+  for (i = 0; i < sizeof(kernels) / sizeof(kernels[0]); i++) {
+    bench_kernel("zero", kernels[i], buf, size);
+  }
+
+  srandom(1);
+  for (off = 0; off < size; off += 64 * 1024) {
+    buf[off + random() % (64 * 1024)] = 1;
+  }
+  bench_old("sparse", buf, size);
+  for (i = 0; i < sizeof(kernels) / sizeof(kernels[0]); i++) {
+    bench_kernel("sparse", kernels[i], buf, size);
+  }
+
+  printf("selected kernel is the same as: %s\n",
+         mtcp_zero_page_kernel(NULL) == mtcp_zero_page_kernel("avx2") ? "avx2" :
+         mtcp_zero_page_kernel(NULL) == mtcp_zero_page_kernel("sse2") ? "sse2" :
+         "scalar");
+  return 0;
+}
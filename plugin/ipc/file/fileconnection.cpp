@@ -920,20 +920,28 @@ void dmtcp::FifoConnection::drain()
   ckptfd = _real_open(_path.c_str(),new_flags);
   JASSERT(ckptfd >= 0) (ckptfd) (JASSERT_ERRNO);
 
-  _in_data.clear();
-  size_t bufsize = 256;
-  char buf[bufsize];
-  int size;
-
+  // A FIFO holds at most its pipe size, so a buffer that large is normally
+  // emptied by a single read.
+  size_t bufsize = 64 * 1024;
+#ifdef F_GETPIPE_SZ
+  int pipeSize = _real_fcntl(ckptfd, F_GETPIPE_SZ, NULL);
+  if (pipeSize > 0) {
+    bufsize = pipeSize;
+  }
+#endif
+  _in_data.resize(bufsize);
+  size_t size = 0;
   while (1) { // flush fifo
-    size = read(ckptfd,buf,bufsize);
-    if (size < 0) {
-      break; // nothing to flush
+    if (size == _in_data.size()) {
+      _in_data.resize(2 * size);
     }
-    for (int i=0;i<size;i++) {
-      _in_data.push_back(buf[i]);
+    ssize_t ret = read(ckptfd, &_in_data[size], _in_data.size() - size);
+    if (ret <= 0) {
+      break; // nothing more to flush
     }
+    size += ret;
   }
+  _in_data.resize(size);
   close(ckptfd);
   JTRACE("Checkpointing fifo:  end.") (_fds[0]) (_in_data.size());
 }
@@ -944,26 +952,23 @@ void dmtcp::FifoConnection::refill(bool isRestart)
   ckptfd = _real_open(_path.c_str(),new_flags);
   JASSERT(ckptfd >= 0) (ckptfd) (JASSERT_ERRNO);
 
-  size_t bufsize = 256;
-  char buf[bufsize];
-  size_t j;
-  ssize_t ret;
-  for (size_t i=0;i<(_in_data.size()/bufsize);i++) { // refill fifo
-    for (j=0; j<bufsize; j++) {
-      buf[j] = _in_data[j+i*bufsize];
-    }
-    ret = Util::writeAll(ckptfd,buf,j);
-    JASSERT(ret ==(ssize_t)j) (JASSERT_ERRNO) (ret) (j) (_fds[0]) (i);
+#ifdef F_SETPIPE_SZ
+  // A FIFO recreated on restart has the default size, which can be less than
+  // what was drained from it.  Nobody reads it before we resume, so it must
+  // hold all the data at once.
+  int pipeSize = _real_fcntl(ckptfd, F_GETPIPE_SZ, NULL);
+  if (pipeSize != -1 && (size_t) pipeSize < _in_data.size()) {
+    JWARNING(_real_fcntl(ckptfd, F_SETPIPE_SZ,
+                         (void*) (long) _in_data.size()) != -1)
+      (_in_data.size()) (pipeSize) (JASSERT_ERRNO)
+      .Text("failed to enlarge fifo, refill may block");
   }
-  int start =(_in_data.size()/bufsize)*bufsize;
-  for (j=0; j<_in_data.size()%bufsize; j++) {
-    buf[j] = _in_data[start+j];
+#endif
+  if (_in_data.size() > 0) {
+    ssize_t ret = Util::writeAll(ckptfd, &_in_data[0], _in_data.size());
+    JASSERT(ret == (ssize_t) _in_data.size())
+      (JASSERT_ERRNO) (ret) (_in_data.size()) (_fds[0]);
   }
-  errno=0;
-  buf[j] ='\0';
-  JTRACE("Buf internals.") ((const char*)buf);
-  ret = Util::writeAll(ckptfd,buf,j);
-  JASSERT(ret ==(ssize_t)j) (JASSERT_ERRNO) (ret) (j) (_fds[0]);
 
   close(ckptfd);
   // unlock fifo
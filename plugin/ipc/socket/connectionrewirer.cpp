@@ -23,12 +23,14 @@
 #include <unistd.h>
 #include <sys/socket.h>
 #include <sys/socket.h>
+#include <sys/epoll.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 
 #include "dmtcpplugin.h"
 #include "protectedfds.h"
 #include "util.h"
+#include "jalib.h"
 #include "jsocket.h"
 
 #include "connectionrewirer.h"
@@ -48,6 +50,9 @@ dmtcp::ConnectionRewirer& dmtcp::ConnectionRewirer::instance()
 
 void dmtcp::ConnectionRewirer::destroy()
 {
+  if (theRewirer == NULL) {
+    return;
+  }
   dmtcp_close_protected_fd(PROTECTED_RESTORE_SOCK_FD);
 
   // Free up the object.
@@ -55,56 +60,183 @@ void dmtcp::ConnectionRewirer::destroy()
   theRewirer = NULL;
 }
 
-void dmtcp::ConnectionRewirer::checkForPendingIncoming()
+namespace
+{
+  enum { REWIRE_MAX_EVENTS = 128 };
+
+  void setNonBlocking(int fd, bool nonBlocking)
+  {
+    int flags = _real_fcntl(fd, F_GETFL, NULL);
+    JASSERT(flags != -1) (fd) (JASSERT_ERRNO);
+    flags = nonBlocking ? (flags | O_NONBLOCK) : (flags & ~O_NONBLOCK);
+    JASSERT(_real_fcntl(fd, F_SETFL, (void*) (long) flags) != -1)
+      (fd) (JASSERT_ERRNO);
+  }
+
+  void watch(int epfd, int op, int fd, void *data, unsigned int events)
+  {
+    struct epoll_event ev;
+    ev.events = events;
+    ev.data.ptr = data;
+    JASSERT(jalib::epoll_ctl(epfd, op, fd, &ev) == 0) (fd) (JASSERT_ERRNO);
+  }
+
+  // Many restore sockets are open at once, so a new one could be given the
+  // number of a connection that is not restored yet, and then be closed
+  // under us when that connection is.  Until they are restored, all those
+  // numbers hold a copy of the restore socket, which has a protected fd.
+  void reserveFds(const dmtcp::map<ConnectionIdentifier, Connection*>& cons)
+  {
+    dmtcp::map<ConnectionIdentifier, Connection*>::const_iterator i;
+    for (i = cons.begin(); i != cons.end(); ++i) {
+      const dmtcp::vector<int>& fds = i->second->getFds();
+      for (size_t n = 0; n < fds.size(); n++) {
+        JASSERT(_real_dup2(PROTECTED_RESTORE_SOCK_FD, fds[n]) == fds[n])
+          (fds[n]) (JASSERT_ERRNO);
+      }
+    }
+  }
+}
+
+// A restore connection in flight: an outgoing one connecting and sending
+// the id of the connection it restores, or an accepted one receiving it.
+struct dmtcp::ConnectionRewirer::PendingRestore
+{
+#ifdef JALIB_ALLOCATOR
+  static void* operator new(size_t nbytes, void* p) { return p; }
+  static void* operator new(size_t nbytes) { JALLOC_HELPER_NEW(nbytes); }
+  static void  operator delete(void* p) { JALLOC_HELPER_DELETE(p); }
+#endif
+  PendingRestore(int fd, Connection *con)
+    : fd(fd), con(con), outgoing(con != NULL), connected(false), done(0) {}
+
+  int fd;
+  Connection *con;
+  bool outgoing;
+  bool connected;
+  ConnectionIdentifier id;
+  size_t done;                // bytes of id sent or received
+};
+
+// Called when the listener is readable; accepts every pending connection.
+void dmtcp::ConnectionRewirer::acceptIncoming(int epfd, size_t *inFlight)
 {
-  while (_pendingIncoming.size() > 0) {
+  for (;;) {
     int fd = _real_accept(PROTECTED_RESTORE_SOCK_FD, NULL, NULL);
-    if (fd == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+    if (fd == -1 && (errno == EAGAIN || errno == EWOULDBLOCK ||
+                     errno == EINTR)) {
       return;
     }
     JASSERT(fd != -1) (JASSERT_ERRNO) .Text("Accept failed.");
-    ConnectionIdentifier id;
-    JASSERT(Util::readAll(fd, &id, sizeof id) == sizeof id);
-
-    iterator i = _pendingIncoming.find(id);
-    JASSERT(i != _pendingIncoming.end()) (id)
-      .Text("got unexpected incoming restore request");
+    watch(epfd, EPOLL_CTL_ADD, fd, new PendingRestore(fd, NULL), EPOLLIN);
+    (*inFlight)++;
+  }
+}
 
-    Util::dupFds(fd, (i->second)->getFds());
+// Advances one restore connection; returns true once the id is through.
+bool dmtcp::ConnectionRewirer::exchangeId(PendingRestore *p)
+{
+  ssize_t cnt;
+  if (p->outgoing) {
+    if (!p->connected) {
+      int err = 0;
+      socklen_t len = sizeof(err);
+      JASSERT(_real_getsockopt(p->fd, SOL_SOCKET, SO_ERROR, &err, &len) == 0)
+        (p->id) (JASSERT_ERRNO);
+      JASSERT(err == 0) (p->id) (strerror(err))
+        .Text("failed to restore connection");
+      p->connected = true;
+    }
+    cnt = jalib::write(p->fd, (char*) &p->id + p->done,
+                       sizeof(p->id) - p->done);
+  } else {
+    cnt = jalib::recv(p->fd, (char*) &p->id + p->done,
+                      sizeof(p->id) - p->done, MSG_DONTWAIT);
+  }
+  if (cnt == -1 && (errno == EAGAIN || errno == EINTR)) {
+    return false;
+  }
+  JASSERT(cnt > 0) (p->id) (p->outgoing) (JASSERT_ERRNO)
+    .Text("failed to restore connection");
+  p->done += cnt;
+  return p->done == sizeof(p->id);
+}
 
-    JTRACE("restoring incoming connection") (id);
+void dmtcp::ConnectionRewirer::restore(PendingRestore *p)
+{
+  if (p->outgoing) {
+    setNonBlocking(p->fd, false);
+    Util::dupFds(p->fd, p->con->getFds());
+  } else {
+    iterator i = _pendingIncoming.find(p->id);
+    JASSERT(i != _pendingIncoming.end()) (p->id)
+      .Text("got unexpected incoming restore request");
+    Util::dupFds(p->fd, (i->second)->getFds());
+    JTRACE("restoring incoming connection") (p->id);
     _pendingIncoming.erase(i);
   }
 }
 
+// All outgoing connections are started at once, and connecting, accepting
+// and exchanging ids progress together on one epoll set, so that restoring
+// many connections takes about a round trip rather than one per connection.
 void dmtcp::ConnectionRewirer::doReconnect()
 {
+  reserveFds(_pendingOutgoing);
+  reserveFds(_pendingIncoming);
+
+  int epfd = jalib::epoll_create1(EPOLL_CLOEXEC);
+  JASSERT(epfd != -1) (JASSERT_ERRNO);
+  size_t inFlight = 0;
+
   iterator i;
   for (i = _pendingOutgoing.begin(); i != _pendingOutgoing.end(); i++) {
     const ConnectionIdentifier& id = i->first;
-    Connection *con = i->second;
     struct RemoteAddr& remoteAddr = _remoteInfo[id];
-    int fd = jalib::JSocket::Create().sockfd();
+    PendingRestore *p =
+      new PendingRestore(jalib::JSocket::Create().sockfd(), i->second);
+    p->id = id;
+    setNonBlocking(p->fd, true);
     errno = 0;
-    JASSERT(_real_connect(fd, (sockaddr*) &remoteAddr.addr, remoteAddr.len) == 0)
+    int ret = _real_connect(p->fd, (sockaddr*) &remoteAddr.addr,
+                            remoteAddr.len);
+    JASSERT(ret == 0 || errno == EINPROGRESS)
       (id) (JASSERT_ERRNO) .Text("failed to restore connection");
-
-    Util::writeAll(fd, &id, sizeof id);
-    Util::dupFds(fd, con->getFds());
-
-    checkForPendingIncoming();
+    p->connected = (ret == 0);
+    watch(epfd, EPOLL_CTL_ADD, p->fd, p, EPOLLOUT);
+    inFlight++;
   }
   _pendingOutgoing.clear();
   _remoteInfo.clear();
 
   if (_pendingIncoming.size() > 0) {
-    // Remove O_NONBLOCK flag from listener socket
-    int flags = _real_fcntl(PROTECTED_RESTORE_SOCK_FD, F_GETFL, NULL);
-    JASSERT(flags != -1);
-    JASSERT(_real_fcntl(PROTECTED_RESTORE_SOCK_FD, F_SETFL,
-                        (void*) (long) (flags & ~O_NONBLOCK)) != -1);
-    checkForPendingIncoming();
+    watch(epfd, EPOLL_CTL_ADD, PROTECTED_RESTORE_SOCK_FD, NULL, EPOLLIN);
+  }
+
+  struct epoll_event events[REWIRE_MAX_EVENTS];
+  while (inFlight > 0 || _pendingIncoming.size() > 0) {
+    int n = jalib::epoll_wait(epfd, events, REWIRE_MAX_EVENTS, -1);
+    if (n == -1 && errno == EINTR) {
+      continue;
+    }
+    JASSERT(n > 0) (JASSERT_ERRNO);
+    for (int k = 0; k < n; k++) {
+      PendingRestore *p = (PendingRestore*) events[k].data.ptr;
+      if (p == NULL) {
+        acceptIncoming(epfd, &inFlight);
+        continue;
+      }
+      if (exchangeId(p)) {
+        // p->fd is closed once restored, so it must leave the set first.
+        watch(epfd, EPOLL_CTL_DEL, p->fd, p, 0);
+        restore(p);
+        delete p;
+        inFlight--;
+      }
+    }
   }
+  jalib::close(epfd);
+
   JTRACE("Closing restore socket");
   _real_close(PROTECTED_RESTORE_SOCK_FD);
 }
@@ -150,6 +282,7 @@ dmtcp::ConnectionRewirer::registerIncoming(const ConnectionIdentifier& local,
 {
   _pendingIncoming[local] = con;
   JTRACE("announcing pending incoming") (local);
+  dmtcp_request_name_service();
 }
 
 void
@@ -158,24 +291,28 @@ dmtcp::ConnectionRewirer::registerOutgoing(const ConnectionIdentifier& remote,
 {
   _pendingOutgoing[remote] = con;
   JTRACE("announcing pending outgoing") (remote);
+  dmtcp_request_name_service();
 }
 
 void dmtcp::ConnectionRewirer::registerNSData()
 {
   iterator i;
   JASSERT(theRewirer != NULL);
+  dmtcp::vector<const void*> keys;
+  dmtcp::vector<size_t> keyLens;
+  dmtcp::vector<const void*> vals;
+  dmtcp::vector<size_t> valLens;
   for (i = _pendingIncoming.begin(); i != _pendingIncoming.end(); ++i) {
     const ConnectionIdentifier& id = i->first;
-    dmtcp_send_key_val_pair_to_coordinator((const void *)&id,
-                                           sizeof(id),
-                                           &_restoreAddr,
-                                           _restoreAddrlen);
-    /*
-    sockaddr_in *sn = (sockaddr_in*) &_restoreAddr;
-    unsigned short port = htons(sn->sin_port);
-    char *ip = inet_ntoa(sn->sin_addr);
-    JTRACE("Send NS information:")(id)(sn->sin_family)(port)(ip);
-    */
+    keys.push_back(&id);
+    keyLens.push_back(sizeof(id));
+    vals.push_back(&_restoreAddr);
+    valLens.push_back(_restoreAddrlen);
+  }
+  if (!keys.empty()) {
+    dmtcp_send_key_val_pairs_to_coordinator(keys.size(), &keys[0],
+                                            &keyLens[0], &vals[0],
+                                            &valLens[0]);
   }
   debugPrint();
 }
@@ -183,19 +320,29 @@ void dmtcp::ConnectionRewirer::registerNSData()
 void dmtcp::ConnectionRewirer::sendQueries()
 {
   iterator i;
+  dmtcp::vector<const void*> keys;
+  dmtcp::vector<size_t> keyLens;
+  dmtcp::vector<void*> vals;
+  dmtcp::vector<size_t> valLens;
   for (i = _pendingOutgoing.begin(); i != _pendingOutgoing.end(); ++i) {
     const ConnectionIdentifier& id = i->first;
-    struct RemoteAddr remote;
-    remote.len = sizeof(remote.addr);
-    dmtcp_send_query_to_coordinator((const void *)&id, sizeof(id),
-                                    &remote.addr, (size_t*) &remote.len);
-    /*
-    sockaddr_in *sn = (sockaddr_in*) &remote.addr;
-    unsigned short port = htons(sn->sin_port);
-    char *ip = inet_ntoa(sn->sin_addr);
-    JTRACE("Send Queries. Get remote from coordinator:")(id)(sn->sin_family)(port)(ip);
-    */
-    _remoteInfo[id] = remote;
+    // The map entries stay put, so the answers can land in them directly.
+    struct RemoteAddr& remote = _remoteInfo[id];
+    keys.push_back(&i->first);
+    keyLens.push_back(sizeof(id));
+    vals.push_back(&remote.addr);
+    valLens.push_back(sizeof(remote.addr));
+  }
+  if (keys.empty()) {
+    return;
+  }
+  dmtcp_send_queries_to_coordinator(keys.size(), &keys[0], &keyLens[0],
+                                    &vals[0], &valLens[0]);
+  size_t n = 0;
+  for (i = _pendingOutgoing.begin(); i != _pendingOutgoing.end(); ++i, ++n) {
+    JASSERT(valLens[n] > 0) (i->first)
+      .Text("No peer registered the address of this connection");
+    _remoteInfo[i->first].len = valLens[n];
   }
 }
 
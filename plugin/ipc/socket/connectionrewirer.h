@@ -51,11 +51,16 @@ namespace dmtcp
       void registerNSData();
       void sendQueries();
       void doReconnect();
-      void checkForPendingIncoming();
 
       void debugPrint() const;
 
     private:
+      struct PendingRestore;
+
+      void acceptIncoming(int epfd, size_t *inFlight);
+      bool exchangeId(PendingRestore *p);
+      void restore(PendingRestore *p);
+
       struct sockaddr_storage _restoreAddr;
       socklen_t               _restoreAddrlen;
 
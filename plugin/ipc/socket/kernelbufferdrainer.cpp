@@ -19,13 +19,26 @@
  *  <http://www.gnu.org/licenses/>.                                         *
  ****************************************************************************/
 
+#include <sys/ioctl.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <algorithm>
+#include <linux/sockios.h>
 #include "kernelbufferdrainer.h"
 #include "connectionlist.h"
+#include "../jalib/jalib.h"
 #include "../jalib/jassert.h"
-#include "../jalib/jbuffer.h"
 
 #define SOCKET_DRAIN_MAGIC_COOKIE_STR "[dmtcp{v0<DRAIN!"
 
+// Name service keys under which announceEndpoints() registers connections
+#define DRAIN_PEER_KEY_PREFIX "dmtcp-drain-peer:"
+
+// Largest segment of a DrainBuffer
+#define DRAIN_MAX_SEGMENT (4 * 1024 * 1024)
+
 namespace
 {
   const char theMagicDrainCookie[] = SOCKET_DRAIN_MAGIC_COOKIE_STR;
@@ -35,9 +48,188 @@ namespace
     //todo resize buffers to avoid blocking
   }
 
+  // The deadline set with DMTCP_DRAIN_TIMEOUT, in DRAINER_CHECK_FREQ ticks;
+  // 0 if there is none.
+  int drainDeadlineTicks()
+  {
+    const char *timeout = getenv(ENV_VAR_DRAIN_TIMEOUT);
+    if (timeout == NULL || atof(timeout) <= 0) {
+      return 0;
+    }
+    int ticks = (int) (atof(timeout) / DRAINER_CHECK_FREQ + 0.5);
+    return ticks > 0 ? ticks : 1;
+  }
+
+  // One end of a connection.  An IPv4-mapped IPv6 address is stored as IPv4,
+  // since the other end may see it either way.
+  struct Endpoint
+  {
+    uint16_t family;
+    uint16_t port;
+    unsigned char addr[16];
+  };
+
+  bool toEndpoint(const struct sockaddr_storage& ss, Endpoint *e)
+  {
+    memset(e, 0, sizeof(*e));
+    if (ss.ss_family == AF_INET) {
+      const struct sockaddr_in *in = (const struct sockaddr_in*) &ss;
+      e->family = AF_INET;
+      e->port = in->sin_port;
+      memcpy(e->addr, &in->sin_addr, 4);
+      return true;
+    }
+    if (ss.ss_family == AF_INET6) {
+      const struct sockaddr_in6 *in6 = (const struct sockaddr_in6*) &ss;
+      e->port = in6->sin6_port;
+      if (IN6_IS_ADDR_V4MAPPED(&in6->sin6_addr)) {
+        e->family = AF_INET;
+        memcpy(e->addr, &in6->sin6_addr.s6_addr[12], 4);
+      } else {
+        e->family = AF_INET6;
+        memcpy(e->addr, &in6->sin6_addr, 16);
+      }
+      return true;
+    }
+    return false;
+  }
+
+  // The name service key of the connection on fd: its local end, then its
+  // remote end.  With peerView the ends are swapped, which gives the key that
+  // the process at the other end registers.  Fails for sockets that are not
+  // connected over IP.
+  bool drainPeerKey(int fd, bool peerView, dmtcp::string *key)
+  {
+    struct sockaddr_storage local, remote;
+    socklen_t localLen = sizeof(local);
+    socklen_t remoteLen = sizeof(remote);
+    Endpoint ends[2];
+    if (getsockname(fd, (struct sockaddr*) &local, &localLen) == -1 ||
+        getpeername(fd, (struct sockaddr*) &remote, &remoteLen) == -1 ||
+        !toEndpoint(local, &ends[peerView ? 1 : 0]) ||
+        !toEndpoint(remote, &ends[peerView ? 0 : 1])) {
+      return false;
+    }
+    *key = DRAIN_PEER_KEY_PREFIX;
+    key->append((const char*) ends, sizeof(ends));
+    return true;
+  }
 }
 using namespace dmtcp;
 
+dmtcp::DrainBuffer::DrainBuffer(size_t expected)
+  : _size(0)
+  , _nextCapacity(expected)
+{
+}
+
+dmtcp::DrainBuffer::~DrainBuffer()
+{
+  for (size_t i = 0; i < _segments.size(); i++) {
+    JALLOC_HELPER_FREE(_segments[i].data);
+  }
+}
+
+char *dmtcp::DrainBuffer::reserve(size_t minBytes, size_t *avail)
+{
+  if (_segments.empty() ||
+      _segments.back().capacity - _segments.back().size < minBytes) {
+    Segment s;
+    s.capacity = _nextCapacity < minBytes ? minBytes : _nextCapacity;
+    s.size = 0;
+    s.data = (char*) JALLOC_HELPER_MALLOC(s.capacity);
+    _segments.push_back(s);
+    _nextCapacity = s.capacity * 2;
+    if (_nextCapacity > DRAIN_MAX_SEGMENT) {
+      _nextCapacity = DRAIN_MAX_SEGMENT;
+    }
+  }
+  Segment& last = _segments.back();
+  *avail = last.capacity - last.size;
+  return last.data + last.size;
+}
+
+void dmtcp::DrainBuffer::truncate(size_t n)
+{
+  JASSERT(n <= _size) (n) (_size);
+  _size -= n;
+  while (n > 0) {
+    Segment& seg = _segments.back();
+    size_t k = seg.size < n ? seg.size : n;
+    seg.size -= k;
+    n -= k;
+    if (seg.size == 0 && n > 0) {
+      JALLOC_HELPER_FREE(seg.data);
+      _segments.pop_back();
+    }
+  }
+}
+
+bool dmtcp::DrainBuffer::endsWith(const char *s, size_t n) const
+{
+  if (_size < n) {
+    return false;
+  }
+  // The tail may straddle segments.
+  size_t i = _segments.size();
+  while (n > 0) {
+    const Segment& seg = _segments[--i];
+    size_t k = seg.size < n ? seg.size : n;
+    if (memcmp(seg.data + seg.size - k, s + n - k, k) != 0) {
+      return false;
+    }
+    n -= k;
+  }
+  return true;
+}
+
+bool dmtcp::DrainReader::readOnce()
+{
+  if (_peek) {
+    return peekOnce();
+  }
+  size_t avail;
+  char *buf = _buffer->reserve(1, &avail);
+  ssize_t cnt = _sock.read(buf, avail);
+  if (cnt <= 0 && errno != EAGAIN && errno != EINTR) {
+    _hadError = true;
+  }
+  if (cnt > 0) {
+    _buffer->commit(cnt);
+    _read += cnt;
+  }
+  return ready();
+}
+
+// Copies all that is queued on the socket into the buffer, from the start,
+// without taking it off the socket.  Peeking the same bytes again means that
+// the wakeup came from an end of file or an error, not from new data.
+bool dmtcp::DrainReader::peekOnce()
+{
+  int queued = 0;
+  if (ioctl(_sock.sockfd(), SIOCINQ, &queued) == -1 || queued < 0) {
+    queued = 0;
+  }
+  size_t before = _buffer->size();
+  _buffer->truncate(before);
+  size_t avail;
+  char *buf = _buffer->reserve(queued + 1, &avail);
+  ssize_t cnt = jalib::recv(_sock.sockfd(), buf, avail,
+                            MSG_PEEK | MSG_DONTWAIT);
+  if (cnt == -1 && (errno == EAGAIN || errno == EINTR)) {
+    return false;
+  }
+  if (cnt > 0) {
+    _buffer->commit(cnt);
+  }
+  if (cnt <= (ssize_t) before) {
+    _stalled = true;
+    return true;
+  }
+  _read = cnt - before;
+  return true;
+}
+
 static dmtcp::KernelBufferDrainer *theDrainer = NULL;
 dmtcp::KernelBufferDrainer& dmtcp::KernelBufferDrainer::instance()
 {
@@ -47,6 +239,14 @@ dmtcp::KernelBufferDrainer& dmtcp::KernelBufferDrainer::instance()
   return *theDrainer;
 }
 
+dmtcp::KernelBufferDrainer::KernelBufferDrainer()
+  : _draining(0)
+  , _timeoutCount(0)
+  , _elapsedTicks(0)
+  , _deadlineTicks(drainDeadlineTicks())
+{
+}
+
 void dmtcp::KernelBufferDrainer::onConnect(const jalib::JSocket& sock, const
                                              struct sockaddr*
                                              remoteAddr,socklen_t remoteLen)
@@ -59,14 +259,42 @@ void dmtcp::KernelBufferDrainer::onConnect(const jalib::JSocket& sock, const
 
 void dmtcp::KernelBufferDrainer::onData(jalib::JReaderInterface* sock)
 {
-  dmtcp::vector<char>& buffer = _drainedData[sock->socket().sockfd() ];
-  buffer.resize(buffer.size() + sock->bytesRead());
-  int startIdx = buffer.size() - sock->bytesRead();
-  memcpy(&buffer[startIdx],sock->buffer(),sock->bytesRead());
+  // DrainReader has already appended the data to the socket's DrainBuffer.
+  // The peer sends the cookie last, so the drain is complete as soon as the
+  // buffer ends with it.
 //     JTRACE("got buffer chunk") (sock->bytesRead());
+  int fd = sock->socket().sockfd();
+  DrainBuffer& buffer = *_drainedData[fd];
+  DrainReader *reader = (DrainReader*) sock;
+  if (reader->peeking()) {
+    if (buffer.endsWith(theMagicDrainCookie, sizeof(theMagicDrainCookie))) {
+      confirmPeer(reader);
+    } else if (reader->stalled()) {
+      markExternal(reader);
+    } else {
+      // Wake up again only once more data has arrived.
+      int lowat = buffer.size() + 1;
+      setsockopt(fd, SOL_SOCKET, SO_RCVLOWAT, &lowat, sizeof(lowat));
+    }
+    sock->reset();
+    return;
+  }
+  if (buffer.endsWith(theMagicDrainCookie, sizeof(theMagicDrainCookie))) {
+    buffer.truncate(sizeof(theMagicDrainCookie));
+    JTRACE("buffer drain complete") (fd) (buffer.size()) (_draining);
+    finishDrainOf(sock);
+  }
   sock->reset();
 }
 
+void dmtcp::KernelBufferDrainer::finishDrainOf(jalib::JReaderInterface* sock)
+{
+  sock->socket() = -1; //poison socket
+  if (--_draining == 0) {
+    _listenSockets.clear();
+  }
+}
+
 void dmtcp::KernelBufferDrainer::onDisconnect(jalib::JReaderInterface* sock)
 {
   int fd;
@@ -77,123 +305,419 @@ void dmtcp::KernelBufferDrainer::onDisconnect(jalib::JReaderInterface* sock)
   JTRACE("found disconnected socket... marking it dead")
       (fd) (_reverseLookup[fd]) (JASSERT_ERRNO);
   _disconnectedSockets.push_back(_reverseLookup[fd]);
+  delete _drainedData[fd];
+  _drainedData.erase(fd);
+  if (--_draining == 0) {
+    _listenSockets.clear();
+  }
+}
+
+void dmtcp::KernelBufferDrainer::restoreRcvLowat(int fd)
+{
+  int lowat = _savedRcvLowat[fd];
+  setsockopt(fd, SOL_SOCKET, SO_RCVLOWAT, &lowat, sizeof(lowat));
+  _savedRcvLowat.erase(fd);
+}
+
+// A peer that was not found in the name service has sent the cookie after
+// all, so it runs under DMTCP.  Answer it, and drain the socket for real.
+void dmtcp::KernelBufferDrainer::confirmPeer(DrainReader* sock)
+{
+  int fd = sock->socket().sockfd();
+  DrainBuffer *buffer = _drainedData[fd];
+  JTRACE("peer sent the cookie, draining socket") (fd) (buffer->size());
+  restoreRcvLowat(fd);
+  buffer->truncate(buffer->size());
+  sock->consume();
+  addWrite(new jalib::JChunkWriter(fd, theMagicDrainCookie,
+                                   sizeof theMagicDrainCookie));
+}
+
+// A peer that was only peeked at, and that closed the connection or did not
+// send the cookie by the deadline, is taken to be an outside process.  Nothing
+// was read from the socket and no cookie was sent to it, so the application
+// finds its data and the connection as they were.
+void dmtcp::KernelBufferDrainer::markExternal(DrainReader* sock)
+{
+  int fd = sock->socket().sockfd();
+  JASSERT(sock->peeking()) (fd);
+  DrainBuffer *buffer = _drainedData[fd];
+  JWARNING(false) (fd) (buffer->size()) (_deadlineTicks * DRAINER_CHECK_FREQ)
+    .Text("Socket peer was not found in this computation and did not answer"
+          " the drain; treating it as a process not running under DMTCP.");
+  restoreRcvLowat(fd);
+  _externalSockets.push_back(_reverseLookup[fd]);
+  delete buffer;
   _drainedData.erase(fd);
+  finishDrainOf(sock);
 }
 
 void dmtcp::KernelBufferDrainer::onTimeoutInterval()
 {
-  int count = 0;
-  for (size_t i = 0; i < _dataSockets.size();++i)
-  {
-    if (_dataSockets[i]->bytesRead() > 0) onData(_dataSockets[i]);
-    dmtcp::vector<char>& buffer = _drainedData[_dataSockets[i]->socket().sockfd() ];
-    if (buffer.size() >= sizeof(theMagicDrainCookie)
-        && memcmp(&buffer[buffer.size() - sizeof(theMagicDrainCookie)],
-                  theMagicDrainCookie,
-                  sizeof(theMagicDrainCookie)) == 0) {
-      buffer.resize(buffer.size() - sizeof(theMagicDrainCookie));
-      JTRACE("buffer drain complete") (_dataSockets[i]->socket().sockfd())
-        (buffer.size()) ((_dataSockets.size()));
-      _dataSockets[i]->socket() = -1; //poison socket
-    } else {
-      ++count;
+  if (_draining == 0) {
+    // Only listen sockets were given to us.
+    _listenSockets.clear();
+    return;
+  }
+
+  // The deadline only applies to peers that we are still peeking at.  The
+  // others run under DMTCP and will return the cookie.
+  if (_deadlineTicks > 0 && ++_elapsedTicks >= _deadlineTicks) {
+    for (size_t i = 0; i < _dataSockets.size(); ++i) {
+      DrainReader *reader = (DrainReader*) _dataSockets[i];
+      if (reader->socket().isValid() && reader->peeking()) {
+        markExternal(reader);
+      }
+    }
+    if (_draining == 0) {
+      return;
     }
   }
 
-  if (count == 0) {
-    _listenSockets.clear();
-  } else {
-    const static int WARN_INTERVAL_TICKS =
-      (int) (DRAINER_WARNING_FREQ / DRAINER_CHECK_FREQ + 0.5);
-    const static float WARN_INTERVAL_SEC =
-      WARN_INTERVAL_TICKS * DRAINER_CHECK_FREQ;
-    if (_timeoutCount++ > WARN_INTERVAL_TICKS){
-      _timeoutCount=0;
-      for (size_t i = 0; i < _dataSockets.size();++i){
-        vector<char>& buffer = _drainedData[_dataSockets[i]->socket().sockfd() ];
-        JWARNING(false) (_dataSockets[i]->socket().sockfd())
-          (buffer.size()) (WARN_INTERVAL_SEC)
-          .Text("Still draining socket... "
-                "perhaps remote host is not running under DMTCP?");
+  const static int WARN_INTERVAL_TICKS =
+    (int) (DRAINER_WARNING_FREQ / DRAINER_CHECK_FREQ + 0.5);
+  const static float WARN_INTERVAL_SEC =
+    WARN_INTERVAL_TICKS * DRAINER_CHECK_FREQ;
+  if (_timeoutCount++ > WARN_INTERVAL_TICKS){
+    _timeoutCount=0;
+    for (size_t i = 0; i < _dataSockets.size();++i){
+      if (!_dataSockets[i]->socket().isValid()) {
+        continue;
+      }
+      DrainBuffer& buffer = *_drainedData[_dataSockets[i]->socket().sockfd() ];
+      JWARNING(false) (_dataSockets[i]->socket().sockfd())
+        (buffer.size()) (WARN_INTERVAL_SEC)
+        .Text("Still draining socket... "
+              "perhaps remote host is not running under DMTCP?");
 #ifdef CERN_CMS
-        JNOTE("\n*** Closing this socket(to database?).  Please use dmtcpaware\n"
-              "***  to gracefully handle database connections, and re-run.\n"
-              "***  Trying a workaround for now, and hoping it doesn't fail.\n");
-        _real_close(_dataSockets[i]->socket().sockfd());
-	//it does it by creating a socket pair and closing one side
-	int sp[2] = {-1,-1};
-	JASSERT(_real_socketpair(AF_UNIX, SOCK_STREAM, 0, sp) == 0)
-          (JASSERT_ERRNO) .Text("socketpair() failed");
-        JASSERT(sp[0] >= 0 && sp[1] >= 0) (sp[0]) (sp[1])
-          .Text("socketpair() failed");
-	_real_close(sp[1]);
-	JTRACE("created dead socket") (sp[0]);
-	_real_dup2(sp[0], _dataSockets[i]->socket().sockfd());
+      JNOTE("\n*** Closing this socket(to database?).  Please use dmtcpaware\n"
+            "***  to gracefully handle database connections, and re-run.\n"
+            "***  Trying a workaround for now, and hoping it doesn't fail.\n");
+      _real_close(_dataSockets[i]->socket().sockfd());
+      //it does it by creating a socket pair and closing one side
+      int sp[2] = {-1,-1};
+      JASSERT(_real_socketpair(AF_UNIX, SOCK_STREAM, 0, sp) == 0)
+        (JASSERT_ERRNO) .Text("socketpair() failed");
+      JASSERT(sp[0] >= 0 && sp[1] >= 0) (sp[0]) (sp[1])
+        .Text("socketpair() failed");
+      _real_close(sp[1]);
+      JTRACE("created dead socket") (sp[0]);
+      _real_dup2(sp[0], _dataSockets[i]->socket().sockfd());
 #endif
+    }
+  }
+}
 
-      }
+void dmtcp::KernelBufferDrainer::announceEndpoints(const dmtcp::vector<int>& fds)
+{
+  if (drainDeadlineTicks() == 0) {
+    return;
+  }
+  dmtcp::vector<dmtcp::string> keys;
+  for (size_t i = 0; i < fds.size(); i++) {
+    dmtcp::string key;
+    if (drainPeerKey(fds[i], false, &key)) {
+      keys.push_back(key);
     }
   }
+  if (keys.empty()) {
+    return;
+  }
+  const char val = 1;
+  dmtcp::vector<const void*> keyPtrs, valPtrs;
+  dmtcp::vector<size_t> keyLens, valLens;
+  for (size_t i = 0; i < keys.size(); i++) {
+    keyPtrs.push_back(keys[i].data());
+    keyLens.push_back(keys[i].length());
+    valPtrs.push_back(&val);
+    valLens.push_back(sizeof(val));
+  }
+  JTRACE("announcing connections for the drain") (keys.size());
+  dmtcp_send_key_val_pairs_to_coordinator(keys.size(), &keyPtrs[0],
+                                          &keyLens[0], &valPtrs[0],
+                                          &valLens[0]);
 }
 
-void dmtcp::KernelBufferDrainer::beginDrainOf(int fd, const ConnectionIdentifier& id)
+void dmtcp::KernelBufferDrainer::beginDrainOf(int fd, const ConnectionIdentifier& id,
+                                               bool dmtcpPeer)
 {
-//     JTRACE("will drain socket") (fd);
-  _drainedData[fd]; // create buffer
-// this is the simple way:  jalib::JSocket(fd) << theMagicDrainCookie;
-  //instead used delayed write in case kernel buffer is full:
-  addWrite(new jalib::JChunkWriter(fd, theMagicDrainCookie,
-                                   sizeof theMagicDrainCookie));
-  //now setup a reader:
-  addDataSocket(new jalib::JChunkReader(fd,512));
+  // What is already queued in each direction; the data still to arrive
+  // before the cookie is at least the first.
+  int inq = 0, outq = 0;
+  if (ioctl(fd, SIOCINQ, &inq) == -1) inq = 0;
+  if (ioctl(fd, SIOCOUTQ, &outq) == -1) outq = 0;
+  JTRACE("will drain socket") (fd) (inq) (outq);
+  _drainedData[fd] = new DrainBuffer(inq + sizeof theMagicDrainCookie);
+  _draining++;
 
   //insert it in reverse lookup
   _reverseLookup[fd]=id;
+
+  // Without a deadline every peer is waited for.  With one, a peer that no
+  // handshake has vouched for is looked up first, in resolvePeers().  Peers
+  // that cannot be looked up are waited for as well.
+  dmtcp::string key;
+  if (dmtcpPeer || _deadlineTicks == 0 || !drainPeerKey(fd, true, &key)) {
+    startDrainOf(fd, false);
+  } else {
+    _unresolved.push_back(fd);
+  }
+}
+
+// Peers with a deadline registered their connections in announceEndpoints()
+// before the barrier that precedes the drain, so a peer that is not found is
+// outside the computation, or runs in it without a deadline.  It is not sent
+// the cookie, and its data is only peeked at until the deadline, in case it
+// is the latter and answers.
+void dmtcp::KernelBufferDrainer::resolvePeers()
+{
+  if (_unresolved.empty()) {
+    return;
+  }
+  size_t n = _unresolved.size();
+  dmtcp::vector<dmtcp::string> keys(n);
+  dmtcp::vector<const void*> keyPtrs(n);
+  dmtcp::vector<size_t> keyLens(n);
+  dmtcp::vector<char> vals(n);
+  dmtcp::vector<void*> valPtrs(n);
+  dmtcp::vector<size_t> valLens(n);
+  for (size_t i = 0; i < n; i++) {
+    drainPeerKey(_unresolved[i], true, &keys[i]);
+    keyPtrs[i] = keys[i].data();
+    keyLens[i] = keys[i].length();
+    valPtrs[i] = &vals[i];
+    valLens[i] = sizeof(vals[i]);
+  }
+  dmtcp_send_queries_to_coordinator(n, &keyPtrs[0], &keyLens[0],
+                                    &valPtrs[0], &valLens[0]);
+  for (size_t i = 0; i < n; i++) {
+    JTRACE("looked up drain peer") (_unresolved[i]) (valLens[i] > 0);
+    startDrainOf(_unresolved[i], valLens[i] == 0);
+  }
+  _unresolved.clear();
+}
+
+void dmtcp::KernelBufferDrainer::startDrainOf(int fd, bool peek)
+{
+  if (peek) {
+    int lowat = 1;
+    socklen_t len = sizeof(lowat);
+    getsockopt(fd, SOL_SOCKET, SO_RCVLOWAT, &lowat, &len);
+    _savedRcvLowat[fd] = lowat;
+    lowat = 1;
+    setsockopt(fd, SOL_SOCKET, SO_RCVLOWAT, &lowat, sizeof(lowat));
+  } else {
+// this is the simple way:  jalib::JSocket(fd) << theMagicDrainCookie;
+    //instead used delayed write in case kernel buffer is full:
+    addWrite(new jalib::JChunkWriter(fd, theMagicDrainCookie,
+                                     sizeof theMagicDrainCookie));
+  }
+  //now setup a reader:
+  addDataSocket(new DrainReader(fd, _drainedData[fd], peek));
 }
 
 
+namespace
+{
+  enum { REFILL_MAX_IOV = 64, REFILL_MAX_EVENTS = 128 };
+
+  // Adds the bytes of buf after the first skip to iov; returns the new count.
+  int gatherSegments(const DrainBuffer *buf, size_t skip,
+                     struct iovec *iov, int n)
+  {
+    const dmtcp::vector<DrainBuffer::Segment>& segs = buf->segments();
+    for (size_t i = 0; i < segs.size() && n < REFILL_MAX_IOV; i++) {
+      if (skip >= segs[i].size) {
+        skip -= segs[i].size;
+        continue;
+      }
+      iov[n].iov_base = segs[i].data + skip;
+      iov[n].iov_len = segs[i].size - skip;
+      n++;
+      skip = 0;
+    }
+    return n;
+  }
+
+  // One socket being refilled.  We send the peer what we drained from the
+  // socket, and it sends that back to us so that it is queued in our receive
+  // buffer again.  Likewise we echo the peer's drained data back to it.  The
+  // echo must follow our own message on the stream, and we must not read
+  // past the peer's message: what follows it is the refilled data.
+  class SocketRefill
+  {
+    public:
+#ifdef JALIB_ALLOCATOR
+      static void* operator new(size_t nbytes, void* p) { return p; }
+      static void* operator new(size_t nbytes) { JALLOC_HELPER_NEW(nbytes); }
+      static void  operator delete(void* p) { JALLOC_HELPER_DELETE(p); }
+#endif
+      SocketRefill(int fd, DrainBuffer *drained)
+        : _fd(fd), _out(ConnMsg::REFILL), _drained(drained), _echo(NULL),
+          _outSent(0), _echoSent(0), _inRead(0), _echoLeft(0)
+      {
+        _out.extraBytes = drained->size();
+        _in.poison();
+      }
+      ~SocketRefill() { delete _drained; delete _echo; }
+
+      int fd() const { return _fd; }
+      bool wantsWrite() const {
+        return _outSent < sizeof(_out) + _drained->size() ||
+               (_echo != NULL && _echoSent < _echo->size());
+      }
+      bool wantsRead() const {
+        return _inRead < sizeof(_in) || _echoLeft > 0;
+      }
+      bool done() const { return !wantsRead() && !wantsWrite(); }
+
+      void writeOnce();
+      void readOnce();
+
+    private:
+      int _fd;
+      ConnMsg _out;
+      DrainBuffer *_drained;
+      DrainBuffer *_echo;       // the peer's drained data, as it arrives
+      size_t _outSent;          // of our message and drained data
+      size_t _echoSent;
+      ConnMsg _in;
+      size_t _inRead;
+      size_t _echoLeft;         // bytes of the peer's message still to read
+  };
+}
+
+void SocketRefill::writeOnce()
+{
+  struct iovec iov[REFILL_MAX_IOV];
+  int n = 0;
+  size_t outLength = sizeof(_out) + _drained->size();
+  if (_outSent < sizeof(_out)) {
+    iov[n].iov_base = (char*) &_out + _outSent;
+    iov[n].iov_len = sizeof(_out) - _outSent;
+    n++;
+  }
+  if (_outSent < outLength) {
+    size_t skip = _outSent > sizeof(_out) ? _outSent - sizeof(_out) : 0;
+    n = gatherSegments(_drained, skip, iov, n);
+  }
+  // Only once all of our own message is in iov, to keep the order.
+  size_t outInIov = 0;
+  for (int k = 0; k < n; k++) {
+    outInIov += iov[k].iov_len;
+  }
+  if (_outSent + outInIov == outLength && _echo != NULL) {
+    n = gatherSegments(_echo, _echoSent, iov, n);
+  }
+  if (n == 0) {
+    return;
+  }
+
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = iov;
+  msg.msg_iovlen = n;
+  ssize_t cnt = jalib::sendmsg(_fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+  if (cnt == -1 && (errno == EAGAIN || errno == EINTR)) {
+    return;
+  }
+  JASSERT(cnt > 0) (_fd) (JASSERT_ERRNO)
+    .Text("failed to refill socket, peer went away?");
+
+  size_t k = std::min((size_t) cnt, outLength - _outSent);
+  _outSent += k;
+  _echoSent += cnt - k;
+}
+
+void SocketRefill::readOnce()
+{
+  ssize_t cnt;
+  char *buf;
+  if (_inRead < sizeof(_in)) {
+    cnt = jalib::recv(_fd, (char*) &_in + _inRead, sizeof(_in) - _inRead,
+                      MSG_DONTWAIT);
+  } else {
+    size_t avail;
+    buf = _echo->reserve(1, &avail);
+    cnt = jalib::recv(_fd, buf, std::min(avail, _echoLeft), MSG_DONTWAIT);
+  }
+  if (cnt == -1 && (errno == EAGAIN || errno == EINTR)) {
+    return;
+  }
+  JASSERT(cnt > 0) (_fd) (JASSERT_ERRNO)
+    .Text("failed to refill socket, peer went away?");
+
+  if (_inRead < sizeof(_in)) {
+    _inRead += cnt;
+    if (_inRead == sizeof(_in)) {
+      _in.assertValid(ConnMsg::REFILL);
+      _echoLeft = _in.extraBytes;
+      _echo = new DrainBuffer(_echoLeft);
+      JTRACE("repeating buffer back to peer") (_fd) (_echoLeft);
+    }
+  } else {
+    _echo->commit(cnt);
+    _echoLeft -= cnt;
+  }
+}
+
 void dmtcp::KernelBufferDrainer::refillAllSockets()
 {
   scaleSendBuffers(2);
 
   JTRACE("refilling socket buffers") (_drainedData.size());
 
-  //write all buffers out
-  dmtcp::map<int, dmtcp::vector<char> >::iterator i;
+  // All the sockets make progress together, so that one slow peer does not
+  // hold up the others.
+  int epfd = jalib::epoll_create1(EPOLL_CLOEXEC);
+  JASSERT(epfd != -1) (JASSERT_ERRNO);
+  size_t pending = 0;
+  dmtcp::map<int, DrainBuffer*>::iterator i;
   for (i = _drainedData.begin(); i != _drainedData.end(); ++i) {
-    int size = i->second.size();
-    JWARNING(size>=0) (size).Text("a failed drain is in our table???");
-    if (size<0) size=0;
-    ConnMsg msg(ConnMsg::REFILL);
-    msg.extraBytes = size;
-    jalib::JSocket sock(i->first);
-    if (size > 0) {
-      JTRACE("requesting repeat buffer...") (sock.sockfd()) (size);
+    if (i->second->size() > 0) {
+      JTRACE("requesting repeat buffer...") (i->first) (i->second->size());
     }
-    sock << msg;
-    if (size>0) sock.writeAll(&i->second[0],size);
-    i->second.clear();
+    SocketRefill *r = new SocketRefill(i->first, i->second);
+    i->second = NULL;
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLOUT;
+    ev.data.ptr = r;
+    JASSERT(jalib::epoll_ctl(epfd, EPOLL_CTL_ADD, r->fd(), &ev) == 0)
+      (r->fd()) (JASSERT_ERRNO);
+    pending++;
   }
 
-//     JTRACE("repeating our friends buffers...");
-
-  //read all buffers in
-  for (i = _drainedData.begin(); i != _drainedData.end(); ++i) {
-    ConnMsg msg;
-    msg.poison();
-    jalib::JSocket sock(i->first);
-    sock >> msg;
-
-    msg.assertValid(ConnMsg::REFILL);
-    int size = msg.extraBytes;
-    JTRACE("repeating buffer back to peer") (size);
-    if (size > 0) {
-      //echo it back...
-      jalib::JBuffer tmp(size);
-      sock.readAll(tmp,size);
-      sock.writeAll(tmp,size);
+  struct epoll_event events[REFILL_MAX_EVENTS];
+  while (pending > 0) {
+    int n = jalib::epoll_wait(epfd, events, REFILL_MAX_EVENTS, -1);
+    if (n == -1 && errno == EINTR) {
+      continue;
+    }
+    JASSERT(n > 0) (JASSERT_ERRNO);
+    for (int k = 0; k < n; k++) {
+      SocketRefill *r = (SocketRefill*) events[k].data.ptr;
+      if (r->wantsWrite() &&
+          (events[k].events & (EPOLLOUT | EPOLLERR | EPOLLHUP))) {
+        r->writeOnce();
+      }
+      if (r->wantsRead() &&
+          (events[k].events & (EPOLLIN | EPOLLERR | EPOLLHUP))) {
+        r->readOnce();
+      }
+      if (r->done()) {
+        jalib::epoll_ctl(epfd, EPOLL_CTL_DEL, r->fd(), NULL);
+        delete r;
+        pending--;
+        continue;
+      }
+      struct epoll_event ev;
+      ev.events = (r->wantsRead() ? EPOLLIN : 0) |
+                  (r->wantsWrite() ? EPOLLOUT : 0);
+      ev.data.ptr = r;
+      jalib::epoll_ctl(epfd, EPOLL_CTL_MOD, r->fd(), &ev);
     }
   }
+  jalib::close(epfd);
 
   JTRACE("buffers refilled");
 
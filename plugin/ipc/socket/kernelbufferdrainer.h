@@ -32,15 +32,98 @@
 
 namespace dmtcp
 {
+  // The bytes drained from one socket, kept as a chain of segments so that
+  // a growing buffer is never reallocated and copied.  Segments grow
+  // geometrically, and the first one is sized to what the kernel reported
+  // queued on the socket.
+  class DrainBuffer
+  {
+    public:
+#ifdef JALIB_ALLOCATOR
+      static void* operator new(size_t nbytes, void* p) { return p; }
+      static void* operator new(size_t nbytes) { JALLOC_HELPER_NEW(nbytes); }
+      static void  operator delete(void* p) { JALLOC_HELPER_DELETE(p); }
+#endif
+      struct Segment {
+        char *data;
+        size_t size;
+        size_t capacity;
+      };
+
+      DrainBuffer(size_t expected);
+      ~DrainBuffer();
+
+      // Free space at the end of the chain, at least minBytes of it.
+      char *reserve(size_t minBytes, size_t *avail);
+      void commit(size_t bytes) { _segments.back().size += bytes; _size += bytes; }
+      // Drop the last n bytes.
+      void truncate(size_t n);
+      bool endsWith(const char *s, size_t n) const;
+
+      size_t size() const { return _size; }
+      const dmtcp::vector<Segment>& segments() const { return _segments; }
+
+    private:
+      DrainBuffer(const DrainBuffer&);
+      DrainBuffer& operator=(const DrainBuffer&);
+
+      dmtcp::vector<Segment> _segments;
+      size_t _size;
+      size_t _nextCapacity;
+  };
+
+  // Reads a draining socket straight into its DrainBuffer.  While peeking,
+  // the buffer is a copy of what is queued on the socket, which is left for
+  // the application until the peer turns out to run under DMTCP.
+  class DrainReader : public jalib::JReaderInterface
+  {
+    public:
+#ifdef JALIB_ALLOCATOR
+      static void* operator new(size_t nbytes, void* p) { return p; }
+      static void* operator new(size_t nbytes) { JALLOC_HELPER_NEW(nbytes); }
+      static void  operator delete(void* p) { JALLOC_HELPER_DELETE(p); }
+#endif
+      DrainReader(jalib::JSocket sock, DrainBuffer *buffer, bool peek)
+        : jalib::JReaderInterface(sock), _buffer(buffer), _read(0),
+          _hadError(false), _peek(peek), _stalled(false) {}
+      bool readOnce();
+      bool hadError() const { return _hadError || !_sock.isValid(); }
+      void reset() { _read = 0; }
+      bool ready() const { return _read > 0; }
+      const char* buffer() const { return NULL; }
+      int bytesRead() const { return _read; }
+
+      bool peeking() const { return _peek; }
+      // Peeking found nothing new: the peer closed the connection or failed.
+      bool stalled() const { return _stalled; }
+      void consume() { _peek = false; }
+
+    private:
+      bool peekOnce();
+
+      DrainBuffer *_buffer;
+      int _read;
+      bool _hadError;
+      bool _peek;
+      bool _stalled;
+  };
 
   class KernelBufferDrainer : public jalib::JMultiSocketProgram
   {
     public:
-      KernelBufferDrainer() : _timeoutCount(0) {}
+      KernelBufferDrainer();
       static KernelBufferDrainer& instance();
 
 //     void drainAllSockets();
-      void beginDrainOf(int fd , const ConnectionIdentifier& id);
+      // Registers the connections on fds with the name service, so that
+      // peers with a drain deadline can tell they belong to the computation.
+      static void announceEndpoints(const dmtcp::vector<int>& fds);
+      // dmtcpPeer:  an earlier handshake found the peer running under DMTCP.
+      void beginDrainOf(int fd , const ConnectionIdentifier& id,
+                        bool dmtcpPeer);
+      // Looks up the peers that beginDrainOf() could not vouch for, and
+      // starts draining them.
+      void resolvePeers();
       void refillAllSockets();
       virtual void onData(jalib::JReaderInterface* sock);
       virtual void onConnect(const jalib::JSocket& sock, const struct sockaddr* remoteAddr,socklen_t remoteLen);
@@ -48,12 +131,25 @@ namespace dmtcp
       virtual void onDisconnect(jalib::JReaderInterface* sock);
 
       const dmtcp::vector<ConnectionIdentifier>& getDisconnectedSockets() const { return _disconnectedSockets; }
+      const dmtcp::vector<ConnectionIdentifier>& getExternalSockets() const { return _externalSockets; }
 
     private:
-      dmtcp::map<int , dmtcp::vector<char> >    _drainedData;
+      dmtcp::map<int , DrainBuffer* >         _drainedData;
       dmtcp::map<int , ConnectionIdentifier > _reverseLookup;
       dmtcp::vector<ConnectionIdentifier>     _disconnectedSockets;
+      dmtcp::vector<ConnectionIdentifier>     _externalSockets;
+      dmtcp::vector<int>                      _unresolved;
+      dmtcp::map<int , int >                  _savedRcvLowat;
+      size_t _draining;         // sockets still waiting for the cookie
       int _timeoutCount;
+      int _elapsedTicks;
+      int _deadlineTicks;       // 0 if there is no deadline
+
+      void startDrainOf(int fd, bool peek);
+      void finishDrainOf(jalib::JReaderInterface* sock);
+      void confirmPeer(DrainReader* sock);
+      void markExternal(DrainReader* sock);
+      void restoreRcvLowat(int fd);
   };
 
 }
@@ -330,7 +330,8 @@ void dmtcp::TcpConnection::drain()
     case TCP_CONNECT:
     case TCP_ACCEPT:
       JTRACE("Will drain socket") (_hasLock) (_fds[0]) (_id) (_remotePeerId);
-      KernelBufferDrainer::instance().beginDrainOf(_fds[0], _id);
+      KernelBufferDrainer::instance().beginDrainOf(_fds[0], _id,
+                                                   !_remotePeerId.isNull());
       break;
     case TCP_LISTEN:
       KernelBufferDrainer::instance().addListenSocket(_fds[0]);
@@ -85,6 +85,10 @@ namespace dmtcp
 
       // This accessor is needed because _type is protected.
       void markExternalConnect() { _type = TCP_EXTERNAL_CONNECT; }
+      // Whether drain() will drain the socket.
+      bool isConnected() const {
+        return _type == TCP_CONNECT || _type == TCP_ACCEPT;
+      }
 
       //basic commands for updating state from wrappers
       /*onSocket*/
@@ -37,10 +37,30 @@ dmtcp::SocketConnList& dmtcp::SocketConnList::instance()
   return *socketConnList;
 }
 
+void dmtcp::SocketConnList::preCkptFdLeaderElection()
+{
+  ConnectionList::preCkptFdLeaderElection();
+  if (dmtcp_no_coordinator()) {
+    return;
+  }
+  // Announced before the barrier that precedes the drain, so that every peer
+  // finds them when it drains.
+  dmtcp::vector<int> fds;
+  for (iterator i = begin(); i != end(); ++i) {
+    Connection *con = i->second;
+    if (con->conType() == Connection::TCP &&
+        ((TcpConnection*)con)->isConnected()) {
+      fds.push_back(con->getFds()[0]);
+    }
+  }
+  KernelBufferDrainer::announceEndpoints(fds);
+}
+
 void dmtcp::SocketConnList::drain()
 {
   // First, let all the Connection prepare for drain
   ConnectionList::drain();
+  KernelBufferDrainer::instance().resolvePeers();
 
   //this will block until draining is complete
   KernelBufferDrainer::instance().monitorSockets(DRAINER_CHECK_FREQ);
@@ -58,6 +78,15 @@ void dmtcp::SocketConnList::drain()
     //we will create a new, broken socket that is not closed
     con->onError();
   }
+  //peers outside the computation that never answered the drain
+  const vector<ConnectionIdentifier>& external =
+    KernelBufferDrainer::instance().getExternalSockets();
+  for (size_t i = 0; i < external.size(); ++i) {
+    TcpConnection *con =
+      (TcpConnection*) SocketConnList::instance().getConnection(external[i]);
+    JTRACE("marking socket external") (external[i]);
+    con->markExternalConnect();
+  }
 }
 
 void dmtcp::SocketConnList::preCkpt()
@@ -113,6 +142,11 @@ void dmtcp::SocketConnList::sendQueries(bool isRestart)
 
 void dmtcp::SocketConnList::refill(bool isRestart)
 {
+  if (isRestart) {
+    // With no pending connections, the name-service phases were skipped and
+    // sendQueries() never ran; close the restore socket here instead.
+    ConnectionRewirer::destroy();
+  }
   KernelBufferDrainer::instance().refillAllSockets();
   ConnectionList::refill(isRestart);
 }
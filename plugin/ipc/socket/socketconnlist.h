@@ -19,6 +19,7 @@ namespace dmtcp
   class SocketConnList : public ConnectionList
   {
     public:
+      virtual void preCkptFdLeaderElection();
       virtual void drain();
       virtual void preCkpt();
       virtual void postRestart();
@@ -32,6 +32,9 @@ CYCLES=2
 #Number of times to try dmtcp_restart
 RETRIES=2
 
+#Number of checkpoints before each restart (an incremental image needs two)
+CKPTS=1
+
 #Sleep after each program startup (sec)
 DEFAULT_S=0.3
 if sys.version_info[0] == 2 and sys.version_info[0:2] >= (2,7) and \
@@ -465,6 +468,9 @@ def runTestRaw(name, numProcs, cmds):
       # NOTE:  If this faile, it will throw an exception to CheckFailed
       #  of this function:  testRestart
       testCheckpoint()
+      for k in range(CKPTS-1):
+        sleep(S*SLOW)
+        testCheckpoint()
       printFixed("PASSED ")
       testKill()
 
@@ -549,6 +555,18 @@ p3=str(randint(2000,10000))
 # Use uniform user shell.  Else apps like script have different subprocesses.
 os.environ["SHELL"]="/bin/bash"
 
+# The coordinator's name-service table, checked on its own (no checkpoint).
+printFixed("lookup-service",15)
+if not shouldRunTest("lookup-service"):
+  print "SKIPPED"
+else:
+  stats[1]+=1
+  if os.system("./test/lookup-service >/dev/null 2>&1") == 0:
+    print "PASSED"
+    stats[0]+=1
+  else:
+    print "FAILED"
+
 runTest("dmtcp1",        1, ["./test/dmtcp1"])
 
 runTest("dmtcp2",        1, ["./test/dmtcp2"])
@@ -663,6 +681,65 @@ os.environ['DMTCP_GZIP'] = "1"
 runTest("gzip",          1, ["./test/dmtcp1"])
 os.environ['DMTCP_GZIP'] = GZIP
 
+# Lazy restore needs an uncompressed image, and areas of 1 MB or more:  the
+# thread stacks here.
+os.environ['DMTCP_GZIP'] = "0"
+os.environ['DMTCP_LAZY_RESTORE'] = "1"
+runTest("lazy-restore",  1, ["./test/pthread1"])
+del os.environ['DMTCP_LAZY_RESTORE']
+os.environ['DMTCP_GZIP'] = GZIP
+
+# The second checkpoint of each cycle writes an incremental image, which
+# needs an uncompressed parent.
+os.environ['DMTCP_GZIP'] = "0"
+os.environ['DMTCP_INCREMENTAL'] = "2"
+CKPTS=2
+runTest("incremental",   1, ["./test/dmtcp1"])
+CKPTS=1
+del os.environ['DMTCP_INCREMENTAL']
+os.environ['DMTCP_GZIP'] = GZIP
+
+# The second checkpoint of each cycle finds its chunks in the store, and
+# removes those of the first.
+os.environ['DMTCP_GZIP'] = "0"
+os.environ['DMTCP_CHUNK_STORE'] = "1"
+CKPTS=2
+runTest("chunk-store",   1, ["./test/dmtcp1"])
+CKPTS=1
+del os.environ['DMTCP_CHUNK_STORE']
+os.environ['DMTCP_GZIP'] = GZIP
+
+os.environ['DMTCP_GZIP'] = "0"
+os.environ['DMTCP_FAST_RESTART'] = "1"
+runTest("fast-restart",  1, ["./test/dmtcp1"])
+del os.environ['DMTCP_FAST_RESTART']
+os.environ['DMTCP_GZIP'] = GZIP
+
+# Workers and dmtcp_restart connect to a relay; checkpoints are still
+# started by the coordinator above, which counts the relayed workers.
+COORD_PORT = os.environ['DMTCP_PORT']
+RELAY_PORT = str(int(COORD_PORT) + 1)
+relay = launch(BIN+"dmtcp_coordinator --relay localhost:"+COORD_PORT+
+               " --port "+RELAY_PORT)
+sleep(S)
+os.environ['DMTCP_PORT'] = RELAY_PORT
+runTest("relay",         1, ["./test/dmtcp1"])
+os.environ['DMTCP_PORT'] = COORD_PORT
+os.kill(relay.pid, signal.SIGKILL)
+relay.wait()
+
+# The image is written by a forked child after the computation resumes;
+# the coordinator waits for its report before writing the restart script.
+os.environ['MTCP_FORKED_CHECKPOINT'] = "1"
+runTest("forked-durable", 1, ["./test/dmtcp1"])
+del os.environ['MTCP_FORKED_CHECKPOINT']
+
+# Both ends are under DMTCP and find each other in the name service before
+# the drain, on the first checkpoint as well, so the limit does not apply.
+os.environ['DMTCP_DRAIN_TIMEOUT'] = "5"
+runTest("drain-timeout", 2, ["./test/client-server"])
+del os.environ['DMTCP_DRAIN_TIMEOUT']
+
 if testconfig.HAS_READLINE == "yes":
   runTest("readline",    1,  ["./test/readline"])
 
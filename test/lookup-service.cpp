@@ -0,0 +1,84 @@
+// Exercises the coordinator's name-service table (dmtcp/src/lookup_service.cpp)
+// directly, without a coordinator: growth past the initial capacity,
+// duplicate keys, keys that are prefixes of one another, entries larger than
+// an arena block, and reuse after reset().  Exits 0 on success.
+
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+#include "lookup_service.h"
+#include "util.h"
+#undef NDEBUG
+#include <assert.h>
+
+static void check(dmtcp::LookupService& ls, const void *key, size_t keyLen,
+                  const void *val, size_t valLen)
+{
+  void *v = NULL;
+  size_t len = 0;
+  assert(ls.query(key, keyLen, &v, &len) != NULL);
+  assert(len == valLen && memcmp(v, val, valLen) == 0);
+}
+
+static void checkMissing(dmtcp::LookupService& ls, const void *key,
+                         size_t keyLen)
+{
+  void *v = NULL;
+  size_t len = 0;
+  assert(ls.query(key, keyLen, &v, &len) == NULL);
+}
+
+int main(int argc, char* argv[])
+{
+  initializeJalib();
+
+  dmtcp::LookupService ls;
+  const int N = 20000;  // Several doublings past the initial capacity.
+  char key[32], val[32];
+
+  checkMissing(ls, "x", 1);  // Query before the table exists.
+
+  for (int round = 0; round < 2; round++) {
+    for (int i = 0; i < N; i++) {
+      int k = sprintf(key, "key-%d", i);
+      int v = sprintf(val, "val-%d-%d", i, round);
+      ls.addKeyValue(key, k, val, v);
+    }
+    for (int i = 0; i < N; i++) {
+      int k = sprintf(key, "key-%d", i);
+      int v = sprintf(val, "val-%d-%d", i, round);
+      check(ls, key, k, val, v);
+    }
+    checkMissing(ls, "key-", 4);  // A prefix of every key.
+    checkMissing(ls, "key-100000", 10);
+
+    // A later value for the same key replaces the earlier one.
+    ls.addKeyValue("dup", 3, "first", 5);
+    ls.addKeyValue("dup", 3, "second-value", 12);
+    check(ls, "dup", 3, "second-value", 12);
+
+    // Keys that differ only in length, including embedded NULs.
+    ls.addKeyValue("ab\0", 3, "3", 1);
+    ls.addKeyValue("ab", 2, "2", 1);
+    check(ls, "ab", 2, "2", 1);
+    check(ls, "ab\0", 3, "3", 1);
+
+    // An entry larger than an arena block gets a block of its own.
+    std::vector<char> big(1024 * 1024);
+    for (size_t i = 0; i < big.size(); i++) {
+      big[i] = (char) (i * 7 + round);
+    }
+    ls.addKeyValue("big", 3, &big[0], big.size());
+    ls.addKeyValue("after-big", 9, "small", 5);
+    check(ls, "big", 3, &big[0], big.size());
+    check(ls, "after-big", 9, "small", 5);
+    check(ls, "key-0", 5, round == 0 ? "val-0-0" : "val-0-1", 7);
+
+    ls.reset();
+    checkMissing(ls, "key-0", 5);
+    checkMissing(ls, "big", 3);
+  }
+
+  printf("lookup-service: OK\n");
+  return 0;
+}
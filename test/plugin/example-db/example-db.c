@@ -36,6 +36,10 @@ void dmtcp_process_event(DmtcpEvent_t event, DmtcpEventData_t *data)
     break;
   case DMTCP_EVENT_PRE_CKPT:
     printf("\nThe plugin is being called before checkpointing.\n");
+    dmtcp_request_name_service();
+    break;
+  case DMTCP_EVENT_POST_RESTART:
+    dmtcp_request_name_service();
     break;
   case DMTCP_EVENT_REGISTER_NAME_SERVICE_DATA:
     /* Although one process resumes late, they will still all synchronize. */